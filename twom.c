@@ -15,6 +15,7 @@
 #define le32toh(x) OSSwapLittleToHostInt32(x)
 #define htole64(x) OSSwapHostToLittleInt64(x)
 #define le64toh(x) OSSwapLittleToHostInt64(x)
+#define be64toh(x) OSSwapBigToHostInt64(x)
 #elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
 #include <sys/endian.h>
 #else
@@ -23,7 +24,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -32,9 +36,22 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "twom.h"
 
+/* XXH3 picks its SIMD kernel at compile time, and the x86_64 baseline only
+ * has SSE2.  Build the AVX2 kernel too, so csum_xxh64 can switch at runtime */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(__AVX2__)
+#include <immintrin.h>
+#define TM_XXH_DISPATCH 1
+#define XXH_DISPATCH_AVX2 1
+#define XXH_ACC_ALIGN 32
+#define XXH_TARGET_AVX2 __attribute__((__target__("avx2")))
+#endif
+
 #define XXH_STATIC_LINKING_ONLY /* access advanced declarations */
 #define XXH_INLINE_ALL          /* maximum optimise */
 #define XXH_NO_INLINE_HINTS   1 /* allow compiling with -Og on modern compilers */
@@ -60,6 +77,15 @@ static void tm_uuid_unparse(const tm_uuid_t uuid, char *out);
  * for most real uses.  31 is heaps. */
 #define MAXLEVEL 31
 
+/* finished transactions and cursors kept on each handle for the next one,
+ * so short reads don't go back to the allocator */
+#define SPARE_OBJECTS 4
+
+/* when the file has been extended, a location is checked against the new records
+ * rather than searched for again, if there are no more than this many of them */
+#define LOC_KEEP_RECORDS 16
+#define LOC_KEEP_BYTES 4096
+
 /* release lock in foreach at least every N records */
 #define FOREACH_LOCK_RELEASE 1024
 
@@ -70,6 +96,76 @@ static void tm_uuid_unparse(const tm_uuid_t uuid, char *out);
  * re-locks we fall back to the full double-lock, bounding writer starvation. */
 #define FOREACH_GATE_RELOCKS 64
 
+/* commits msync only the pages they changed: the appended records, plus the
+ * older records whose pointers were updated.  Past this many scattered pages
+ * we just sync from the lowest one to the end. */
+#define SYNC_PAGES 64
+
+/* with TWOM_CSUMCACHE, remember this many records whose tail checksum has
+ * been verified (a power of two, 8 bytes each per open file).  Tails shorter
+ * than CSUM_CACHE_MIN are cheaper to hash again than to look up */
+#define CSUM_CACHE_SLOTS 4096
+#define CSUM_CACHE_MIN 256
+
+/* twom_db_should_repack advises a repack once a quarter of the file is dead
+ * records.  On a big file that can be a lot of space, so past REPACK_DIRTY_BYTES
+ * of dead records, a tenth is enough */
+#define REPACK_DIRTY_RATIO 4
+#define REPACK_DIRTY_BYTES (64 * 1024 * 1024)
+#define REPACK_DIRTY_BYTES_RATIO 10
+
+/* twom_txn_estimate_range counts the records in the range at the highest skip
+ * level with at least this many, and scales up.  More is closer, but slower */
+#define ESTIMATE_SAMPLE 16
+
+/* with TWOM_BLOBS, values larger than this (unless the open gives a
+ * blob_threshold) are kept in the blob file rather than in the record */
+#define BLOB_THRESHOLD (64 * 1024)
+
+/* with a compress function, values larger than this (unless the open gives a
+ * compress_threshold) are compressed, if that makes them any shorter */
+#define COMPRESS_THRESHOLD 256
+
+/* with TWOM_THREADSAFE the threads share one read lock, which is only dropped
+ * when none of them is reading.  So that busy threads can't hold it forever
+ * between them, once this many transactions have ended without being able to
+ * drop it, new reads wait until it has been */
+#define THREADS_RELEASE_DRAIN 64
+
+/* twom_db_scrub splits the keyspace into this many ranges per thread, so
+ * that the threads finish at about the same time.  It takes the read lock for
+ * a slice of each range at a time: this much of it, or with a rate limit,
+ * a share of SCRUB_SLICE_USEC worth */
+#define SCRUB_RANGES_PER_JOB 4
+#define SCRUB_SLICE (4 * 1024 * 1024)
+#define SCRUB_SLICE_USEC 100000
+
+/* with TWOM_WARMUP, the first lock of each file starts reading in about this
+ * many records from the top skip levels down, where every search begins */
+#define WARMUP_RECORDS 1024
+
+/* a whole-database foreach (or a repack) tells the kernel to read ahead the
+ * part of the file that's in key order since the last repack, if there's at
+ * least this much of it; for less, the readahead isn't worth the syscalls */
+#define SEQUENTIAL_MIN (1024 * 1024)
+
+/* twom_db_backup copies this much of the file (or the blob file) at a time
+ * between yielding the lock.  Once it has caught up, it keeps going round
+ * catching up on the records written meanwhile until there's no more than
+ * BACKUP_FINAL of them (or it's been BACKUP_ROUNDS times), and then does the
+ * rest without letting go */
+#define BACKUP_CHUNK (4 * 1024 * 1024)
+#define BACKUP_FINAL (1024 * 1024)
+#define BACKUP_ROUNDS 8
+
+/* with TWOM_BLOOM, the key filter gets this many bits per key it's sized for,
+ * which with BLOOM_HASHES bits set per key gives about 1% false positives.
+ * Repack sizes it for twice the records it copies, and a new database for
+ * BLOOM_MINKEYS */
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+#define BLOOM_MINKEYS 65536
+
 /* type aliases */
 #define LLU long long unsigned int
 #define LU long unsigned int
@@ -84,12 +180,27 @@ static void tm_uuid_unparse(const tm_uuid_t uuid, char *out);
 #define FATREPLACE 5
 #define DELETE 6
 #define COMMIT 7
+// ADD and REPLACE with the first 8 bytes of the key in the head (TWOM_KEYPREFIX files)
+#define PFXADD 8
+#define PFXREPLACE 9
+// ADD and REPLACE whose value is a reference into the blob file (TWOM_BLOBS files)
+#define BLOBADD 10
+#define BLOBREPLACE 11
+// ADD and REPLACE whose value went through the compress function (COMPRESSED files)
+#define ZADD 12
+#define ZREPLACE 13
+#define MAXTYPE ZREPLACE
 static const char *typestr[] = { NULL, "DUMMY", "ADD", "FATADD",
-                          "REPLACE", "FATREPLACE", "DELETE", "COMMIT" };
-static uint8_t ptroffset[8]      = { 0,  8,  8, 24, 16, 32,  8,  8 };
-static uint8_t ancestoroffset[8] = { 0,  0,  0,  0,  8, 24,  8,  0 };
-static uint8_t fatrecord[8]      = { 0,  0,  0,  1,  0,  1,  0,  0 };
-static uint8_t hastail[8]        = { 0,  0,  1,  1,  1,  1,  0,  0 };
+                          "REPLACE", "FATREPLACE", "DELETE", "COMMIT",
+                          "PFXADD", "PFXREPLACE", "BLOBADD", "BLOBREPLACE",
+                          "ZADD", "ZREPLACE" };
+static uint8_t ptroffset[14]      = { 0,  8,  8, 24, 16, 32,  8,  8, 16, 24,  8, 16,  8, 16 };
+static uint8_t ancestoroffset[14] = { 0,  0,  0,  0,  8, 24,  8,  0,  0,  8,  0,  8,  0,  8 };
+static uint8_t fatrecord[14]      = { 0,  0,  0,  1,  0,  1,  0,  0,  0,  0,  0,  0,  0,  0 };
+static uint8_t hastail[14]        = { 0,  0,  1,  1,  1,  1,  0,  0,  1,  1,  1,  1,  1,  1 };
+static uint8_t prefixoffset[14]   = { 0,  0,  0,  0,  0,  0,  0,  0,  8, 16,  0,  0,  0,  0 };
+static uint8_t blobrecord[14]     = { 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  0,  0 };
+static uint8_t zrecord[14]        = { 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1 };
 
 /********** DATA STRUCTURES *************/
 
@@ -117,12 +228,30 @@ struct tm_file {
     // mmap
     char *base;
     size_t size; // the mmap size
+    size_t reserved; // address space reserved at base for the mapping to grow into
     size_t committed_size;  // the end of committed data
     size_t written_size;    // the end of written data (pointers will match)
+    size_t aborts;          // write transactions aborted, whose space gets written again
     int refcount;
     uint8_t has_headlock;
     uint8_t has_datalock;
     unsigned dirty:1;
+    unsigned unsynced:1;    // has commits from nosync transactions not yet flushed
+    unsigned useprefix:1;   // records carry key prefixes, and the comparator can use them
+    unsigned shmwrite:1;    // write locked, and the shm seq made odd for it
+    unsigned warmed:1;      // the top levels have been prefetched, with TWOM_WARMUP
+    uint64_t ino;           // the inode, once known
+    uint64_t shmseq;        // the shm seq when the header was last read under a lock
+    uint64_t *csumcache;    // offsets of committed records with a verified tail, or NULL
+    struct tm_bloom *bloom; // the key filter for this generation, with TWOM_BLOOM
+    int bloom_tried;        // looked for it already (it's NULL if there isn't a good one)
+    // pages which need msync at the next commit
+    size_t sync_tail;       // everything from here to the end of the data
+    size_t sync_low;        // if there were too many pages, the lowest one
+    size_t own_size;        // where this process's last commit ended
+    unsigned sync_overflow:1;
+    size_t nsyncpages;
+    size_t syncpages[SYNC_PAGES];
     // tracking
     struct tm_file *next;
 };
@@ -145,12 +274,25 @@ struct tm_file {
 struct tm_loc {
     struct tm_file *file;
     size_t end;               // pointers are only valid when end matches file end
+    size_t aborts;            // or the file has only been extended since (see loc_still_good)
     size_t offset;            // current position
     size_t deleted_offset;    // was there a deletion in front of the current record?
     size_t backloc[MAXLEVEL+1]; // previous record at every level
 };
 
 #define DIRTY (1<<0)
+// only in the header (TWOM_SHARED is never written there): the file may have
+// ZADD and ZREPLACE records, so it can only be read with a decompress function
+#define COMPRESSED (1<<1)
+// also only in the header (TWOM_NOCSUM isn't either): the file was created
+// with TWOM_SHM, so every handle on it keeps the shared memory hints
+#define SHMHINTS (1<<2)
+
+/* somewhere to decompress values into, see record_value */
+struct tm_zbuf {
+    char *base;
+    size_t size;
+};
 
 struct twom_txn {
     struct twom_db *db;
@@ -158,19 +300,113 @@ struct twom_txn {
     size_t end;
     uint64_t counter;
     uint64_t nlocks;
+    uint64_t lockseq;   // with TWOM_THREADSAFE, db->threads->unlocks when last seen locked
     unsigned readonly:1;
     unsigned nosync:1;
     unsigned noyield:1;
     unsigned mvcc:1;
+    unsigned unlocked:1;    // reading without any lock, see db_fetch_unlocked
+    struct tm_zbuf zbuf;    // the last value decompressed for this transaction
     struct twom_txn *next;
+    // with TWOM_THREADSAFE a read transaction searches from its own location,
+    // rather than the db's, see TXNLOC.  Last, see tm_newtxn
+    struct tm_loc loc;
 };
 
+#define TXNLOC(txn) ((txn)->readonly && (txn)->db->threads ? &(txn)->loc : &(txn)->db->loc)
+
 struct twom_cursor {
     char *prefix;
     size_t prefixlen;
-    struct tm_loc loc;
+    size_t prefixspace;     // allocated for prefix, which a spare cursor keeps
     struct twom_txn *txn;
     unsigned alwaysyield:1;
+    unsigned nocsum:1;      // don't check tail checksums, nobody will read the values
+    unsigned reverse:1;     // cursor_next walks backwards
+    unsigned inclusive:1;   // the next step back may return the current record
+    // optional bound on the records returned, see twom_cursor_set_end
+    char *endkey;
+    size_t endkeylen;
+    size_t limit;
+    size_t count;
+    unsigned endinclusive:1;
+    struct twom_cursor *next;   // on the spare list, see tm_newcursor
+    struct tm_loc loc;          // last, see tm_newcursor
+};
+
+/* the blob file, see BLOB FILE below.  It belongs to the db rather than to
+ * a tm_file, since every generation of the database shares it */
+struct tm_blobs {
+    int fd;             // -1 until it's needed
+    char *base;
+    size_t size;        // the mapped size
+    size_t end;         // where the next blob goes, while a write txn is adding them
+    unsigned dirty:1;   // has blobs which need syncing at the next commit
+    unsigned unsynced:1;    // has blobs from nosync commits not yet flushed
+    unsigned copying:1;     // a repack is copying references, not reading values
+    // the last blob whose checksum was verified, so a copy of its reference
+    // (repack, replay) doesn't need to hash it again
+    size_t lastoffset;
+    uint32_t lastcsum;
+    uint32_t (*lastengine)(const char *base, size_t len);
+};
+
+/* the key filter, with TWOM_BLOOM, see KEY FILTER below */
+struct tm_bloom {
+    char *base;         // the mapping: header, then the blocks
+    size_t size;
+    uint64_t nblocks;
+    unsigned dirty:1;       // has bits set since the last commit
+    unsigned unsynced:1;    // has bits from nosync commits not yet flushed
+};
+
+/* with TWOM_THREADSAFE, the handle is shared by threads, see THREADS below */
+struct tm_threads {
+    pthread_mutex_t gate;   // for the counts below
+    pthread_cond_t cond;
+    pthread_mutex_t lock;   // recursive, for the lists of transactions and files
+    pthread_key_t depth;    // how many reads the calling thread is inside
+    pthread_key_t zlast;    // the calling thread's struct tm_zlast, see zbuf_keep
+    struct tm_zlast *zlasts;    // every thread's, freed with the handle
+    int readers;            // reads in progress
+    int waiting;            // writers waiting for them to finish
+    int deferred;           // releases left to the last reader since the last unlock
+    uint64_t unlocks;       // files unlocked, see txn_locked
+    unsigned writer:1;
+    unsigned release:1;     // drop the read locks when the last reader leaves
+    unsigned drain:1;       // and hold off new readers until then
+    pthread_t owner;        // the writer
+};
+
+// the last value a thread's transactions decompressed, see zbuf_keep
+struct tm_zlast {
+    struct tm_zbuf zbuf;
+    struct tm_zlast *next;
+};
+
+// a mapping we're finished with, but another thread may still be reading
+struct tm_retired {
+    void *base;
+    size_t len;
+    struct tm_retired *next;
+};
+
+/* during twom_txn_store_batch, records whose pointers have been updated but
+ * whose head checksum hasn't been rewritten yet, since the next record in the
+ * batch will probably update them again.  A record which is a back pointer at
+ * all is one at its own top level, and keys only go up, so there's one slot
+ * per level: a new record there means the old one is finished with */
+struct tm_batch {
+    size_t pending[MAXLEVEL];
+};
+
+/* with TWOM_SHM, hints shared by every process using the database, see SHARED MEMORY */
+#define SHM_WAITERS 16
+struct tm_shm {
+    uint64_t magic;
+    uint64_t seq;       // odd while a writer has the file, bumped again as it lets go
+    uint64_t ino;       // the inode of the current file
+    uint64_t waiting[SHM_WAITERS];  // pids of writers blocked on the data lock, or 0
 };
 
 struct twom_db {
@@ -197,14 +433,71 @@ struct twom_db {
     unsigned nosync:1;
     unsigned noyield:1;
     unsigned nocompact:1;
+    unsigned fdatasync:1;
+    unsigned fallocate:1;
+    unsigned keyprefix:1;
+    unsigned csumcache:1;
+    unsigned blobs_wanted:1;
+    unsigned bloom_wanted:1;
+    unsigned warmup:1;
     int refcount;
 
+    // how the mapping will be read, see twom_db_advise
+    int advice;
+
+    // growth policy
+    size_t reserve;
+    size_t growth;
+
+    // large values, with TWOM_BLOBS
+    size_t blob_threshold;
+    struct tm_blobs blobs;
+
+    // value compression, with a compress or decompress function
+    twom_compress *compress;
+    twom_decompress *decompress;
+    size_t compress_threshold;
+    struct tm_zbuf zwrite;  // the value store_here is writing, or skipwrite comparing
+    struct tm_zbuf zlast;   // from the last transaction to finish, see zbuf_keep
+
+    // group commit: commits made through this handle, and how many are on disk
+    uint64_t commit_seq;
+    uint64_t durable_seq;
+
     uint64_t foreach_lock_release;
 
+    // a repack being done in slices, see twom_db_repack_step
+    struct tm_repack *repack;
+
+    // runtime counters, see twom_db_stats
+    struct twom_stats stats;
+
+    // shared between threads, with TWOM_THREADSAFE
+    struct tm_threads *threads;
+    struct tm_retired *retired;
+
+    // lock hints, with TWOM_SHM
+    struct tm_shm *shm;
+
+    // checksums put off until later, within twom_txn_store_batch
+    struct tm_batch *batch;
+
+    // finished objects to reuse, see tm_newtxn and tm_newcursor
+    struct twom_txn *spare_txn;
+    struct twom_cursor *spare_cursor;
+    int nspare_txn;
+    int nspare_cursor;
+
     struct twom_db *next;
 };
 
-#define TWOM_VERSION 1
+/* version 2 files have TWOM_KEYPREFIX set, and PFXADD/PFXREPLACE records.
+ * version 3 files have TWOM_BLOBS set, and may have BLOBADD/BLOBREPLACE records.
+ * version 4 files have COMPRESSED set, and may have ZADD/ZREPLACE records.
+ * version 5 files have SHMHINTS set, so a writer which doesn't keep the shared
+ * memory segment up to date can't open them.
+ * Files with none of them are still written as version 1 */
+#define TWOM_VERSION 5
 
 #define HEADER_MAGIC ("\241\002\213\015twomfile\0\0\0\0")
 #define HEADER_MAGIC_SIZE (16)
@@ -230,6 +523,7 @@ enum {
 #define DUMMY_SIZE (24 + (8 * MAXLEVEL))
 
 static struct twom_db *open_twom = NULL;
+static pthread_mutex_t open_twom_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /********************* LIBRARY SUPPORT FUNCTIONS *******************************/
 
@@ -284,6 +578,47 @@ static void tm_uuid_unparse(const tm_uuid_t uuid, char *out)
              uuid[8], uuid[9], uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
 }
 
+// with TWOM_THREADSAFE, the lists of transactions and files, and the other
+// state which reads on different threads can change, are kept under this lock
+static inline void threads_lock(struct twom_db *db)
+{
+    if (db->threads) pthread_mutex_lock(&db->threads->lock);
+}
+
+static inline void threads_unlock(struct twom_db *db)
+{
+    if (db->threads) pthread_mutex_unlock(&db->threads->lock);
+}
+
+// locations on any thread can take and drop references to a file
+static inline void tm_ref(struct tm_file *file)
+{
+    __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void tm_unref(struct tm_file *file)
+{
+    __atomic_sub_fetch(&file->refcount, 1, __ATOMIC_RELEASE);
+}
+
+// a key or value handed out on one thread stays good until that thread's
+// next call, however the mapping changes meanwhile on another, so with
+// TWOM_THREADSAFE old mappings are kept until the database is closed
+static void tm_unmap(struct twom_db *db, void *base, size_t len)
+{
+    if (!db->threads) {
+        munmap(base, len);
+        return;
+    }
+    struct tm_retired *old = (struct tm_retired *)twom_zmalloc(sizeof(struct tm_retired));
+    old->base = base;
+    old->len = len;
+    threads_lock(db);
+    old->next = db->retired;
+    db->retired = old;
+    threads_unlock(db);
+}
+
 /********************** POINTER MANAGEMENT WITHIN THE FILES *********************/
 
 // pad out to an 8 byte boundary
@@ -309,6 +644,8 @@ static void tm_uuid_unparse(const tm_uuid_t uuid, char *out)
 #define KEYPTR(ptr) (hastail[TYPE(ptr)] ? (ptr + HEADLEN(ptr) + 8) : "")
 #define VALLEN(ptr) ((size_t)(fatrecord[TYPE(ptr)] ? VLFAT(ptr) : VLSKINNY(ptr)))
 #define VALPTR(ptr) (ptr + HEADLEN(ptr) + 8 + KEYLEN(ptr) + 1)
+// the first 8 bytes of the key, zero padded, as a big-endian number so they sort like memcmp
+#define PREFIX(ptr) be64toh(*((uint64_t *)(ptr + prefixoffset[TYPE(ptr)])))
 #define ANCESTOR(ptr) (ancestoroffset[TYPE(ptr)] ? le64toh(*((uint64_t *)(ptr+(ancestoroffset[TYPE(ptr)])))) : 0)
 #define NEXT0PTR(ptr, alt) (ptr + ptroffset[TYPE(ptr)] + (alt ? 8 : 0))
 #define NEXTNPTR(ptr, lvl) (ptr + ptroffset[TYPE(ptr)] + 8 * (1 + lvl))
@@ -316,6 +653,14 @@ static void tm_uuid_unparse(const tm_uuid_t uuid, char *out)
 #define NEXTN(ptr, lvl) le64toh(*((uint64_t *)NEXTNPTR(ptr, lvl)))
 #define SET0(file, ptr, offset) _setloc0(file, ptr, offset)
 #define SETN(ptr, level, offset)  *((uint64_t *)((ptr) + ptroffset[TYPE(ptr)] + 8 * ((level) + 1))) = htole64(offset)
+// start loading the record at offset while we do something else; prefetch can't fault,
+// but stay inside the mapping anyway
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(loc, offset) do { size_t _o = (offset); \
+    if (_o && _o < (loc)->end) __builtin_prefetch((loc)->file->base + _o); } while (0)
+#else
+#define PREFETCH(loc, offset) do { } while (0)
+#endif
 
 #ifdef HAVE_DECLARE_OPTIMIZE
 static size_t reclen_dummy(const char *ptr);
@@ -384,9 +729,32 @@ static size_t reclen_commit(const char *ptr __attribute__((unused)))
     return 24;
 }
 
+#ifdef HAVE_DECLARE_OPTIMIZE
+static size_t reclen_pfxadd(const char *ptr);
+    __attribute__((optimize("-O3")));
+#endif
+static size_t reclen_pfxadd(const char *ptr)
+{
+    uint8_t level = LEVEL(ptr);
+    return 32 + (8 * level) + PAD8(KLSKINNY(ptr) + VLSKINNY(ptr) + 2);
+}
+
+#ifdef HAVE_DECLARE_OPTIMIZE
+static size_t reclen_pfxreplace(const char *ptr);
+    __attribute__((optimize("-O3")));
+#endif
+static size_t reclen_pfxreplace(const char *ptr)
+{
+    uint8_t level = LEVEL(ptr);
+    return 40 + (8 * level) + PAD8(KLSKINNY(ptr) + VLSKINNY(ptr) + 2);
+}
+
+// blob and compressed records are laid out just like ADD and REPLACE
 static size_t(*reclenfn[])(const char *) = {
     NULL, reclen_dummy, reclen_add, reclen_fatadd,
-    reclen_replace, reclen_fatreplace, reclen_delete, reclen_commit
+    reclen_replace, reclen_fatreplace, reclen_delete, reclen_commit,
+    reclen_pfxadd, reclen_pfxreplace, reclen_add, reclen_replace,
+    reclen_add, reclen_replace
 };
 
 #define RECLEN(ptr) (reclenfn[TYPE(ptr)](ptr))
@@ -403,7 +771,7 @@ static inline const char *safeptr(struct tm_loc *loc, size_t offset)
     if (loc->end < offset + 24) return NULL;  // need space for the head info
     const char *base = loc->file->base + offset;
     if (!*base) return NULL; // no type
-    if (*base & ~7) return NULL; // invalid type
+    if (*base > MAXTYPE) return NULL; // invalid type
     if (loc->end < offset + RECLEN(base)) return NULL; // no space for entire record
     return base;
 }
@@ -454,6 +822,35 @@ static int compar_raw(const char *s1, size_t l1, const char *s2, size_t l2)
 #define COMPAR(fn, a, al, b, bl) \
     (!(al) ? (!(bl) ? 0 : -1) : (!(bl) ? 1 : (fn)((a), (al), (b), (bl))))
 
+/* the search key's prefix, in the same shape as PREFIX() on a record */
+static inline uint64_t key_prefix(const char *key, size_t keylen)
+{
+    unsigned char buf[8] = { 0 };
+    uint64_t v;
+    memcpy(buf, key, keylen < 8 ? keylen : 8);
+    memcpy(&v, buf, 8);
+    return be64toh(v);
+}
+
+/* compare a record's key with the search key.  Where the record has a key
+ * prefix in its head and the comparator is compar_raw, differing prefixes
+ * decide it without touching the key in the tail.  Zero padding sorts a
+ * short key before any longer key it's a prefix of, just like compar_raw */
+#ifdef HAVE_DECLARE_OPTIMIZE
+static inline int compar_rec(const struct tm_file *file, const char *ptr,
+                             uint64_t keypfx, const char *key, size_t keylen)
+    __attribute__((optimize("-O3")));
+#endif
+static inline int compar_rec(const struct tm_file *file, const char *ptr,
+                             uint64_t keypfx, const char *key, size_t keylen)
+{
+    if (file->useprefix && prefixoffset[TYPE(ptr)]) {
+        uint64_t pfx = PREFIX(ptr);
+        if (pfx != keypfx) return pfx < keypfx ? -1 : 1;
+    }
+    return COMPAR(file->compar, KEYPTR(ptr), KEYLEN(ptr), key, keylen);
+}
+
 /************** CHECKSUMS ****************/
 
 #ifdef HAVE_DECLARE_OPTIMIZE
@@ -470,14 +867,43 @@ static uint32_t csum_null(const char *base __attribute__((unused)),
 static uint32_t csum_xxh64(const char *base, size_t len)
     __attribute__((optimize("-O3")));
 #endif
+#ifdef TM_XXH_DISPATCH
+// same hash, using the AVX2 kernel.  Only inputs over 240 bytes get here,
+// shorter ones are scalar code whatever the CPU
+XXH_NO_INLINE XXH_TARGET_AVX2 XXH64_hash_t
+tm_xxh3_long_avx2(const void *input, size_t len, XXH64_hash_t seed64,
+                  const xxh_u8 *secret, size_t secretLen)
+{
+    (void)seed64; (void)secret; (void)secretLen;
+    return XXH3_hashLong_64b_internal(input, len, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                      XXH3_accumulate_avx2, XXH3_scrambleAcc_avx2);
+}
+#endif
+
+static XXH3_hashLong64_f tm_xxh3_long = XXH3_hashLong_64b_default;
+
+static void tm_xxh3_select(void)
+{
+#ifdef TM_XXH_DISPATCH
+    if (__builtin_cpu_supports("avx2"))
+        tm_xxh3_long = tm_xxh3_long_avx2;
+#endif
+}
+
+// despite the name this is, and always has been, XXH3_64bits truncated to 32 bits
 static uint32_t csum_xxh64(const char *base, size_t len)
 {
     if (!len) return 0;
-    return (uint32_t)XXH3_64bits(base, len);
+    return (uint32_t)XXH3_64bits_internal(base, len, 0, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                          tm_xxh3_long);
 }
 
 static uint32_t set_csum_engine(struct twom_db *db, struct tm_file *file, uint32_t flags)
 {
+    // handles may be opened from several threads at once
+    static pthread_once_t selected = PTHREAD_ONCE_INIT;
+    pthread_once(&selected, tm_xxh3_select);
+
     if (flags & TWOM_CSUM_EXTERNAL) {
         file->csum = db->external_csum;
         return TWOM_CSUM_EXTERNAL;
@@ -515,11 +941,14 @@ static inline int check_headcsum(struct twom_txn *txn, struct tm_file *file, con
 static inline int check_headcsum(struct twom_txn *txn, struct tm_file *file, const char *ptr, size_t offset)
 {
     if (txn->db->nocsum) return 0;
+    txn->db->stats.headcsums++;
     uint32_t csum = file->csum(ptr, HEADLEN(ptr));
     if (csum != HEADCSUM(ptr)) {
-        txn->db->error("invalid head checksum",
-                       "filename=<%s> offset=<%08llX>",
-                       txn->db->fname, (LLU)offset);
+        // without a lock a writer may be half way through this record's pointers
+        if (!txn->unlocked)
+            txn->db->error("invalid head checksum",
+                           "filename=<%s> offset=<%08llX>",
+                           txn->db->fname, (LLU)offset);
         return TWOM_BADCHECKSUM;
     }
 
@@ -535,25 +964,177 @@ static inline int check_tailcsum(struct twom_txn *txn, struct tm_file *file, con
     if (txn->db->nocsum) return 0;
     size_t taillen = TAILLEN(ptr);
     if (!taillen) return 0;
+    txn->db->stats.tailcsums++;
     uint32_t csum = file->csum(KEYPTR(ptr), taillen);
     if (csum != TAILCSUM(ptr)) {
-        txn->db->error("invalid tail checksum",
-                       "filename=<%s> offset=<%08llX>",
-                       txn->db->fname, (LLU)offset);
+        if (!txn->unlocked)
+            txn->db->error("invalid tail checksum",
+                           "filename=<%s> offset=<%08llX>",
+                           txn->db->fname, (LLU)offset);
         return TWOM_BADCHECKSUM;
     }
 
     return 0;
 }
 
+/* records never change their tail once committed, and the cache belongs to
+ * the tm_file, so a repack (a new file) starts afresh.  Uncommitted records
+ * aren't cached, since an abort can reuse their offsets */
+#ifdef HAVE_DECLARE_OPTIMIZE
+static inline int check_tailcsum_cached(struct twom_txn *txn, struct tm_file *file, const char *ptr, size_t offset)
+    __attribute__((optimize("-O3")));
+#endif
+static inline int check_tailcsum_cached(struct twom_txn *txn, struct tm_file *file, const char *ptr, size_t offset)
+{
+    struct twom_db *db = txn->db;
+    if (!db->csumcache || db->nocsum || TAILLEN(ptr) < CSUM_CACHE_MIN)
+        return check_tailcsum(txn, file, ptr, offset);
+
+    size_t slot = (size_t)(((uint64_t)(offset >> 3) * 0x9E3779B97F4A7C15ULL) >> 32) & (CSUM_CACHE_SLOTS - 1);
+    if (file->csumcache && file->csumcache[slot] == offset) {
+        db->stats.tailcsums_cached++;
+        return 0;
+    }
+
+    int r = check_tailcsum(txn, file, ptr, offset);
+    if (r) return r;
+
+    if (offset + RECLEN(ptr) <= file->header.current_size) {
+        if (!file->csumcache) {
+            threads_lock(db);
+            if (!file->csumcache)
+                file->csumcache = twom_zmalloc(CSUM_CACHE_SLOTS * sizeof(uint64_t));
+            threads_unlock(db);
+        }
+        file->csumcache[slot] = offset;
+    }
+    return 0;
+}
+
 /**********************  MMAP MANAGEMENT **************************/
 
+// for the stats timers
+static uint64_t tm_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static size_t tm_roundup(size_t offset)
 {
     size_t page_size = 1<<14; // 16k
     return ((offset + offset / 4) + page_size - 1) & ~(page_size - 1);
 }
 
+static size_t tm_pagesize(void)
+{
+    static size_t pagesize = 0;
+    if (!pagesize) pagesize = sysconf(_SC_PAGESIZE);
+    return pagesize;
+}
+
+// remember that the bytes at ptr have changed and need to be synced
+#ifdef HAVE_DECLARE_OPTIMIZE
+static inline void tm_touch(struct tm_file *file, const char *ptr, size_t len)
+    __attribute__((optimize("-O3")));
+#endif
+static inline void tm_touch(struct tm_file *file, const char *ptr, size_t len)
+{
+    size_t offset = ptr - file->base;
+    // appended data is all synced in one range anyway
+    if (offset >= file->sync_tail) return;
+
+    size_t pagesize = tm_pagesize();
+    size_t page = offset / pagesize;
+    size_t last = (offset + len - 1) / pagesize;
+    for (; page <= last; page++) {
+        size_t i;
+        if (!file->sync_overflow) {
+            for (i = 0; i < file->nsyncpages; i++)
+                if (file->syncpages[i] == page) break;
+            if (i < file->nsyncpages) continue;
+            if (file->nsyncpages < SYNC_PAGES) {
+                file->syncpages[file->nsyncpages++] = page;
+                continue;
+            }
+            // too many, fall back to a single range from the lowest page
+            file->sync_overflow = 1;
+            file->sync_low = page * pagesize;
+            for (i = 0; i < file->nsyncpages; i++)
+                if (file->syncpages[i] * pagesize < file->sync_low)
+                    file->sync_low = file->syncpages[i] * pagesize;
+        }
+        else if (page * pagesize < file->sync_low) {
+            file->sync_low = page * pagesize;
+        }
+    }
+}
+
+static int cmp_page(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// flush the touched pages, and any appended data up to len
+static int tm_msync(struct twom_db *db, struct tm_file *file, size_t len)
+{
+    size_t pagesize = tm_pagesize();
+    size_t start = file->sync_tail & ~(pagesize - 1);
+    uint64_t began = tm_usec();
+    int r = 0;
+
+    if (db->fdatasync) {
+        db->stats.syncs++;
+#if defined(__APPLE__)
+        r = fsync(file->fd);
+#else
+        r = fdatasync(file->fd);
+#endif
+    }
+    else if (file->sync_overflow) {
+        // the touched pages are all below sync_tail, so one range covers everything
+        if (file->sync_low < start) start = file->sync_low;
+        if (len < file->sync_tail) len = file->sync_tail;
+        if (len > start) {
+            db->stats.syncs++;
+            db->stats.sync_bytes += len - start;
+            r = msync(file->base + start, len - start, MS_SYNC);
+        }
+    }
+    else {
+        // sync runs of adjacent touched pages together, then the tail
+        qsort(file->syncpages, file->nsyncpages, sizeof(size_t), cmp_page);
+        size_t i = 0;
+        while (i < file->nsyncpages && !r) {
+            size_t first = file->syncpages[i];
+            size_t last = first;
+            while (++i < file->nsyncpages && file->syncpages[i] == last + 1)
+                last++;
+            // anything from the tail page on is covered by the tail
+            if (first * pagesize >= start) break;
+            if ((last + 1) * pagesize > start) last = start / pagesize - 1;
+            db->stats.syncs++;
+            db->stats.sync_bytes += (last - first + 1) * pagesize;
+            r = msync(file->base + first * pagesize, (last - first + 1) * pagesize, MS_SYNC);
+        }
+        if (!r && len > start) {
+            db->stats.syncs++;
+            db->stats.sync_bytes += len - start;
+            r = msync(file->base + start, len - start, MS_SYNC);
+        }
+    }
+    db->stats.sync_usec += tm_usec() - began;
+    if (r) return r;
+
+    file->nsyncpages = 0;
+    file->sync_overflow = 0;
+    if (file->sync_tail < len) file->sync_tail = len;
+    return 0;
+}
+
 static inline int tm_commit(struct twom_db *db, size_t len)
 {
     assert(db->openfile);
@@ -564,8 +1145,142 @@ static inline int tm_commit(struct twom_db *db, size_t len)
     // while erroring out and leaving the file dirty.
     db->openfile->dirty = 0;
     if (db->nosync) return 0;
-    if (db->write_txn && db->write_txn->nosync) return 0;
-    return msync(db->openfile->base, len, MS_SYNC);
+    if (db->write_txn && db->write_txn->nosync) {
+        // twom_db_sync will flush this later
+        db->openfile->unsynced = 1;
+        return 0;
+    }
+    return tm_msync(db, db->openfile, len);
+}
+
+// the page cache hints for each twom_advice
+static const int tm_advice[] = {
+    POSIX_MADV_NORMAL, POSIX_MADV_RANDOM, POSIX_MADV_SEQUENTIAL, POSIX_MADV_WILLNEED
+};
+
+// pass a hint about the first len bytes of the mapping on to the kernel.  It's
+// only a hint, so there's nothing to do if it can't be taken
+static void tm_advise(struct tm_file *file, size_t len, int advice)
+{
+    if (!file->base) return;
+    if (len > file->size) len = file->size;
+    if (len) posix_madvise(file->base, len, tm_advice[advice]);
+}
+
+// start reading in the pages under [offset, offset+len)
+static void tm_willneed(struct tm_file *file, size_t offset, size_t len)
+{
+    size_t pagesize = tm_pagesize();
+    size_t start = offset & ~(pagesize - 1);
+    if (offset >= file->size) return;
+    if (offset + len > file->size) len = file->size - offset;
+    posix_madvise(file->base + start, offset + len - start, POSIX_MADV_WILLNEED);
+}
+
+/* with TWOM_WARMUP, start reading in the records at the top of the skiplist,
+ * which every search goes through, rather than leaving the first searches to
+ * fault them in one page at a time.  Walking a level means reading its records,
+ * but each of them also points into the level below, so those pages are already
+ * on their way by the time that level is walked */
+static void tm_warmup(struct tm_file *file)
+{
+    struct tm_loc loc;
+    memset(&loc, 0, sizeof(loc));
+    loc.file = file;
+    loc.end = file->committed_size;
+
+    file->warmed = 1;
+    const char *dummy = safeptr(&loc, DUMMY_OFFSET);
+    if (!dummy) return;
+
+    size_t pagesize = tm_pagesize();
+    size_t lastpage = 0;
+    size_t seen = 0;
+    uint8_t level;
+    for (level = MAXLEVEL-1; level && seen < WARMUP_RECORDS; level--) {
+        size_t offset = NEXTN(dummy, level);
+        while (offset && seen < WARMUP_RECORDS) {
+            // anything damaged or uncommitted is for the reads to report
+            const char *ptr = safeptr(&loc, offset);
+            if (!ptr) return;
+            seen++;
+            size_t below = level > 1 ? NEXTN(ptr, level-1) : advance0(ptr, loc.end);
+            if (below && below < loc.end && below / pagesize != lastpage) {
+                lastpage = below / pagesize;
+                tm_willneed(file, below, 24);
+            }
+            offset = NEXTN(ptr, level);
+        }
+    }
+}
+
+static int _tm_map(struct twom_db *db, struct tm_file *file, size_t size, int prot)
+{
+    void *map;
+
+    // grow in place
+    if (file->base && size <= file->reserved) {
+        map = mmap(file->base, size, prot, MAP_SHARED|MAP_FIXED, file->fd, 0L);
+        if (map == MAP_FAILED) return TWOM_IOERROR;
+        file->size = size;
+        return 0;
+    }
+
+    if (file->base)
+        tm_unmap(db, file->base, file->reserved > file->size ? file->reserved : file->size);
+    file->base = NULL;
+    file->reserved = 0;
+    file->size = size;
+
+    if (db->reserve) {
+        // keep doubling past the reservation if the file has outgrown it
+        size_t reserve = db->reserve;
+        while (reserve < size) reserve *= 2;
+        void *space = mmap((caddr_t)0, reserve, PROT_NONE, MAP_PRIVATE|MAP_ANON, -1, 0L);
+        if (space != MAP_FAILED) {
+            map = mmap(space, size, prot, MAP_SHARED|MAP_FIXED, file->fd, 0L);
+            if (map != MAP_FAILED) {
+                file->base = map;
+                file->reserved = reserve;
+                return 0;
+            }
+            munmap(space, reserve);
+        }
+        // no address space?  It still works without the reservation
+    }
+
+    map = mmap((caddr_t)0, size, prot, MAP_SHARED, file->fd, 0L);
+    if (map == MAP_FAILED) return TWOM_IOERROR;
+    file->base = map;
+    return 0;
+}
+
+// map the file at the given size, replacing any existing mapping.  If the
+// database asked for a reservation, the file is mapped inside a block of
+// reserved address space, so that later growth can map over the top of it
+// at the same address rather than moving everything.  A new mapping starts
+// with the kernel's defaults, so any advice is given again.
+static int tm_map(struct twom_db *db, struct tm_file *file, size_t size, int prot)
+{
+    db->stats.remaps++;
+    int r = _tm_map(db, file, size, prot);
+    if (!r && db->advice) tm_advise(file, file->size, db->advice);
+    return r;
+}
+
+// extend the file to newsize, allocating the blocks if asked to
+static int tm_extend(struct twom_db *db, struct tm_file *file, size_t newsize)
+{
+#if defined(__linux__) || defined(__FreeBSD__)
+    if (db->fallocate) {
+        int r = posix_fallocate(file->fd, file->size, newsize - file->size);
+        if (!r) return 0;
+        // not supported by this filesystem, fall back to a sparse extend
+        if (r != EINVAL && r != EOPNOTSUPP) return TWOM_IOERROR;
+    }
+#endif
+    if (ftruncate(file->fd, newsize)) return TWOM_IOERROR;
+    return 0;
 }
 
 static inline int tm_ensure(struct twom_db *db, size_t offset)
@@ -577,3164 +1292,8636 @@ static inline int tm_ensure(struct twom_db *db, size_t offset)
     assert(file->has_datalock == 2);
 
     size_t newoffset = tm_roundup(offset);
+    if (db->growth && newoffset < file->size + db->growth)
+        newoffset = (file->size + db->growth + (1<<14) - 1) & ~(size_t)((1<<14) - 1);
+    // don't step outside the reservation just for the extra headroom
+    if (offset <= file->reserved && newoffset > file->reserved)
+        newoffset = file->reserved;
     assert(newoffset >= offset);
 
-    // unmap first
-    if (file->size) munmap(file->base, file->size);
-
-    // extend (could also use fseek and write a NULL byte, or
-    if (ftruncate(file->fd, newoffset)) {
+    db->stats.extends++;
+    if (tm_extend(db, file, newoffset)) {
         db->error("twom failed to extend file during tm_ensure",
                    "filename=<%s> size=<%08llX> newsize=<%08llX>",
                    db->fname, (LLU)file->size, (LLU)newoffset);
         return TWOM_IOERROR;
     }
 
-    // map the larger file into new memory
-    file->size = newoffset;
-    void *map = mmap((caddr_t)0, file->size, PROT_READ|PROT_WRITE, MAP_SHARED, db->openfile->fd, 0L);
-    if (map == MAP_FAILED) {
+    // map the larger file, in place if there's space reserved
+    if (tm_map(db, file, newoffset, PROT_READ|PROT_WRITE)) {
         db->error("twom failed to mmap during tm_ensure",
                    "filename=<%s> newsize=<%08llX>",
-                   db->fname, (LLU)file->size);
+                   db->fname, (LLU)newoffset);
         return TWOM_IOERROR;
     }
-    file->base = map;
 
     return 0;
 }
 
-/**************** OBJECT CLEANUP ******************/
+/************** COMPRESSED VALUES ****************/
 
-static void _remove_txn(struct twom_txn **ptr)
+/* With a compress function, a file created (or repacked) by this open is
+ * marked COMPRESSED in the header, and values over the threshold which come
+ * out shorter are written as ZADD or ZREPLACE records instead.  Their value is
+ * the original length (8) followed by whatever the function made of it, so the
+ * tail checksum covers the compressed bytes.  Reading one back decompresses it
+ * into a buffer belonging to the transaction, which stays good until its next
+ * read.  Keys are never compressed, so searches don't need to know. */
+
+// the length of a compressed record's value once it's decompressed
+static size_t zip_rawlen(const char *ptr)
 {
-    struct twom_txn *cur = *ptr;
-    struct twom_txn *next = cur->next;
-    cur->file->refcount--;
-    free(cur);
-    *ptr = next;
+    // the value follows the key, so it's not aligned
+    uint64_t len;
+    memcpy(&len, VALPTR(ptr), 8);
+    return le64toh(len);
 }
 
-static void _remove_file(struct tm_file **ptr)
+static int zbuf_ensure(struct tm_zbuf *zb, size_t len)
 {
-    struct tm_file *cur = *ptr;
-    struct tm_file *next = (*ptr)->next;
-    assert(!cur->refcount);
-    assert(!cur->has_datalock);
-    assert(!cur->has_headlock);
-    if (cur->base) munmap(cur->base, cur->size);
-    if (cur->fd != -1) close(cur->fd);
-    free(cur);
-    *ptr = next;
+    if (len <= zb->size) return 0;
+    size_t size = zb->size ? zb->size : 4096;
+    while (size < len) size *= 2;
+    char *base = realloc(zb->base, size);
+    if (!base) return TWOM_IOERROR;
+    zb->base = base;
+    zb->size = size;
+    return 0;
 }
 
-static void empty_db(struct twom_db *db)
+// decompress the value of a ZADD or ZREPLACE record into zb
+static int zip_value(struct twom_db *db, struct tm_zbuf *zb, const char *ptr,
+                     const char **valp, size_t *vallenp)
 {
-    if (db->loc.file) {
-        db->loc.file->refcount--;
-        db->loc.file = NULL;
+    size_t len = zip_rawlen(ptr);
+    int r = zbuf_ensure(zb, len + 1);
+    if (r) return r;
+    db->stats.decompressions++;
+    if (db->decompress(VALPTR(ptr) + 8, VALLEN(ptr) - 8, zb->base, len) != len) {
+        db->error("invalid compressed value",
+                  "filename=<%s> key=<%.*s>",
+                  db->fname, (int)(KEYLEN(ptr) < 64 ? KEYLEN(ptr) : 64), KEYPTR(ptr));
+        return TWOM_BADFORMAT;
     }
-    while (db->write_txn)
-        _remove_txn(&db->write_txn);
-    while (db->read_txn)
-        _remove_txn(&db->read_txn);
-    while (db->openfile)
-        _remove_file(&db->openfile);
+    // like the values in the file, it's NUL terminated
+    zb->base[len] = 0;
+    *valp = zb->base;
+    if (vallenp) *vallenp = len;
+    return 0;
 }
 
-static void tm_cleanup(struct twom_db *db)
+/* compress a value for store_here into db->zwrite, if the file takes
+ * compressed values and it comes out shorter.  Returns the length of the
+ * record's value (including the original length in front) or 0 to write it
+ * as it is */
+static size_t zip_store(struct twom_db *db, struct tm_file *file,
+                        const char *val, size_t vallen)
 {
-    // close any open files with a zero refcount (no loc or txn
-    // still points there) except the first one
-    if (!db->openfile) return;
-    struct tm_file **ptr = &db->openfile->next;
-    while (*ptr) {
-        if (!(*ptr)->refcount) {
-            _remove_file(ptr);
-        }
-        else {
-            ptr = &((*ptr)->next);
-        }
-    }
+    if (!db->compress || !(file->header.flags & COMPRESSED)) return 0;
+    if (vallen <= db->compress_threshold || vallen > 0xFFFFFFFFULL) return 0;
+    if (zbuf_ensure(&db->zwrite, 8 + vallen)) return 0;
+    size_t zlen = db->compress(val, vallen, db->zwrite.base + 8, vallen);
+    if (!zlen || 8 + zlen >= vallen) return 0;
+    uint64_t len = htole64(vallen);
+    memcpy(db->zwrite.base, &len, 8);
+    db->stats.compressions++;
+    return 8 + zlen;
 }
 
-/************** DATABASE HEADER MANAGEMENT ****************/
+/************** BLOB FILE ****************/
 
-/* given an open, mapped db, read in the header information */
-static int read_header(struct twom_db *db, struct tm_file *file, struct tm_header *header)
-{
-    assert(db && file);
-    const char *base = file->base;
+/* With TWOM_BLOBS, values over the threshold are appended to fname.BLOBS and
+ * the record (BLOBADD or BLOBREPLACE) holds a reference to the value instead
+ * of the value itself: offset (8), length (8), checksum (4) and 4 bytes of
+ * padding.  That keeps the skiplist file small and dense for searching.
+ *
+ * The blob file is only appended to, under the write lock, and anything in it
+ * is never changed, so it is shared by every generation of the database.  A
+ * repack copies just the references.  The flip side is that the space of
+ * replaced and deleted blobs isn't reclaimed.
+ *
+ * Blobs are written with pwrite and read through a read-only mapping, which
+ * grows as references further along are followed. */
 
-    if (memcmp(base, HEADER_MAGIC, HEADER_MAGIC_SIZE))
-        return TWOM_BADFORMAT;
+#define BLOB_SUFFIX ".BLOBS"
+#define BLOB_MAGIC ("\241\002\213\015twomblob\0\0\0\0")
+#define BLOB_MAGIC_SIZE (16)
+#define BLOB_REFLEN (24)
 
-    memcpy(header->uuid, base + OFFSET_UUID, 16);
+static void blob_ref(const char *ptr, uint64_t *offsetp, uint64_t *lenp, uint32_t *csump)
+{
+    // the value follows the key, so it's not aligned
+    const char *ref = VALPTR(ptr);
+    uint64_t offset, len;
+    uint32_t csum;
+    memcpy(&offset, ref, 8);
+    memcpy(&len, ref + 8, 8);
+    memcpy(&csum, ref + 16, 4);
+    *offsetp = le64toh(offset);
+    *lenp = le64toh(len);
+    *csump = le32toh(csum);
+}
 
-    header->version
-        = le32toh(*((uint32_t *)(base + OFFSET_VERSION)));
+// the length of a record's value, without following a blob reference or decompressing it
+static size_t record_vallen(const char *ptr)
+{
+    if (zrecord[TYPE(ptr)]) return zip_rawlen(ptr);
+    if (!blobrecord[TYPE(ptr)]) return VALLEN(ptr);
+    uint64_t offset, len;
+    uint32_t csum;
+    blob_ref(ptr, &offset, &len, &csum);
+    return len;
+}
 
-    if (header->version > TWOM_VERSION) {
-        db->error("invalid version",
-                  "filename=<%s> version=<%d>",
-                  db->fname, header->version);
-        return TWOM_BADFORMAT;
+// make a new name in fname's directory durable
+static int fsync_dir(struct twom_db *db, const char *fname)
+{
+    char *copy = strdup(fname);
+    const char *dir = dirname(copy);
+#if defined(O_DIRECTORY)
+    int dirfd = open(dir, O_RDONLY|O_DIRECTORY, 0600);
+#else
+    int dirfd = open(dir, O_RDONLY, 0600);
+#endif
+    int r = 0;
+    if (dirfd < 0 || fsync(dirfd) < 0) {
+        db->error("fsync directory failed",
+                  "filename=<%s> directory=<%s>", fname, dir);
+        r = TWOM_IOERROR;
     }
+    if (dirfd >= 0) close(dirfd);
+    free(copy);
+    return r;
+}
 
-    header->flags
-        = le32toh(*((uint32_t *)(base + OFFSET_FLAGS)));
+static int blob_open(struct twom_db *db)
+{
+    if (db->blobs.fd >= 0) return 0;
 
-    if (header->flags & TWOM_CSUM_EXTERNAL) {
-        if (!db->external_csum) {
-            db->error("missing external csum function",
-                      "filename=<%s>", db->fname);
-            return TWOM_BADUSAGE;
-        }
+    char fname[1024];
+    snprintf(fname, sizeof(fname), "%s%s", db->fname, BLOB_SUFFIX);
+    int fd = open(fname, db->readonly ? O_RDONLY : O_RDWR|O_CREAT, 0644);
+    if (fd < 0) {
+        db->error("open blob file failed",
+                  "filename=<%s>", fname);
+        return TWOM_IOERROR;
     }
-    set_csum_engine(db, file, header->flags);
 
-    // XXX - check flags for other comparison engines?
-    if (header->flags & TWOM_COMPAR_EXTERNAL) {
-        if (!db->external_compar) {
-            db->error("missing external compar function",
-                      "filename=<%s>", db->fname);
-            return TWOM_BADUSAGE;
+    struct stat sbuf;
+    char magic[BLOB_MAGIC_SIZE];
+    if (fstat(fd, &sbuf) < 0) goto ioerror;
+
+    // blobs are only written under the write lock, so an empty (or half
+    // created) file can only be one we're about to write to
+    if (sbuf.st_size < BLOB_MAGIC_SIZE && !db->readonly) {
+        if (ftruncate(fd, 0) < 0) goto ioerror;
+        if (pwrite(fd, BLOB_MAGIC, BLOB_MAGIC_SIZE, 0) != BLOB_MAGIC_SIZE) goto ioerror;
+        // blob_commit syncs the file, but the main file mustn't point
+        // into a blob file whose directory entry could still be lost
+        if (!db->nosync && fsync_dir(db, fname)) {
+            close(fd);
+            return TWOM_IOERROR;
         }
-        file->compar = db->external_compar;
     }
-    else  {
-        file->compar = compar_raw;
+    else if (pread(fd, magic, BLOB_MAGIC_SIZE, 0) != BLOB_MAGIC_SIZE
+             || memcmp(magic, BLOB_MAGIC, BLOB_MAGIC_SIZE)) {
+        db->error("invalid blob file",
+                  "filename=<%s>", fname);
+        close(fd);
+        return TWOM_BADFORMAT;
     }
 
-    header->generation
-        = le64toh(*((uint64_t *)(base + OFFSET_GENERATION)));
+    db->blobs.fd = fd;
+    return 0;
 
-    header->num_records
-        = le64toh(*((uint64_t *)(base + OFFSET_NUM_RECORDS)));
+ ioerror:
+    db->error("blob file setup failed",
+              "filename=<%s>", fname);
+    close(fd);
+    return TWOM_IOERROR;
+}
 
-    header->num_commits
-        = le64toh(*((uint64_t *)(base + OFFSET_NUM_COMMITS)));
+// make sure the mapping covers the first 'need' bytes of the blob file
+static int blob_map(struct twom_db *db, size_t need)
+{
+    struct tm_blobs *blobs = &db->blobs;
+    if (need <= blobs->size) return 0;
 
-    header->dirty_size
-        = le64toh(*((uint64_t *)(base + OFFSET_DIRTY_SIZE)));
+    struct stat sbuf;
+    if (fstat(blobs->fd, &sbuf) < 0) {
+        db->error("stat blob file failed",
+                  "filename=<%s>", db->fname);
+        return TWOM_IOERROR;
+    }
+    if ((size_t)sbuf.st_size < need) {
+        db->error("blob reference past the end of the blob file",
+                  "filename=<%s> need=<%llu> size=<%llu>",
+                  db->fname, (LLU)need, (LLU)sbuf.st_size);
+        return TWOM_BADFORMAT;
+    }
 
-    header->repack_size
-        = le64toh(*((uint64_t *)(base + OFFSET_REPACK_SIZE)));
+    db->stats.remaps++;
+    if (blobs->base) tm_unmap(db, blobs->base, blobs->size);
+    blobs->base = NULL;
+    blobs->size = 0;
+    void *map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, blobs->fd, 0L);
+    if (map == MAP_FAILED) {
+        db->error("mmap blob file failed",
+                  "filename=<%s>", db->fname);
+        return TWOM_IOERROR;
+    }
+    blobs->base = map;
+    blobs->size = sbuf.st_size;
+    return 0;
+}
 
-    header->current_size
-        = le64toh(*((uint64_t *)(base + OFFSET_CURRENT_SIZE)));
+/* find the value of the record at ptr: either in the record itself, or for
+ * a blob record, in the blob file.  A compressed value is decompressed into
+ * the transaction's buffer */
+#ifdef HAVE_DECLARE_OPTIMIZE
+static inline int record_value(struct twom_txn *txn, struct tm_file *file, const char *ptr,
+                               const char **valp, size_t *vallenp)
+    __attribute__((optimize("-O3")));
+#endif
+static inline int record_value(struct twom_txn *txn, struct tm_file *file, const char *ptr,
+                               const char **valp, size_t *vallenp)
+{
+    if (!blobrecord[TYPE(ptr)]) {
+        if (zrecord[TYPE(ptr)]) {
+            if (valp) return zip_value(txn->db, &txn->zbuf, ptr, valp, vallenp);
+            if (vallenp) *vallenp = zip_rawlen(ptr);
+            return 0;
+        }
+        if (valp) *valp = VALPTR(ptr);
+        if (vallenp) *vallenp = VALLEN(ptr);
+        return 0;
+    }
+    // just the length doesn't need the blob file
+    if (!valp) {
+        if (vallenp) *vallenp = record_vallen(ptr);
+        return 0;
+    }
 
-    assert(file->size >= header->current_size);
+    struct twom_db *db = txn->db;
+    uint64_t offset, len;
+    uint32_t csum;
+    blob_ref(ptr, &offset, &len, &csum);
+
+    // readers on other threads may be opening or growing the mapping too
+    threads_lock(db);
+    int r = blob_open(db);
+    if (!r) r = blob_map(db, offset + len);
+    const char *val = db->blobs.base + offset;
+    threads_unlock(db);
+    if (r) return r;
 
-    header->maxlevel
-        = le32toh(*((uint32_t *)(base + OFFSET_MAXLEVEL)));
+    if (db->blobs.copying) {
+        // the value is only going to be referenced again, so it isn't read.
+        // The reference itself is covered by the record's tail checksum
+        db->blobs.lastoffset = offset;
+        db->blobs.lastcsum = csum;
+        db->blobs.lastengine = file->csum;
+    }
+    else if (!db->nocsum && (db->threads || !(db->blobs.lastoffset == offset
+                                              && db->blobs.lastcsum == csum
+                                              && db->blobs.lastengine == file->csum))) {
+        db->stats.tailcsums++;
+        if (file->csum(val, len) != csum) {
+            db->error("invalid blob checksum",
+                      "filename=<%s> blob=<%08llX>",
+                      db->fname, (LLU)offset);
+            return TWOM_BADCHECKSUM;
+        }
+        // (readers on several threads would just trample each other's)
+        if (!db->threads) {
+            db->blobs.lastoffset = offset;
+            db->blobs.lastcsum = csum;
+            db->blobs.lastengine = file->csum;
+        }
+    }
 
-    if (db->nocsum) return 0;
+    if (valp) *valp = val;
+    if (vallenp) *vallenp = len;
+    return 0;
+}
 
-    uint32_t csum = le32toh(*((uint32_t *)(base + OFFSET_CSUM)));
-    if (file->csum(base, OFFSET_CSUM) != csum) {
-        db->error("header checksum failure",
-                  "filename=<%s>", db->fname);
-        return TWOM_BADCHECKSUM;
+/* put a value in the blob file and fill out a reference to it.  A value which
+ * is already in the blob file (we were handed a pointer into our own mapping,
+ * e.g. by repack copying a record) is just referenced again */
+static int blob_store(struct twom_db *db, struct tm_file *file,
+                      const char *val, size_t vallen, char *ref)
+{
+    struct tm_blobs *blobs = &db->blobs;
+    uint64_t offset;
+    uint32_t csum;
+
+    int r = blob_open(db);
+    if (r) return r;
+
+    if (blobs->base && val >= blobs->base && val + vallen <= blobs->base + blobs->size) {
+        offset = val - blobs->base;
+        if (blobs->lastoffset == offset && blobs->lastengine == file->csum)
+            csum = blobs->lastcsum;
+        else
+            csum = file->csum(val, vallen);
+    }
+    else {
+        if (!blobs->end) {
+            // first blob in this transaction: start after whatever is there
+            // already, even an aborted transaction's blobs
+            struct stat sbuf;
+            if (fstat(blobs->fd, &sbuf) < 0) {
+                db->error("stat blob file failed",
+                          "filename=<%s>", db->fname);
+                return TWOM_IOERROR;
+            }
+            blobs->end = PAD8((size_t)sbuf.st_size);
+        }
+        offset = blobs->end;
+        size_t written;
+        for (written = 0; written < vallen; ) {
+            ssize_t n = pwrite(blobs->fd, val + written, vallen - written, offset + written);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                db->error("blob write failed",
+                          "filename=<%s>", db->fname);
+                return TWOM_IOERROR;
+            }
+            written += n;
+        }
+        blobs->end = PAD8(offset + vallen);
+        blobs->dirty = 1;
+        csum = file->csum(val, vallen);
     }
 
+    uint64_t v64 = htole64(offset);
+    memcpy(ref, &v64, 8);
+    v64 = htole64(vallen);
+    memcpy(ref + 8, &v64, 8);
+    uint32_t v32 = htole32(csum);
+    memcpy(ref + 16, &v32, 4);
+    memset(ref + 20, 0, 4);
     return 0;
 }
 
-/* given an open, mapped, locked db, write the header information */
-static void pack_header(struct tm_header *header, struct tm_file *file, char *base)
+// the blobs must be on disk before any commit which refers to them
+static int blob_commit(struct twom_db *db, struct twom_txn *txn)
 {
-    memcpy(base, HEADER_MAGIC, HEADER_MAGIC_SIZE);
-    memcpy(base + OFFSET_UUID, header->uuid, 16);
-    *((uint32_t *)(base + OFFSET_VERSION)) = htole32(header->version);
-    *((uint32_t *)(base + OFFSET_FLAGS)) = htole32(header->flags);
-    *((uint64_t *)(base + OFFSET_GENERATION)) = htole64(header->generation);
-    *((uint64_t *)(base + OFFSET_NUM_RECORDS)) = htole64(header->num_records);
-    *((uint64_t *)(base + OFFSET_NUM_COMMITS)) = htole64(header->num_commits);
-    *((uint64_t *)(base + OFFSET_DIRTY_SIZE)) = htole64(header->dirty_size);
-    *((uint64_t *)(base + OFFSET_REPACK_SIZE)) = htole64(header->repack_size);
-    *((uint64_t *)(base + OFFSET_CURRENT_SIZE)) = htole64(header->current_size);
-    *((uint32_t *)(base + OFFSET_MAXLEVEL)) = htole32(header->maxlevel);
-    *((uint32_t *)(base + OFFSET_CSUM)) = htole32(file->csum(base, OFFSET_CSUM));
+    struct tm_blobs *blobs = &db->blobs;
+    blobs->end = 0;
+    if (!blobs->dirty) return 0;
+    blobs->dirty = 0;
+    if (db->nosync) return 0;
+    if (txn->nosync) {
+        // twom_db_sync will flush this later
+        blobs->unsynced = 1;
+        return 0;
+    }
+    blobs->unsynced = 0;
+    db->stats.syncs++;
+#if defined(__APPLE__)
+    int r = fsync(blobs->fd);
+#else
+    int r = fdatasync(blobs->fd);
+#endif
+    if (r) {
+        db->error("blob sync failed",
+                  "filename=<%s>", db->fname);
+        return TWOM_IOERROR;
+    }
+    return 0;
 }
 
-/* simple wrapper to write with an fsync */
-static int commit_header(struct twom_db *db, struct tm_header *header)
+/************** KEY FILTER ****************/
+
+/* With TWOM_BLOOM, fname.BLOOM holds a blocked Bloom filter of the keys in
+ * the file, so that most fetches of a key which isn't there never search at
+ * all.  After a 64 byte header it's 64 byte blocks, and each key sets its
+ * BLOOM_HASHES bits in just the one block its hash picks, so a check reads
+ * a single cache line.  Bits are only ever set: deletes leave them, and so
+ * do aborts, which makes them false positives, and those fall through to the
+ * search like any other.
+ *
+ * Each generation of the file has its own filter, tagged with its UUID and
+ * generation, built by repack as it writes the new file and renamed into
+ * place just before it.  'covered' is the committed size of the file that
+ * the filter has every key for.  Writers add keys as they store them, flush
+ * the filter before the commit, and move covered on once it's done, first
+ * catching up on anything another writer left out.  A reader only trusts
+ * the filter if it covers exactly the file it has locked, so a missing,
+ * stale or lagging filter just means searching as usual. */
+
+#define BLOOM_SUFFIX ".BLOOM"
+#define BLOOM_MAGIC ("twomblm1")
+#define BLOOM_MAGIC_SIZE (8)
+#define BLOOM_HEADER (64)
+#define BLOOM_BLOCK (64)
+
+enum {
+    BLOOM_OFFSET_UUID = 8,
+    BLOOM_OFFSET_GENERATION = 24,
+    BLOOM_OFFSET_COVERED = 32,
+    BLOOM_OFFSET_NBLOCKS = 40,
+};
+
+static inline uint64_t bloom_hash(const char *key, size_t keylen)
 {
-    struct tm_file *file = db->openfile;
-    pack_header(header, file, file->base);
-    file->dirty = 1;
-    return tm_commit(db, HEADER_SIZE);
+    return XXH3_64bits_internal(key, keylen, 0, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                tm_xxh3_long);
 }
 
-/******************** RECORD MANAGEMENT *********************/
+// the block a hash picks: the top half scaled to the number of blocks
+static inline char *bloom_block(const struct tm_bloom *bl, uint64_t hash)
+{
+    return bl->base + BLOOM_HEADER + ((hash >> 32) * bl->nblocks >> 32) * BLOOM_BLOCK;
+}
 
-// Setting the next location at level 0 is special within twom (and
-// twoskip before it).  The logic is:
-// * if the higher value is past the committed length of the file, update
-//   the higher value, because it's been changed within this transaction.
-// * otherwise, update the lower value
-//
-// This means that the highest value that's NOT past the end of the
-// committed file is correct, so when we do a recovery or a transaction
-// abort, we can zero out the pointer that's past the "end" of the file,
-// and the remaining value will always point to the next committed record
-// in the valid file.
-//
-// The recovery operation then checks all the higher-level pointers to make
-// sure they still point to the correct next record as it walks the entire
-// linked list at level zero, which fixes any other values that were updated
-// in the aborted transaction.
-#ifdef HAVE_DECLARE_OPTIMIZE
-static inline void _setloc0(struct tm_file *file, char *ptr, size_t offset)
-    __attribute__((optimize("-O3")));
-#endif
-static inline void _setloc0(struct tm_file *file, char *ptr, size_t offset)
+// and the bits within it, 9 at a time from the hash mixed again
+static inline uint64_t bloom_bits(uint64_t hash)
 {
-    char *addr = ptr + ptroffset[TYPE(ptr)];
+    return hash * 0x9E3779B97F4A7C15ULL;
+}
 
-    /* level zero is special */
-    size_t val0 = NEXT0(ptr, 0);
-    size_t val1 = NEXT0(ptr, 1);
+static inline uint64_t bloom_covered(const struct tm_bloom *bl)
+{
+    return le64toh(__atomic_load_n((uint64_t *)(bl->base + BLOOM_OFFSET_COVERED),
+                                   __ATOMIC_ACQUIRE));
+}
 
-    size_t end = file->committed_size;
-    /* already this transaction, update this one */
-    if (val0 < end && (val1 >= end || val0 > val1))
-        addr += 8; // conditions to write to val1
+static inline void bloom_set_covered(struct tm_bloom *bl, uint64_t covered)
+{
+    __atomic_store_n((uint64_t *)(bl->base + BLOOM_OFFSET_COVERED),
+                     htole64(covered), __ATOMIC_RELEASE);
+}
 
-    *((uint64_t *)(addr)) = htole64(offset);
+static void bloom_add(struct tm_bloom *bl, const char *key, size_t keylen)
+{
+    uint64_t hash = bloom_hash(key, keylen);
+    unsigned char *block = (unsigned char *)bloom_block(bl, hash);
+    uint64_t bits = bloom_bits(hash);
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++, bits >>= 9) {
+        unsigned bit = bits & (BLOOM_BLOCK * 8 - 1);
+        // only write what isn't set already, so existing keys don't dirty pages
+        if (block[bit >> 3] & (1 << (bit & 7))) continue;
+        block[bit >> 3] |= 1 << (bit & 7);
+        bl->dirty = 1;
+    }
 }
 
-#ifdef HAVE_DECLARE_OPTIMIZE
-static inline void _recsum(struct tm_file *file, char *ptr)
-    __attribute__((optimize("-O3")));
-#endif
-static inline void _recsum(struct tm_file *file, char *ptr)
+static int bloom_has(const struct tm_bloom *bl, const char *key, size_t keylen)
 {
-    size_t headlen = HEADLEN(ptr);
-    uint32_t newcsum = file->csum(ptr, headlen);
-    *((uint32_t *)(ptr + headlen)) = htole32(newcsum);
+    uint64_t hash = bloom_hash(key, keylen);
+    const unsigned char *block = (const unsigned char *)bloom_block(bl, hash);
+    uint64_t bits = bloom_bits(hash);
+    int i;
+    for (i = 0; i < BLOOM_HASHES; i++, bits >>= 9) {
+        unsigned bit = bits & (BLOOM_BLOCK * 8 - 1);
+        if (!(block[bit >> 3] & (1 << (bit & 7)))) return 0;
+    }
+    return 1;
 }
 
-/******************** LOCATION MANAGEMENT *********************/
+static void bloom_fname(struct twom_db *db, char *buf, size_t len)
+{
+    // while repacking, the filter for the new file goes alongside it
+    snprintf(buf, len, "%s%s%s", db->fname, BLOOM_SUFFIX, db->repack ? ".NEW" : "");
+}
 
-/* locate()
- *
- * db: a database, with a read or write locked file (not necessarily the most recent)
- * loc: a location pointer which points to the locked file; with and "end" which is the MVCC
- *      transaction end for the records we're looking through
- * key, keylen: find either this key or the key immediately before it (may be the DUMMY) if
- *      the database is empty or this key is before any key in the database.
- */
-#ifdef HAVE_DECLARE_OPTIMIZE
-static int locate(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen)
-    __attribute__((optimize("-O3")));
-#endif
-static int locate(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen)
+static void bloom_free(struct twom_db *db, struct tm_file *file)
 {
-    size_t offset = DUMMY_OFFSET;
-    uint8_t level = MAXLEVEL-1;
-    int cmp = -1; /* never found a thing! */
-    struct tm_file *file = loc->file;
-    size_t end = loc->end;
-    const char *ptr = NULL;
+    if (!file->bloom) return;
+    tm_unmap(db, file->bloom->base, file->bloom->size);
+    free(file->bloom);
+    file->bloom = NULL;
+}
 
-    // reset the location
-    loc->offset = 0;
-    loc->deleted_offset = 0;
+// start an empty filter for a file that initdb is just creating
+static int bloom_create(struct twom_db *db, struct tm_file *file,
+                        const struct tm_header *header, size_t nkeys)
+{
+    char fname[1024];
+    bloom_fname(db, fname, sizeof(fname));
+
+    if (nkeys < BLOOM_MINKEYS) nkeys = BLOOM_MINKEYS;
+    uint64_t nblocks = (nkeys * BLOOM_BITS_PER_KEY + BLOOM_BLOCK * 8 - 1) / (BLOOM_BLOCK * 8);
+    if (nblocks > UINT32_MAX) nblocks = UINT32_MAX;
+    size_t size = BLOOM_HEADER + nblocks * BLOOM_BLOCK;
+
+    // never write into a filter someone else may have mapped
+    unlink(fname);
+    int fd = open(fname, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) goto ioerror;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        goto ioerror;
+    }
+    char *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0L);
+    close(fd);
+    if (base == MAP_FAILED) goto ioerror;
+
+    memcpy(base, BLOOM_MAGIC, BLOOM_MAGIC_SIZE);
+    memcpy(base + BLOOM_OFFSET_UUID, header->uuid, 16);
+    *((uint64_t *)(base + BLOOM_OFFSET_GENERATION)) = htole64(header->generation);
+    *((uint64_t *)(base + BLOOM_OFFSET_NBLOCKS)) = htole64(nblocks);
+
+    bloom_free(db, file);
+    file->bloom = (struct tm_bloom *)twom_zmalloc(sizeof(struct tm_bloom));
+    file->bloom->base = base;
+    file->bloom->size = size;
+    file->bloom->nblocks = nblocks;
+    file->bloom->dirty = 1;
+    bloom_set_covered(file->bloom, header->current_size);
+    file->bloom_tried = 1;
+    return 0;
 
-    /* if we don't even have space for the DUMMY record in our mapped file,
-     * we can't locate anything */
-    const char *locptr = safeptr(loc, DUMMY_OFFSET);
-    if (!locptr) return TWOM_IOERROR;
+ ioerror:
+    db->error("key filter creation failed",
+              "filename=<%s>", fname);
+    return TWOM_IOERROR;
+}
 
-    /* the empty string is always first, so every back pointer will be the dummy,
-     * - there's no need to compare records, shortcircuit here */
-    if (!keylen) {
-        while (level) {
-            loc->backloc[level] = DUMMY_OFFSET;
-            level--;
-        }
-        loc->backloc[0] = DUMMY_OFFSET;
-        return 0;
-    }
+// repack gives the new file the old one's UUID and the next generation
+static void bloom_stamp(struct tm_file *file)
+{
+    if (!file->bloom) return;
+    char *base = file->bloom->base;
+    memcpy(base + BLOOM_OFFSET_UUID, file->header.uuid, 16);
+    *((uint64_t *)(base + BLOOM_OFFSET_GENERATION)) = htole64(file->header.generation);
+}
 
-    /* at every level except zero, walk the pointers at this level until we either hit a record
-     * at or past the one we're looking for. */
-    size_t futureoffset = 0; // efficiency hack, remember the offset we just saw in the future
-    while (level) {
-        size_t next = NEXTN(locptr, level);
-        /* optimisation: if the next address is the same on levels N and N-1,
-         * we don't need to compar the key again */
-        if (next && next != futureoffset && next < end) {
-            ptr = safeptr(loc, next);
-            if (!ptr) return TWOM_IOERROR;
+// map fname.BLOOM, if it's the filter for this generation of the file
+static struct tm_bloom *bloom_open(struct twom_db *db, struct tm_file *file)
+{
+    char fname[1024];
+    snprintf(fname, sizeof(fname), "%s%s", db->fname, BLOOM_SUFFIX);
+    int fd = open(fname, db->readonly ? O_RDONLY : O_RDWR);
+    if (fd < 0) return NULL;
 
-            cmp = COMPAR(file->compar, KEYPTR(ptr), KEYLEN(ptr),
-                         key, keylen);
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < BLOOM_HEADER + BLOOM_BLOCK) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = sbuf.st_size;
+    char *base = mmap(NULL, size, db->readonly ? PROT_READ : PROT_READ|PROT_WRITE,
+                      MAP_SHARED, fd, 0L);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    uint64_t nblocks = le64toh(*((uint64_t *)(base + BLOOM_OFFSET_NBLOCKS)));
+    if (memcmp(base, BLOOM_MAGIC, BLOOM_MAGIC_SIZE)
+        || memcmp(base + BLOOM_OFFSET_UUID, file->header.uuid, 16)
+        || le64toh(*((uint64_t *)(base + BLOOM_OFFSET_GENERATION))) != file->header.generation
+        || BLOOM_HEADER + nblocks * BLOOM_BLOCK != size) {
+        munmap(base, size);
+        return NULL;
+    }
 
-            /* not there?  stay at this level */
-            if (cmp < 0) {
-                locptr = ptr;
-                offset = next;
-                continue;
-            }
-            /* NOTE: if we match exactly, we still need to make sure all the back
-             * pointers at the lower levels are correct, so we still drop down to
-             * the next level and repeat the algorithm */
-            futureoffset = next;
-        }
+    struct tm_bloom *bl = (struct tm_bloom *)twom_zmalloc(sizeof(struct tm_bloom));
+    bl->base = base;
+    bl->size = size;
+    bl->nblocks = nblocks;
+    return bl;
+}
 
-        loc->backloc[level] = offset;
-        level--;
+// the filter for a file, looking for it the first time.  It isn't used at
+// all with another comparator, where keys which differ can still match
+static struct tm_bloom *bloom_get(struct twom_db *db, struct tm_file *file)
+{
+    if (!(file->header.flags & TWOM_BLOOM) || file->compar != compar_raw) return NULL;
+    struct tm_bloom *bl = __atomic_load_n(&file->bloom, __ATOMIC_ACQUIRE);
+    if (bl || __atomic_load_n(&file->bloom_tried, __ATOMIC_ACQUIRE)) return bl;
+
+    threads_lock(db);
+    if (!file->bloom_tried) {
+        __atomic_store_n(&file->bloom, bloom_open(db, file), __ATOMIC_RELEASE);
+        __atomic_store_n(&file->bloom_tried, 1, __ATOMIC_RELEASE);
     }
+    bl = file->bloom;
+    threads_unlock(db);
+    return bl;
+}
 
-    while (offset) {
-        size_t next = advance0(locptr, end);
-        if (!next) {
-            // hit the end!  No match
-            loc->backloc[0] = offset;
-            return 0;
-        }
+// could the key be in the file the transaction is reading?
+static int bloom_maybe(struct twom_txn *txn, const char *key, size_t keylen)
+{
+    struct tm_file *file = txn->file;
+    struct tm_bloom *bl = bloom_get(txn->db, file);
+    if (!bl || bloom_covered(bl) != file->committed_size) return 1;
+    return bloom_has(bl, key, keylen);
+}
 
-        size_t deleted_offset = 0;
-        ptr = safeptr(loc, next);
-        if (!ptr) return TWOM_IOERROR;
-        if (TYPE(ptr) == DELETE) {
-            deleted_offset = next;
-            next = ANCESTOR(ptr);
-            if (!next) return TWOM_IOERROR;
-            ptr = safeptr(loc, next);
-            if (!ptr) return TWOM_IOERROR;
-        }
+// before a commit: add the keys of anything committed since the filter last
+// covered the file, which only another writer can have left out, and flush
+// it.  Returns the filter if it can be moved on past this commit
+static int bloom_commit(struct twom_db *db, struct twom_txn *txn, struct tm_bloom **blp)
+{
+    struct tm_file *file = txn->file;
+    *blp = NULL;
+    struct tm_bloom *bl = bloom_get(db, file);
+    if (!bl || db->readonly) return 0;
 
-        cmp = COMPAR(file->compar, KEYPTR(ptr), KEYLEN(ptr),
-                     key, keylen);
+    size_t offset = bloom_covered(bl);
+    // the file was rolled back past it (a crash), but was the same up to here
+    if (offset > file->committed_size) offset = file->committed_size;
 
-        // if we match exactly or see into the future, we're there!
-        if (cmp > 0) {
-            // we're past, no match
-            loc->backloc[0] = offset;
-            return 0;
-        }
-        else if (!cmp) {
-            // we found it, track the previous offset
-            loc->backloc[0] = offset;
-            offset = next;
-            loc->offset = offset;
-            loc->deleted_offset = deleted_offset;
-            return check_headcsum(txn, loc->file, ptr, next);
-        }
-        locptr = ptr;
-        offset = next;
+    struct tm_loc loc;
+    memset(&loc, 0, sizeof(loc));
+    loc.file = file;
+    loc.end = file->committed_size;
+    while (offset < file->committed_size) {
+        const char *ptr = safeptr(&loc, offset);
+        // can't tell what's missing: leave it lagging, and nobody will use it
+        if (!ptr) return 0;
+        if (TYPE(ptr) != COMMIT && TYPE(ptr) != DELETE && TYPE(ptr) != DUMMY)
+            bloom_add(bl, KEYPTR(ptr), KEYLEN(ptr));
+        offset += RECLEN(ptr);
     }
+    *blp = bl;
 
-    return TWOM_INTERNAL;
+    if (!bl->dirty) return 0;
+    bl->dirty = 0;
+    if (db->nosync) return 0;
+    if (txn->nosync) {
+        // twom_db_sync will flush this later
+        bl->unsynced = 1;
+        return 0;
+    }
+    bl->unsynced = 0;
+    db->stats.syncs++;
+    if (msync(bl->base, bl->size, MS_SYNC)) {
+        db->error("key filter sync failed",
+                  "filename=<%s>", db->fname);
+        return TWOM_IOERROR;
+    }
+    return 0;
 }
 
-/* advance_loc()
- * db: a database, with a read or write locked file (not necessarily the most recent)
- * txn: a transaction which points to a locked file, which may or may not be the most
- *      recent (for a read-only transaction in MVCC it could be an older file), and
- *      which has an 'end' value which is the MVCC end for the view we're in
- * loc: a previously 'locate'd location which contains a file (possibly not locked)
- *      and an offset into the mmap on on that file for a record which contains the
- *      key data for that location.
- * Will update loc to txn if needed (with relocate), then move loc to point to the next
- * record (or offset == 0 at EOF)
- * Used by foreach, fetchnext, and internal functions */
-#ifdef HAVE_DECLARE_OPTIMIZE
-static int advance_loc(struct twom_txn *txn, struct tm_loc *loc)
-    __attribute__((optimize("-O3")));
-#endif
-static int advance_loc(struct twom_txn *txn, struct tm_loc *loc)
-{
-    // need to read ptr BEFORE we potentially switch the file pointer
-    // below
-    const char *ptr = loc->offset ? LOCPTR(loc) : LOCBACKPTR(loc, 0);
+/**************** OBJECT CLEANUP ******************/
 
-    // update to the new file if the transaction has refreshed
-    if (loc->file != txn->file) {
-        loc->file->refcount--;
-        loc->file = txn->file;
-        loc->file->refcount++;
-        loc->end = 0;
+/* transactions and cursors come off a short list of spares on the handle
+ * when there are any, so a fetch doesn't need the allocator.  Only the
+ * fields in front of the location's back pointers get cleared: they're
+ * never read until a search has set them, and the end of zero says so */
+static struct twom_txn *tm_newtxn(struct twom_db *db)
+{
+    threads_lock(db);
+    struct twom_txn *txn = db->spare_txn;
+    if (txn) {
+        db->spare_txn = txn->next;
+        db->nspare_txn--;
     }
+    threads_unlock(db);
 
-    // if file has changed, either new file or extended,
-    // then we need to re-calculate our location
-    if (loc->end != loc->file->written_size) {
-        int was_inexact = !loc->offset;
-        const char *key = KEYPTR(ptr);
-        size_t keylen = KEYLEN(ptr);
-        loc->end = loc->file->written_size;
-        int r = locate(txn, loc, key, keylen);
-        if (r) return r;
-        if (was_inexact) {
-            loc->deleted_offset = 0;
-            loc->offset = 0;
+    if (!txn) return (struct twom_txn *)twom_zmalloc(sizeof(struct twom_txn));
+    memset(txn, 0, offsetof(struct twom_txn, loc.backloc));
+    return txn;
+}
+
+/* a value a finished transaction decompressed may still be in use
+ * (twom_db_fetch has just finished with its transaction), so the handle keeps
+ * the latest.  With TWOM_THREADSAFE that's one for each thread, since what's
+ * handed out on one thread stays good until that thread's next call */
+static void zbuf_keep(struct twom_db *db, struct tm_zbuf *zb)
+{
+    struct tm_zbuf *last = &db->zlast;
+    if (db->threads) {
+        struct tm_zlast *zl = pthread_getspecific(db->threads->zlast);
+        if (!zl) {
+            zl = (struct tm_zlast *)twom_zmalloc(sizeof(struct tm_zlast));
+            threads_lock(db);
+            zl->next = db->threads->zlasts;
+            db->threads->zlasts = zl;
+            threads_unlock(db);
+            pthread_setspecific(db->threads->zlast, zl);
         }
-        ptr = loc->offset ? LOCPTR(loc) : LOCBACKPTR(loc, 0);
-        // now we've re-mapped, we might have something to clean up
-        tm_cleanup(txn->db);
+        last = &zl->zbuf;
     }
+    free(last->base);
+    *last = *zb;
+    zb->base = NULL;
+    zb->size = 0;
+}
 
-    /* If we had an offset, advance the backloc to this record, so the location now points
-     * immediately after this record as if we had found a key in the gap */
-    if (loc->offset) {
-        uint8_t n;
-        uint8_t level = LEVEL(ptr);
-        for (n = 0; n < level; n++)
-            loc->backloc[n] = loc->offset;
-        loc->deleted_offset = 0;
-        loc->offset = 0;
+static void tm_freetxn(struct twom_db *db, struct twom_txn *txn)
+{
+    if (txn->zbuf.base) zbuf_keep(db, &txn->zbuf);
+    threads_lock(db);
+    if (db->nspare_txn < SPARE_OBJECTS) {
+        txn->next = db->spare_txn;
+        db->spare_txn = txn;
+        db->nspare_txn++;
+        txn = NULL;
     }
+    threads_unlock(db);
+    free(txn);
+}
 
-    /* advance0 always get the exactly next record in the series, since it finds the level0
-     * pointer after using the skip math to pick the highest value */
-    size_t offset = advance0(ptr, loc->end);
-
-    /* reached the end:
-     * will have offset == 0, so will break foreach */
-    if (!offset) return TWOM_DONE;
-
-    ptr = safeptr(loc, offset);
-    if (!ptr) return TWOM_IOERROR;
-    if (TYPE(ptr) == DELETE) {
-        loc->deleted_offset = offset;
-        offset = ANCESTOR(ptr);
-        if (!offset) return TWOM_IOERROR;
-        ptr = safeptr(loc, offset);
-        if (!ptr) return TWOM_IOERROR;
+static struct twom_cursor *tm_newcursor(struct twom_db *db)
+{
+    threads_lock(db);
+    struct twom_cursor *cur = db->spare_cursor;
+    if (cur) {
+        db->spare_cursor = cur->next;
+        db->nspare_cursor--;
     }
-
-    /* make sure this record is complete */
-    loc->offset = offset;
-    return check_headcsum(txn, loc->file, ptr, offset);
+    threads_unlock(db);
+
+    if (!cur) return (struct twom_cursor *)twom_zmalloc(sizeof(struct twom_cursor));
+    char *prefix = cur->prefix;
+    size_t prefixspace = cur->prefixspace;
+    memset(cur, 0, offsetof(struct twom_cursor, loc.backloc));
+    cur->prefix = prefix;
+    cur->prefixspace = prefixspace;
+    return cur;
 }
 
-// find_loc is an optimisation on locate.  In the cases where the file hasn't changed and
-// either the current key matches exactly, or is in the gap, or is the immediately next
-// record, we can avoid the full cost of filling out the location.
-//
-// This function can also be used to initialise a blank location, since it will detect
-// that as a "file has changed" and fill out the right values
-static int find_loc(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen)
+// the transaction and location must already be finished with
+static void tm_freecursor(struct twom_db *db, struct twom_cursor *cur)
 {
-    // the old location is for an old file or this file has been extended
-    if (loc->file != txn->file || loc->end != loc->file->written_size) {
-        if (loc->file) loc->file->refcount--;
-        loc->file = txn->file;
-        loc->file->refcount++;
-        loc->end = loc->file->written_size;
-        int r = locate(txn, loc, key, keylen);
-        if (r) return r;
-        // we may have released the last reference, so clean up
-        tm_cleanup(txn->db);
-        return 0;
+    free(cur->endkey);
+    cur->endkey = NULL;
+    threads_lock(db);
+    if (db->nspare_cursor < SPARE_OBJECTS) {
+        cur->next = db->spare_cursor;
+        db->spare_cursor = cur;
+        db->nspare_cursor++;
+        cur = NULL;
     }
+    threads_unlock(db);
+    if (!cur) return;
+    free(cur->prefix);
+    free(cur);
+}
 
-    const char *ptr = loc->offset ? LOCPTR(loc) : LOCBACKPTR(loc, 0);
-    int cmp = COMPAR(loc->file->compar, KEYPTR(ptr), KEYLEN(ptr), key, keylen);
-    if (!cmp && loc->offset) {
-        // we haven't moved
-        return 0;
-    }
+static void _remove_txn(struct twom_txn **ptr)
+{
+    struct twom_txn *cur = *ptr;
+    struct twom_txn *next = cur->next;
+    tm_unref(cur->file);
+    if (cur->loc.file) tm_unref(cur->loc.file);
+    tm_freetxn(cur->db, cur);
+    *ptr = next;
+}
 
-    // key is in the future?  let's see if it's next!
-    if (cmp < 0) {
-        loc->deleted_offset = 0;
-        if (loc->offset) {
-            uint8_t n;
-            uint8_t level = LEVEL(ptr);
-            for (n = 0; n < level; n++)
-                loc->backloc[n] = loc->offset;
-            loc->offset = 0;
-        }
-        size_t deleted_offset = 0;
-        size_t offset = advance0(ptr, loc->end);
+static void _remove_file(struct twom_db *db, struct tm_file **ptr)
+{
+    struct tm_file *cur = *ptr;
+    struct tm_file *next = (*ptr)->next;
+    assert(!cur->refcount);
+    assert(!cur->has_datalock);
+    assert(!cur->has_headlock);
+    if (cur->base) tm_unmap(db, cur->base, cur->reserved > cur->size ? cur->reserved : cur->size);
+    if (cur->fd != -1) close(cur->fd);
+    bloom_free(db, cur);
+    free(cur->csumcache);
+    free(cur);
+    *ptr = next;
+}
 
-        // did we reach the end?
-        if (!offset) return 0;
+static void empty_db(struct twom_db *db)
+{
+    if (db->loc.file) {
+        tm_unref(db->loc.file);
+        db->loc.file = NULL;
+    }
+    while (db->write_txn)
+        _remove_txn(&db->write_txn);
+    while (db->read_txn)
+        _remove_txn(&db->read_txn);
+    while (db->openfile)
+        _remove_file(db, &db->openfile);
+    while (db->spare_txn) {
+        struct twom_txn *txn = db->spare_txn;
+        db->spare_txn = txn->next;
+        free(txn);
+    }
+    while (db->spare_cursor) {
+        struct twom_cursor *cur = db->spare_cursor;
+        db->spare_cursor = cur->next;
+        free(cur->prefix);
+        free(cur);
+    }
+    db->nspare_txn = db->nspare_cursor = 0;
+    if (db->blobs.base) tm_unmap(db, db->blobs.base, db->blobs.size);
+    db->blobs.base = NULL;
+    if (db->blobs.fd >= 0) close(db->blobs.fd);
+    db->blobs.fd = -1;
+    while (db->retired) {
+        struct tm_retired *old = db->retired;
+        db->retired = old->next;
+        munmap(old->base, old->len);
+        free(old);
+    }
+}
 
-        ptr = safeptr(loc, offset);
-        if (!ptr) return TWOM_IOERROR;
-        if (TYPE(ptr) == DELETE) {
-            deleted_offset = offset;
-            offset = ANCESTOR(ptr);
-            if (!offset) return TWOM_IOERROR;
-            ptr = safeptr(loc, offset);
-            if (!ptr) return TWOM_IOERROR;
+static void tm_cleanup(struct twom_db *db)
+{
+    // close any open files with a zero refcount (no loc or txn
+    // still points there) except the first one.  With TWOM_THREADSAFE,
+    // one may still be read locked until the last reader is done, and
+    // another thread may be adding a file, so even the check is locked
+    threads_lock(db);
+    if (!db->openfile) {
+        threads_unlock(db);
+        return;
+    }
+    struct tm_file **ptr = &db->openfile->next;
+    while (*ptr) {
+        if (!__atomic_load_n(&(*ptr)->refcount, __ATOMIC_ACQUIRE) && !(*ptr)->has_datalock) {
+            _remove_file(db, ptr);
         }
-        cmp = COMPAR(loc->file->compar, KEYPTR(ptr), KEYLEN(ptr), key, keylen);
-        // it's in the gap?
-        if (cmp > 0) return 0;
-        // found it?
-        if (cmp == 0) {
-            loc->deleted_offset = deleted_offset;
-            loc->offset = offset;
-            return check_headcsum(txn, loc->file, ptr, offset);
+        else {
+            ptr = &((*ptr)->next);
         }
     }
-
-    // not immediately here or next, locate from scratch
-    return locate(txn, loc, key, keylen);
+    threads_unlock(db);
 }
 
-static int delete_here(struct twom_txn *txn, struct tm_loc *loc)
-{
-    struct twom_db *db = txn->db;
-    struct tm_file *file = loc->file;
-    size_t offset = file->written_size;
-    struct tm_header *header = &file->header;
+/************** DATABASE HEADER MANAGEMENT ****************/
 
-    size_t headlen = 16;
-    size_t reclen = 24;
+/* given an open, mapped db, read in the header information */
+static int read_header(struct twom_db *db, struct tm_file *file, struct tm_header *header)
+{
+    assert(db && file);
+    const char *base = file->base;
 
-    int r = tm_ensure(db, offset + reclen);
-    if (r) return r;
+    if (memcmp(base, HEADER_MAGIC, HEADER_MAGIC_SIZE))
+        return TWOM_BADFORMAT;
 
-    // loca may have refreshed
-    char *base = file->base + offset;
-    memset(base, 0, reclen);
+    memcpy(header->uuid, base + OFFSET_UUID, 16);
 
-    char *addr = base;
+    header->version
+        = le32toh(*((uint32_t *)(base + OFFSET_VERSION)));
 
-    *((uint8_t *)(addr)) = DELETE;
-    addr += 8;
+    if (header->version > TWOM_VERSION) {
+        db->error("invalid version",
+                  "filename=<%s> version=<%d>",
+                  db->fname, header->version);
+        return TWOM_BADFORMAT;
+    }
 
-    // update the level0 back record and re-checksum
-    char *backptr = LOCBACKPTR(loc, 0);
-    SET0(file, backptr, offset);
-    _recsum(file, backptr);
+    header->flags
+        = le32toh(*((uint32_t *)(base + OFFSET_FLAGS)));
 
-    // set ancestor to current record
-    *((uint64_t *)(addr)) = htole64(loc->offset);
-    addr += 8;
-
-    // calculate checksum of current record
-    *((uint32_t *)(addr)) = htole32(file->csum(base, headlen));
-
-    /* update header to know details of new record */
-    header->dirty_size += reclen;
-
-    // track that we've added the record
-    loc->deleted_offset = offset;
-    file->written_size += reclen;
-    txn->end = file->written_size;
-    loc->end = file->written_size;
-
-    // file definitely needs to be flushed now
-    file->dirty = 1;
-
-    return 0;
-}
-
-/* overall "store" function - update the value in the current loc.
-   All updates funnel through here.  NULL val means
-   deletion.   Force is implied here, it gets checked higher.
-   Can be used to replace, add or delete a record */
-static int store_here(struct twom_txn *txn, const char *key, size_t keylen, const char *val, size_t vallen)
-{
-    if (vallen) assert(val);
-
-    struct twom_db *db = txn->db;
-    struct tm_loc *loc = &db->loc;
-    size_t end = loc->end;
-    struct tm_file *file = loc->file;
-    assert(file == txn->file);
-    assert(file == db->openfile);
-    assert(file->written_size == end);
-    struct tm_header *header = &file->header;
-    size_t keyoffset = 0;
-    size_t valoffset = 0;
-    uint64_t ancestor = 0;
-    int r;
-    int type = ADD;
-
-    size_t offset = end;
-
-    // it's a pointer into our map!  we'll magically re-map it
-    if (key > file->base && key < file->base + offset)
-        keyoffset = key - file->base;
-    if (val > file->base && val < file->base + offset)
-        valoffset = val - file->base;
-
-    /* dirty the header if not already dirty */
-    if (!(header->flags & DIRTY)) {
-        assert(offset == header->current_size);
-        header->flags |= DIRTY;
-        r = commit_header(db, header);
-        if (r) return r;
-    }
-
-    uint8_t level;
-    if (loc->offset) {
-        const char *locptr = LOCPTR(loc);
-        // if was a delete we'll point back to that
-        if (loc->deleted_offset) {
-            assert(val); // can't replace a delete with another delete!
-            ancestor = loc->deleted_offset;
-        }
-        // if it's not already a delete, we replace it
-        else {
-            ancestor = loc->offset;
-            header->num_records--;
-            header->dirty_size += RECLEN(locptr);
+    if (header->flags & TWOM_CSUM_EXTERNAL) {
+        if (!db->external_csum) {
+            db->error("missing external csum function",
+                      "filename=<%s>", db->fname);
+            return TWOM_BADUSAGE;
         }
-        // new type
-        type = val ? REPLACE : DELETE;
-        level = LEVEL(locptr);
     }
-    else {
-        assert(val); // can't start with a delete
-        level = randlvl(1, MAXLEVEL);
-    }
-
-    if (type == DELETE) return delete_here(txn, loc);
-
-    // promote to fat record if key or value exceeds skinny field sizes
-    // (ADD+1 == FATADD, REPLACE+1 == FATREPLACE)
-    if (keylen > 0xFFFF || vallen > 0xFFFFFFFFULL)
-        type++;
-
-    size_t headlen = HLCALC(type, level);
-    size_t taillen = TLCALC(type, keylen, vallen);
-    size_t reclen = headlen + 8 + taillen;
-
-    r = tm_ensure(db, offset + reclen);
-    if (r) return r;
 
-    // the file may have been re-mapped, so grab the locptr AFTER ensuring space
-    char *base = file->base + offset;
-    memset(base, 0, reclen);
-    char *addr = base;
+    if ((header->flags & COMPRESSED) && !db->decompress) {
+        db->error("missing decompress function",
+                  "filename=<%s>", db->fname);
+        return TWOM_BADUSAGE;
+    }
+    set_csum_engine(db, file, header->flags);
 
-    // the first 1-3 blocks are metadata.  Fat records have extra for the key
-    // and value lengths
-    *((uint8_t *)(addr)) = type;
-    *((uint8_t *)(addr+1)) = level;
-    if (fatrecord[type]) {
-        *((uint64_t *)(addr+8)) = htole64(keylen);
-        *((uint64_t *)(addr+16)) = htole64(vallen);
-        addr += 24;
+    // XXX - check flags for other comparison engines?
+    if (header->flags & TWOM_COMPAR_EXTERNAL) {
+        if (!db->external_compar) {
+            db->error("missing external compar function",
+                      "filename=<%s>", db->fname);
+            return TWOM_BADUSAGE;
+        }
+        file->compar = db->external_compar;
     }
-    else {
-        *((uint16_t *)(addr+2)) = htole16(keylen);
-        *((uint32_t *)(addr+4)) = htole32(vallen);
-        addr += 8;
+    else  {
+        file->compar = compar_raw;
     }
+    // the prefixes sort like compar_raw, so they're no use to another comparator
+    file->useprefix = ((header->flags & TWOM_KEYPREFIX) && file->compar == compar_raw) ? 1 : 0;
 
-    // replacement records have an ancestor for MVCC chaining
-    if (ancestoroffset[type]) {
-        *((uint64_t *)(addr)) = htole64(ancestor);
-        addr += 8;
-    }
+    header->generation
+        = le64toh(*((uint64_t *)(base + OFFSET_GENERATION)));
 
-    // the first alternate level0 pointer is always zero - we've already
-    // wiped the space, so just skip it.
-    addr += 8;
+    header->num_records
+        = le64toh(*((uint64_t *)(base + OFFSET_NUM_RECORDS)));
 
-    if (loc->offset) {
-        // store all the backwards and forwards locations
-        const char *locptr = LOCPTR(loc);
+    header->num_commits
+        = le64toh(*((uint64_t *)(base + OFFSET_NUM_COMMITS)));
 
-        // we need to update the backpointers to this new location,
-        // and the forward pointers to the old pointer's next location
-        char *backptr = LOCBACKPTR(loc, 0);
-        char *prevptr = backptr;
-        *((uint64_t *)(addr)) = htole64(advance0(locptr, end));
-        addr += 8;
-        SET0(file, backptr, offset);
+    header->dirty_size
+        = le64toh(*((uint64_t *)(base + OFFSET_DIRTY_SIZE)));
 
-        uint8_t n;
-        for (n = 1; n < level; n++) {
-            backptr = LOCBACKPTR(loc, n);
-            if (backptr != prevptr) _recsum(file, prevptr);
-            prevptr = backptr;
-            *((uint64_t *)(addr)) = htole64(NEXTN(locptr, n));
-            addr += 8;
-            SETN(backptr, n, offset);
-        }
+    header->repack_size
+        = le64toh(*((uint64_t *)(base + OFFSET_REPACK_SIZE)));
 
-        // update the last old checksum
-        _recsum(file, prevptr);
-    }
-    else {
-        // we need to update the backpointers to this new location,
-        // and the forward pointers to the old pointer's next location
-        char *backptr = LOCBACKPTR(loc, 0);
-        char *prevptr = backptr;
-        *((uint64_t *)(addr)) = htole64(advance0(backptr, end));
-        addr += 8;
-        SET0(file, backptr, offset);
+    header->current_size
+        = le64toh(*((uint64_t *)(base + OFFSET_CURRENT_SIZE)));
 
-        uint8_t n;
-        for (n = 1; n < level; n++) {
-            backptr = LOCBACKPTR(loc, n);
-            if (backptr != prevptr) _recsum(file, prevptr);
-            prevptr = backptr;
-            *((uint64_t *)(addr)) = htole64(NEXTN(backptr, n));
-            addr += 8;
-            SETN(backptr, n, offset);
-        }
+    assert(file->size >= header->current_size);
 
-        // update the last old checksum
-        _recsum(file, prevptr);
-    }
+    header->maxlevel
+        = le32toh(*((uint32_t *)(base + OFFSET_MAXLEVEL)));
 
-    // head checksum
-    *((uint32_t *)(addr)) = htole32(file->csum(base, headlen));
+    if (db->nocsum) return 0;
 
-    // if we have a KEY then we add a tail (key, maybe value, plus padding),
-    // otherwise we've already zeroed out the tailcsum field.
-    if (taillen) {
-        if (keyoffset) key = file->base + keyoffset;
-        memcpy(addr + 8, key, keylen);
-        addr[8+keylen] = 0;
-        if (hastail[type]) {
-            if (valoffset) val = file->base + valoffset;
-            memcpy(addr + 8 + keylen + 1, val, vallen);
-            addr[8+keylen+1+vallen] = 0;
-        }
-        *((uint32_t *)(addr+4)) = htole32(file->csum(addr+8, taillen));
+    uint32_t csum = le32toh(*((uint32_t *)(base + OFFSET_CSUM)));
+    if (file->csum(base, OFFSET_CSUM) != csum) {
+        db->error("header checksum failure",
+                  "filename=<%s>", db->fname);
+        return TWOM_BADCHECKSUM;
     }
 
-    /* update header to know details of new record */
-    header->num_records++;
-
-    /* track the highest level in this DB */
-    if (level > header->maxlevel)
-        header->maxlevel = level;
-
-    // track that we've added the record
-    loc->offset = offset;
-    loc->deleted_offset = 0;
-    file->written_size += reclen;
-    txn->end = file->written_size;
-    loc->end = file->written_size;
-
-    // file definitely needs to be flushed now
-    file->dirty = 1;
-
     return 0;
 }
 
-/************ DATABASE RECOVERY **************/
-
-static int db_is_clean(struct twom_db *db, struct tm_file *file)
+/* given an open, mapped, locked db, write the header information */
+static void pack_header(struct tm_header *header, struct tm_file *file, char *base)
 {
-    if (!file) file = db->openfile;
-    if (file->header.flags & DIRTY)
-        return 0;
-
-    return 1;
+    memcpy(base, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    memcpy(base + OFFSET_UUID, header->uuid, 16);
+    *((uint32_t *)(base + OFFSET_VERSION)) = htole32(header->version);
+    *((uint32_t *)(base + OFFSET_FLAGS)) = htole32(header->flags);
+    *((uint64_t *)(base + OFFSET_GENERATION)) = htole64(header->generation);
+    *((uint64_t *)(base + OFFSET_NUM_RECORDS)) = htole64(header->num_records);
+    *((uint64_t *)(base + OFFSET_NUM_COMMITS)) = htole64(header->num_commits);
+    *((uint64_t *)(base + OFFSET_DIRTY_SIZE)) = htole64(header->dirty_size);
+    *((uint64_t *)(base + OFFSET_REPACK_SIZE)) = htole64(header->repack_size);
+    *((uint64_t *)(base + OFFSET_CURRENT_SIZE)) = htole64(header->current_size);
+    *((uint32_t *)(base + OFFSET_MAXLEVEL)) = htole32(header->maxlevel);
+    *((uint32_t *)(base + OFFSET_CSUM)) = htole32(file->csum(base, OFFSET_CSUM));
 }
 
-/* run recovery on this file.
- * always called with a write lock.  This goes through and zeros out any
- * level0 pointers past the end, plus re-stitches any higher level pointers
- * to their matching next location */
-static int recovery1(struct twom_db *db, struct tm_loc *loc, int *count)
+/* simple wrapper to write with an fsync */
+static int commit_header(struct twom_db *db, struct tm_header *header)
 {
-    size_t prev[MAXLEVEL+1];
-    size_t next[MAXLEVEL+1];
-    uint64_t num_records = 0;
-    uint64_t dirty_size = 0;
-    int changed = 0;
-    int r = 0;
-    int cmp;
-    int i;
+    struct tm_file *file = db->openfile;
+    pack_header(header, file, file->base);
+    tm_touch(file, file->base, HEADER_SIZE);
+    file->dirty = 1;
+    return tm_commit(db, HEADER_SIZE);
+}
 
-    /* no need to run recovery if we're consistent */
-    if (db_is_clean(db, db->openfile))
+/******************** RECORD MANAGEMENT *********************/
+
+// Setting the next location at level 0 is special within twom (and
+// twoskip before it).  The logic is:
+// * if the higher value is past the committed length of the file, update
+//   the higher value, because it's been changed within this transaction.
+// * otherwise, update the lower value
+//
+// This means that the highest value that's NOT past the end of the
+// committed file is correct, so when we do a recovery or a transaction
+// abort, we can zero out the pointer that's past the "end" of the file,
+// and the remaining value will always point to the next committed record
+// in the valid file.
+//
+// The recovery operation then checks all the higher-level pointers to make
+// sure they still point to the correct next record as it walks the entire
+// linked list at level zero, which fixes any other values that were updated
+// in the aborted transaction.
+#ifdef HAVE_DECLARE_OPTIMIZE
+static inline void _setloc0(struct tm_file *file, char *ptr, size_t offset)
+    __attribute__((optimize("-O3")));
+#endif
+static inline void _setloc0(struct tm_file *file, char *ptr, size_t offset)
+{
+    char *addr = ptr + ptroffset[TYPE(ptr)];
+
+    /* level zero is special */
+    size_t val0 = NEXT0(ptr, 0);
+    size_t val1 = NEXT0(ptr, 1);
+
+    size_t end = file->committed_size;
+    /* already this transaction, update this one */
+    if (val0 < end && (val1 >= end || val0 > val1))
+        addr += 8; // conditions to write to val1
+
+    *((uint64_t *)(addr)) = htole64(offset);
+}
+
+#ifdef HAVE_DECLARE_OPTIMIZE
+static inline void _recsum(struct tm_file *file, char *ptr)
+    __attribute__((optimize("-O3")));
+#endif
+static inline void _recsum(struct tm_file *file, char *ptr)
+{
+    size_t headlen = HEADLEN(ptr);
+    uint32_t newcsum = file->csum(ptr, headlen);
+    *((uint32_t *)(ptr + headlen)) = htole32(newcsum);
+    // every pointer update is followed by a recsum, so this catches them all
+    tm_touch(file, ptr, headlen + 4);
+}
+
+// re-checksum a back pointer record after a store, or within a batch, note
+// it down to do once the batch has finished with it, see batch_flush
+static inline void _backsum(struct twom_db *db, struct tm_file *file, char *ptr)
+{
+    struct tm_batch *batch = db->batch;
+    if (!batch) {
+        _recsum(file, ptr);
+        return;
+    }
+    size_t offset = ptr - file->base;
+    uint8_t level = LEVEL(ptr);
+    size_t *slot = &batch->pending[level ? level - 1 : 0];
+    if (*slot == offset) return;
+    if (*slot) _recsum(file, file->base + *slot);
+    *slot = offset;
+}
+
+/******************** LOCATION MANAGEMENT *********************/
+
+/* locate()
+ *
+ * db: a database, with a read or write locked file (not necessarily the most recent)
+ * loc: a location pointer which points to the locked file; with and "end" which is the MVCC
+ *      transaction end for the records we're looking through
+ * key, keylen: find either this key or the key immediately before it (may be the DUMMY) if
+ *      the database is empty or this key is before any key in the database.
+ */
+#ifdef HAVE_DECLARE_OPTIMIZE
+static int locate(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen)
+    __attribute__((optimize("-O3")));
+#endif
+static int locate_from(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen,
+                       uint8_t level, size_t offset);
+static int locate(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen)
+{
+    size_t offset = DUMMY_OFFSET;
+    uint8_t level = MAXLEVEL-1;
+
+    // reset the location
+    loc->offset = 0;
+    loc->deleted_offset = 0;
+    txn->db->stats.locates++;
+
+    /* if we don't even have space for the DUMMY record in our mapped file,
+     * we can't locate anything */
+    const char *locptr = safeptr(loc, DUMMY_OFFSET);
+    if (!locptr) return TWOM_IOERROR;
+
+    /* the empty string is always first, so every back pointer will be the dummy,
+     * - there's no need to compare records, shortcircuit here */
+    if (!keylen) {
+        while (level) {
+            loc->backloc[level] = DUMMY_OFFSET;
+            level--;
+        }
+        loc->backloc[0] = DUMMY_OFFSET;
         return 0;
+    }
 
-    assert(db->openfile->has_datalock == 2);
-    assert(loc->file == db->openfile);
+    return locate_from(txn, loc, key, keylen, level, offset);
+}
+
+/* locate_from()
+ *
+ * the descent half of locate: starting at the record at "offset", which must sort before
+ * key and have a pointer at "level", fill out backloc[level] and below and find the key.
+ * loc->offset and loc->deleted_offset must already be reset.
+ */
+#ifdef HAVE_DECLARE_OPTIMIZE
+static int locate_from(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen,
+                       uint8_t level, size_t offset)
+    __attribute__((optimize("-O3")));
+#endif
+static int locate_from(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen,
+                       uint8_t level, size_t offset)
+{
+    int cmp = -1; /* never found a thing! */
     struct tm_file *file = loc->file;
+    size_t end = loc->end;
+    const char *ptr = NULL;
 
-    const char *ptr = safeptr(loc, DUMMY_OFFSET);
-    if (!ptr) {
-        db->error("failed to read DUMMY for recovery",
-                  "fname=<%s>", db->fname);
-        return TWOM_IOERROR;
+    const char *locptr = safeptr(loc, offset);
+    if (!locptr) return TWOM_IOERROR;
+    txn->db->stats.locate_levels += level;
+    uint64_t keypfx = file->useprefix ? key_prefix(key, keylen) : 0;
+
+    /* at every level except zero, walk the pointers at this level until we either hit a record
+     * at or past the one we're looking for. */
+    size_t futureoffset = 0; // efficiency hack, remember the offset we just saw in the future
+    while (level) {
+        size_t next = NEXTN(locptr, level);
+        /* optimisation: if the next address is the same on levels N and N-1,
+         * we don't need to compar the key again */
+        if (next && next != futureoffset && next < end) {
+            ptr = safeptr(loc, next);
+            if (!ptr) return TWOM_IOERROR;
+            // the next hop at this level, which we'll need if this record is still short
+            PREFETCH(loc, NEXTN(ptr, level));
+
+            cmp = compar_rec(file, ptr, keypfx, key, keylen);
+            txn->db->stats.compars++;
+
+            /* not there?  stay at this level */
+            if (cmp < 0) {
+                locptr = ptr;
+                offset = next;
+                continue;
+            }
+            /* NOTE: if we match exactly, we still need to make sure all the back
+             * pointers at the lower levels are correct, so we still drop down to
+             * the next level and repeat the algorithm */
+            futureoffset = next;
+        }
+
+        loc->backloc[level] = offset;
+        level--;
+    }
+
+    while (offset) {
+        size_t next = advance0(locptr, end);
+        if (!next) {
+            // hit the end!  No match
+            loc->backloc[0] = offset;
+            return 0;
+        }
+
+        size_t deleted_offset = 0;
+        ptr = safeptr(loc, next);
+        if (!ptr) return TWOM_IOERROR;
+        if (TYPE(ptr) == DELETE) {
+            deleted_offset = next;
+            next = ANCESTOR(ptr);
+            if (!next) return TWOM_IOERROR;
+            ptr = safeptr(loc, next);
+            if (!ptr) return TWOM_IOERROR;
+        }
+
+        cmp = compar_rec(file, ptr, keypfx, key, keylen);
+        txn->db->stats.compars++;
+
+        // if we match exactly or see into the future, we're there!
+        if (cmp > 0) {
+            // we're past, no match
+            loc->backloc[0] = offset;
+            return 0;
+        }
+        else if (!cmp) {
+            // we found it, track the previous offset
+            loc->backloc[0] = offset;
+            offset = next;
+            loc->offset = offset;
+            loc->deleted_offset = deleted_offset;
+            return check_headcsum(txn, loc->file, ptr, next);
+        }
+        locptr = ptr;
+        offset = next;
+    }
+
+    return TWOM_INTERNAL;
+}
+
+// since loc was found, the file it's on has only been extended.  Records are only
+// ever appended, and the pointers which change are in the records just before a new
+// one, which then point at it, past the old end.  So if every record loc points back
+// from (at any level) still points before the old end, or at a new record which sorts
+// after loc's key, nothing has been spliced in next to it.  Unless one of those records
+// has been replaced itself: then its pointers are left as they were, but it's not in
+// the list any more.  So read the new records too (if there aren't too many), and look
+// for any with the same key as a record loc points back from.
+//
+// After an abort in this process the space past the committed end is written again,
+// so then the location has to be found from scratch.  Callers reset loc->end if it's
+// no good
+#ifdef HAVE_DECLARE_OPTIMIZE
+static int loc_still_good(struct twom_txn *txn, struct tm_loc *loc)
+    __attribute__((optimize("-O3")));
+#endif
+static int loc_still_good(struct twom_txn *txn, struct tm_loc *loc)
+{
+    struct tm_file *file = loc->file;
+    size_t oldend = loc->end;
+    size_t offset;
+    uint8_t level;
+    int n;
+
+    if (!oldend || oldend > file->written_size) return 0;
+    if (file->written_size - oldend > LOC_KEEP_BYTES) return 0;
+    if (loc->aborts != file->aborts) return 0;
+    loc->end = file->written_size;
+
+    const char *ptr = loc->offset ? LOCPTR(loc) : NULL;
+    for (level = 0; level < MAXLEVEL; level++) {
+        const char *backptr = LOCBACKPTR(loc, level);
+        size_t next = level ? NEXTN(backptr, level) : advance0(backptr, loc->end);
+        if (next < oldend) continue;
+        // in the gap loc doesn't know which key it was after, so any change counts
+        if (!ptr) return 0;
+        const char *nextptr = safeptr(loc, next);
+        if (!nextptr || TYPE(nextptr) == DELETE) return 0;
+        txn->db->stats.compars++;
+        if (COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr),
+                   KEYPTR(ptr), KEYLEN(ptr)) <= 0) return 0;
+    }
+
+    // a delete leaves the record in place, and a commit has no key
+    for (offset = oldend, n = 0; offset < loc->end; offset += RECLEN(ptr), n++) {
+        ptr = safeptr(loc, offset);
+        if (!ptr || n >= LOC_KEEP_RECORDS) return 0;
+        if (!hastail[TYPE(ptr)]) continue;
+        // the back records sort further back at each level up
+        for (level = 0; level < MAXLEVEL; level++) {
+            if (level && loc->backloc[level] == loc->backloc[level-1]) continue;
+            const char *backptr = LOCBACKPTR(loc, level);
+            txn->db->stats.compars++;
+            int cmp = COMPAR(file->compar, KEYPTR(ptr), KEYLEN(ptr),
+                             KEYPTR(backptr), KEYLEN(backptr));
+            if (!cmp) return 0;
+            if (cmp > 0) break;
+        }
+    }
+
+    txn->db->stats.locs_kept++;
+    return 1;
+}
+
+/* advance_loc()
+ * db: a database, with a read or write locked file (not necessarily the most recent)
+ * txn: a transaction which points to a locked file, which may or may not be the most
+ *      recent (for a read-only transaction in MVCC it could be an older file), and
+ *      which has an 'end' value which is the MVCC end for the view we're in
+ * loc: a previously 'locate'd location which contains a file (possibly not locked)
+ *      and an offset into the mmap on on that file for a record which contains the
+ *      key data for that location.
+ * Will update loc to txn if needed (with relocate), then move loc to point to the next
+ * record (or offset == 0 at EOF)
+ * Used by foreach, fetchnext, and internal functions */
+#ifdef HAVE_DECLARE_OPTIMIZE
+static int advance_loc(struct twom_txn *txn, struct tm_loc *loc)
+    __attribute__((optimize("-O3")));
+#endif
+static int advance_loc(struct twom_txn *txn, struct tm_loc *loc)
+{
+    // need to read ptr BEFORE we potentially switch the file pointer
+    // below
+    const char *ptr = loc->offset ? LOCPTR(loc) : LOCBACKPTR(loc, 0);
+
+    // update to the new file if the transaction has refreshed
+    if (loc->file != txn->file) {
+        tm_unref(loc->file);
+        loc->file = txn->file;
+        tm_ref(loc->file);
+        loc->end = 0;
+    }
+
+    // if file has changed, either new file or extended,
+    // then we need to re-calculate our location
+    if (loc->end != loc->file->written_size && !loc_still_good(txn, loc)) {
+        int was_inexact = !loc->offset;
+        const char *key = KEYPTR(ptr);
+        size_t keylen = KEYLEN(ptr);
+        loc->end = loc->file->written_size;
+        loc->aborts = loc->file->aborts;
+        txn->db->stats.relocates++;
+        int r = locate(txn, loc, key, keylen);
+        if (r) return r;
+        if (was_inexact) {
+            loc->deleted_offset = 0;
+            loc->offset = 0;
+        }
+        ptr = loc->offset ? LOCPTR(loc) : LOCBACKPTR(loc, 0);
+        // now we've re-mapped, we might have something to clean up
+        tm_cleanup(txn->db);
+    }
+
+    /* If we had an offset, advance the backloc to this record, so the location now points
+     * immediately after this record as if we had found a key in the gap */
+    if (loc->offset) {
+        uint8_t n;
+        uint8_t level = LEVEL(ptr);
+        for (n = 0; n < level; n++)
+            loc->backloc[n] = loc->offset;
+        loc->deleted_offset = 0;
+        loc->offset = 0;
+    }
+
+    /* advance0 always get the exactly next record in the series, since it finds the level0
+     * pointer after using the skip math to pick the highest value */
+    size_t offset = advance0(ptr, loc->end);
+
+    /* reached the end:
+     * will have offset == 0, so will break foreach */
+    if (!offset) return TWOM_DONE;
+
+    ptr = safeptr(loc, offset);
+    if (!ptr) return TWOM_IOERROR;
+    if (TYPE(ptr) == DELETE) {
+        loc->deleted_offset = offset;
+        offset = ANCESTOR(ptr);
+        if (!offset) return TWOM_IOERROR;
+        ptr = safeptr(loc, offset);
+        if (!ptr) return TWOM_IOERROR;
+    }
+
+    /* make sure this record is complete */
+    loc->offset = offset;
+    return check_headcsum(txn, loc->file, ptr, offset);
+}
+
+// find_loc is an optimisation on locate.  In the cases where the file hasn't changed and
+// either the current key matches exactly, or is in the gap, or is the immediately next
+// record, we can avoid the full cost of filling out the location.
+//
+// If the key is further ahead than that, every backloc already sorts before it, so rather
+// than descending from the DUMMY we climb only until a level's next pointer reaches the
+// key and descend from there (a finger search), costing O(log distance) rather than
+// O(log n).  Ascending and clustered lookups, like fetch_many or a loop of stores in key
+// order, mostly take this path.
+//
+// This function can also be used to initialise a blank location, since it will detect
+// that as a "file has changed" and fill out the right values
+static int find_loc(struct twom_txn *txn, struct tm_loc *loc, const char *key, size_t keylen)
+{
+    // the old location is for an old file or this file has been extended
+    if (loc->file != txn->file
+        || (loc->end != loc->file->written_size && !loc_still_good(txn, loc))) {
+        if (loc->file) tm_unref(loc->file);
+        loc->file = txn->file;
+        tm_ref(loc->file);
+        loc->end = loc->file->written_size;
+        loc->aborts = loc->file->aborts;
+        txn->db->stats.findloc_full++;
+        int r = locate(txn, loc, key, keylen);
+        if (r) return r;
+        // we may have released the last reference, so clean up
+        tm_cleanup(txn->db);
+        return 0;
+    }
+
+    const char *ptr = loc->offset ? LOCPTR(loc) : LOCBACKPTR(loc, 0);
+    int cmp = COMPAR(loc->file->compar, KEYPTR(ptr), KEYLEN(ptr), key, keylen);
+    txn->db->stats.compars++;
+    if (!cmp && loc->offset) {
+        // we haven't moved
+        txn->db->stats.findloc_fast++;
+        return 0;
+    }
+
+    // key is in the future?  let's see if it's next!
+    if (cmp < 0) {
+        loc->deleted_offset = 0;
+        if (loc->offset) {
+            uint8_t n;
+            uint8_t level = LEVEL(ptr);
+            for (n = 0; n < level; n++)
+                loc->backloc[n] = loc->offset;
+            loc->offset = 0;
+        }
+        size_t deleted_offset = 0;
+        size_t offset = advance0(ptr, loc->end);
+
+        // did we reach the end?
+        if (!offset) {
+            txn->db->stats.findloc_fast++;
+            return 0;
+        }
+
+        ptr = safeptr(loc, offset);
+        if (!ptr) return TWOM_IOERROR;
+        if (TYPE(ptr) == DELETE) {
+            deleted_offset = offset;
+            offset = ANCESTOR(ptr);
+            if (!offset) return TWOM_IOERROR;
+            ptr = safeptr(loc, offset);
+            if (!ptr) return TWOM_IOERROR;
+        }
+        cmp = COMPAR(loc->file->compar, KEYPTR(ptr), KEYLEN(ptr), key, keylen);
+        txn->db->stats.compars++;
+        // it's in the gap?
+        if (cmp > 0) {
+            txn->db->stats.findloc_fast++;
+            return 0;
+        }
+        // found it?
+        if (cmp == 0) {
+            txn->db->stats.findloc_fast++;
+            loc->deleted_offset = deleted_offset;
+            loc->offset = offset;
+            return check_headcsum(txn, loc->file, ptr, offset);
+        }
+    }
+
+    // going backwards, nothing to reuse: locate from scratch
+    if (cmp >= 0) {
+        txn->db->stats.findloc_full++;
+        return locate(txn, loc, key, keylen);
+    }
+
+    // every level from the first one which reaches the key upwards is already correct
+    struct tm_file *file = loc->file;
+    uint64_t keypfx = file->useprefix ? key_prefix(key, keylen) : 0;
+    uint8_t level;
+    txn->db->stats.findloc_finger++;
+    for (level = 1; level < MAXLEVEL; level++) {
+        size_t next = NEXTN(LOCBACKPTR(loc, level), level);
+        if (!next || next >= loc->end) break;
+        ptr = safeptr(loc, next);
+        if (!ptr) return TWOM_IOERROR;
+        // if this one is still short, we'll want the next level's back pointer
+        if (level + 1 < MAXLEVEL) PREFETCH(loc, loc->backloc[level+1]);
+        txn->db->stats.compars++;
+        if (compar_rec(file, ptr, keypfx, key, keylen) >= 0) break;
+    }
+    level--;
+
+    return locate_from(txn, loc, key, keylen, level, loc->backloc[level]);
+}
+
+static int delete_here(struct twom_txn *txn, struct tm_loc *loc)
+{
+    struct twom_db *db = txn->db;
+    struct tm_file *file = loc->file;
+    size_t offset = file->written_size;
+    struct tm_header *header = &file->header;
+
+    size_t headlen = 16;
+    size_t reclen = 24;
+
+    int r = tm_ensure(db, offset + reclen);
+    if (r) return r;
+
+    // loca may have refreshed
+    char *base = file->base + offset;
+    memset(base, 0, reclen);
+
+    char *addr = base;
+
+    *((uint8_t *)(addr)) = DELETE;
+    addr += 8;
+
+    // update the level0 back record and re-checksum
+    char *backptr = LOCBACKPTR(loc, 0);
+    SET0(file, backptr, offset);
+    _backsum(db, file, backptr);
+
+    // set ancestor to current record
+    *((uint64_t *)(addr)) = htole64(loc->offset);
+    addr += 8;
+
+    // calculate checksum of current record
+    *((uint32_t *)(addr)) = htole32(file->csum(base, headlen));
+
+    /* update header to know details of new record */
+    header->dirty_size += reclen;
+
+    // track that we've added the record
+    loc->deleted_offset = offset;
+    file->written_size += reclen;
+    txn->end = file->written_size;
+    loc->end = file->written_size;
+
+    // file definitely needs to be flushed now
+    file->dirty = 1;
+
+    return 0;
+}
+
+/* overall "store" function - update the value in the current loc.
+   All updates funnel through here.  NULL val means
+   deletion.   Force is implied here, it gets checked higher.
+   Can be used to replace, add or delete a record */
+static int store_here(struct twom_txn *txn, const char *key, size_t keylen, const char *val, size_t vallen)
+{
+    if (vallen) assert(val);
+
+    struct twom_db *db = txn->db;
+    struct tm_loc *loc = &db->loc;
+    size_t end = loc->end;
+    struct tm_file *file = loc->file;
+    assert(file == txn->file);
+    assert(file == db->openfile);
+    assert(file->written_size == end);
+    struct tm_header *header = &file->header;
+    size_t keyoffset = 0;
+    size_t valoffset = 0;
+    uint64_t ancestor = 0;
+    int r;
+    int type = ADD;
+
+    size_t offset = end;
+
+    // it's a pointer into our map!  we'll magically re-map it
+    if (key > file->base && key < file->base + offset)
+        keyoffset = key - file->base;
+    if (val > file->base && val < file->base + offset)
+        valoffset = val - file->base;
+
+    /* dirty the header if not already dirty */
+    if (!(header->flags & DIRTY)) {
+        assert(offset == header->current_size);
+        header->flags |= DIRTY;
+        r = commit_header(db, header);
+        if (r) return r;
+    }
+
+    uint8_t level;
+    if (loc->offset) {
+        const char *locptr = LOCPTR(loc);
+        // if was a delete we'll point back to that
+        if (loc->deleted_offset) {
+            assert(val); // can't replace a delete with another delete!
+            ancestor = loc->deleted_offset;
+        }
+        // if it's not already a delete, we replace it
+        else {
+            ancestor = loc->offset;
+            header->num_records--;
+            header->dirty_size += RECLEN(locptr);
+        }
+        // new type
+        type = val ? REPLACE : DELETE;
+        level = LEVEL(locptr);
+    }
+    else {
+        assert(val); // can't start with a delete
+        level = randlvl(1, MAXLEVEL);
+        // a new key goes in the filter, before anything can remap the key
+        struct tm_bloom *bl = bloom_get(db, file);
+        if (bl) bloom_add(bl, key, keylen);
+    }
+
+    if (type == DELETE) return delete_here(txn, loc);
+
+    // big values go in the blob file, and the record gets a reference
+    char blobref[BLOB_REFLEN];
+    size_t ziplen = 0;
+    if ((header->flags & TWOM_BLOBS) && vallen > db->blob_threshold && keylen <= 0xFFFF) {
+        if (valoffset) val = file->base + valoffset;
+        r = blob_store(db, file, val, vallen, blobref);
+        if (r) return r;
+        val = blobref;
+        vallen = BLOB_REFLEN;
+        valoffset = 0;
+        type = (type == ADD) ? BLOBADD : BLOBREPLACE;
+    }
+    // others are compressed if that makes them shorter
+    else if (keylen <= 0xFFFF &&
+             (ziplen = zip_store(db, file, valoffset ? file->base + valoffset : val, vallen))) {
+        val = db->zwrite.base;
+        vallen = ziplen;
+        valoffset = 0;
+        type = (type == ADD) ? ZADD : ZREPLACE;
+    }
+    // promote to fat record if key or value exceeds skinny field sizes
+    // (ADD+1 == FATADD, REPLACE+1 == FATREPLACE)
+    else if (keylen > 0xFFFF || vallen > 0xFFFFFFFFULL)
+        type++;
+    // otherwise carry the key prefix if the file does
+    else if (header->flags & TWOM_KEYPREFIX)
+        type = (type == ADD) ? PFXADD : PFXREPLACE;
+
+    size_t headlen = HLCALC(type, level);
+    size_t taillen = TLCALC(type, keylen, vallen);
+    size_t reclen = headlen + 8 + taillen;
+
+    r = tm_ensure(db, offset + reclen);
+    if (r) return r;
+
+    // the file may have been re-mapped, so grab the locptr AFTER ensuring space
+    char *base = file->base + offset;
+    memset(base, 0, reclen);
+    char *addr = base;
+
+    // the first 1-3 blocks are metadata.  Fat records have extra for the key
+    // and value lengths
+    *((uint8_t *)(addr)) = type;
+    *((uint8_t *)(addr+1)) = level;
+    if (fatrecord[type]) {
+        *((uint64_t *)(addr+8)) = htole64(keylen);
+        *((uint64_t *)(addr+16)) = htole64(vallen);
+        addr += 24;
+    }
+    else {
+        *((uint16_t *)(addr+2)) = htole16(keylen);
+        *((uint32_t *)(addr+4)) = htole32(vallen);
+        addr += 8;
+    }
+
+    // replacement records have an ancestor for MVCC chaining
+    if (ancestoroffset[type]) {
+        *((uint64_t *)(addr)) = htole64(ancestor);
+        addr += 8;
+    }
+
+    // and prefixed records have the first 8 bytes of the key (already zero padded)
+    if (prefixoffset[type]) {
+        if (keyoffset) key = file->base + keyoffset;
+        memcpy(addr, key, keylen < 8 ? keylen : 8);
+        addr += 8;
+    }
+
+    // the first alternate level0 pointer is always zero - we've already
+    // wiped the space, so just skip it.
+    addr += 8;
+
+    if (loc->offset) {
+        // store all the backwards and forwards locations
+        const char *locptr = LOCPTR(loc);
+
+        // we need to update the backpointers to this new location,
+        // and the forward pointers to the old pointer's next location
+        char *backptr = LOCBACKPTR(loc, 0);
+        char *prevptr = backptr;
+        *((uint64_t *)(addr)) = htole64(advance0(locptr, end));
+        addr += 8;
+        SET0(file, backptr, offset);
+
+        uint8_t n;
+        for (n = 1; n < level; n++) {
+            backptr = LOCBACKPTR(loc, n);
+            if (backptr != prevptr) _backsum(db, file, prevptr);
+            prevptr = backptr;
+            *((uint64_t *)(addr)) = htole64(NEXTN(locptr, n));
+            addr += 8;
+            SETN(backptr, n, offset);
+        }
+
+        // update the last old checksum
+        _backsum(db, file, prevptr);
+    }
+    else {
+        // we need to update the backpointers to this new location,
+        // and the forward pointers to the old pointer's next location
+        char *backptr = LOCBACKPTR(loc, 0);
+        char *prevptr = backptr;
+        *((uint64_t *)(addr)) = htole64(advance0(backptr, end));
+        addr += 8;
+        SET0(file, backptr, offset);
+
+        uint8_t n;
+        for (n = 1; n < level; n++) {
+            backptr = LOCBACKPTR(loc, n);
+            if (backptr != prevptr) _backsum(db, file, prevptr);
+            prevptr = backptr;
+            *((uint64_t *)(addr)) = htole64(NEXTN(backptr, n));
+            addr += 8;
+            SETN(backptr, n, offset);
+        }
+
+        // update the last old checksum
+        _backsum(db, file, prevptr);
+    }
+
+    // head checksum
+    *((uint32_t *)(addr)) = htole32(file->csum(base, headlen));
+
+    // if we have a KEY then we add a tail (key, maybe value, plus padding),
+    // otherwise we've already zeroed out the tailcsum field.
+    if (taillen) {
+        if (keyoffset) key = file->base + keyoffset;
+        memcpy(addr + 8, key, keylen);
+        addr[8+keylen] = 0;
+        if (hastail[type]) {
+            if (valoffset) val = file->base + valoffset;
+            memcpy(addr + 8 + keylen + 1, val, vallen);
+            addr[8+keylen+1+vallen] = 0;
+        }
+        *((uint32_t *)(addr+4)) = htole32(file->csum(addr+8, taillen));
+    }
+
+    /* update header to know details of new record */
+    header->num_records++;
+
+    /* track the highest level in this DB */
+    if (level > header->maxlevel)
+        header->maxlevel = level;
+
+    // track that we've added the record
+    loc->offset = offset;
+    loc->deleted_offset = 0;
+    file->written_size += reclen;
+    txn->end = file->written_size;
+    loc->end = file->written_size;
+
+    // file definitely needs to be flushed now
+    file->dirty = 1;
+
+    return 0;
+}
+
+/************ DATABASE RECOVERY **************/
+
+static int db_is_clean(struct twom_db *db, struct tm_file *file)
+{
+    if (!file) file = db->openfile;
+    if (file->header.flags & DIRTY)
+        return 0;
+
+    return 1;
+}
+
+/* run recovery on this file.
+ * always called with a write lock.  This goes through and zeros out any
+ * level0 pointers past the end, plus re-stitches any higher level pointers
+ * to their matching next location */
+static int recovery1(struct twom_db *db, struct tm_loc *loc, int *count)
+{
+    size_t prev[MAXLEVEL+1];
+    size_t next[MAXLEVEL+1];
+    uint64_t num_records = 0;
+    uint64_t dirty_size = 0;
+    int changed = 0;
+    int r = 0;
+    int cmp;
+    int i;
+
+    /* no need to run recovery if we're consistent */
+    if (db_is_clean(db, db->openfile))
+        return 0;
+
+    assert(db->openfile->has_datalock == 2);
+    assert(loc->file == db->openfile);
+    struct tm_file *file = loc->file;
+
+    const char *ptr = safeptr(loc, DUMMY_OFFSET);
+    if (!ptr) {
+        db->error("failed to read DUMMY for recovery",
+                  "fname=<%s>", db->fname);
+        return TWOM_IOERROR;
+    }
+
+    /* and pointers forwards */
+    prev[0] = DUMMY_OFFSET;
+    next[0] = 0;
+    for (i = 0; i < 2; i++) {
+        size_t cur = NEXT0(ptr, i);
+        /* check for broken level - pointers, and extract the best next pointer */
+        if (cur >= loc->end) {
+            // zero out bogus pointer
+            *((uint64_t *)(NEXT0PTR(ptr, i))) = 0;
+            _recsum(file, (char *)ptr);
+            changed++;
+        }
+        else if (cur > next[0]) {
+            next[0] = cur;
+        }
+    }
+
+    for (i = 1; i < MAXLEVEL; i++) {
+        prev[i] = DUMMY_OFFSET;
+        next[i] = NEXTN(ptr, i);
+    }
+
+    while (next[0]) {
+        size_t deleted_offset = 0;
+        const char *nextptr = safeptr(loc, next[0]);
+        if (!nextptr) {
+            db->error("failed to read next record for recovery",
+                      "fname=<%s> prev_key=<%.*s> offset=<%08llX>",
+                      db->fname, (int)KEYLEN(ptr), KEYPTR(ptr),
+                      (LLU)next[0]);
+            return TWOM_IOERROR;
+        }
+        if (TYPE(nextptr) == DELETE) {
+            deleted_offset = next[0];
+            dirty_size += 24;
+            next[0] = ANCESTOR(nextptr);
+            if (!next[0]) return TWOM_IOERROR;
+            nextptr = safeptr(loc, next[0]);
+            if (!nextptr) return TWOM_IOERROR;
+        }
+
+        cmp = COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr),
+                     KEYPTR(ptr), KEYLEN(ptr));
+        if (cmp <= 0) {
+            db->error("out of order for recovery",
+                      "fname=<%s> prev_key=<%.*s> key=<%.*s> offset=<%08llX>",
+                      db->fname,
+                      (int)KEYLEN(ptr), KEYPTR(ptr),
+                      (int)KEYLEN(nextptr), KEYPTR(nextptr),
+                      (LLU)next[0]);
+            return TWOM_INTERNAL;
+        }
+
+        size_t ancestor = ANCESTOR(nextptr);
+        while (ancestor) {
+            const char *aptr = safeptr(loc, ancestor);
+            if (!aptr) {
+                db->error("failed to read next record for recovery",
+                          "fname=<%s> key=<%.*s> offset=<%08llX>",
+                          db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr),
+                          (LLU)ancestor);
+                return TWOM_IOERROR;
+            }
+            if (TYPE(aptr) == DELETE) {
+                dirty_size += 24;
+                ancestor = ANCESTOR(aptr);
+                if (!ancestor) return TWOM_IOERROR;
+                aptr = safeptr(loc, ancestor);
+                if (!aptr) return TWOM_IOERROR;
+            }
+            cmp = COMPAR(file->compar, KEYPTR(aptr), KEYLEN(aptr),
+                         KEYPTR(nextptr), KEYLEN(nextptr));
+            if (cmp) {
+                db->error("twom mismatched ancestor for recovery",
+                        "fname=<%s> key=<%.*s> offset=<%08llX>"
+                        " parent_key=<%.*s> parent_offset=<%08llX)",
+                        db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr), (LLU)next[0],
+                        (int)KEYLEN(aptr), KEYPTR(aptr), (LLU)ancestor);
+                return TWOM_IOERROR;
+            }
+            dirty_size += RECLEN(aptr);
+            ancestor = ANCESTOR(aptr);
+        }
+
+        /* check for old offsets needing fixing */
+        uint8_t level = LEVEL(nextptr);
+
+        for (i = 1; i < level; i++) {
+            if (next[i] != next[0]) {
+                char *rec = file->base + prev[i];
+                *((uint64_t *)(NEXTNPTR(rec, i))) = htole64(next[0]);
+                _recsum(file, rec);
+                changed++;
+            }
+            prev[i] = next[0];
+            next[i] = NEXTN(nextptr, i);
+        }
+
+        prev[0] = next[0];
+        next[0] = 0;
+        for (i = 0; i < 2; i++) {
+            size_t cur = NEXT0(nextptr, i);
+            /* check for broken level - pointers, and extract the best next pointer */
+            if (cur >= loc->end) {
+                // zero out bogus pointer
+                *((uint64_t *)(NEXT0PTR(nextptr, i))) = 0;
+                _recsum(file, (char *)nextptr);
+                changed++;
+            }
+            else if (cur > next[0]) {
+                next[0] = cur;
+            }
+        }
+
+        if (deleted_offset) dirty_size += RECLEN(nextptr);
+        else num_records++;
+
+        ptr = nextptr;
+    }
+
+    /* check for remaining offsets needing zeroing */
+    for (i = 1; i < MAXLEVEL; i++) {
+        if (next[i]) {
+            char *rec = file->base + prev[i];
+            *((uint64_t *)(NEXTNPTR(rec, i))) = htole64(next[0]);
+            _recsum(file, rec);
+            changed++;
+        }
+    }
+
+    /* commit first so all other bits are committed before we undirty the header */
+    r = tm_commit(db, loc->end);
+    if (r) return r;
+
+    /* clear the dirty flag */
+    struct tm_header *header = &file->header;
+    header->flags &= ~DIRTY;
+    header->num_records = num_records;
+    header->dirty_size = dirty_size;
+    r = commit_header(db, header);
+    if (r) return r;
+
+    if (count) *count = changed;
+
+    return 0;
+}
+
+/* Everything past current_size was written by the transaction which didn't
+ * commit, and nothing else of it is in the file but the pointers it changed
+ * in older records.  Each of those belongs to the record before one of the
+ * new ones, at a level the new one has, so searching the committed records
+ * for each new key finds them all, and the new records themselves say what
+ * was there before: the old record a replacement points back to, or else
+ * wherever the new record was pointing on to.
+ *
+ * That's only safe if every record the transaction wrote can be read back,
+ * since one that can't may still be pointed to.  An abort knows where its
+ * records end, so they must all check out.  After a crash any page may be
+ * missing, and a lost page reads back as zeros, just like the end of the
+ * records: so once they've been put back, every committed record is swept
+ * for pointers still leading past current_size (see tail_sweep), and if
+ * there are any it's the full walk in recovery1 instead.  So only an abort
+ * costs just its own records: a crash still reads every record's head,
+ * which is cheaper than recovery1 but in proportion to the file.  Without
+ * checksums to say what's real, it's always the full walk */
+struct tm_tail {
+    size_t start;       // current_size
+    size_t end;         // just after the last one
+    size_t nrecs;
+    size_t alloc;
+    size_t *recs;       // offset of each record, in order
+};
+
+// is offset the start of a record in the tail?
+static int tail_has(const struct tm_tail *tail, size_t offset)
+{
+    size_t lo = 0, hi = tail->nrecs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tail->recs[mid] == offset) return 1;
+        if (tail->recs[mid] < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return 0;
+}
+
+// find the records from tail->start, up to end if known, which all have to
+// be whole and checksum correctly
+static int tail_scan(struct tm_file *file, struct tm_tail *tail, size_t end)
+{
+    size_t limit = end ? end : file->size;
+    size_t offset = tail->start;
+
+    while (offset < limit) {
+        const char *ptr = file->base + offset;
+        uint8_t type = TYPE(ptr);
+        if (!type && !end) break;
+        if (limit - offset < 24) return TWOM_IOERROR;
+        if (type < ADD || type > MAXTYPE || LEVEL(ptr) > MAXLEVEL) return TWOM_IOERROR;
+        size_t headlen = HEADLEN(ptr);
+        if (limit - offset < headlen + 8) return TWOM_IOERROR;
+        size_t reclen = RECLEN(ptr);
+        if (reclen < headlen + 8 || limit - offset < reclen) return TWOM_IOERROR;
+        if (file->csum(ptr, headlen) != HEADCSUM(ptr)) return TWOM_BADCHECKSUM;
+        if (hastail[type] && file->csum(KEYPTR(ptr), TAILLEN(ptr)) != TAILCSUM(ptr))
+            return TWOM_BADCHECKSUM;
+
+        if (tail->nrecs == tail->alloc) {
+            size_t alloc = tail->alloc ? tail->alloc * 2 : 256;
+            size_t *recs = realloc(tail->recs, alloc * sizeof(size_t));
+            if (!recs) return TWOM_IOERROR;
+            tail->recs = recs;
+            tail->alloc = alloc;
+        }
+        tail->recs[tail->nrecs++] = offset;
+        offset += reclen;
+    }
+    tail->end = offset;
+
+    // and nothing after them
+    for (; offset < limit; offset += 8)
+        if (*((uint64_t *)(file->base + offset))) return TWOM_IOERROR;
+
+    return 0;
+}
+
+// what a committed record's pointer at this level into the tail was before
+static int tail_resolve(struct tm_file *file, const struct tm_tail *tail,
+                        size_t offset, uint8_t level, size_t *resultp)
+{
+    while (offset >= tail->start) {
+        if (!tail_has(tail, offset)) return TWOM_IOERROR;
+        const char *ptr = file->base + offset;
+
+        // a replacement was linked in where the record it replaced was
+        size_t ancestor = ANCESTOR(ptr);
+        while (ancestor >= tail->start) {
+            if (!tail_has(tail, ancestor)) return TWOM_IOERROR;
+            ancestor = ANCESTOR(file->base + ancestor);
+        }
+        if (ancestor) {
+            // the level pointers skip over deletes
+            const char *aptr = file->base + ancestor;
+            if (TYPE(aptr) == DELETE) ancestor = ANCESTOR(aptr);
+            *resultp = ancestor;
+            return 0;
+        }
+
+        // a new key was put in front of whatever it points to
+        if (LEVEL(ptr) <= level) return TWOM_IOERROR;
+        offset = NEXTN(ptr, level);
+    }
+
+    *resultp = offset;
+    return 0;
+}
+
+// after a crash, check that nothing committed still points into the tail,
+// which it will if some of the tail's records were lost with their pages.
+// It's every record, but in file order, and only their heads
+static int tail_sweep(struct tm_loc *loc)
+{
+    size_t offset = DUMMY_OFFSET;
+    uint8_t i;
+
+    while (offset < loc->end) {
+        const char *ptr = safeptr(loc, offset);
+        if (!ptr) return TWOM_IOERROR;
+        uint8_t level = LEVEL(ptr);
+        if (level && (NEXT0(ptr, 0) >= loc->end || NEXT0(ptr, 1) >= loc->end))
+            return TWOM_IOERROR;
+        for (i = 1; i < level; i++)
+            if (NEXTN(ptr, i) >= loc->end) return TWOM_IOERROR;
+        offset += RECLEN(ptr);
+    }
+
+    return offset == loc->end ? 0 : TWOM_IOERROR;
+}
+
+// search the committed records for key, putting back every pointer on the
+// way which leads into the tail
+static int tail_restitch(struct tm_loc *loc, const struct tm_tail *tail,
+                         const char *key, size_t keylen, int *changed)
+{
+    struct tm_file *file = loc->file;
+    char *ptr = file->base + DUMMY_OFFSET;
+    const char *nextptr;
+    size_t next;
+    int level, i, r;
+
+    for (level = MAXLEVEL - 1; level > 0; level--) {
+        for (;;) {
+            next = NEXTN(ptr, level);
+            if (next >= loc->end) {
+                r = tail_resolve(file, tail, next, level, &next);
+                if (r) return r;
+                SETN(ptr, level, next);
+                _recsum(file, ptr);
+                (*changed)++;
+            }
+            if (!next) break;
+            nextptr = safeptr(loc, next);
+            if (!nextptr) return TWOM_IOERROR;
+            if (COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr), key, keylen) >= 0)
+                break;
+            ptr = (char *)nextptr;
+        }
+    }
+
+    for (;;) {
+        for (i = 0; i < 2; i++) {
+            if (NEXT0(ptr, i) >= loc->end) {
+                *((uint64_t *)(NEXT0PTR(ptr, i))) = 0;
+                _recsum(file, ptr);
+                (*changed)++;
+            }
+        }
+        next = advance0(ptr, loc->end);
+        if (!next) break;
+        nextptr = safeptr(loc, next);
+        if (!nextptr) return TWOM_IOERROR;
+        if (TYPE(nextptr) == DELETE) {
+            nextptr = safeptr(loc, ANCESTOR(nextptr));
+            if (!nextptr) return TWOM_IOERROR;
+        }
+        if (COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr), key, keylen) >= 0)
+            break;
+        ptr = (char *)nextptr;
+    }
+
+    return 0;
+}
+
+static int recovery_tail(struct twom_db *db, struct tm_loc *loc, size_t end, int *count)
+{
+    struct tm_file *file = loc->file;
+    struct tm_tail tail;
+    struct tm_header header;
+    int changed = 0;
+    size_t i;
+    int r;
+
+    assert(file->has_datalock == 2);
+    if (db->nocsum || (file->header.flags & TWOM_CSUM_NULL)) return TWOM_BADUSAGE;
+
+    // the counts are as they were when the transaction began
+    r = read_header(db, file, &header);
+    if (r) return r;
+
+    memset(&tail, 0, sizeof(tail));
+    tail.start = loc->end;
+    r = tail_scan(file, &tail, end);
+
+    for (i = 0; !r && i < tail.nrecs; i++) {
+        const char *ptr = file->base + tail.recs[i];
+        if (TYPE(ptr) == COMMIT) continue;
+        // a delete is found by the key it deletes
+        while (TYPE(ptr) == DELETE) {
+            size_t ancestor = ANCESTOR(ptr);
+            if (!ancestor || (ancestor >= tail.start && !tail_has(&tail, ancestor))) {
+                r = TWOM_IOERROR;
+                break;
+            }
+            ptr = file->base + ancestor;
+        }
+        if (!r) r = tail_restitch(loc, &tail, KEYPTR(ptr), KEYLEN(ptr), &changed);
+    }
+    free(tail.recs);
+    if (!r && !end) r = tail_sweep(loc);
+    // anything put back on the way is what recovery1 would have done too
+    if (r) return r;
+
+    // the pointers have to be right on disk before the records go
+    if (changed) file->dirty = 1;
+    r = tm_commit(db, tail.start);
+    if (r) return r;
+    if (tail.end > tail.start) {
+        memset(file->base + tail.start, 0, tail.end - tail.start);
+        file->dirty = 1;
+        r = tm_commit(db, tail.end);
+        if (r) return r;
+    }
+
+    file->header.flags &= ~DIRTY;
+    file->header.num_records = header.num_records;
+    file->header.dirty_size = header.dirty_size;
+    file->header.maxlevel = header.maxlevel;
+    r = commit_header(db, &file->header);
+    if (r) return r;
+
+    if (count) *count = changed;
+    return 0;
+}
+
+// NOTE: it would be possible to add a 'recovery2' option which replayed the entire
+// database like a transaction log (like the repack does after finishing the MVCC read).
+// this would allow recovery from having lost an external COMPAR function and also from
+// having lost an external CSUM function if you blindly trust and hope that the file
+// isn't otherwise corrupted!
+static int recovery(struct twom_db *db, struct tm_file *file)
+{
+    int count = 0;
+    int r;
+
+    /* no need to run recovery if we're consistent */
+    if (db_is_clean(db, file))
+        return 0;
+
+    // recovery is run before allocating transactions, but we need a 'loc' for
+    // all the safeptr logic, so create a synthetic one with the correct
+    // offsets.
+    struct tm_loc *loc = (struct tm_loc *)twom_zmalloc(sizeof(struct tm_loc));
+    loc->file = file;
+    loc->end = loc->file->header.current_size;
+    tm_ref(loc->file);
+
+    // an abort knows where its records end, after a crash we look
+    size_t end = file->written_size > loc->end ? file->written_size : 0;
+    db->stats.recoveries++;
+    r = recovery_tail(db, loc, end, &count);
+    if (!r) db->stats.tail_recoveries++;
+    else r = recovery1(db, loc, &count);
+    if (r) {
+        db->error("recovery1 failed",
+                  "filename=<%s>",
+                  db->fname);
+    }
+
+    tm_unref(loc->file);
+    free(loc);
+
+    return r;
+}
+
+/*********************** SHARED MEMORY ********************/
+
+/* A file created with TWOM_SHM is marked SHMHINTS, and every process using it
+ * maps a small segment named for its UUID (which a repack keeps, along with
+ * the mark), and the writers keep it up to date:
+ *
+ * - seq is made odd once a writer has locked the file, before it changes
+ *   anything, and moved on to the next even number as it unlocks.  A reader
+ *   which saw the same even number before and after looking didn't overlap
+ *   a writer, so it didn't need the lock.
+ * - ino is the inode of the current file, so a reader can tell that a
+ *   repack hasn't renamed a new one over it without calling stat.
+ * - waiting has a slot for each writer blocked on the data lock, holding
+ *   its pid.  While they're all zero, readers skip the header lock and the
+ *   periodic yields, which are only there to let a writer in.  If there are
+ *   more writers than slots, the ones with slots are raising it anyway.
+ *
+ * It's all hints: a process which dies at the wrong moment leaves seq odd or
+ * its slot taken, and the others just go back to doing everything with the
+ * locks until the next writer to get the lock (which makes seq even again
+ * as it lets go) finds that the pid is gone and frees the slot.  But a
+ * writer which doesn't update the segment would be invisible to readers
+ * trusting it, so one which can't map it can't open the file either, and
+ * versions of twom without it don't know the file's version.
+ *
+ * Nothing removes a segment: it's a page, left until shm_unlink or a reboot.
+ * Removing one is only safe once no process has the database open, since
+ * they'd carry on with the old one while new openers made another. */
+
+#define SHM_MAGIC 0x74776f6d73686d32ULL   // "twomshm2"
+
+// a writer opening the file waits up to this many milliseconds for the segment
+#define SHM_ATTACH_TRIES 100
+
+static void shm_attach(struct twom_db *db)
+{
+    struct tm_file *file = db->openfile;
+    const unsigned char *uuid = file->header.uuid;
+    char name[32];
+    int i, fd, created = 0;
+    struct stat sbuf;
+
+    // macOS allows 31 characters, so the name has the first 96 bits of the UUID
+    strcpy(name, "/twom-");
+    for (i = 0; i < 12; i++)
+        snprintf(name + 6 + 2 * i, 3, "%02x", uuid[i]);
+
+    fd = shm_open(name, db->readonly ? O_RDONLY : O_RDWR, 0);
+    if (fd < 0 && errno == ENOENT && !db->readonly) {
+        mode_t mode = fstat(file->fd, &sbuf) ? 0600 : (sbuf.st_mode & 0666);
+        fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, mode);
+        if (fd >= 0) created = 1;
+        else if (errno == EEXIST) fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) return;
+
+    if (created && ftruncate(fd, sizeof(struct tm_shm))) {
+        shm_unlink(name);
+        close(fd);
+        return;
+    }
+    // still being created by someone else?  Then do without
+    if (fstat(fd, &sbuf) || (size_t)sbuf.st_size < sizeof(struct tm_shm)) {
+        close(fd);
+        return;
+    }
+    void *base = mmap(NULL, sizeof(struct tm_shm),
+                      db->readonly ? PROT_READ : PROT_READ|PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return;
+
+    struct tm_shm *shm = (struct tm_shm *)base;
+    if (created) {
+        // we hold a lock on the file, and anyone who could rename another
+        // over it would already have had the segment
+        shm->seq = 2;
+        shm->ino = file->ino;
+        __atomic_store_n(&shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    else if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        munmap(base, sizeof(struct tm_shm));
+        return;
+    }
+    db->shm = shm;
+}
+
+static void shm_detach(struct twom_db *db)
+{
+    if (db->shm) munmap(db->shm, sizeof(struct tm_shm));
+    db->shm = NULL;
+}
+
+// is this file still the current one, and mapped as far as its header says?
+// The caller holds a lock, so the header is stable
+static int shm_current(struct twom_db *db, struct tm_file *file)
+{
+    if (!db->shm || !file->ino) return 0;
+    if (__atomic_load_n(&db->shm->ino, __ATOMIC_ACQUIRE) != file->ino) return 0;
+    if (file->size < HEADER_SIZE + DUMMY_SIZE) return 0;
+    size_t current_size = le64toh(*((uint64_t *)(file->base + OFFSET_CURRENT_SIZE)));
+    return current_size <= file->size;
+}
+
+// is a writer (in any process) waiting for the readers to get out of the way?
+// Without the hints, assume so
+static int shm_writer_waiting(struct twom_db *db)
+{
+    int i;
+    if (!db->shm) return 1;
+    for (i = 0; i < SHM_WAITERS; i++)
+        if (__atomic_load_n(&db->shm->waiting[i], __ATOMIC_RELAXED)) return 1;
+    if (db->threads && __atomic_load_n(&db->threads->waiting, __ATOMIC_RELAXED)) return 1;
+    return 0;
+}
+
+// take a slot while blocking on the data lock, returning it (or -1 for none)
+static int shm_wait_begin(struct twom_db *db, int cmd)
+{
+    uint64_t pid = (uint64_t)getpid();
+    int i;
+    if (!db->shm || cmd != F_SETLKW) return -1;
+    for (i = 0; i < SHM_WAITERS; i++) {
+        uint64_t none = 0;
+        if (__atomic_compare_exchange_n(&db->shm->waiting[i], &none, pid, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return i;
+    }
+    return -1;
+}
+
+static inline void shm_wait_end(struct twom_db *db, int slot)
+{
+    if (slot >= 0) __atomic_store_n(&db->shm->waiting[slot], 0, __ATOMIC_RELAXED);
+}
+
+// free the slots of writers which died waiting: whoever is waiting now is
+// blocked behind us, so a pid which has gone can't come back for its slot
+static void shm_wait_reap(struct tm_shm *shm)
+{
+    int i;
+    for (i = 0; i < SHM_WAITERS; i++) {
+        uint64_t pid = __atomic_load_n(&shm->waiting[i], __ATOMIC_RELAXED);
+        if (!pid) continue;
+        if (kill((pid_t)pid, 0) == 0 || errno != ESRCH) continue;
+        __atomic_compare_exchange_n(&shm->waiting[i], &pid, 0, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+// a writer has the current file locked, and is about to change it
+static void shm_write_begin(struct twom_db *db, struct tm_file *file)
+{
+    struct tm_shm *shm = db->shm;
+    if (!shm) return;
+    uint64_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->seq, (seq + 2) | 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->ino, file->ino, __ATOMIC_RELAXED);
+    // the odd number has to be visible before any change to the file
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    file->shmwrite = 1;
+    shm_wait_reap(shm);
+}
+
+static void shm_write_end(struct twom_db *db, struct tm_file *file)
+{
+    struct tm_shm *shm = db->shm;
+    file->shmwrite = 0;
+    if (!shm) return;
+    // and every change visible before the even one
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&shm->seq, 1, __ATOMIC_RELEASE);
+}
+
+// a repack has renamed a new file into place: readers of the old one need to
+// stat their way over to it, and unlocked fetches to take the lock
+static void shm_renamed(struct twom_db *db, struct tm_file *file)
+{
+    struct tm_shm *shm = db->shm;
+    struct stat sbuf;
+    if (!shm) return;
+    file->ino = fstat(file->fd, &sbuf) ? 0 : sbuf.st_ino;
+    __atomic_store_n(&shm->ino, file->ino, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shm->seq, 2, __ATOMIC_RELEASE);
+}
+
+/*********************** FILE LOCKING ********************/
+
+static struct twom_txn *_newtxn_write(struct twom_db *db)
+{
+    assert(!db->write_txn);
+    assert(db->openfile);
+    assert(db->openfile->has_datalock == 2);
+
+    /* create the transaction */
+    struct twom_txn *txn = tm_newtxn(db);
+    txn->db = db;
+    txn->file = db->openfile;
+    tm_ref(txn->file);
+    assert(txn->file->committed_size == txn->file->written_size);
+    txn->end = txn->file->committed_size;
+    db->write_txn = txn;
+
+    return txn;
+}
+
+static struct twom_txn *_newtxn_read(struct twom_db *db, int unlocked)
+{
+    // it's OK to have a write transaction as well, we'll just use the same file
+    assert(db->openfile);
+    assert(unlocked || db->openfile->has_datalock);
+
+    /* create the transaction */
+    struct twom_txn *txn = tm_newtxn(db);
+    txn->db = db;
+    txn->file = db->openfile;
+    tm_ref(txn->file);
+    assert(txn->file->committed_size == txn->file->written_size);
+    txn->end = txn->file->committed_size;
+    txn->readonly = 1;
+    txn->next = db->read_txn;
+    db->read_txn = txn;
+
+    return txn;
+}
+
+static int unlock(struct twom_db *db, struct tm_file *file)
+{
+    if (!file) file = db->openfile;
+    if (!file->has_headlock && !file->has_datalock) return 0;
+    if (file == db->openfile) assert(!db->write_txn);
+    if (file->shmwrite) shm_write_end(db, file);
+
+    struct flock fl;
+    fl.l_type= F_UNLCK;
+    fl.l_whence = SEEK_SET;
+
+    fl.l_start = 0;
+    fl.l_len = HEADER_MAGIC_SIZE;
+    for (;file->has_headlock;) {
+        if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        file->has_headlock = 0;
+    }
+
+    fl.l_start = DUMMY_OFFSET;
+    fl.l_len = DUMMY_SIZE;
+    for (;file->has_datalock;) {
+        if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        file->has_datalock = 0;
+    }
+    if (db->threads) __atomic_add_fetch(&db->threads->unlocks, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int write_lock(struct twom_db *db, struct twom_txn **txnp,
+                      struct tm_file *forcefile, int flags)
+{
+    if (db->readonly) return TWOM_LOCKED;
+    if (txnp) assert(!*txnp);
+
+    struct stat sbuf, sbuffile;
+    struct flock fl;
+    int r = 0;
+    int cmd = (flags & TWOM_NONBLOCKING) ? F_SETLK : F_SETLKW;
+    int take_headlock = (flags & TWOM_ONELOCK) ? 0 : 1;
+    struct tm_file *file = forcefile ? forcefile : db->openfile;
+
+    if (file->has_headlock || file->has_datalock) return TWOM_INTERNAL;
+
+    for (;;) {
+        // lock the head section
+        uint64_t began = tm_usec();
+        for (;take_headlock && !file->has_headlock;) {
+            fl.l_type = F_WRLCK;
+            fl.l_whence = SEEK_SET;
+            fl.l_start = 0;
+            fl.l_len = HEADER_MAGIC_SIZE;
+            if (fcntl(file->fd, cmd, &fl) < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN && cmd == F_SETLK)
+                    return TWOM_LOCKED;
+                db->error("write_lock headlock fcntl failed",
+                        "filename=<%s>", db->fname);
+                return TWOM_IOERROR;
+            }
+            file->has_headlock = 2;
+            db->stats.headlocks++;
+            db->stats.headlock_usec += tm_usec() - began;
+        }
+
+        // lock the data section
+        began = tm_usec();
+        for (;!file->has_datalock;) {
+            fl.l_type = F_WRLCK;
+            fl.l_whence = SEEK_SET;
+            fl.l_start = DUMMY_OFFSET;
+            fl.l_len = DUMMY_SIZE;
+            // let the readers know someone's waiting for them
+            int slot = shm_wait_begin(db, cmd);
+            int res = fcntl(file->fd, cmd, &fl);
+            shm_wait_end(db, slot);
+            if (res < 0) {
+                if (errno == EAGAIN && cmd == F_SETLK) {
+                    r = TWOM_LOCKED;
+                    goto done;
+                }
+                if (errno == EINTR) continue;
+                db->error("write_lock datalock fcntl failed",
+                        "filename=<%s>", db->fname);
+                r = TWOM_IOERROR;
+                goto done;
+            }
+            file->has_datalock = 2;
+            db->stats.datalocks++;
+            db->stats.datalock_usec += tm_usec() - began;
+        }
+
+        // release the head section (so readers don't starve)
+        for (;file->has_headlock;) {
+            fl.l_type= F_UNLCK;
+            fl.l_start = 0;
+            fl.l_whence = SEEK_SET;
+            fl.l_len = HEADER_MAGIC_SIZE;
+            if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
+                if (errno == EINTR) continue;
+                db->error("write_lock headunlock fcntl failed",
+                        "filename=<%s>", db->fname);
+                r = TWOM_IOERROR;
+                goto done;
+            }
+            file->has_headlock = 0;
+        }
+
+        if (fstat(file->fd, &sbuf) == -1) {
+            db->error("write_lock fstat failed",
+                      "filename=<%s>", db->fname);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+        file->ino = sbuf.st_ino;
+
+        if (forcefile) break;
+
+        if (stat(db->fname, &sbuffile) == -1) {
+            db->error("write_lock stat failed",
+                      "filename=<%s>", db->fname);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+
+        if (sbuf.st_ino == sbuffile.st_ino) break;
+
+        // go straight to the data lock when retrying
+        take_headlock = 0;
+
+        r = unlock(db, file);
+        if (r) goto done;
+
+        int newfd = open(db->fname, O_RDWR, 0644);
+        if (newfd == -1) {
+            db->error("write_lock open failed",
+                      "filename=<%s>", db->fname);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+
+        // new file, create a new mapping
+        file = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
+        file->fd = newfd;
+        file->next = db->openfile;
+        db->openfile = file;
+    }
+
+    // empty file is same as nothing
+    if (!sbuf.st_size) {
+        r = TWOM_NOTFOUND;
+        goto done;
+    }
+
+    // any other tiny file isn't this format
+    if (sbuf.st_size < HEADER_SIZE + DUMMY_SIZE) {
+        r = TWOM_BADFORMAT;
+        goto done;
+    }
+
+    // if we haven't mapped enough space, do it now
+    if (file->size < (size_t)sbuf.st_size) {
+        if (tm_map(db, file, sbuf.st_size, PROT_READ|PROT_WRITE)) {
+            db->error("write_lock mmap failed",
+                      "filename=<%s> size=<%08llX>", db->fname, (LLU)sbuf.st_size);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+    }
+
+    /* reread header */
+    r = read_header(db, file, &file->header);
+    if (r) goto done;
+
+    // a repack's new file isn't visible to readers yet
+    if (!forcefile) shm_write_begin(db, file);
+
+    file->committed_size = file->header.current_size;
+    file->written_size = file->committed_size;
+    // if someone else committed since we last did, we can't know what they
+    // synced (they may have used TWOM_NOSYNC, touching pages anywhere), and
+    // our clean header will cover their records: so sync the whole file
+    if (file->committed_size != file->own_size)
+        file->sync_tail = 0;
+
+    if (!db_is_clean(db, file)) {
+        r = recovery(db, file);
+        if (r) goto done;
+    }
+
+    if (db->warmup && !file->warmed) tm_warmup(file);
+
+    if (txnp) {
+        *txnp = _newtxn_write(db);
+        return 0;
+    }
+
+ done:
+    unlock(db, file);
+    return r;
+}
+
+static int read_lock(struct twom_db *db, struct twom_txn **txnp,
+                     struct tm_file *forcefile, int flags)
+{
+    struct stat sbuf, sbuffile;
+    int r = 0;
+    struct flock fl;
+    struct tm_file *file = forcefile ? forcefile : db->openfile;
+    int cmd = (flags & TWOM_NONBLOCKING) ? F_SETLK : F_SETLKW;
+    int take_headlock = (flags & TWOM_ONELOCK) ? 0 : 1;
+    size_t filesize;
+
+    if (file->has_headlock || file->has_datalock) return TWOM_INTERNAL;
+
+    // the header lock is only there to let a waiting writer in
+    if (!shm_writer_waiting(db)) take_headlock = 0;
+
+    for (;;) {
+        // take the headlock
+        uint64_t began = tm_usec();
+        for (;take_headlock && !file->has_headlock;) {
+            fl.l_type = F_RDLCK;
+            fl.l_whence = SEEK_SET;
+            fl.l_start = 0;
+            fl.l_len = HEADER_MAGIC_SIZE;
+            if (fcntl(file->fd, cmd, &fl) < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN && cmd == F_SETLK)
+                    return TWOM_LOCKED;
+                db->error("read_lock fcntl failed",
+                        "filename=<%s>", db->fname);
+                return TWOM_IOERROR;
+            }
+            file->has_headlock = 1;
+            db->stats.headlocks++;
+            db->stats.headlock_usec += tm_usec() - began;
+        }
+
+        // lock the data section
+        began = tm_usec();
+        for (;!file->has_datalock;) {
+            fl.l_type = F_RDLCK;
+            fl.l_whence = SEEK_SET;
+            fl.l_start = DUMMY_OFFSET;
+            fl.l_len = DUMMY_SIZE;
+            if (fcntl(file->fd, cmd, &fl) < 0) {
+                if (errno == EAGAIN && cmd == F_SETLK) {
+                    r = TWOM_LOCKED;
+                    goto done;
+                }
+                if (errno == EINTR) continue;
+                db->error("read_lock datalock fcntl failed",
+                        "filename=<%s>", db->fname);
+                r = TWOM_IOERROR;
+                goto done;
+            }
+            file->has_datalock = 1;
+            db->stats.datalocks++;
+            db->stats.datalock_usec += tm_usec() - began;
+        }
+
+        // release the head section (so writers don't starve)
+        for (;file->has_headlock;) {
+            fl.l_type= F_UNLCK;
+            fl.l_whence = SEEK_SET;
+            fl.l_start = 0;
+            fl.l_len = HEADER_MAGIC_SIZE;
+            if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
+                if (errno == EINTR) continue;
+                db->error("read_lock headunlock fcntl failed",
+                        "filename=<%s>", db->fname);
+                r = TWOM_IOERROR;
+                goto done;
+            }
+            file->has_headlock = 0;
+        }
+
+        // a file the hints say is still current, and mapped far enough, needs no stat
+        if (shm_current(db, file)) {
+            filesize = file->size;
+            break;
+        }
+
+        if (fstat(file->fd, &sbuf) == -1) {
+            db->error("read_lock fstat failed",
+                      "filename=<%s>", db->fname);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+        file->ino = sbuf.st_ino;
+        filesize = sbuf.st_size;
+
+        // we're not interested in getting the latest file
+        if (forcefile) break;
+
+        if (stat(db->fname, &sbuffile) == -1) {
+            db->error("read_lock stat failed",
+                      "filename=<%s>", db->fname);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+
+        // file is unchanged, we have successfully locked
+        if (sbuf.st_ino == sbuffile.st_ino) break;
+
+        // go straight to the data lock when retrying
+        take_headlock = 0;
+
+        // unlock the old file
+        r = unlock(db, file);
+        if (r) goto done;
+
+        int newfd = open(db->fname, db->readonly ? O_RDONLY : O_RDWR, 0644);
+        if (newfd == -1) {
+            db->error("read_lock open failed",
+                      "filename=<%s>", db->fname);
+            return TWOM_IOERROR;
+        }
+
+        // new file
+        file = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
+        file->fd = newfd;
+        file->next = db->openfile;
+        db->openfile = file;
+    }
+
+    // empty file is same as nothing
+    if (!filesize) {
+        r = TWOM_NOTFOUND;
+        goto done;
+    }
+
+    // any other tiny file isn't this format
+    if (filesize < HEADER_SIZE + DUMMY_SIZE) {
+        r = TWOM_BADFORMAT;
+        goto done;
+    }
+
+    // if the existing map it too small, replace it
+    if (file->size < filesize) {
+        /* map the new space (note: we map READ|WRITE even for readonly locks,
+         * if we might lock for write later and want to reuse the mmap */
+        int flags = db->readonly ? PROT_READ : PROT_READ|PROT_WRITE;
+        if (tm_map(db, file, filesize, flags)) {
+            db->error("read_lock mmap failed",
+                      "filename=<%s> size=<%08llX>", db->fname, (LLU)filesize);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+    }
+
+    // reread header
+    r = read_header(db, file, &file->header);
+    if (r) goto done;
+    if (db->shm) file->shmseq = __atomic_load_n(&db->shm->seq, __ATOMIC_ACQUIRE);
+
+    file->committed_size = file->header.current_size;
+    file->written_size = file->committed_size;
+
+    if (db->warmup && !file->warmed) tm_warmup(file);
+
+    if (txnp) {
+        if (!*txnp) *txnp = _newtxn_read(db, 0);
+        else if (!(*txnp)->mvcc) {
+            // if we're not on this file, change file
+            if ((*txnp)->file != file) {
+                tm_unref((*txnp)->file);
+                (*txnp)->file = file;
+                tm_ref((*txnp)->file);
+            }
+            (*txnp)->end = file->written_size;
+        }
+
+        return 0;
+    }
+
+ done:
+    unlock(db, file);
+    return r;
+}
+
+/*********************** THREADS ********************/
+
+/* fcntl locks belong to the process, so threads sharing a TWOM_THREADSAFE
+ * handle can't use them to keep out of each other's way.  Instead there's a
+ * reader/writer gate in front of them: every public read call counts in and
+ * out, and a write transaction (or a repack step) waits for the count to
+ * reach zero and holds everyone else off until it's done.
+ *
+ * The readers all share the one fcntl read lock, so nobody can drop it
+ * while another thread is in the middle of a read.  A yield, or the end of
+ * a read transaction, drops it straight away if the caller is the only
+ * reader, and otherwise leaves it to the last one out.  A yield also makes
+ * new reads wait for that, so that another process gets its turn.
+ *
+ * A callback (foreach, fetch_many) runs inside its read, and may make other
+ * reads, which don't wait for a writer: that writer is waiting for them. */
+
+static inline intptr_t threads_depth(struct tm_threads *th)
+{
+    return (intptr_t)pthread_getspecific(th->depth);
+}
+
+static inline int threads_is_writer(struct tm_threads *th)
+{
+    return th->writer && pthread_equal(th->owner, pthread_self());
+}
+
+// a thread which is going away won't be reading its last value again
+static void threads_zlast_exit(void *arg)
+{
+    struct tm_zlast *zl = (struct tm_zlast *)arg;
+    free(zl->zbuf.base);
+    zl->zbuf.base = NULL;
+    zl->zbuf.size = 0;
+}
+
+static int threads_init(struct twom_db *db)
+{
+    struct tm_threads *th = (struct tm_threads *)twom_zmalloc(sizeof(struct tm_threads));
+    if (pthread_key_create(&th->depth, NULL)) {
+        db->error("twom failed to create thread key",
+                  "filename=<%s>", db->fname);
+        free(th);
+        return TWOM_INTERNAL;
+    }
+    if (pthread_key_create(&th->zlast, threads_zlast_exit)) {
+        db->error("twom failed to create thread key",
+                  "filename=<%s>", db->fname);
+        pthread_key_delete(th->depth);
+        free(th);
+        return TWOM_INTERNAL;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&th->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&th->gate, NULL);
+    pthread_cond_init(&th->cond, NULL);
+    th->unlocks = 1;    // so a new transaction checks under the lock first
+    db->threads = th;
+    return 0;
+}
+
+static void threads_free(struct twom_db *db)
+{
+    struct tm_threads *th = db->threads;
+    if (!th) return;
+    pthread_key_delete(th->depth);
+    pthread_key_delete(th->zlast);
+    while (th->zlasts) {
+        struct tm_zlast *zl = th->zlasts;
+        th->zlasts = zl->next;
+        free(zl->zbuf.base);
+        free(zl);
+    }
+    pthread_mutex_destroy(&th->lock);
+    pthread_mutex_destroy(&th->gate);
+    pthread_cond_destroy(&th->cond);
+    free(th);
+    db->threads = NULL;
+}
+
+// nobody is reading, so the read locks can go (called with the gate held)
+static void threads_unlock_reads(struct twom_db *db)
+{
+    struct tm_file *file;
+    threads_lock(db);
+    for (file = db->openfile; file; file = file->next)
+        if (file->has_datalock == 1) unlock(db, file);
+    tm_cleanup(db);
+    threads_unlock(db);
+    db->threads->release = 0;
+    db->threads->drain = 0;
+    db->threads->deferred = 0;
+}
+
+// count a read in, once any writer on another thread is done.  Returns
+// whether it was counted, for threads_leave
+static int threads_enter(struct twom_db *db)
+{
+    struct tm_threads *th = db->threads;
+    if (!th) return 0;
+
+    pthread_mutex_lock(&th->gate);
+    // the writer reads under its own lock
+    if (threads_is_writer(th)) {
+        pthread_mutex_unlock(&th->gate);
+        return 0;
+    }
+    intptr_t depth = threads_depth(th);
+    while (th->writer || (!depth && (th->waiting || th->drain)))
+        pthread_cond_wait(&th->cond, &th->gate);
+    th->readers++;
+    pthread_setspecific(th->depth, (void *)(depth + 1));
+    pthread_mutex_unlock(&th->gate);
+    return 1;
+}
+
+static void threads_leave(struct twom_db *db, int counted)
+{
+    struct tm_threads *th = db->threads;
+    if (!counted) return;
+
+    pthread_mutex_lock(&th->gate);
+    pthread_setspecific(th->depth, (void *)(threads_depth(th) - 1));
+    if (!--th->readers) {
+        if (th->release) threads_unlock_reads(db);
+        pthread_cond_broadcast(&th->cond);
+    }
+    pthread_mutex_unlock(&th->gate);
+}
+
+// let go of the read locks from inside a read: now if it's the only one,
+// otherwise when the last reader leaves.  With 'drain' (a yield) new reads
+// wait for that too, unless this is a callback inside a longer read, which
+// could hold them up for as long as it likes
+static void threads_release(struct twom_db *db, int drain)
+{
+    struct tm_threads *th = db->threads;
+    pthread_mutex_lock(&th->gate);
+    if (th->readers <= 1) {
+        threads_unlock_reads(db);
+    }
+    else {
+        th->release = 1;
+        if (++th->deferred >= THREADS_RELEASE_DRAIN) drain = 1;
+        if (drain && threads_depth(th) <= 1) th->drain = 1;
+    }
+    pthread_mutex_unlock(&th->gate);
+}
+
+// the periodic yield in a long read (a foreach, say): step out of the gate
+// until the other readers have finished and the locks are dropped, so a
+// waiting writer and other processes get their turn, then carry on
+static void threads_yield(struct twom_db *db)
+{
+    struct tm_threads *th = db->threads;
+    pthread_mutex_lock(&th->gate);
+    if (th->readers > 1 && threads_depth(th) == 1) {
+        th->release = 1;
+        th->drain = 1;
+        th->readers--;
+        pthread_setspecific(th->depth, (void *)0);
+        while (th->writer || th->waiting || th->drain)
+            pthread_cond_wait(&th->cond, &th->gate);
+        th->readers++;
+        pthread_setspecific(th->depth, (void *)1);
+    }
+    else if (th->readers <= 1) {
+        threads_unlock_reads(db);
+    }
+    else {
+        th->release = 1;
+    }
+    pthread_mutex_unlock(&th->gate);
+}
+
+// take the handle for writing, when the reads on other threads are done
+static int threads_write_begin(struct twom_db *db, int flags)
+{
+    struct tm_threads *th = db->threads;
+    if (!th) return 0;
+
+    pthread_mutex_lock(&th->gate);
+    // we'd be waiting for ourselves
+    if (threads_depth(th) || threads_is_writer(th)) {
+        pthread_mutex_unlock(&th->gate);
+        return TWOM_LOCKED;
+    }
+    if ((flags & TWOM_NONBLOCKING) && (th->writer || th->readers)) {
+        pthread_mutex_unlock(&th->gate);
+        return TWOM_LOCKED;
+    }
+    th->waiting++;
+    while (th->writer || th->readers)
+        pthread_cond_wait(&th->cond, &th->gate);
+    th->waiting--;
+    th->writer = 1;
+    th->owner = pthread_self();
+    if (th->release) threads_unlock_reads(db);
+    pthread_mutex_unlock(&th->gate);
+    return 0;
+}
+
+static void threads_write_end(struct twom_db *db)
+{
+    struct tm_threads *th = db->threads;
+    if (!th) return;
+
+    pthread_mutex_lock(&th->gate);
+    th->writer = 0;
+    pthread_cond_broadcast(&th->cond);
+    pthread_mutex_unlock(&th->gate);
+}
+
+// is the write transaction (if any) this thread's to use?
+static int threads_own_writer(struct twom_db *db)
+{
+    struct tm_threads *th = db->threads;
+    if (!th) return 1;
+
+    pthread_mutex_lock(&th->gate);
+    int mine = threads_is_writer(th);
+    pthread_mutex_unlock(&th->gate);
+    return mine;
+}
+
+// the write transaction the twom_db_* calls should join, if any
+static struct twom_txn *current_write_txn(struct twom_db *db)
+{
+    return threads_own_writer(db) ? db->write_txn : NULL;
+}
+
+/***********************  OPEN AND CLOSE *************************************/
+
+static void errors_to_stderr(const char *msg, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void errors_to_stderr(const char *msg, const char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(stderr, "DBERROR: %s ", msg);
+    if (fmt) {
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+    }
+    if (errno)
+        fprintf(stderr, " errno=<%s>", strerror(errno));
+    fprintf(stderr, "%s", "\n");
+}
+
+static int repack_abandon(struct twom_db *db);
+static void dispose_db(struct twom_db *db)
+{
+    if (!db) return;
+    repack_abandon(db);
+    empty_db(db);
+    threads_free(db);
+    shm_detach(db);
+    free(db->zwrite.base);
+    free(db->zlast.base);
+    free(db->fname);
+    free(db);
+}
+
+static int initdb(struct twom_db *db, int flags)
+{
+    char scratch[512]; // this is big enough, header plus dummy fits in 512
+    struct tm_header header;
+    size_t filesize = HEADER_SIZE + DUMMY_SIZE;
+    struct tm_file *file = db->openfile;
+
+    // zero out our workspace
+    memset(scratch, 0, 512);
+
+    // prepare the header
+    tm_uuid_generate(header.uuid);
+    header.flags = set_csum_engine(db, file, flags);
+    if (flags & TWOM_COMPAR_EXTERNAL)
+        header.flags |= TWOM_COMPAR_EXTERNAL;
+    else if (flags & TWOM_KEYPREFIX)
+        header.flags |= TWOM_KEYPREFIX;
+    if (flags & TWOM_BLOBS)
+        header.flags |= TWOM_BLOBS;
+    // a filter of raw keys would turn away keys another comparator matches
+    if ((flags & TWOM_BLOOM) && !(flags & TWOM_COMPAR_EXTERNAL))
+        header.flags |= TWOM_BLOOM;
+    if (db->compress)
+        header.flags |= COMPRESSED;
+    if (flags & TWOM_SHM)
+        header.flags |= SHMHINTS;
+    // only use the new version if we need it, so older readers can still read the rest
+    header.version = (header.flags & SHMHINTS) ? 5 : (header.flags & COMPRESSED) ? 4
+                   : (header.flags & TWOM_BLOBS) ? 3 : (header.flags & TWOM_KEYPREFIX) ? 2 : 1;
+    header.generation = 1;
+    header.num_records = 0;
+    header.num_commits = 0;
+    header.dirty_size = 0;
+    header.repack_size = filesize;
+    header.current_size = filesize;
+    header.maxlevel = 0;
+    pack_header(&header, file, scratch);
+
+    // write a blank dummy record
+    size_t headlen = HLCALC(DUMMY, MAXLEVEL);
+    char *base = scratch + DUMMY_OFFSET;
+    *((uint8_t *)(base)) = DUMMY;
+    *((uint8_t *)(base+1)) = MAXLEVEL;
+    *((uint32_t *)(base+headlen)) = htole32(file->csum(base, headlen));
+
+    // the filter is ready before the file is.  A repack's new file is first in
+    // the list, in front of the one it's copying
+    if (header.flags & TWOM_BLOOM) {
+        size_t nkeys = (db->repack && file->next) ? 2 * file->next->header.num_records : 0;
+        int r = bloom_create(db, file, &header, nkeys);
+        if (r) return r;
+    }
+
+    // ensure that the data is written to the file!
+    size_t written;
+    for (written = 0; written < filesize; ) {
+        ssize_t n = write(file->fd, scratch + written, filesize - written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            db->error("db creation failed",
+                      "filename=<%s>", db->fname);
+            return TWOM_IOERROR;
+        }
+        written += n;
+    }
+
+    return 0;
+}
+
+static int opendb(const char *fname, struct twom_open_data *setup, struct twom_db **ret, struct twom_txn **txnp)
+{
+    assert(setup);
+    int r = TWOM_IOERROR;
+
+    assert(fname);
+    assert(ret);
+
+    struct twom_db *db = (struct twom_db *)twom_zmalloc(sizeof(struct twom_db));
+    db->readonly = (setup->flags & TWOM_SHARED) ? 1 : 0;
+    db->nocsum = (setup->flags & TWOM_NOCSUM) ? 1 : 0;
+    db->nosync = (setup->flags & TWOM_NOSYNC) ? 1 : 0;
+    db->fdatasync = (setup->flags & TWOM_FDATASYNC) ? 1 : 0;
+    db->noyield = (setup->flags & TWOM_NOYIELD) ? 1 : 0;
+    db->fallocate = (setup->flags & TWOM_FALLOCATE) ? 1 : 0;
+    db->keyprefix = (setup->flags & TWOM_KEYPREFIX) ? 1 : 0;
+    db->csumcache = (setup->flags & TWOM_CSUMCACHE) ? 1 : 0;
+    db->blobs_wanted = (setup->flags & TWOM_BLOBS) ? 1 : 0;
+    db->bloom_wanted = (setup->flags & TWOM_BLOOM) ? 1 : 0;
+    db->warmup = (setup->flags & TWOM_WARMUP) ? 1 : 0;
+    db->reserve = setup->reserve;
+    db->growth = setup->growth;
+    db->blob_threshold = setup->blob_threshold ? setup->blob_threshold : BLOB_THRESHOLD;
+    db->compress = setup->compress;
+    db->decompress = setup->decompress;
+    db->compress_threshold = setup->compress_threshold ? setup->compress_threshold : COMPRESS_THRESHOLD;
+    db->blobs.fd = -1;
+    db->fname = strdup(fname);
+    db->foreach_lock_release = FOREACH_LOCK_RELEASE;
+    db->error = setup->error ? setup->error : errors_to_stderr;
+    db->external_csum = setup->csum;
+    db->external_compar = setup->compar;
+
+    db->openfile = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
+    db->openfile->fd = -1;
+
+    // what it compresses, it will need to read back
+    if (db->compress && !db->decompress) {
+        db->error("compress function without decompress",
+                  "filename=<%s>", db->fname);
+        r = TWOM_BADUSAGE;
+        goto done;
+    }
+
+    if (setup->flags & TWOM_THREADSAFE) {
+        r = threads_init(db);
+        if (r) goto done;
+    }
+
+    int fd = open(db->fname, db->readonly ? O_RDONLY : O_RDWR, 0644);
+    db->openfile->fd = fd;
+    if (fd < 0) {
+        if (setup->flags & TWOM_CREATE) {
+            char *copy = strdup(fname);
+            const char *dir = dirname(copy);
+#if defined(O_DIRECTORY)
+            int dirfd = open(dir, O_RDONLY|O_DIRECTORY, 0600);
+#else
+            int dirfd = open(dir, O_RDONLY, 0600);
+#endif
+            free(copy);
+            if (dirfd < 0) {
+                if (errno == ENOENT) r = TWOM_NOTFOUND;
+                else r = TWOM_IOERROR;
+                goto done;
+            }
+            copy = strdup(fname);
+            const char *leaf = basename(copy);
+            fd = openat(dirfd, leaf, O_RDWR|O_CREAT, 0644);
+            free(copy);
+            db->openfile->fd = fd;
+            if (fd < 0) {
+                if (errno == ENOENT) r = TWOM_NOTFOUND;
+                else r = TWOM_IOERROR;
+                close(dirfd);
+                goto done;
+            }
+            if (fsync(dirfd) < 0) {
+                r = TWOM_IOERROR;
+                close(dirfd);
+                goto done;
+            }
+            close(dirfd);
+            r = initdb(db, setup->flags);
+            if (r) goto done;
+        }
+        else {
+            if (errno == ENOENT) r = TWOM_NOTFOUND;
+            goto done;
+        }
+    }
+
+    if (db->readonly || !txnp) {
+        /* grab a read lock to read the header */
+        r = read_lock(db, txnp, NULL, setup->flags);
+        if (r == TWOM_NOTFOUND && !db->readonly) {
+            r = initdb(db, setup->flags);
+            if (!r) r = read_lock(db, txnp, NULL, setup->flags);
+        }
+        if (r) goto done;
+    }
+    else {
+        /* go straight for a write lock and hold it */
+        r = write_lock(db, txnp, NULL, setup->flags);
+        if (r == TWOM_NOTFOUND) {
+            r = initdb(db, setup->flags);
+            if (!r) r = write_lock(db, txnp, NULL, setup->flags);
+        }
+        if (r) goto done;
+        // nobody else has the handle yet, so it's ours to write with
+        if (db->threads) {
+            db->threads->writer = 1;
+            db->threads->owner = pthread_self();
+        }
+    }
+
+    // the UUID names the segment, so it can only be found now we have the header.
+    // The writer which created it may still be setting it up
+    if (db->openfile->header.flags & SHMHINTS) {
+        int tries;
+        for (tries = 0; !db->shm && tries < SHM_ATTACH_TRIES; tries++) {
+            if (tries) {
+                struct timespec ts = { 0, 1000000 };
+                nanosleep(&ts, NULL);
+            }
+            shm_attach(db);
+            if (db->readonly) break;
+        }
+        if (!db->shm && !db->readonly) {
+            db->error("can't map the shared memory hints",
+                      "filename=<%s>", db->fname);
+            if (txnp) *txnp = NULL;
+            r = TWOM_IOERROR;
+            goto done;
+        }
+        if (db->openfile->has_datalock == 2) shm_write_begin(db, db->openfile);
+    }
+
+    *ret = db;
+
+ done:
+    if (r) dispose_db(db);
+    return r;
+}
+
+static int abort_locked(struct twom_txn **txnp)
+{
+    if (!*txnp) return 0;
+    struct twom_txn *txn = *txnp;
+    struct twom_db *db = txn->db;
+    if (txn != db->write_txn) {
+        struct twom_txn **ptr;
+        for (ptr = &db->read_txn; *ptr; ptr = &(*ptr)->next)
+            if (*ptr == txn) break;
+        assert(*ptr);
+        _remove_txn(ptr);
+        tm_cleanup(db);
+        return 0;
+    }
+
+    // we use recovery to abort - it will undo any pointers past the end.
+    //
+    // NOTE: we don't (currently) truncate the file afterwards, so there
+    // could be junk at the end of the file until new transactions overwrite
+    // it or it gets repacked.
+    int r = recovery(db, txn->file);
+    txn->file->aborts++;
+    // any blobs it wrote are just dead space now (still synced with the next
+    // commit though, a repack between slices may have written some too)
+    db->blobs.end = 0;
+    tm_unref(txn->file);
+    tm_freetxn(db, txn);
+    *txnp = NULL;
+    db->write_txn = NULL;
+    tm_cleanup(db);
+
+    return r;
+}
+
+static int commit_locked(struct twom_txn **txnp)
+{
+    if (!*txnp) return 0;
+    struct twom_txn *txn = *txnp;
+    struct twom_db *db = txn->db;
+    if (txn != db->write_txn) {
+        struct twom_txn **ptr;
+        for (ptr = &db->read_txn; *ptr; ptr = &(*ptr)->next)
+            if (*ptr == txn) break;
+        assert(*ptr);
+        _remove_txn(ptr);
+        tm_cleanup(db);
+        return 0;
+    }
+
+    int r = 0;
+
+    assert(db);
+    assert(txn);
+
+    struct tm_file *file = txn->file;
+    struct tm_header *header = &file->header;
+
+    /* no need to commit if we're not dirty */
+    if (!(header->flags & DIRTY))
+        goto done;
+
+    /* if we're committing we have a location */
+    struct tm_loc *loc = &db->loc;
+    assert(file == txn->file);
+    assert(file->has_datalock == 2);
+
+    size_t headlen = 16;
+    size_t reclen = 24;
+
+    r = blob_commit(db, txn);
+    if (r) goto done;
+    struct tm_bloom *bloom = NULL;
+    r = bloom_commit(db, txn, &bloom);
+    if (r) goto done;
+
+    // could re-map, but it WON'T change the header
+    r = tm_ensure(db, file->written_size + reclen);
+    if (r) goto done;
+
+    char *base = file->base + file->written_size;
+    memset(base, 0, reclen); // zero out the whole thing before we set just the bits we want
+
+    *((uint8_t *)(base)) = COMMIT;
+    *((uint64_t *)(base+8)) = htole64(header->current_size);
+    *((uint32_t *)(base+16)) = htole32(file->csum(base, headlen));
+
+    file->written_size += reclen;
+    txn->end = file->written_size;
+    loc->end = file->written_size;
+    file->dirty = 1;
+
+    /* commit ALL outstanding changes first, before
+     * rewriting the header */
+    r = tm_commit(db, file->written_size);
+    if (r) goto done;
+
+    /* finally, update the header and commit again */
+    header->num_commits++;
+    header->current_size = file->written_size;
+    header->flags &= ~DIRTY;
+    r = commit_header(db, header);
+    if (r) goto done;
+
+    file->committed_size = file->written_size;
+    file->own_size = file->committed_size;
+    if (bloom) bloom_set_covered(bloom, file->committed_size);
+
+    // a synced commit flushes the whole file, including any earlier
+    // nosync commits
+    if (!txn->nosync) file->unsynced = 0;
+    db->commit_seq++;
+    if (!file->unsynced) db->durable_seq = db->commit_seq;
+
+ done:
+    if (r) {
+        /* error during commit; we must abort */
+        int r2 = abort_locked(txnp);
+        if (r2) {
+            db->error("commit AND abort failed",
+                      "filename=<%s>", db->fname);
+        }
+        return r;
+    }
+
+    tm_unref(txn->file);
+    tm_freetxn(db, txn);
+    *txnp = NULL;
+    db->write_txn = NULL;
+    tm_cleanup(db);
+
+    return 0;
+}
+
+/**************** NOT YET SORTED *******************/
+
+// play the rest of the records in a file from any point (used by repack
+// and could also be used by a recovery2 or similar to fix a file where
+// an external compar function had been lost)
+static int myreplay(struct twom_txn *txn,
+                    twom_cb *cb, void *rock)
+{
+    int r;
+
+    struct twom_db *db = txn->db;
+    struct tm_file *file = txn->file;
+
+    while (txn->end + 24 <= file->committed_size) {
+        const char *ptr = file->base + txn->end;
+        size_t reclen = RECLEN(ptr);
+        // ensure the entire record fits!
+        if (txn->end + reclen > file->committed_size)
+            return TWOM_IOERROR;
+
+        // skip over commits, but replay all ADD, REPLACE or DELETE
+        if (TYPE(ptr) == COMMIT) {
+            // skip over
+        }
+        else if (TYPE(ptr) == DELETE) {
+            const char *aptr = file->base + ANCESTOR(ptr);
+            r = cb(rock, KEYPTR(aptr), KEYLEN(aptr), NULL, 0);
+            if (r) return r;
+        }
+        else {
+            const char *val;
+            size_t vallen;
+            r = record_value(txn, file, ptr, &val, &vallen);
+            if (r) return r;
+            r = cb(rock, KEYPTR(ptr), KEYLEN(ptr), val, vallen);
+            if (r) return r;
+        }
+        // advance to the next record
+        txn->end += reclen;
+
+        // release every so often
+        txn->counter++;
+        if (txn->counter > db->foreach_lock_release) {
+            r = unlock(db, file);
+            if (r) return r;
+            db->stats.yields++;
+            /* as in twom_cursor_next: mostly ONELOCK, but periodically take
+             * the full double-lock so we don't starve a waiting writer */
+            int lockflags = (txn->nlocks++ % FOREACH_GATE_RELOCKS) ? TWOM_ONELOCK : 0;
+            if (!lockflags) db->stats.gate_relocks++;
+            r = read_lock(db, &txn, file, lockflags);
+            if (r) return r;
+            txn->counter = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* helper function for all writes - wraps create and delete and the FORCE
+ * logic for each */
+static int skipwrite(struct twom_txn *txn,
+                     const char *key, size_t keylen,
+                     const char *data, size_t datalen,
+                     int flags)
+{
+    struct tm_loc *loc = &txn->db->loc;
+
+    int r = find_loc(txn, loc, key, keylen);
+    if (r) return r;
+
+    const char *ptr = LOCPTR(loc);
+    /* could be a delete or a replace */
+    if (loc->offset && !loc->deleted_offset) {
+        // replacing existing record
+        if (flags & TWOM_IFNOTEXIST) return TWOM_EXISTS;
+        if (!data) return store_here(txn, key, keylen, NULL, 0);
+        /* unchanged?  Save the IO */
+        const char *val;
+        size_t vallen;
+        // (not into the transaction's buffer, where data may well be)
+        int r = zrecord[TYPE(ptr)] ? zip_value(txn->db, &txn->db->zwrite, ptr, &val, &vallen)
+                                   : record_value(txn, loc->file, ptr, &val, &vallen);
+        if (r) return r;
+        if (!COMPAR(loc->file->compar, data, datalen, val, vallen))
+            return 0;
+        return store_here(txn, key, keylen, data, datalen);
+    }
+
+    if (flags & TWOM_IFEXIST) return TWOM_NOTFOUND;
+
+    /* delete of already deleted is a NOOP */
+    if (data) return store_here(txn, key, keylen, data, datalen);
+
+    return 0;
+}
+
+/* compress 'db', closing at the end.  Uses foreach to copy into a new
+ * database, then rewrites over the old one */
+static int copy_cb(void *rock,
+                   const char *key, size_t keylen,
+                   const char *data, size_t datalen)
+{
+    struct twom_txn *txn = (struct twom_txn *)rock;
+    int i;
+
+    /* minimal logic from find_loc and advance_loc knowing that we're
+     * always writing in order at the end of a file */
+    struct tm_loc *loc = &txn->db->loc;
+    if (loc->offset) {
+        const char *ptr = LOCPTR(loc);
+        uint8_t level = LEVEL(ptr);
+        for (i = 0; i < level; i++)
+            loc->backloc[i] = loc->offset;
+        loc->offset = 0;
+    }
+    return store_here(txn, key, keylen, data, datalen);
+}
+
+static int replay_cb(void *rock,
+                     const char *key, size_t keylen,
+                     const char *data, size_t datalen)
+{
+    struct twom_txn *txn = (struct twom_txn *)rock;
+    return skipwrite(txn, key, keylen, data, datalen, 0);
+}
+
+static int tm_rename(struct twom_db *db, struct tm_file *oldfile, const char *newname)
+{
+    struct stat sbuf, sbuffile;
+    char *copyd = strdup(db->fname);
+    char *copyb = strdup(db->fname);
+    const char *dir = dirname(copyd);
+    const char *file = basename(copyb);
+    int r = 0;
+    int dirfd = -1;
+
+#if defined(O_DIRECTORY)
+    dirfd = open(dir, O_RDONLY|O_DIRECTORY, 0600);
+#else
+    dirfd = open(dir, O_RDONLY, 0600);
+#endif
+    if (dirfd < 0) {
+        db->error("open directory failed",
+                  "filename=<%s> newname=<%s> directory=<%s>",
+                  db->fname, newname, dir);
+        r = TWOM_IOERROR;
+        goto done;
+    }
+
+    if (fstat(oldfile->fd, &sbuf) == -1) {
+        db->error("tm_rename fstat failed",
+                  "filename=<%s>", db->fname);
+        r = TWOM_IOERROR;
+        goto done;
+    }
+
+    if (stat(db->fname, &sbuffile) == -1) {
+        db->error("tm_rename stat failed",
+                  "filename=<%s>", db->fname);
+        r = TWOM_IOERROR;
+        goto done;
+    }
+
+    if (sbuf.st_ino != sbuffile.st_ino) {
+        db->error("tm_rename file has changed under us",
+                  "filename=<%s>", db->fname);
+        r = TWOM_IOERROR;
+        goto done;
+    }
+
+    r = renameat(AT_FDCWD, newname, dirfd, file);
+    if (r) goto done;
+
+    if (!db->nosync) {
+        if (fsync(dirfd) < 0) {
+            db->error("fsync directory failed",
+                      "filename=<%s> newname=<%s> directory=<%s>",
+                      db->fname, newname, dir);
+            // but we can't abort now, we've already renamed, so we need to
+            // carry on and update our object
+        }
+    }
+
+ done:
+    if (dirfd >= 0) close(dirfd);
+    free(copyd);
+    free(copyb);
+    return r;
+}
+
+/* perform some basic consistency checks - key order, ancestor key match,
+ * links in order at every level */
+static int consistent1(struct twom_txn *txn, struct tm_loc *loc)
+{
+    size_t next[MAXLEVEL];
+    size_t num_records = 0;
+    size_t dirty_size = 0;
+    const char *ptr;
+    int cmp;
+    int i;
+
+    assert(txn->file->size >= txn->end);
+
+    struct tm_file *file = txn->file;
+    struct twom_db *db = txn->db;
+
+    /* set up the location pointers */
+    ptr = safeptr(loc, DUMMY_OFFSET);
+    if (!ptr) {
+        txn->db->error("failed to read DUMMY for consistent",
+                  "fname=<%s>", db->fname);
+        return TWOM_IOERROR;
+    }
+    next[0] = advance0(ptr, loc->end);
+    for (i = 1; i < MAXLEVEL; i++)
+        next[i] = NEXTN(ptr, i);
+
+    while (next[0]) {
+        const char *nextptr = safeptr(loc, next[0]);
+        size_t deleted_offset = 0;
+        if (!nextptr) {
+            db->error("failed to read next record for consistent",
+                      "fname=<%s> prev_key=<%.*s> offset=<%08llX>",
+                    db->fname, (int)KEYLEN(ptr), KEYPTR(ptr), (LLU)next[0]);
+            return TWOM_IOERROR;
+        }
+        if (TYPE(nextptr) == DELETE) {
+            deleted_offset = next[0];
+            dirty_size += 24;
+            next[0] = ANCESTOR(nextptr);
+            if (!next[0]) return TWOM_IOERROR;
+            nextptr = safeptr(loc, next[0]);
+            if (!nextptr) return TWOM_IOERROR;
+        }
+
+        cmp = COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr),
+                     KEYPTR(ptr), KEYLEN(ptr));
+        if (cmp <= 0) {
+            db->error("out of order for consistent",
+                      "fname=<%s> key=<%.*s> offset=<%08llX> prev_key=<%.*s>",
+                      db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr),
+                      (LLU)next[0], (int)KEYLEN(ptr), KEYPTR(ptr));
+            return TWOM_IOERROR;
+        }
+
+        size_t ancestor = ANCESTOR(nextptr);
+        while (ancestor) {
+            const char *aptr = safeptr(loc, ancestor);
+            if (!aptr) {
+                db->error("failed to read ancestor for consistent",
+                          "fname=<%s> key=<%.*s> offset=<%08llX>",
+                          db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr),
+                          (LLU)ancestor);
+                return TWOM_IOERROR;
+            }
+            if (TYPE(aptr) == DELETE) {
+                dirty_size += 24;
+                ancestor = ANCESTOR(aptr);
+                if (!ancestor) return TWOM_IOERROR;
+                aptr = safeptr(loc, ancestor);
+                if (!aptr) return TWOM_IOERROR;
+            }
+            cmp = COMPAR(file->compar, KEYPTR(aptr), KEYLEN(aptr),
+                         KEYPTR(nextptr), KEYLEN(nextptr));
+            if (cmp) {
+                db->error("mismatched ancestor for consistent",
+                          "fname=<%s> key=<%.*s> offset=<%08llX>"
+                          " parent_key=<%.*s> parent_offset=<%08llX)",
+                          db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr), (LLU)next[0],
+                          (int)KEYLEN(aptr), KEYPTR(aptr), (LLU)ancestor);
+                return TWOM_IOERROR;
+            }
+            dirty_size += RECLEN(aptr);
+            ancestor = ANCESTOR(aptr);
+        }
+
+        uint8_t level = LEVEL(nextptr);
+        for (i = 1; i < level; i++) {
+            /* check the old pointer was to here.  On a read-only
+             * transaction a higher-level pointer into the future (at or
+             * past our snapshot end) is a "future link" left by a writer
+             * that extended the file after we started, or by a crashed
+             * write transaction: recovery on a write lock would re-stitch
+             * it, so tolerate it here and resync rather than reporting
+             * broken linkage. */
+            if (next[i] != next[0]
+                && !(txn->readonly && next[i] >= loc->end)) {
+                db->error("broken linkage for consistent",
+                          "fname=<%s> offset=<%08llX> level=<%d>"
+                          " expected=<%08llX>",
+                          db->fname, (LLU)next[0], i, (LLU)next[i]);
+                return TWOM_IOERROR;
+            }
+            /* and advance to the new pointer */
+            next[i] = NEXTN(nextptr, i);
+        }
+        next[0] = advance0(nextptr, loc->end);
+
+        // count if record or tombstone
+        if (deleted_offset) dirty_size += RECLEN(nextptr);
+        else num_records++;
+
+        // a live blob reference must be inside the blob file
+        if (!deleted_offset && blobrecord[TYPE(nextptr)]) {
+            uint64_t boffset, blen;
+            uint32_t bcsum;
+            blob_ref(nextptr, &boffset, &blen, &bcsum);
+            int r = blob_open(db);
+            if (!r) r = blob_map(db, boffset + blen);
+            if (r) return r;
+        }
+
+        ptr = nextptr;
+    }
+
+    for (i = 0; i < MAXLEVEL; i++) {
+        if (next[i]) {
+            /* as above: a higher-level future link left dangling at the
+             * tail (a pointer at or past our snapshot end) is fine for a
+             * read-only transaction; recovery would zero it. */
+            if (i && txn->readonly && next[i] >= loc->end)
+                continue;
+            db->error("broken tail for consistent",
+                      "filename=<%s> offset=<%08llX> level=<%d>",
+                      db->fname, (LLU)next[i], i);
+            return TWOM_IOERROR;
+        }
+    }
+
+    /* we walked the whole file and saw every pointer */
+
+    if (num_records != txn->file->header.num_records) {
+        db->error("record count mismatch for consistent",
+                  "filename=<%s> num_records=<%llu> expected_records=<%llu>",
+                  db->fname, (LLU)num_records, (LLU)txn->file->header.num_records);
+        return TWOM_IOERROR;
+    }
+
+    if (dirty_size != txn->file->header.dirty_size) {
+        db->error("dirty_size mismatch for consistent",
+                  "filename=<%s> dirty_size=<%llu> expected_size=<%llu>",
+                  db->fname, (LLU)dirty_size, (LLU)txn->file->header.dirty_size);
+        return TWOM_IOERROR;
+    }
+
+    return 0;
+}
+
+/* twom_db_scrub: consistent1 a range at a time, on several threads, and with
+ * the checksums too.
+ *
+ * The ranges start at the records on one of the upper skip levels, the highest
+ * with enough of them.  Each range is checked the way consistent1 checks the
+ * whole file, from its first record (the last of the range before) through to
+ * its last, starting with the pointers that a search for the first one passes
+ * at the levels above it.  So between them the ranges see every pointer once.
+ *
+ * The view is an MVCC snapshot, and the read lock is only held for a slice of
+ * each range at a time, so writers carry on in between.  They only ever point
+ * old records at new ones (past the snapshot end), which consistent1 already
+ * allows for on a read-only transaction, except that two commits can use up
+ * both level 0 slots of a record.  Then the way on is through the records
+ * they added: the first of those with an ancestor inside the snapshot is the
+ * next key's version in it, and the others are keys added since. */
+
+struct tm_scrub_range {
+    size_t ptr;                 // the last record checked
+    size_t stop;                // the range's last record, 0 for the end of the file
+    size_t next[MAXLEVEL];      // as in consistent1
+    size_t num_records;
+    size_t dirty_size;
+    uint64_t records;           // records read, including old versions and tombstones
+    uint64_t bytes;
+    uint64_t headcsums;
+    uint64_t tailcsums;
+    int done;
+    int r;
+};
+
+struct tm_scrub {
+    struct twom_txn *txn;
+    struct tm_loc loc;          // the snapshot
+    struct tm_loc now;          // and everything committed, during this slice
+    struct tm_scrub_range *ranges;
+    size_t nranges;
+    size_t budget;              // bytes to read from each range this slice
+    size_t nexttake;            // the next range to hand out this slice
+    pthread_mutex_t lock;       // for nexttake, and the blob file mapping
+};
+
+static int scrub_csum(struct tm_scrub *sc, struct tm_scrub_range *rg,
+                      const char *ptr, size_t offset)
+{
+    struct twom_db *db = sc->txn->db;
+    struct tm_file *file = sc->loc.file;
+
+    rg->records++;
+    rg->bytes += RECLEN(ptr);
+    if (db->nocsum) return 0;
+
+    rg->headcsums++;
+    if (file->csum(ptr, HEADLEN(ptr)) != HEADCSUM(ptr)) {
+        db->error("invalid head checksum for scrub",
+                  "filename=<%s> offset=<%08llX>",
+                  db->fname, (LLU)offset);
+        return TWOM_BADCHECKSUM;
+    }
+
+    size_t taillen = TAILLEN(ptr);
+    if (!taillen) return 0;
+    rg->tailcsums++;
+    if (file->csum(KEYPTR(ptr), taillen) != TAILCSUM(ptr)) {
+        db->error("invalid tail checksum for scrub",
+                  "filename=<%s> offset=<%08llX>",
+                  db->fname, (LLU)offset);
+        return TWOM_BADCHECKSUM;
+    }
+
+    return 0;
+}
+
+// a live blob reference: it must be inside the blob file, and the value match
+static int scrub_blob(struct tm_scrub *sc, struct tm_scrub_range *rg, const char *ptr)
+{
+    struct twom_db *db = sc->txn->db;
+    uint64_t boffset, blen;
+    uint32_t bcsum;
+    blob_ref(ptr, &boffset, &blen, &bcsum);
+
+    // the other scrub threads, and with TWOM_THREADSAFE other readers, map it too
+    pthread_mutex_lock(&sc->lock);
+    threads_lock(db);
+    int r = blob_open(db);
+    if (!r) r = blob_map(db, boffset + blen);
+    if (!r && !db->nocsum) {
+        rg->tailcsums++;
+        rg->bytes += blen;
+        if (sc->loc.file->csum(db->blobs.base + boffset, blen) != bcsum) {
+            db->error("invalid blob checksum for scrub",
+                      "filename=<%s> key=<%.*s> blob_offset=<%08llX>",
+                      db->fname, (int)KEYLEN(ptr), KEYPTR(ptr), (LLU)boffset);
+            r = TWOM_BADCHECKSUM;
+        }
+    }
+    threads_unlock(db);
+    pthread_mutex_unlock(&sc->lock);
+    return r;
+}
+
+// the record after ptr at level 0 in the snapshot (see above)
+static int scrub_next0(struct tm_scrub *sc, const char *ptr, size_t *nextp)
+{
+    size_t end = sc->loc.end;
+    size_t next = advance0(ptr, end);
+
+    while (next >= end) {
+        const char *nextptr = safeptr(&sc->now, next);
+        if (!nextptr) return TWOM_IOERROR;
+        size_t ancestor = next;
+        const char *aptr = nextptr;
+        while (ancestor >= end) {
+            ancestor = ANCESTOR(aptr);
+            if (!ancestor) break;
+            aptr = safeptr(&sc->now, ancestor);
+            if (!aptr) return TWOM_IOERROR;
+        }
+        if (ancestor) {
+            next = ancestor;
+            break;
+        }
+        next = advance0(nextptr, sc->now.end);
+    }
+
+    *nextp = next;
+    return 0;
+}
+
+// set up a range starting after the record at 'start', with the locked snapshot
+static int scrub_start(struct tm_scrub *sc, struct tm_scrub_range *rg, size_t start)
+{
+    struct tm_loc *loc = &sc->loc;
+    struct tm_file *file = loc->file;
+    const char *ptr = safeptr(loc, start);
+    const char *backptr = safeptr(loc, DUMMY_OFFSET);
+    int level = MAXLEVEL;
+    int i;
+
+    if (!ptr || !backptr) return TWOM_IOERROR;
+
+    if (start == DUMMY_OFFSET) {
+        int r = scrub_csum(sc, rg, ptr, start);
+        if (r) return r;
+    }
+    else {
+        // above its own levels, what the search for it passes
+        level = LEVEL(ptr);
+        for (i = MAXLEVEL - 1; i >= level; i--) {
+            for (;;) {
+                size_t next = NEXTN(backptr, i);
+                if (!next || next >= loc->end) break;
+                const char *nextptr = safeptr(loc, next);
+                if (!nextptr) return TWOM_IOERROR;
+                if (COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr),
+                           KEYPTR(ptr), KEYLEN(ptr)) >= 0) break;
+                backptr = nextptr;
+            }
+            rg->next[i] = NEXTN(backptr, i);
+        }
+    }
+
+    for (i = 1; i < level; i++)
+        rg->next[i] = NEXTN(ptr, i);
+    rg->ptr = start;
+    return scrub_next0(sc, ptr, &rg->next[0]);
+}
+
+// check about sc->budget bytes more of a range, under the read lock
+static void scrub_slice(struct tm_scrub *sc, struct tm_scrub_range *rg)
+{
+    struct twom_db *db = sc->txn->db;
+    struct tm_loc *loc = &sc->loc;
+    struct tm_file *file = loc->file;
+    uint64_t upto = rg->bytes + sc->budget;
+    size_t *next = rg->next;
+    int cmp;
+    int i;
+    int r = 0;
+
+    const char *ptr = safeptr(loc, rg->ptr);
+    if (!ptr) {
+        r = TWOM_IOERROR;
+        goto done;
+    }
+
+    while (next[0]) {
+        if (rg->bytes >= upto) {
+            // more next time
+            return;
+        }
+
+        const char *nextptr = safeptr(loc, next[0]);
+        size_t deleted_offset = 0;
+        if (!nextptr) {
+            db->error("failed to read next record for scrub",
+                      "fname=<%s> prev_key=<%.*s> offset=<%08llX>",
+                      db->fname, (int)KEYLEN(ptr), KEYPTR(ptr), (LLU)next[0]);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+        if (TYPE(nextptr) == DELETE) {
+            r = scrub_csum(sc, rg, nextptr, next[0]);
+            if (r) goto done;
+            deleted_offset = next[0];
+            rg->dirty_size += 24;
+            next[0] = ANCESTOR(nextptr);
+            nextptr = safeptr(loc, next[0]);
+            if (!nextptr) {
+                r = TWOM_IOERROR;
+                goto done;
+            }
+        }
+        size_t offset = next[0];
+        r = scrub_csum(sc, rg, nextptr, offset);
+        if (r) goto done;
+
+        cmp = COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr),
+                     KEYPTR(ptr), KEYLEN(ptr));
+        if (cmp <= 0) {
+            db->error("out of order for scrub",
+                      "fname=<%s> key=<%.*s> offset=<%08llX> prev_key=<%.*s>",
+                      db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr),
+                      (LLU)offset, (int)KEYLEN(ptr), KEYPTR(ptr));
+            r = TWOM_IOERROR;
+            goto done;
+        }
+
+        size_t ancestor = ANCESTOR(nextptr);
+        while (ancestor) {
+            const char *aptr = safeptr(loc, ancestor);
+            if (!aptr) {
+                r = TWOM_IOERROR;
+                goto done;
+            }
+            if (TYPE(aptr) == DELETE) {
+                r = scrub_csum(sc, rg, aptr, ancestor);
+                if (r) goto done;
+                rg->dirty_size += 24;
+                ancestor = ANCESTOR(aptr);
+                aptr = safeptr(loc, ancestor);
+                if (!aptr) {
+                    r = TWOM_IOERROR;
+                    goto done;
+                }
+            }
+            r = scrub_csum(sc, rg, aptr, ancestor);
+            if (r) goto done;
+            cmp = COMPAR(file->compar, KEYPTR(aptr), KEYLEN(aptr),
+                         KEYPTR(nextptr), KEYLEN(nextptr));
+            if (cmp) {
+                db->error("mismatched ancestor for scrub",
+                          "fname=<%s> key=<%.*s> offset=<%08llX>"
+                          " parent_key=<%.*s> parent_offset=<%08llX)",
+                          db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr), (LLU)offset,
+                          (int)KEYLEN(aptr), KEYPTR(aptr), (LLU)ancestor);
+                r = TWOM_IOERROR;
+                goto done;
+            }
+            rg->dirty_size += RECLEN(aptr);
+            ancestor = ANCESTOR(aptr);
+        }
+
+        uint8_t level = LEVEL(nextptr);
+        for (i = 1; i < level; i++) {
+            // a future link is fine, as in consistent1
+            if (next[i] != offset && next[i] < loc->end) {
+                db->error("broken linkage for scrub",
+                          "fname=<%s> offset=<%08llX> level=<%d>"
+                          " expected=<%08llX>",
+                          db->fname, (LLU)offset, i, (LLU)next[i]);
+                r = TWOM_IOERROR;
+                goto done;
+            }
+            next[i] = NEXTN(nextptr, i);
+        }
+        r = scrub_next0(sc, nextptr, &next[0]);
+        if (r) goto done;
+
+        if (deleted_offset) rg->dirty_size += RECLEN(nextptr);
+        else rg->num_records++;
+
+        if (!deleted_offset && blobrecord[TYPE(nextptr)]) {
+            r = scrub_blob(sc, rg, nextptr);
+            if (r) goto done;
+        }
+
+        rg->ptr = offset;
+        ptr = nextptr;
+
+        // the next range starts here
+        if (offset == rg->stop) goto done;
+    }
+
+    if (rg->stop) {
+        db->error("range ended early for scrub",
+                  "filename=<%s> offset=<%08llX> expected=<%08llX>",
+                  db->fname, (LLU)rg->ptr, (LLU)rg->stop);
+        r = TWOM_IOERROR;
+        goto done;
+    }
+
+    for (i = 1; i < MAXLEVEL; i++) {
+        if (next[i] && next[i] < loc->end) {
+            db->error("broken tail for scrub",
+                      "filename=<%s> offset=<%08llX> level=<%d>",
+                      db->fname, (LLU)next[i], i);
+            r = TWOM_IOERROR;
+            goto done;
+        }
+    }
+
+ done:
+    rg->r = r;
+    rg->done = 1;
+}
+
+// take ranges which still have work to do until there are none left this slice
+static void *scrub_worker(void *rock)
+{
+    struct tm_scrub *sc = (struct tm_scrub *)rock;
+    for (;;) {
+        pthread_mutex_lock(&sc->lock);
+        while (sc->nexttake < sc->nranges && sc->ranges[sc->nexttake].done)
+            sc->nexttake++;
+        size_t i = sc->nexttake++;
+        pthread_mutex_unlock(&sc->lock);
+        if (i >= sc->nranges) break;
+        scrub_slice(sc, &sc->ranges[i]);
+    }
+    return NULL;
+}
+
+// the records at the highest level with at least 'want' of them (or level 1)
+static size_t scrub_splits(struct tm_loc *loc, size_t want, size_t **splitsp)
+{
+    const char *dummy = safeptr(loc, DUMMY_OFFSET);
+    size_t *splits = NULL;
+    size_t count = 0;
+    int level;
+
+    if (!dummy) return 0;
+
+    for (level = MAXLEVEL - 1; level >= 1; level--) {
+        const char *ptr = dummy;
+        count = 0;
+        for (;;) {
+            size_t next = NEXTN(ptr, level);
+            if (!next || next >= loc->end) break;
+            ptr = safeptr(loc, next);
+            if (!ptr) break;
+            if (splits) splits[count] = next;
+            count++;
+        }
+        if (splits) break;
+        // go round again on the same level to record them
+        if (count >= want || level == 1) {
+            if (!count) break;
+            splits = (size_t *)twom_zmalloc(count * sizeof(size_t));
+            level++;
+        }
+    }
+
+    *splitsp = splits;
+    return splits ? count : 0;
+}
+
+/*********************** PUBLIC API ******************************/
+
+// we refcount the database object by filename, so if you open twice in
+// the same process, we don't have flock shenanigans, because flock state
+// is process-wise, not file-descriptor specific, so it's not safe to just
+// open the file in separate objects and lock it separately.
+int twom_db_open(const char *fname, struct twom_open_data *setup,
+                 struct twom_db **ret, struct twom_txn **txnp)
+{
+    struct twom_db *mydb;
+    int r = 0;
+
+    pthread_mutex_lock(&open_twom_lock);
+
+    /* do we already have this DB open? */
+    for (mydb = open_twom; mydb; mydb = mydb->next) {
+        if (strcmp(mydb->fname, fname)) continue;
+        // XXX: we should check that setup->flags are compatible with the
+        // flags that the DB was originally opened with and reject if they
+        // aren't, e.g. NOSYNC
+        mydb->refcount++;
+        break;
+    }
+
+    if (mydb) {
+        pthread_mutex_unlock(&open_twom_lock);
+        // (outside the list lock, this can wait for another thread's writes)
+        if (txnp) {
+            r = twom_db_begin_txn(mydb, setup->flags, txnp);
+            if (r) {
+                twom_db_close(&mydb);
+                return r;
+            }
+        }
+        *ret = mydb;
+        return 0;
+    }
+
+    r = opendb(fname, setup, &mydb, txnp);
+    if (r) {
+        pthread_mutex_unlock(&open_twom_lock);
+        return r;
+    }
+
+    /* track this database in the open list */
+    mydb->refcount = 1;
+    mydb->next = open_twom;
+    open_twom = mydb;
+
+    pthread_mutex_unlock(&open_twom_lock);
+
+    /* return the open DB */
+    *ret = mydb;
+
+    return 0;
+}
+
+int twom_db_close(struct twom_db **dbp)
+{
+    struct twom_db *mydb;
+    struct twom_db *prev = NULL;
+
+    if (!*dbp) return 0;
+
+    pthread_mutex_lock(&open_twom_lock);
+
+    /* remove this DB from the open list */
+    mydb = open_twom;
+    while (mydb && mydb != *dbp) {
+        prev = mydb;
+        mydb = mydb->next;
+    }
+    assert(mydb);
+
+    if (--mydb->refcount <= 0) {
+        if (prev) prev->next = mydb->next;
+        else open_twom = mydb->next;
+    }
+    else {
+        mydb = NULL;
+    }
+
+    pthread_mutex_unlock(&open_twom_lock);
+
+    dispose_db(mydb);
+
+    *dbp = NULL;
+
+    return 0;
+}
+
+// give up a read lock, either periodically to let others have a turn, or
+// because we're done for now.  With TWOM_THREADSAFE the other threads' reads
+// have to finish first, see threads_release
+static int txn_yield(struct twom_txn *txn, int turn)
+{
+    if (!txn->readonly) return TWOM_LOCKED;
+    if (!txn->db->threads) {
+        if (txn->file->has_datalock == 1) unlock(txn->db, txn->file);
+    }
+    else if (turn) {
+        threads_yield(txn->db);
+    }
+    else {
+        threads_release(txn->db, 0);
+    }
+    return 0;
+}
+
+// if this is called instead of the txn_yield, it yields all
+// readonly-locked files in the database, not just the current one.
+int twom_db_yield(struct twom_db *db)
+{
+    if (!db) return 0;
+    int counted = threads_enter(db);
+    int r = 0;
+    // we don't check transactions for noyield, because they don't
+    // control yield on other transactions; if you want to restrict
+    // it entirely, it's only at the DB level that you we check
+    if (db->write_txn || db->noyield) {
+        r = TWOM_LOCKED;
+    }
+    else if (db->threads) {
+        threads_release(db, 1);
+    }
+    else {
+        struct tm_file *file;
+        for (file = db->openfile; file; file = file->next)
+            if (file->has_datalock == 1) unlock(db, file);
+    }
+    threads_leave(db, counted);
+    return r;
+}
+
+// with a readonly transaction, call this if you know you have
+// a lot of other work to do, so other processes can make
+// changes which you will either see or ignore depending on the
+// TWOM_MVCC flag used to create the transaction.
+int twom_txn_yield(struct twom_txn *txn)
+{
+    if (!txn) return 0;
+    if (!txn->readonly) return TWOM_LOCKED;
+    if (!txn->db->threads) return txn_yield(txn, 0);
+    int counted = threads_enter(txn->db);
+    threads_release(txn->db, 1);
+    threads_leave(txn->db, counted);
+    return 0;
+}
+
+// lock a read transaction again after a yield.  A non-MVCC transaction moves on to the
+// latest file, and if another transaction (another thread's, with TWOM_THREADSAFE) has
+// that read locked already, it just joins in.  Inside a read, nobody else unlocks a file,
+// so a caller can check has_datalock first without the lock
+// is a read transaction's file still locked?  With TWOM_THREADSAFE another thread may be
+// half way through locking it, so only trust what txn_relock saw under the lock, and only
+// if nothing has been unlocked since
+static inline int txn_locked(struct twom_txn *txn)
+{
+    struct tm_threads *th = txn->db->threads;
+    if (!th) return txn->file->has_datalock;
+    return txn->lockseq == __atomic_load_n(&th->unlocks, __ATOMIC_ACQUIRE);
+}
+
+static int txn_relock(struct twom_txn **txnp, int flags)
+{
+    struct twom_txn *txn = *txnp;
+    struct twom_db *db = txn->db;
+    int r = 0;
+
+    threads_lock(db);
+    if (txn->file->has_datalock) goto done;
+    if (!txn->mvcc && db->openfile->has_datalock == 1) {
+        tm_unref(txn->file);
+        txn->file = db->openfile;
+        tm_ref(txn->file);
+        txn->end = txn->file->committed_size;
+        goto done;
+    }
+    r = read_lock(db, txnp, txn->mvcc ? txn->file : NULL, flags);
+ done:
+    if (!r && db->threads) (*txnp)->lockseq = db->threads->unlocks;
+    threads_unlock(db);
+    return r;
+}
+
+// take back the lock on a read transaction which has yielded it, so that searches are
+// safe again.  A non-MVCC transaction moves on to the latest file, like a cursor does
+static int txn_lock(struct twom_txn *txn)
+{
+    if (!txn->readonly || txn->unlocked || txn_locked(txn)) return 0;
+    return txn_relock(&txn, 0);
+}
+
+static int begin_txn(struct twom_db *db, int flags, struct twom_txn **txnp)
+{
+    struct twom_txn *txn = *txnp;
+    // you can call begin on an existing transaction, and it just refreshes
+    // the read_lock if yield or another action has released it meanwhile
+    if (txn) {
+        assert (txn->file);
+        if (txn->file->has_datalock == 2) return 0;
+        if (!txn->readonly) return TWOM_LOCKED;
+        if (txn->file->has_datalock) return 0;
+        return read_lock(db, txnp, txn->file, flags);
+    }
+
+    // you can have multiple read-only transactions on a single database
+    if (flags & TWOM_SHARED) {
+        /* if we're already in a lock, that's fine! */
+        if (db->openfile->has_datalock) {
+            *txnp = _newtxn_read(db, 0);
+        }
+        else {
+            int r = read_lock(db, txnp, NULL, flags);
+            if (r) return r;
+        }
+    }
+    else {
+        // you can't start another writable transaction if the file is
+        // already locked for writing!
+        if (db->openfile->has_datalock == 2) return TWOM_LOCKED;
+
+        // if it's already read-locked, then we're fine to release that
+        // lock, the caller will notice and refresh on next read if the
+        // file has changed or extended; and it's fine to read from a
+        // exclusively locked file.
+        if (db->openfile->has_datalock == 1) unlock(db, db->openfile);
+
+        int r = write_lock(db, txnp, NULL, flags);
+        if (r) return r;
+    }
+
+    if (flags & TWOM_MVCC)
+        (*txnp)->mvcc = 1;
+    if (flags & TWOM_NOSYNC)
+        (*txnp)->nosync = 1;
+    if (flags & TWOM_NOYIELD)
+        (*txnp)->noyield = 1;
+
+    return 0;
+}
+
+// all database activity happens through transactions, either explicitly
+// or via one implicitly created for a single call
+int twom_db_begin_txn(struct twom_db *db, int flags, struct twom_txn **txnp)
+{
+    if (!db->threads) return begin_txn(db, flags, txnp);
+
+    int r;
+    if (*txnp || (flags & TWOM_SHARED)) {
+        int counted = threads_enter(db);
+        threads_lock(db);
+        r = begin_txn(db, flags, txnp);
+        threads_unlock(db);
+        threads_leave(db, counted);
+        return r;
+    }
+
+    // a write transaction keeps the other threads out until it's done
+    r = threads_write_begin(db, flags);
+    if (r) return r;
+    r = begin_txn(db, flags, txnp);
+    if (r) threads_write_end(db);
+    return r;
+}
+
+// finish a transaction with abort_locked or commit_locked
+static int end_txn(struct twom_txn **txnp, int (*fn)(struct twom_txn **))
+{
+    if (!txnp || !*txnp) return 0;
+    struct twom_db *db = (*txnp)->db;
+
+    if (!db->threads) {
+        int r = fn(txnp);
+        *txnp = 0;
+        if (!db->write_txn) unlock(db, NULL);
+        return r;
+    }
+
+    int writer = !(*txnp)->readonly;
+    int counted = threads_enter(db);
+    threads_lock(db);
+    int r = fn(txnp);
+    *txnp = 0;
+    threads_unlock(db);
+    if (!db->write_txn) {
+        if (writer) unlock(db, NULL);
+        else threads_release(db, 0);
+    }
+    threads_leave(db, counted);
+    if (writer) threads_write_end(db);
+    return r;
+}
+
+int twom_txn_abort(struct twom_txn **txnp)
+{
+    return end_txn(txnp, abort_locked);
+}
+
+int twom_txn_commit(struct twom_txn **txnp)
+{
+    return end_txn(txnp, commit_locked);
+}
+
+// find the version of the record at loc which is visible to this transaction,
+// returns TWOM_DONE if that version is a delete
+static int fetch_here(struct twom_txn *txn, struct tm_loc *loc, const char **ptrp)
+{
+    // if there's no match, this key never existed
+    if (!loc->offset) return TWOM_NOTFOUND;
+
+    // if we're in an MVCC read, might need to find an ancestor
+
+    size_t offset = loc->deleted_offset ? loc->deleted_offset : loc->offset;
+    const char *ptr = safeptr(loc, offset);
+    if (!ptr) return TWOM_IOERROR;
+    while (offset >= txn->end) {
+        offset = ANCESTOR(ptr);
+        if (!offset) return TWOM_NOTFOUND;
+        ptr = safeptr(loc, offset);
+        if (!ptr) return TWOM_IOERROR;
+    }
+
+    /* active ancestor is a delete */
+    if (TYPE(ptr) == DELETE) return TWOM_DONE;
+
+    int r = check_tailcsum_cached(txn, loc->file, ptr, offset);
+    if (r) return r;
+
+    *ptrp = ptr;
+    return 0;
+}
+
+// this API is a bit weird, but allows us to return the actual
+// key if we were a FETCHNEXT.
+static int txn_fetch(struct twom_txn *txn,
+                     const char *key, size_t keylen,
+                     const char **foundkey, size_t *foundkeylen,
+                     const char **data, size_t *datalen,
+                     int flags)
+{
+    int r = 0;
+
+    if (datalen) assert(data);
+
+    if (data) *data = NULL;
+    if (datalen) *datalen = 0;
+
+    r = txn_lock(txn);
+    if (r) return r;
+
+    // not in the key filter, so there's no need to search
+    if (!(flags & TWOM_FETCHNEXT) && !bloom_maybe(txn, key, keylen)) {
+        txn->db->stats.bloom_negatives++;
+        return TWOM_NOTFOUND;
+    }
+
+    struct tm_loc *loc = TXNLOC(txn);
+
+    r = find_loc(txn, loc, key, keylen);
+    if (r) return r;
+
+    if (flags & TWOM_FETCHNEXT) {
+again:
+        r = advance_loc(txn, loc);
+        if (r == TWOM_DONE) return TWOM_NOTFOUND;
+        if (r) return r;
+    }
+
+    const char *ptr = NULL;
+    r = fetch_here(txn, loc, &ptr);
+    if (r == TWOM_DONE) {
+        if (flags & TWOM_FETCHNEXT) goto again;
+        return TWOM_NOTFOUND;
+    }
+    if (r) return r;
+
+    r = record_value(txn, loc->file, ptr, data, datalen);
+    if (r) return r;
+    if (foundkey) *foundkey = KEYPTR(ptr);
+    if (foundkeylen) *foundkeylen = KEYLEN(ptr);
+
+    return 0;
+}
+
+int twom_txn_fetch(struct twom_txn *txn,
+                   const char *key, size_t keylen,
+                   const char **foundkey, size_t *foundkeylen,
+                   const char **data, size_t *datalen,
+                   int flags)
+{
+    int counted = threads_enter(txn->db);
+    int r = txn_fetch(txn, key, keylen, foundkey, foundkeylen, data, datalen, flags);
+    threads_leave(txn->db, counted);
+    return r;
+}
+
+// stable merge sort of the key indexes in idx[lo, hi) using the database comparator
+static void sort_keys(twom_compar *compar, const char * const *keys, const size_t *keylens,
+                      size_t *idx, size_t *tmp, size_t lo, size_t hi)
+{
+    if (hi - lo < 2) return;
+    size_t mid = lo + (hi - lo) / 2;
+    sort_keys(compar, keys, keylens, idx, tmp, lo, mid);
+    sort_keys(compar, keys, keylens, idx, tmp, mid, hi);
+
+    size_t a = lo, b = mid, n = lo;
+    while (a < mid && b < hi) {
+        if (COMPAR(compar, keys[idx[b]], keylens[idx[b]], keys[idx[a]], keylens[idx[a]]) < 0)
+            tmp[n++] = idx[b++];
+        else
+            tmp[n++] = idx[a++];
+    }
+    while (a < mid) tmp[n++] = idx[a++];
+    while (b < hi) tmp[n++] = idx[b++];
+    memcpy(idx + lo, tmp + lo, (hi - lo) * sizeof(size_t));
+}
+
+// fetch a batch of keys in a single pass through the skiplist.  The callback
+// is made for every key which exists, in sorted order.
+static int txn_fetch_many(struct twom_txn *txn, size_t nkeys,
+                          const char * const *keys, const size_t *keylens,
+                          twom_cb *cb, void *rock, int flags)
+{
+    struct tm_loc *loc = TXNLOC(txn);
+    size_t *idx = NULL;
+    int r = 0, cb_r = 0;
+
+    assert(cb);
+    if (!nkeys) return 0;
+    assert(keys && keylens);
+
+    r = txn_lock(txn);
+    if (r) return r;
+
+    if (!(flags & TWOM_SORTEDKEYS)) {
+        idx = twom_zmalloc(2 * nkeys * sizeof(size_t));
+        size_t i;
+        for (i = 0; i < nkeys; i++) idx[i] = i;
+        sort_keys(txn->file->compar, keys, keylens, idx, idx + nkeys, 0, nkeys);
+    }
+
+    size_t i;
+    for (i = 0; i < nkeys; i++) {
+        size_t n = idx ? idx[i] : i;
+        r = find_loc(txn, loc, keys[n], keylens[n]);
+        if (r) break;
+
+        const char *ptr = NULL;
+        r = fetch_here(txn, loc, &ptr);
+        if (r == TWOM_DONE || r == TWOM_NOTFOUND) {
+            r = 0;
+            continue;
+        }
+        if (r) break;
+
+        const char *val;
+        size_t vallen;
+        r = record_value(txn, loc->file, ptr, &val, &vallen);
+        if (r) break;
+        cb_r = cb(rock, KEYPTR(ptr), KEYLEN(ptr), val, vallen);
+        if (cb_r) break;
+    }
+
+    free(idx);
+    return r ? r : cb_r;
+}
+
+int twom_txn_fetch_many(struct twom_txn *txn, size_t nkeys,
+                        const char * const *keys, const size_t *keylens,
+                        twom_cb *cb, void *rock, int flags)
+{
+    int counted = threads_enter(txn->db);
+    int r = txn_fetch_many(txn, nkeys, keys, keylens, cb, rock, flags);
+    threads_leave(txn->db, counted);
+    return r;
+}
+
+int twom_db_begin_cursor(struct twom_db *db,
+                         const char *prefix, size_t prefixlen,
+                         struct twom_cursor **curp, int flags)
+{
+    struct twom_txn *txn = NULL;
+    int r = twom_db_begin_txn(db, flags, &txn);
+    if (r) return r;
+    r = twom_txn_begin_cursor(txn, prefix, prefixlen, curp, flags);
+    if (r) {
+        int r2 = twom_txn_abort(&txn);
+        return r2 ? r2 : r;
+    }
+    return 0;
+}
+
+/* has the cursor reached the end it was given?  The key is past it going forwards,
+ * or before it for a TWOM_REVERSE cursor */
+static int cursor_past_end(struct twom_cursor *cur, const char *key, size_t keylen)
+{
+    if (!cur->endkey) return 0;
+    int cmp = COMPAR(cur->txn->file->compar, key, keylen, cur->endkey, cur->endkeylen);
+    if (cur->reverse) cmp = -cmp;
+    return cmp > 0 || (!cmp && !cur->endinclusive);
+}
+
+/* the cursor has run out: nothing further will be read, so a read transaction may as
+ * well give up its lock now rather than when the caller gets around to finishing */
+static int cursor_done(struct twom_cursor *cur)
+{
+    struct twom_txn *txn = cur->txn;
+    if (txn->readonly && !txn->noyield && !txn->db->noyield && txn->file->has_datalock) {
+        int r = txn_yield(txn, 0);
+        if (r) return r;
+    }
+    return TWOM_DONE;
+}
+
+// release the read lock every N records, and take it back when needed
+static int cursor_lock(struct twom_cursor *cur)
+{
+    struct twom_txn *txn = cur->txn;
+    int r;
+
+    if (!txn->readonly) return 0;
+
+    // release locks every N records if readonly
+    if (!txn->db->noyield && !txn->noyield && txn->counter++ > txn->db->foreach_lock_release) {
+        // unless the hints say nobody is waiting for it
+        if (shm_writer_waiting(txn->db)) {
+            r = txn_yield(txn, 1);
+            if (r) return r;
+            txn->db->stats.yields++;
+        }
+        else txn->counter = 0;
+    }
+
+    if (!txn_locked(txn)) {
+        /* usually re-lock cheaply with ONELOCK (skipping the header gate),
+         * but every FOREACH_GATE_RELOCKS re-locks take the full double-lock
+         * so a writer waiting on the gate isn't starved by this foreach */
+        int lockflags = (txn->nlocks++ % FOREACH_GATE_RELOCKS) ? TWOM_ONELOCK : 0;
+        if (!lockflags) txn->db->stats.gate_relocks++;
+        r = txn_relock(&cur->txn, lockflags);
+        if (r) return r;
+        cur->txn->counter = 0;
+    }
+
+    return 0;
+}
+
+/* the offset of the last record in the level 0 list whose key, cut to prefixlen, sorts
+ * at or before prefix - so the last key inside the prefix, or the one before where it
+ * would be.  With an empty prefix that's the last record in the file.  Deleted keys are
+ * included (it's the record the DELETE points at).  Returns 0 on error */
+static size_t locate_prefix_end(struct twom_txn *txn, struct tm_loc *loc,
+                                const char *prefix, size_t prefixlen)
+{
+    struct tm_file *file = loc->file;
+    size_t offset = DUMMY_OFFSET;
+    uint8_t level = MAXLEVEL-1;
+
+    const char *locptr = safeptr(loc, offset);
+    if (!locptr) return 0;
+    txn->db->stats.locates++;
+
+    for (;;) {
+        size_t next = level ? NEXTN(locptr, level) : advance0(locptr, loc->end);
+        if (next && next < loc->end) {
+            const char *ptr = safeptr(loc, next);
+            if (!ptr) return 0;
+            if (TYPE(ptr) == DELETE) {
+                next = ANCESTOR(ptr);
+                ptr = safeptr(loc, next);
+                if (!ptr) return 0;
+            }
+            PREFETCH(loc, level ? NEXTN(ptr, level) : 0);
+            size_t keylen = KEYLEN(ptr);
+            if (keylen > prefixlen) keylen = prefixlen;
+            txn->db->stats.compars++;
+            if (COMPAR(file->compar, KEYPTR(ptr), keylen, prefix, prefixlen) <= 0) {
+                locptr = ptr;
+                offset = next;
+                continue;
+            }
+        }
+        if (!level) break;
+        level--;
+    }
+
+    return offset;
+}
+
+/* step a cursor backwards: to the last record in its view which sorts before the
+ * current location, or is the current record itself if cur->inclusive is set.
+ *
+ * The skiplist only links forwards, but the location already knows the record before
+ * it (backloc[0]), so each step is a search for the current key, then a look at its
+ * predecessor with the same MVCC and delete rules as cursor_next.  Records which aren't
+ * visible cost another step, but nothing else does, so reading the last N keys under a
+ * prefix is N searches rather than a scan of the whole prefix. */
+static int cursor_back(struct twom_cursor *cur,
+                       const char **foundkey, size_t *foundkeylen,
+                       const char **data, size_t *datalen)
+{
+    struct tm_loc *loc = &cur->loc;
+    int inclusive = cur->inclusive;
+    int r;
+
+    cur->inclusive = 0;
+    if (cur->limit && cur->count >= cur->limit) return cursor_done(cur);
+
+    r = cursor_lock(cur);
+    if (r) return r;
+    struct twom_txn *txn = cur->txn;
+
+    // read the key BEFORE find_loc can switch the file.  An inexact location is in the
+    // gap after backloc[0], so that record is the first one to try
+    const char *ptr = loc->offset ? LOCPTR(loc) : LOCBACKPTR(loc, 0);
+    if (!loc->offset) inclusive = 1;
+
+    for (;;) {
+        const char *key = KEYPTR(ptr);
+        size_t keylen = KEYLEN(ptr);
+        if (!keylen) return TWOM_DONE; // that was the DUMMY, we're at the start
+
+        r = find_loc(txn, loc, key, keylen);
+        if (r) return r;
+
+        // the one before, unless it's this record and we haven't seen it yet
+        // (or it went away with a repack)
+        if (!inclusive || !loc->offset) {
+            ptr = LOCBACKPTR(loc, 0);
+            inclusive = 1;
+            continue;
+        }
+        inclusive = 0;
+
+        // have we left our prefix?
+        ptr = LOCPTR(loc);
+        if (cur->prefixlen) {
+            if (KEYLEN(ptr) < cur->prefixlen) return TWOM_DONE;
+            if (COMPAR(txn->file->compar, KEYPTR(ptr), cur->prefixlen, cur->prefix, cur->prefixlen))
+                return TWOM_DONE;
+        }
+        if (cur->reverse && cursor_past_end(cur, KEYPTR(ptr), KEYLEN(ptr))) {
+            cur->inclusive = 1;
+            return cursor_done(cur);
+        }
+
+        // find the version in our view, if there is one
+        size_t offset = loc->deleted_offset ? loc->deleted_offset : loc->offset;
+        const char *this = safeptr(loc, offset);
+        if (!this) return TWOM_IOERROR;
+        while (offset >= txn->end) {
+            offset = ANCESTOR(this);
+            if (!offset) break;
+            this = safeptr(loc, offset);
+            if (!this) return TWOM_IOERROR;
+        }
+        if (!offset || TYPE(this) == DELETE) continue;
+
+        r = check_tailcsum_cached(txn, loc->file, this, offset);
+        if (r) return r;
+
+        if (txn->readonly && cur->alwaysyield) {
+            r = txn_yield(txn, 0);
+            if (r) return r;
+            txn->counter = 0;
+        }
+
+        r = record_value(txn, loc->file, this, data, datalen);
+        if (r) return r;
+        if (foundkey) *foundkey = KEYPTR(this);
+        if (foundkeylen) *foundkeylen = KEYLEN(this);
+        cur->count++;
+
+        return 0;
+    }
+}
+
+// advance an existing cursor
+static int cursor_next(struct twom_cursor *cur,
+                       const char **foundkey, size_t *foundkeylen,
+                       const char **data, size_t *datalen)
+{
+    int r;
+
+    struct twom_txn *txn = cur->txn;
+    struct tm_loc *loc = &cur->loc;
+
+    if (cur->reverse) return cursor_back(cur, foundkey, foundkeylen, data, datalen);
+    cur->inclusive = 0;
+    if (cur->limit && cur->count >= cur->limit) return cursor_done(cur);
+
+ again:
+    r = cursor_lock(cur);
+    if (r) return r;
+
+    // otherwise we need to get the next key
+    // (returns TWOM_DONE at end of file)
+    r = advance_loc(txn, loc);
+    if (r) return r;
+
+    // do we need an MVCC ancestor?
+    size_t offset = loc->deleted_offset ? loc->deleted_offset : loc->offset;
+    const char *ptr = safeptr(loc, offset);
+    if (!ptr) return TWOM_IOERROR;
+    while (offset >= txn->end) {
+        offset = ANCESTOR(ptr);
+        if (!offset) goto again; // record didn't exist
+        ptr = safeptr(loc, offset);
+        if (!ptr) return TWOM_IOERROR;
+    }
+
+    // have we left our prefix?
+    if (cur->prefixlen) {
+        const char *this = ptr;
+        if (TYPE(ptr) == DELETE)
+            this = safeptr(loc, ANCESTOR(ptr));
+        size_t keylen = KEYLEN(this);
+        if (keylen < cur->prefixlen) return TWOM_DONE;
+        const char *key = KEYPTR(this);
+        if (COMPAR(txn->file->compar, key, cur->prefixlen, cur->prefix, cur->prefixlen))
+            return TWOM_DONE;
+    }
+
+    // or passed the end?  Before the tail checksum, which there's no need to pay for
+    if (cur->endkey) {
+        const char *this = ptr;
+        if (TYPE(ptr) == DELETE)
+            this = safeptr(loc, ANCESTOR(ptr));
+        if (cursor_past_end(cur, KEYPTR(this), KEYLEN(this))) {
+            // step back into the gap before it, so a new end can still find it
+            loc->deleted_offset = 0;
+            loc->offset = 0;
+            return cursor_done(cur);
+        }
+    }
+
+    // latest is a delete?  move along
+    if (TYPE(ptr) == DELETE) goto again;
+
+    // we have a returnable value!
+    if (!cur->nocsum) {
+        r = check_tailcsum_cached(txn, loc->file, ptr, offset);
+        if (r) return r;
+    }
+
+    // we have to check the tailcsum BEFORE yielding, because another
+    // process could change pointers, but we can yield now because the
+    // lengths and contents are never changed after being written, so
+    // it's safe to access them unlocked.
+    if (txn->readonly && cur->alwaysyield) {
+        r = txn_yield(txn, 0);
+        if (r) return r;
+        txn->counter = 0;
+    }
+
+    r = record_value(txn, loc->file, ptr, data, datalen);
+    if (r) return r;
+    if (foundkey) *foundkey = KEYPTR(ptr);
+    if (foundkeylen) *foundkeylen = KEYLEN(ptr);
+    cur->count++;
+
+    return 0;
+}
+
+int twom_cursor_next(struct twom_cursor *cur,
+                     const char **foundkey, size_t *foundkeylen,
+                     const char **data, size_t *datalen)
+{
+    int counted = threads_enter(cur->txn->db);
+    int r = cursor_next(cur, foundkey, foundkeylen, data, datalen);
+    threads_leave(cur->txn->db, counted);
+    return r;
+}
+
+// step an existing cursor the other way: backwards, or forwards for a TWOM_REVERSE cursor
+static int cursor_prev(struct twom_cursor *cur,
+                       const char **foundkey, size_t *foundkeylen,
+                       const char **data, size_t *datalen)
+{
+    if (!cur->reverse) return cursor_back(cur, foundkey, foundkeylen, data, datalen);
+
+    cur->reverse = 0;
+    int r = cursor_next(cur, foundkey, foundkeylen, data, datalen);
+    cur->reverse = 1;
+    return r;
+}
+
+int twom_cursor_prev(struct twom_cursor *cur,
+                     const char **foundkey, size_t *foundkeylen,
+                     const char **data, size_t *datalen)
+{
+    int counted = threads_enter(cur->txn->db);
+    int r = cursor_prev(cur, foundkey, foundkeylen, data, datalen);
+    threads_leave(cur->txn->db, counted);
+    return r;
+}
+
+// stop the cursor at a key (NULL for no end key) and/or after a number of records (0 for
+// no limit), in the direction it's going.  TWOM_INCLUSIVE includes the end key itself
+int twom_cursor_set_end(struct twom_cursor *cur,
+                        const char *end, size_t endlen,
+                        size_t limit, int flags)
+{
+    free(cur->endkey);
+    cur->endkey = NULL;
+    cur->endkeylen = 0;
+    if (end) {
+        // an empty end key is still an end, so always allocate something
+        cur->endkey = twom_zmalloc(endlen + 1);
+        memcpy(cur->endkey, end, endlen);
+        cur->endkeylen = endlen;
+    }
+    cur->endinclusive = (flags & TWOM_INCLUSIVE) ? 1 : 0;
+    cur->limit = limit;
+    cur->count = 0;
+    return 0;
+}
+
+// note: unused so far!  But this seems a useful API to provide
+int twom_cursor_replace(struct twom_cursor *cur,
+                        const char *data, size_t datalen, int flags)
+{
+    if (cur->txn->readonly) return TWOM_READONLY;
+    if (!cur->loc.offset) return TWOM_NOTFOUND;
+    const char *ptr = LOCPTR(&cur->loc);
+    const char *key = KEYPTR(ptr);
+    size_t keylen = KEYLEN(ptr);
+
+    /* position db->loc at the key so store_here can rewire skip pointers */
+    int r = find_loc(cur->txn, &cur->txn->db->loc, key, keylen);
+    if (r) return r;
+
+    /* could be a delete or a replace */
+    if (hastail[TYPE(ptr)]) {
+        // replacing existing record
+        if (flags & TWOM_IFNOTEXIST) return TWOM_EXISTS;
+        if (!data) return store_here(cur->txn, key, keylen, NULL, 0);
+        /* unchanged?  Save the IO */
+        const char *val;
+        size_t vallen;
+        r = record_value(cur->txn, cur->loc.file, ptr, &val, &vallen);
+        if (r) return r;
+        if (!COMPAR(cur->loc.file->compar, data, datalen, val, vallen))
+            return 0;
+        return store_here(cur->txn, key, keylen, data, datalen);
     }
 
-    /* and pointers forwards */
-    prev[0] = DUMMY_OFFSET;
-    next[0] = 0;
-    for (i = 0; i < 2; i++) {
-        size_t cur = NEXT0(ptr, i);
-        /* check for broken level - pointers, and extract the best next pointer */
-        if (cur >= loc->end) {
-            // zero out bogus pointer
-            *((uint64_t *)(NEXT0PTR(ptr, i))) = 0;
-            _recsum(file, (char *)ptr);
-            changed++;
-        }
-        else if (cur > next[0]) {
-            next[0] = cur;
-        }
-    }
+    if (flags & TWOM_IFEXIST) return TWOM_NOTFOUND;
 
-    for (i = 1; i < MAXLEVEL; i++) {
-        prev[i] = DUMMY_OFFSET;
-        next[i] = NEXTN(ptr, i);
-    }
+    /* delete of already deleted is a NOOP */
+    if (data) return store_here(cur->txn, key, keylen, data, datalen);
 
-    while (next[0]) {
-        size_t deleted_offset = 0;
-        const char *nextptr = safeptr(loc, next[0]);
-        if (!nextptr) {
-            db->error("failed to read next record for recovery",
-                      "fname=<%s> prev_key=<%.*s> offset=<%08llX>",
-                      db->fname, (int)KEYLEN(ptr), KEYPTR(ptr),
-                      (LLU)next[0]);
-            return TWOM_IOERROR;
-        }
-        if (TYPE(nextptr) == DELETE) {
-            deleted_offset = next[0];
-            dirty_size += 24;
-            next[0] = ANCESTOR(nextptr);
-            if (!next[0]) return TWOM_IOERROR;
-            nextptr = safeptr(loc, next[0]);
-            if (!nextptr) return TWOM_IOERROR;
-        }
+    return 0;
+}
 
-        cmp = COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr),
-                     KEYPTR(ptr), KEYLEN(ptr));
-        if (cmp <= 0) {
-            db->error("out of order for recovery",
-                      "fname=<%s> prev_key=<%.*s> key=<%.*s> offset=<%08llX>",
-                      db->fname,
-                      (int)KEYLEN(ptr), KEYPTR(ptr),
-                      (int)KEYLEN(nextptr), KEYPTR(nextptr),
-                      (LLU)next[0]);
-            return TWOM_INTERNAL;
-        }
+int twom_cursor_abort(struct twom_cursor **curp)
+{
+    struct twom_cursor *cur = *curp;
+    if (cur->loc.file) {
+        tm_unref(cur->loc.file);
+        cur->loc.file = NULL;
+    }
+    struct twom_db *db = cur->txn->db;
+    int r = twom_txn_abort(&cur->txn);
+    tm_freecursor(db, cur);
+    *curp = NULL;
+    return r;
+}
 
-        size_t ancestor = ANCESTOR(nextptr);
-        while (ancestor) {
-            const char *aptr = safeptr(loc, ancestor);
-            if (!aptr) {
-                db->error("failed to read next record for recovery",
-                          "fname=<%s> key=<%.*s> offset=<%08llX>",
-                          db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr),
-                          (LLU)ancestor);
-                return TWOM_IOERROR;
-            }
-            if (TYPE(aptr) == DELETE) {
-                dirty_size += 24;
-                ancestor = ANCESTOR(aptr);
-                if (!ancestor) return TWOM_IOERROR;
-                aptr = safeptr(loc, ancestor);
-                if (!aptr) return TWOM_IOERROR;
-            }
-            cmp = COMPAR(file->compar, KEYPTR(aptr), KEYLEN(aptr),
-                         KEYPTR(nextptr), KEYLEN(nextptr));
-            if (cmp) {
-                db->error("twom mismatched ancestor for recovery",
-                        "fname=<%s> key=<%.*s> offset=<%08llX>"
-                        " parent_key=<%.*s> parent_offset=<%08llX)",
-                        db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr), (LLU)next[0],
-                        (int)KEYLEN(aptr), KEYPTR(aptr), (LLU)ancestor);
-                return TWOM_IOERROR;
-            }
-            dirty_size += RECLEN(aptr);
-            ancestor = ANCESTOR(aptr);
+int twom_cursor_commit(struct twom_cursor **curp)
+{
+    struct twom_cursor *cur = *curp;
+    if (cur->loc.file) {
+        tm_unref(cur->loc.file);
+        cur->loc.file = NULL;
+    }
+    struct twom_db *db = cur->txn->db;
+    int r = twom_txn_commit(&cur->txn); // will call abort itself on error
+    tm_freecursor(db, cur);
+    *curp = NULL;
+    return r;
+}
+
+// begin a transaction with a cursor (use _fini below to close it)
+static int txn_begin_cursor(struct twom_txn *txn,
+                            const char *prefix, size_t prefixlen,
+                            struct twom_cursor **curp, int flags)
+{
+    struct twom_cursor *cur = tm_newcursor(txn->db);
+    cur->txn = txn;
+    if (flags & TWOM_ALWAYSYIELD) cur->alwaysyield = 1;
+    if ((flags & TWOM_CURSOR_PREFIX) && prefix && prefixlen) {
+        if (prefixlen > cur->prefixspace) {
+            free(cur->prefix);
+            cur->prefix = malloc(prefixlen);
+            cur->prefixspace = prefixlen;
         }
+        memcpy(cur->prefix, prefix, prefixlen);
+        cur->prefixlen = prefixlen;
+    }
 
-        /* check for old offsets needing fixing */
-        uint8_t level = LEVEL(nextptr);
+    int r = txn_lock(txn);
+    if (r) goto done;
+    r = find_loc(cur->txn, &cur->loc, prefix, prefixlen);
+    if (r) goto done;
 
-        for (i = 1; i < level; i++) {
-            if (next[i] != next[0]) {
-                char *rec = file->base + prev[i];
-                *((uint64_t *)(NEXTNPTR(rec, i))) = htole64(next[0]);
-                _recsum(file, rec);
-                changed++;
+    // walking backwards, start from the last record inside the prefix (or the end of
+    // the database), or from the key itself
+    if (flags & TWOM_REVERSE) {
+        cur->reverse = 1;
+        cur->inclusive = 1;
+        if (cur->prefixlen || !prefixlen) {
+            size_t offset = locate_prefix_end(cur->txn, &cur->loc, prefix, prefixlen);
+            if (!offset) {
+                r = TWOM_IOERROR;
+                goto done;
             }
-            prev[i] = next[0];
-            next[i] = NEXTN(nextptr, i);
+            const char *ptr = cur->loc.file->base + offset;
+            r = find_loc(cur->txn, &cur->loc, KEYPTR(ptr), KEYLEN(ptr));
         }
-
-        prev[0] = next[0];
-        next[0] = 0;
-        for (i = 0; i < 2; i++) {
-            size_t cur = NEXT0(nextptr, i);
-            /* check for broken level - pointers, and extract the best next pointer */
-            if (cur >= loc->end) {
-                // zero out bogus pointer
-                *((uint64_t *)(NEXT0PTR(nextptr, i))) = 0;
-                _recsum(file, (char *)nextptr);
-                changed++;
-            }
-            else if (cur > next[0]) {
-                next[0] = cur;
-            }
+        else if (flags & TWOM_SKIPROOT) {
+            cur->inclusive = 0;
         }
-
-        if (deleted_offset) dirty_size += RECLEN(nextptr);
-        else num_records++;
-
-        ptr = nextptr;
+        goto done;
     }
 
-    /* check for remaining offsets needing zeroing */
-    for (i = 1; i < MAXLEVEL; i++) {
-        if (next[i]) {
-            char *rec = file->base + prev[i];
-            *((uint64_t *)(NEXTNPTR(rec, i))) = htole64(next[0]);
-            _recsum(file, rec);
-            changed++;
-        }
+    // unless we're skipping the first record, mark this location
+    // as inexact, so advance_loc will find the key first, which
+    // allows us to still re-seek all the way back to this record
+    // and then advance from there if the file gets changed between
+    // starting the cursor and our first read.
+    if (!(flags & TWOM_SKIPROOT)) {
+        cur->loc.deleted_offset = 0;
+        cur->loc.offset = 0;
     }
 
-    /* commit first so all other bits are committed before we undirty the header */
-    r = tm_commit(db, loc->end);
-    if (r) return r;
+ done:
+    if (r) twom_cursor_fini(&cur);
+    else *curp = cur;
 
-    /* clear the dirty flag */
-    struct tm_header *header = &file->header;
-    header->flags &= ~DIRTY;
-    header->num_records = num_records;
-    header->dirty_size = dirty_size;
-    r = commit_header(db, header);
-    if (r) return r;
+    return r;
+}
 
-    if (count) *count = changed;
+int twom_txn_begin_cursor(struct twom_txn *txn,
+                          const char *prefix, size_t prefixlen,
+                          struct twom_cursor **curp, int flags)
+{
+    int counted = threads_enter(txn->db);
+    int r = txn_begin_cursor(txn, prefix, prefixlen, curp, flags);
+    threads_leave(txn->db, counted);
+    return r;
+}
 
-    return 0;
+// useful for when you started with an external transaction that you're
+// not finished with, just clean up the cursor
+void twom_cursor_fini(struct twom_cursor **curp)
+{
+    struct twom_cursor *cur = *curp;
+    if (!cur) return;
+    if (cur->loc.file) {
+        tm_unref(cur->loc.file);
+        cur->loc.file = NULL;
+    }
+    tm_freecursor(cur->txn->db, cur);
+    *curp = NULL;
+    return;
 }
 
-// NOTE: it would be possible to add a 'recovery2' option which replayed the entire
-// database like a transaction log (like the repack does after finishing the MVCC read).
-// this would allow recovery from having lost an external COMPAR function and also from
-// having lost an external CSUM function if you blindly trust and hope that the file
-// isn't otherwise corrupted!
-static int recovery(struct twom_db *db, struct tm_file *file)
+/* foreach allows for subsidiary operations in 'cb',
+ * if there's a transaction then cb must use it.
+ * If cb returns a non-zero result, then it gets
+ * returned to the caller.  NOTE the values -128 to +1
+ * are reserved.  This is a sucky interface really,
+ * there should be another way to return errors.
+ *
+ * If you really need to return anything more complex, you
+ * can store the return value inside 'rock' instead.
+*/
+static int txn_foreach(struct twom_txn *txn,
+                       const char *prefix, size_t prefixlen,
+                       twom_cb *goodp, twom_cb *cb, void *rock,
+                       int flags)
 {
-    int count = 0;
-    int r;
+    int r = 0, cb_r = 0;
+    const char *key = NULL;
+    size_t keylen = 0;
+    const char *data = NULL;
+    size_t datalen = 0;
+    struct twom_cursor *cur = NULL;
 
-    /* no need to run recovery if we're consistent */
-    if (db_is_clean(db, file))
-        return 0;
+    assert(cb);
+    if (prefixlen) assert(prefix);
 
-    // recovery is run before allocating transactions, but we need a 'loc' for
-    // all the safeptr logic, so create a synthetic one with the correct
-    // offsets.
-    struct tm_loc *loc = (struct tm_loc *)twom_zmalloc(sizeof(struct tm_loc));
-    loc->file = file;
-    loc->end = loc->file->header.current_size;
-    loc->file->refcount++;
+    r = txn_begin_cursor(txn, prefix, prefixlen, &cur, flags | TWOM_CURSOR_PREFIX);
+    if (r) goto done;
 
-    r = recovery1(db, loc, &count);
-    if (r) {
-        db->error("recovery1 failed",
-                  "filename=<%s>",
-                  db->fname);
+    // reading the whole database in order reads the repacked part of the file
+    // from start to end, so ask for more readahead there while we do
+    struct tm_file *seqfile = NULL;
+    if (!prefixlen && !(flags & TWOM_REVERSE) && cur->loc.file
+        && txn->db->advice != TWOM_ADVICE_SEQUENTIAL
+        && cur->loc.file->header.repack_size >= SEQUENTIAL_MIN) {
+        seqfile = cur->loc.file;
+        tm_ref(seqfile);
+        tm_advise(seqfile, seqfile->header.repack_size, TWOM_ADVICE_SEQUENTIAL);
     }
 
-    loc->file->refcount--;
-    free(loc);
+    while ((r = cursor_next(cur, &key, &keylen, &data, &datalen)) == 0) {
+        if ((!goodp || goodp(rock, key, keylen, data, datalen))) {
+            /* make callback */
+            cb_r = cb(rock, key, keylen, data, datalen);
+            if (cb_r) break;
+        }
+    }
+
+    // safely finished
+    if (r == TWOM_DONE) r = 0;
+
+    if (seqfile) {
+        tm_advise(seqfile, seqfile->header.repack_size, txn->db->advice);
+        tm_unref(seqfile);
+    }
+
+ done:
+    twom_cursor_fini(&cur);
 
+    return r ? r : cb_r;
+}
+
+int twom_txn_foreach(struct twom_txn *txn,
+                     const char *prefix, size_t prefixlen,
+                     twom_cb *goodp, twom_cb *cb, void *rock,
+                     int flags)
+{
+    int counted = threads_enter(txn->db);
+    int r = txn_foreach(txn, prefix, prefixlen, goodp, cb, rock, flags);
+    threads_leave(txn->db, counted);
     return r;
 }
 
-/*********************** FILE LOCKING ********************/
-
-static struct twom_txn *_newtxn_write(struct twom_db *db)
+/* foreach over a range rather than a prefix: from start (or the start of the database
+ * if NULL) until end (or the end if NULL) and/or limit records (0: no limit).  With
+ * TWOM_REVERSE the range runs backwards, so start is the upper bound */
+static int txn_foreach_range(struct twom_txn *txn,
+                             const char *start, size_t startlen,
+                             const char *end, size_t endlen, size_t limit,
+                             twom_cb *goodp, twom_cb *cb, void *rock,
+                             int flags)
 {
-    assert(!db->write_txn);
-    assert(db->openfile);
-    assert(db->openfile->has_datalock == 2);
+    int r = 0, cb_r = 0;
+    const char *key = NULL;
+    size_t keylen = 0;
+    const char *data = NULL;
+    size_t datalen = 0;
+    struct twom_cursor *cur = NULL;
 
-    /* create the transaction */
-    struct twom_txn *txn = (struct twom_txn *)twom_zmalloc(sizeof(struct twom_txn));
-    txn->db = db;
-    txn->file = db->openfile;
-    txn->file->refcount++;
-    assert(txn->file->committed_size == txn->file->written_size);
-    txn->end = txn->file->committed_size;
-    db->write_txn = txn;
+    assert(cb);
+    if (startlen) assert(start);
 
-    return txn;
-}
+    r = txn_begin_cursor(txn, start, startlen, &cur, flags & ~TWOM_CURSOR_PREFIX);
+    if (r) goto done;
+    r = twom_cursor_set_end(cur, end, endlen, limit, flags);
+    if (r) goto done;
 
-static struct twom_txn *_newtxn_read(struct twom_db *db)
-{
-    // it's OK to have a write transaction as well, we'll just use the same file
-    assert(db->openfile);
-    assert(db->openfile->has_datalock);
+    while ((r = cursor_next(cur, &key, &keylen, &data, &datalen)) == 0) {
+        if ((!goodp || goodp(rock, key, keylen, data, datalen))) {
+            /* make callback */
+            cb_r = cb(rock, key, keylen, data, datalen);
+            if (cb_r) break;
+        }
+    }
 
-    /* create the transaction */
-    struct twom_txn *txn = (struct twom_txn *)twom_zmalloc(sizeof(struct twom_txn));
-    txn->db = db;
-    txn->file = db->openfile;
-    txn->file->refcount++;
-    assert(txn->file->committed_size == txn->file->written_size);
-    txn->end = txn->file->committed_size;
-    txn->readonly = 1;
-    txn->next = db->read_txn;
-    db->read_txn = txn;
+    // safely finished
+    if (r == TWOM_DONE) r = 0;
 
-    return txn;
+ done:
+    twom_cursor_fini(&cur);
+
+    return r ? r : cb_r;
 }
 
-static int unlock(struct twom_db *db, struct tm_file *file)
+int twom_txn_foreach_range(struct twom_txn *txn,
+                           const char *start, size_t startlen,
+                           const char *end, size_t endlen, size_t limit,
+                           twom_cb *goodp, twom_cb *cb, void *rock,
+                           int flags)
 {
-    if (!file) file = db->openfile;
-    if (!file->has_headlock && !file->has_datalock) return 0;
-    if (file == db->openfile) assert(!db->write_txn);
+    int counted = threads_enter(txn->db);
+    int r = txn_foreach_range(txn, start, startlen, end, endlen, limit, goodp, cb, rock, flags);
+    threads_leave(txn->db, counted);
+    return r;
+}
 
-    struct flock fl;
-    fl.l_type= F_UNLCK;
-    fl.l_whence = SEEK_SET;
+/* estimate how many records are in [start, end), and how many bytes of key and value
+ * they hold, without reading them all.  A record has a pointer at level L with
+ * probability 2^-L (see randlvl), so from the top down, count the records in the
+ * range at each level until there are ESTIMATE_SAMPLE of them, and scale up by 2^L.
+ * That costs about as much as a locate, plus ESTIMATE_SAMPLE records at each of
+ * a couple of levels.  At the upper levels deleted keys which haven't been repacked
+ * away are counted too, and the view is the whole file rather than the MVCC one.
+ *
+ * With TWOM_EXACT, walk every record in the transaction's view instead, which is
+ * exact but not cheap (the tail checksums are skipped, since the values aren't read) */
+static int txn_estimate_range(struct twom_txn *txn,
+                              const char *start, size_t startlen,
+                              const char *end, size_t endlen,
+                              size_t *nrecordsp, size_t *nbytesp,
+                              int flags)
+{
+    size_t nrecords = 0;
+    size_t nbytes = 0;
+    int r;
 
-    fl.l_start = 0;
-    fl.l_len = HEADER_MAGIC_SIZE;
-    for (;file->has_headlock;) {
-        if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
-            if (errno == EINTR) continue;
-            return -1;
+    if (startlen) assert(start);
+    if (endlen) assert(end);
+
+    if (flags & TWOM_EXACT) {
+        struct twom_cursor *cur = NULL;
+        size_t keylen, vallen;
+        r = txn_begin_cursor(txn, start, startlen, &cur, 0);
+        if (r) return r;
+        cur->nocsum = 1;
+        r = twom_cursor_set_end(cur, end, endlen, 0, 0);
+        while (!r && !(r = cursor_next(cur, NULL, &keylen, NULL, &vallen))) {
+            nrecords++;
+            nbytes += keylen + vallen;
         }
-        file->has_headlock = 0;
+        twom_cursor_fini(&cur);
+        if (r != TWOM_DONE) return r;
+        goto done;
     }
 
-    fl.l_start = DUMMY_OFFSET;
-    fl.l_len = DUMMY_SIZE;
-    for (;file->has_datalock;) {
-        if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
-            if (errno == EINTR) continue;
-            return -1;
+    r = txn_lock(txn);
+    if (r) return r;
+
+    // backloc[] is the last record before start at every level
+    struct tm_loc loc;
+    memset(&loc, 0, sizeof(loc));
+    r = find_loc(txn, &loc, start, startlen);
+    if (r) goto out;
+
+    struct tm_file *file = loc.file;
+    uint8_t level = MAXLEVEL;
+    while (level--) {
+        const char *ptr = safeptr(&loc, loc.backloc[level]);
+        if (!ptr) {
+            r = TWOM_IOERROR;
+            goto out;
+        }
+        size_t count = 0;
+        size_t bytes = 0;
+        for (;;) {
+            size_t next = level ? NEXTN(ptr, level) : advance0(ptr, loc.end);
+            if (!next || next >= loc.end) break;
+            ptr = safeptr(&loc, next);
+            if (!ptr) {
+                r = TWOM_IOERROR;
+                goto out;
+            }
+            // only level 0 can see a delete, and carries on through the old record
+            int deleted = 0;
+            if (TYPE(ptr) == DELETE) {
+                deleted = 1;
+                ptr = safeptr(&loc, ANCESTOR(ptr));
+                if (!ptr) {
+                    r = TWOM_IOERROR;
+                    goto out;
+                }
+            }
+            if (end) {
+                txn->db->stats.compars++;
+                if (COMPAR(file->compar, KEYPTR(ptr), KEYLEN(ptr), end, endlen) >= 0) break;
+            }
+            if (deleted) continue;
+            count++;
+            bytes += KEYLEN(ptr) + record_vallen(ptr);
+        }
+        if (count >= ESTIMATE_SAMPLE || !level) {
+            nrecords = count << level;
+            nbytes = bytes << level;
+            break;
         }
-        file->has_datalock = 0;
     }
 
+ out:
+    if (loc.file) tm_unref(loc.file);
+    if (r) return r;
+
+ done:
+    if (nrecordsp) *nrecordsp = nrecords;
+    if (nbytesp) *nbytesp = nbytes;
     return 0;
 }
 
-static int write_lock(struct twom_db *db, struct twom_txn **txnp,
-                      struct tm_file *forcefile, int flags)
+int twom_txn_estimate_range(struct twom_txn *txn,
+                            const char *start, size_t startlen,
+                            const char *end, size_t endlen,
+                            size_t *nrecordsp, size_t *nbytesp,
+                            int flags)
 {
-    if (db->readonly) return TWOM_LOCKED;
-    if (txnp) assert(!*txnp);
+    int counted = threads_enter(txn->db);
+    int r = txn_estimate_range(txn, start, startlen, end, endlen, nrecordsp, nbytesp, flags);
+    threads_leave(txn->db, counted);
+    return r;
+}
 
-    struct stat sbuf, sbuffile;
-    struct flock fl;
-    int r = 0;
-    int cmd = (flags & TWOM_NONBLOCKING) ? F_SETLK : F_SETLKW;
-    int take_headlock = (flags & TWOM_ONELOCK) ? 0 : 1;
-    struct tm_file *file = forcefile ? forcefile : db->openfile;
+// reading the head of the first record faulted in its page already, so a run of
+// records only needs asking for if it goes on past that, and isn't inside the
+// run from the repacked part of the file which was asked for already
+static void prefetch_run(struct tm_file *file, size_t lo, size_t hi,
+                         size_t donelo, size_t donehi)
+{
+    if (hi - lo <= tm_pagesize()) return;
+    if (lo >= donelo && hi <= donehi) return;
+    tm_willneed(file, lo, hi - lo);
+}
 
-    if (file->has_headlock || file->has_datalock) return TWOM_INTERNAL;
+/* start reading in the records under a prefix (everything, if it's empty) before a
+ * scan needs them.  Up to the last repack the file is in key order, so if the prefix
+ * starts and ends there, all of it in that part of the file is one run, from the first
+ * record to the one locate_prefix_end finds, and gets a single WILLNEED up front.
+ * Then the level 0 list is walked through the prefix, which finds the records
+ * written since (reading just their heads and keys), and asks for the rest of each run of
+ * them, and for their blob values */
+static int txn_prefetch(struct twom_txn *txn, const char *prefix, size_t prefixlen)
+{
+    struct twom_db *db = txn->db;
+    int r;
 
-    for (;;) {
-        // lock the head section
-        for (;take_headlock && !file->has_headlock;) {
-            fl.l_type = F_WRLCK;
-            fl.l_whence = SEEK_SET;
-            fl.l_start = 0;
-            fl.l_len = HEADER_MAGIC_SIZE;
-            if (fcntl(file->fd, cmd, &fl) < 0) {
-                if (errno == EINTR) continue;
-                if (errno == EAGAIN && cmd == F_SETLK)
-                    return TWOM_LOCKED;
-                db->error("write_lock headlock fcntl failed",
-                        "filename=<%s>", db->fname);
-                return TWOM_IOERROR;
-            }
-            file->has_headlock = 2;
-        }
+    if (prefixlen) assert(prefix);
 
-        // lock the data section
-        for (;!file->has_datalock;) {
-            fl.l_type = F_WRLCK;
-            fl.l_whence = SEEK_SET;
-            fl.l_start = DUMMY_OFFSET;
-            fl.l_len = DUMMY_SIZE;
-            if (fcntl(file->fd, cmd, &fl) < 0) {
-                if (errno == EAGAIN && cmd == F_SETLK) {
-                    r = TWOM_LOCKED;
-                    goto done;
-                }
-                if (errno == EINTR) continue;
-                db->error("write_lock datalock fcntl failed",
-                        "filename=<%s>", db->fname);
-                r = TWOM_IOERROR;
-                goto done;
-            }
-            file->has_datalock = 2;
+    r = txn_lock(txn);
+    if (r) return r;
+
+    // backloc[0] is the last record before the prefix
+    struct tm_loc loc;
+    memset(&loc, 0, sizeof(loc));
+    r = find_loc(txn, &loc, prefix, prefixlen);
+    if (r) goto out;
+
+    struct tm_file *file = loc.file;
+    const char *ptr = safeptr(&loc, loc.backloc[0]);
+    size_t last = locate_prefix_end(txn, &loc, prefix, prefixlen);
+    if (!ptr || !last) {
+        r = TWOM_IOERROR;
+        goto out;
+    }
+    // nothing in the prefix
+    if (last == loc.backloc[0]) goto out;
+
+    size_t offset = advance0(ptr, loc.end);
+    size_t sorted = file->header.repack_size;
+    size_t runlo = 0, runhi = 0;
+    if (offset < sorted && last < sorted) {
+        const char *lastptr = safeptr(&loc, last);
+        if (lastptr && last > offset) {
+            runlo = offset;
+            runhi = last + RECLEN(lastptr);
+            tm_willneed(file, runlo, runhi - runlo);
         }
+    }
 
-        // release the head section (so readers don't starve)
-        for (;file->has_headlock;) {
-            fl.l_type= F_UNLCK;
-            fl.l_start = 0;
-            fl.l_whence = SEEK_SET;
-            fl.l_len = HEADER_MAGIC_SIZE;
-            if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
-                if (errno == EINTR) continue;
-                db->error("write_lock headunlock fcntl failed",
-                        "filename=<%s>", db->fname);
+    size_t pagesize = tm_pagesize();
+    size_t lo = 0, hi = 0;
+    while (offset && offset < loc.end) {
+        ptr = safeptr(&loc, offset);
+        if (!ptr) {
+            r = TWOM_IOERROR;
+            goto out;
+        }
+        size_t len = RECLEN(ptr);
+        const char *keyptr = ptr;
+        if (TYPE(ptr) == DELETE) {
+            keyptr = safeptr(&loc, ANCESTOR(ptr));
+            if (!keyptr) {
                 r = TWOM_IOERROR;
-                goto done;
+                goto out;
             }
-            file->has_headlock = 0;
         }
-
-        if (fstat(file->fd, &sbuf) == -1) {
-            db->error("write_lock fstat failed",
-                      "filename=<%s>", db->fname);
-            r = TWOM_IOERROR;
-            goto done;
+        size_t keylen = KEYLEN(keyptr);
+        if (keylen > prefixlen) keylen = prefixlen;
+        db->stats.compars++;
+        if (COMPAR(file->compar, KEYPTR(keyptr), keylen, prefix, prefixlen) > 0) break;
+
+        if (offset < lo || offset > hi + pagesize) {
+            prefetch_run(file, lo, hi, runlo, runhi);
+            lo = offset;
+            hi = offset;
         }
-
-        if (forcefile) break;
-
-        if (stat(db->fname, &sbuffile) == -1) {
-            db->error("write_lock stat failed",
-                      "filename=<%s>", db->fname);
-            r = TWOM_IOERROR;
-            goto done;
+        if (offset + len > hi) hi = offset + len;
+
+#if defined(__linux__) || defined(__FreeBSD__)
+        if (blobrecord[TYPE(ptr)]) {
+            uint64_t boffset, blen;
+            uint32_t bcsum;
+            blob_ref(ptr, &boffset, &blen, &bcsum);
+            threads_lock(db);
+            if (!blob_open(db))
+                posix_fadvise(db->blobs.fd, boffset, blen, POSIX_FADV_WILLNEED);
+            threads_unlock(db);
         }
+#endif
 
-        if (sbuf.st_ino == sbuffile.st_ino) break;
-
-        // go straight to the data lock when retrying
-        take_headlock = 0;
+        offset = advance0(ptr, loc.end);
+    }
+    prefetch_run(file, lo, hi, runlo, runhi);
 
-        r = unlock(db, file);
-        if (r) goto done;
+ out:
+    if (loc.file) tm_unref(loc.file);
+    return r;
+}
 
-        int newfd = open(db->fname, O_RDWR, 0644);
-        if (newfd == -1) {
-            db->error("write_lock open failed",
-                      "filename=<%s>", db->fname);
-            r = TWOM_IOERROR;
-            goto done;
-        }
+int twom_db_advise(struct twom_db *db, int advice)
+{
+    if (advice < TWOM_ADVICE_NORMAL || advice > TWOM_ADVICE_WILLNEED)
+        return TWOM_BADUSAGE;
 
-        // new file, create a new mapping
-        file = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
-        file->fd = newfd;
-        file->next = db->openfile;
-        db->openfile = file;
+    threads_lock(db);
+    struct tm_file *file = db->openfile;
+    if (advice == TWOM_ADVICE_WILLNEED) {
+        // not kept: it's about what's in the file now
+        if (file) tm_advise(file, file->header.current_size, advice);
     }
+    else {
+        // kept, for every mapping from now on
+        db->advice = advice;
+        for (; file; file = file->next)
+            tm_advise(file, file->size, advice);
+    }
+    threads_unlock(db);
+    return 0;
+}
 
-    // empty file is same as nothing
-    if (!sbuf.st_size) {
-        r = TWOM_NOTFOUND;
-        goto done;
+int twom_db_prefetch(struct twom_db *db, const char *prefix, size_t prefixlen)
+{
+    // if we're inside a write txn, use that
+    struct twom_txn *txn = current_write_txn(db);
+    if (txn) {
+        int counted = threads_enter(db);
+        int r = txn_prefetch(txn, prefix, prefixlen);
+        threads_leave(db, counted);
+        return r;
     }
 
-    // any other tiny file isn't this format
-    if (sbuf.st_size < HEADER_SIZE + DUMMY_SIZE) {
-        r = TWOM_BADFORMAT;
-        goto done;
+    // otherwise a readonly transaction just for the duration and abort when done.
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) return r;
+    int counted = threads_enter(db);
+    r = txn_prefetch(txn, prefix, prefixlen);
+    threads_leave(db, counted);
+    twom_txn_abort(&txn);
+    return r;
+}
+
+int twom_txn_store(struct twom_txn *txn,
+                   const char *key, size_t keylen,
+                   const char *data, size_t datalen,
+                   int flags)
+{
+    /* no writing a readonly database */
+    if (txn->db->readonly)
+        return TWOM_READONLY;
+
+    assert(txn == txn->db->write_txn);
+    assert(key && keylen);
+
+    return skipwrite(txn, key, keylen, data, datalen, flags);
+}
+
+// append a record which sorts after every key already in the file.  This is
+// the same in-order fast path that repack uses in copy_cb: find_loc sees that
+// the new key is past the last record we wrote and just moves the backlocs up.
+int twom_txn_append_sorted(struct twom_txn *txn,
+                           const char *key, size_t keylen,
+                           const char *data, size_t datalen,
+                           int flags __attribute__((unused)))
+{
+    /* no writing a readonly database */
+    if (txn->db->readonly)
+        return TWOM_READONLY;
+
+    assert(txn == txn->db->write_txn);
+    // appending a delete makes no sense
+    if (!key || !keylen || !data) return TWOM_BADUSAGE;
+
+    struct tm_loc *loc = &txn->db->loc;
+    int r = find_loc(txn, loc, key, keylen);
+    if (r) return r;
+
+    // not strictly after everything else in the file (including deletes)
+    if (loc->offset) return TWOM_BADUSAGE;
+    if (advance0(LOCBACKPTR(loc, 0), loc->end)) return TWOM_BADUSAGE;
+
+    return store_here(txn, key, keylen, data, datalen);
+}
+
+// checksum whatever the batch left pending
+static void batch_flush(struct twom_db *db, struct tm_file *file)
+{
+    struct tm_batch *batch = db->batch;
+    int level;
+    for (level = 0; level < MAXLEVEL; level++) {
+        if (!batch->pending[level]) continue;
+        _recsum(file, file->base + batch->pending[level]);
+        batch->pending[level] = 0;
     }
+}
 
-    // if we haven't mapped enough space, do it now
-    if (file->size < (size_t)sbuf.st_size) {
-        if (file->size) munmap(file->base, file->size);
-        file->size = sbuf.st_size;
-        void *map = mmap((caddr_t)0, file->size, PROT_READ|PROT_WRITE, MAP_SHARED, file->fd, 0L);
-        if (map == MAP_FAILED) {
-            db->error("write_lock mmap failed",
-                      "filename=<%s> size=<%08llX>", db->fname, (LLU)file->size);
-            r = TWOM_IOERROR;
-            goto done;
-        }
-        file->base = map;
-    }
+// roughly how much space a record in the batch will take, with a level of two
+static size_t batch_reclen(struct twom_db *db, struct tm_file *file, size_t keylen,
+                           const char *val, size_t vallen)
+{
+    if (!val) return 24;
+    int type = PFXREPLACE;
+    if ((file->header.flags & TWOM_BLOBS) && vallen > db->blob_threshold && keylen <= 0xFFFF)
+        vallen = BLOB_REFLEN;
+    else if (keylen > 0xFFFF || vallen > 0xFFFFFFFFULL)
+        type = FATREPLACE;
+    return HLCALC(type, 2) + 8 + TLCALC(type, keylen, vallen);
+}
 
-    /* reread header */
-    r = read_header(db, file, &file->header);
-    if (r) goto done;
+// many stores in ascending key order, on a live database.  Each record goes
+// through skipwrite like twom_txn_store, but the space is reserved up front,
+// the finger search makes each find_loc start from the last, and the head
+// checksums of the records they all point back from are only rewritten once
+// the batch has moved past them
+int twom_txn_store_batch(struct twom_txn *txn, size_t nrecords,
+                         const char * const *keys, const size_t *keylens,
+                         const char * const *vals, const size_t *vallens,
+                         const int *flags, int *rets)
+{
+    struct twom_db *db = txn->db;
+    struct tm_batch batch;
+    size_t i, need = 0;
+    int r = 0;
 
-    file->committed_size = file->header.current_size;
-    file->written_size = file->committed_size;
+    /* no writing a readonly database */
+    if (db->readonly)
+        return TWOM_READONLY;
 
-    if (!db_is_clean(db, file)) {
-        r = recovery(db, file);
-        if (r) goto done;
+    assert(txn == db->write_txn);
+    if (!nrecords) return 0;
+    assert(keys && keylens && vals && vallens);
+
+    // check the whole batch before writing any of it
+    struct tm_file *file = txn->file;
+    for (i = 0; i < nrecords; i++) {
+        if (!keys[i] || !keylens[i]) return TWOM_BADUSAGE;
+        if (i && COMPAR(file->compar, keys[i-1], keylens[i-1], keys[i], keylens[i]) > 0)
+            return TWOM_BADUSAGE;
+        need += batch_reclen(db, file, keylens[i], vals[i], vallens[i]);
     }
+    r = tm_ensure(db, file->written_size + need + 24);
+    if (r) return r;
 
-    if (txnp) {
-        *txnp = _newtxn_write(db);
-        return 0;
+    memset(&batch, 0, sizeof(batch));
+    db->batch = &batch;
+    for (i = 0; i < nrecords; i++) {
+        r = skipwrite(txn, keys[i], keylens[i], vals[i], vallens[i], flags ? flags[i] : 0);
+        if (rets) rets[i] = r;
+        // a condition not met leaves the record alone, like twom_txn_store
+        if (r == TWOM_EXISTS || r == TWOM_NOTFOUND) r = 0;
+        if (r) break;
     }
+    batch_flush(db, file);
+    db->batch = NULL;
 
- done:
-    unlock(db, file);
     return r;
 }
 
-static int read_lock(struct twom_db *db, struct twom_txn **txnp,
-                     struct tm_file *forcefile, int flags)
+/* the file is already a log of every change since it was created or last
+ * repacked, in commit order, which is all a replica needs.  A position is just
+ * after a COMMIT record (or the DUMMY, at the start) in one generation of the
+ * file.  A repack writes a new file where the old offsets mean nothing, and
+ * which has no record of what was deleted meanwhile, so then the replica has
+ * to start again from the beginning with a full comparison */
+static int changes_start(struct twom_txn *txn, const struct twom_changepos *pos,
+                         size_t *offsetp)
 {
-    struct stat sbuf, sbuffile;
-    int r = 0;
-    struct flock fl;
-    struct tm_file *file = forcefile ? forcefile : db->openfile;
-    int cmd = (flags & TWOM_NONBLOCKING) ? F_SETLK : F_SETLKW;
-    int take_headlock = (flags & TWOM_ONELOCK) ? 0 : 1;
+    struct twom_db *db = txn->db;
+    struct tm_file *file = txn->file;
+    size_t start = DUMMY_OFFSET + DUMMY_SIZE;
+    char uuid[37];
+
+    *offsetp = start;
+    if (!pos->uuid[0]) return 0;
+
+    tm_uuid_unparse(file->header.uuid, uuid);
+    if (strcmp(pos->uuid, uuid)) {
+        db->error("change position is for another database",
+                  "filename=<%s> uuid=<%s> position=<%s>",
+                  db->fname, uuid, pos->uuid);
+        return TWOM_BADUSAGE;
+    }
+    if (pos->generation != file->header.generation) return TWOM_NOTFOUND;
+    if (pos->offset == start) return 0;
 
-    if (file->has_headlock || file->has_datalock) return TWOM_INTERNAL;
+    const char *ptr = NULL;
+    if (pos->offset >= start + 24 && pos->offset <= txn->end)
+        ptr = file->base + pos->offset - 24;
+    if (!ptr || TYPE(ptr) != COMMIT || check_headcsum(txn, file, ptr, pos->offset - 24)) {
+        db->error("change position isn't after a commit",
+                  "filename=<%s> offset=<%08llX>",
+                  db->fname, (LLU)pos->offset);
+        return TWOM_BADUSAGE;
+    }
+    *offsetp = pos->offset;
+    return 0;
+}
 
-    for (;;) {
-        // take the headlock
-        for (;take_headlock && !file->has_headlock;) {
-            fl.l_type = F_RDLCK;
-            fl.l_whence = SEEK_SET;
-            fl.l_start = 0;
-            fl.l_len = HEADER_MAGIC_SIZE;
-            if (fcntl(file->fd, cmd, &fl) < 0) {
-                if (errno == EINTR) continue;
-                if (errno == EAGAIN && cmd == F_SETLK)
-                    return TWOM_LOCKED;
-                db->error("read_lock fcntl failed",
-                        "filename=<%s>", db->fname);
-                return TWOM_IOERROR;
-            }
-            file->has_headlock = 1;
-        }
+// every change committed after pos, in order, up to the end of the file as it
+// was when called; pos is moved past each commit as it's finished with
+int twom_db_changes_since(struct twom_db *db, struct twom_changepos *pos,
+                          twom_cb *cb, void *rock)
+{
+    struct twom_txn *txn = NULL;
+    size_t offset = 0;
+    int r;
 
-        // lock the data section
-        for (;!file->has_datalock;) {
-            fl.l_type = F_RDLCK;
-            fl.l_whence = SEEK_SET;
-            fl.l_start = DUMMY_OFFSET;
-            fl.l_len = DUMMY_SIZE;
-            if (fcntl(file->fd, cmd, &fl) < 0) {
-                if (errno == EAGAIN && cmd == F_SETLK) {
-                    r = TWOM_LOCKED;
-                    goto done;
-                }
-                if (errno == EINTR) continue;
-                db->error("read_lock datalock fcntl failed",
-                        "filename=<%s>", db->fname);
+    assert(cb);
+    if (current_write_txn(db)) return TWOM_LOCKED;
+
+    // MVCC keeps the one file, even if a repack renames another over it
+    r = twom_db_begin_txn(db, TWOM_SHARED|TWOM_MVCC, &txn);
+    if (r) return r;
+
+    struct tm_file *file = txn->file;
+    struct tm_loc loc;
+    memset(&loc, 0, sizeof(loc));
+    loc.file = file;
+    loc.end = txn->end;
+
+    int counted = threads_enter(db);
+    r = changes_start(txn, pos, &offset);
+    threads_leave(db, counted);
+    if (r) goto done;
+    tm_uuid_unparse(file->header.uuid, pos->uuid);
+    pos->generation = file->header.generation;
+    pos->offset = offset;
+
+    while (offset < txn->end) {
+        size_t n = 0;
+        counted = threads_enter(db);
+        r = txn_lock(txn);
+        while (!r && offset < txn->end && n++ < db->foreach_lock_release) {
+            const char *ptr = safeptr(&loc, offset);
+            if (!ptr) {
+                db->error("failed to read change",
+                          "filename=<%s> offset=<%08llX>",
+                          db->fname, (LLU)offset);
                 r = TWOM_IOERROR;
-                goto done;
+                break;
             }
-            file->has_datalock = 1;
-        }
+            r = check_headcsum(txn, file, ptr, offset);
+            if (r) break;
 
-        // release the head section (so writers don't starve)
-        for (;file->has_headlock;) {
-            fl.l_type= F_UNLCK;
-            fl.l_whence = SEEK_SET;
-            fl.l_start = 0;
-            fl.l_len = HEADER_MAGIC_SIZE;
-            if (fcntl(file->fd, F_SETLKW, &fl) < 0) {
-                if (errno == EINTR) continue;
-                db->error("read_lock headunlock fcntl failed",
-                        "filename=<%s>", db->fname);
-                r = TWOM_IOERROR;
-                goto done;
+            if (TYPE(ptr) == COMMIT) {
+                pos->offset = offset + RECLEN(ptr);
             }
-            file->has_headlock = 0;
+            else if (TYPE(ptr) == DELETE) {
+                const char *aptr = safeptr(&loc, ANCESTOR(ptr));
+                if (!aptr) r = TWOM_IOERROR;
+                else r = cb(rock, KEYPTR(aptr), KEYLEN(aptr), NULL, 0);
+            }
+            else {
+                const char *val;
+                size_t vallen;
+                r = check_tailcsum_cached(txn, file, ptr, offset);
+                if (!r) r = record_value(txn, file, ptr, &val, &vallen);
+                if (!r) r = cb(rock, KEYPTR(ptr), KEYLEN(ptr), val, vallen);
+            }
+            offset += RECLEN(ptr);
         }
+        threads_leave(db, counted);
+        if (r) break;
+        twom_txn_yield(txn);
+    }
 
-        if (fstat(file->fd, &sbuf) == -1) {
-            db->error("read_lock fstat failed",
-                      "filename=<%s>", db->fname);
-            r = TWOM_IOERROR;
-            goto done;
-        }
+ done:
+    twom_txn_abort(&txn);
+    return r;
+}
 
-        // we're not interested in getting the latest file
-        if (forcefile) break;
+// the other end of twom_db_changes_since: changes in the order they were made,
+// NULL vals delete.  Like repack's replay, deleting something which isn't there
+// or storing the value it already has does nothing, so a run of changes which
+// was partly applied already can be applied again
+int twom_txn_apply_changes(struct twom_txn *txn, size_t nchanges,
+                           const char * const *keys, const size_t *keylens,
+                           const char * const *vals, const size_t *vallens)
+{
+    struct twom_db *db = txn->db;
+    size_t i, need = 0;
+    int r;
 
-        if (stat(db->fname, &sbuffile) == -1) {
-            db->error("read_lock stat failed",
-                      "filename=<%s>", db->fname);
-            r = TWOM_IOERROR;
-            goto done;
-        }
+    /* no writing a readonly database */
+    if (db->readonly)
+        return TWOM_READONLY;
 
-        // file is unchanged, we have successfully locked
-        if (sbuf.st_ino == sbuffile.st_ino) break;
+    assert(txn == db->write_txn);
+    if (!nchanges) return 0;
+    assert(keys && keylens && vals && vallens);
 
-        // go straight to the data lock when retrying
-        take_headlock = 0;
+    struct tm_file *file = txn->file;
+    for (i = 0; i < nchanges; i++) {
+        if (!keys[i] || !keylens[i]) return TWOM_BADUSAGE;
+        need += batch_reclen(db, file, keylens[i], vals[i], vallens[i]);
+    }
+    r = tm_ensure(db, file->written_size + need + 24);
+    if (r) return r;
 
-        // unlock the old file
-        r = unlock(db, file);
-        if (r) goto done;
+    for (i = 0; i < nchanges; i++) {
+        r = skipwrite(txn, keys[i], keylens[i], vals[i], vallens[i], 0);
+        if (r) return r;
+    }
 
-        int newfd = open(db->fname, db->readonly ? O_RDONLY : O_RDWR, 0644);
-        if (newfd == -1) {
-            db->error("read_lock open failed",
+    return 0;
+}
+
+const char *twom_db_fname(struct twom_db *db)
+{
+    return db->fname;
+}
+
+static int db_sync(struct twom_db *db)
+{
+    if (!db->openfile) return 0;
+    int r = tm_commit(db, db->openfile->written_size);
+    if (r) return r;
+
+    // flush everything committed by nosync transactions in one go.  Older
+    // files were copied and synced by whoever repacked them, but may still
+    // have our commits before that.
+    uint64_t seq = db->commit_seq;
+    struct tm_file *file;
+    for (file = db->openfile; file; file = file->next) {
+        if (!file->unsynced) continue;
+        if (!db->nosync && tm_msync(db, file, file->committed_size)) {
+            db->error("msync failed",
                       "filename=<%s>", db->fname);
             return TWOM_IOERROR;
         }
-
-        // new file
-        file = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
-        file->fd = newfd;
-        file->next = db->openfile;
-        db->openfile = file;
-    }
-
-    // empty file is same as nothing
-    if (!sbuf.st_size) {
-        r = TWOM_NOTFOUND;
-        goto done;
+        file->unsynced = 0;
     }
-
-    // any other tiny file isn't this format
-    if (sbuf.st_size < HEADER_SIZE + DUMMY_SIZE) {
-        r = TWOM_BADFORMAT;
-        goto done;
+    for (file = db->openfile; file; file = file->next) {
+        if (!file->bloom || !file->bloom->unsynced) continue;
+        db->stats.syncs++;
+        if (msync(file->bloom->base, file->bloom->size, MS_SYNC)) {
+            db->error("key filter sync failed",
+                      "filename=<%s>", db->fname);
+            return TWOM_IOERROR;
+        }
+        file->bloom->unsynced = 0;
     }
-
-    // if the existing map it too small, replace it
-    if (file->size < (size_t)sbuf.st_size) {
-        /* map the new space (note: we map READ|WRITE even for readonly locks,
-         * if we might lock for write later and want to reuse the mmap */
-        if (file->size) munmap(file->base, file->size);
-        int flags = db->readonly ? PROT_READ : PROT_READ|PROT_WRITE;
-        file->size = sbuf.st_size;
-        void *map = mmap((caddr_t)0, file->size, flags, MAP_SHARED, file->fd, 0L);
-        if (map == MAP_FAILED) {
-            db->error("read_lock mmap failed",
-                      "filename=<%s> size=<%08llX>", db->fname, (LLU)file->size);
-            r = TWOM_IOERROR;
-            goto done;
+    if (db->blobs.unsynced) {
+        db->stats.syncs++;
+#if defined(__APPLE__)
+        r = fsync(db->blobs.fd);
+#else
+        r = fdatasync(db->blobs.fd);
+#endif
+        if (r) {
+            db->error("blob sync failed",
+                      "filename=<%s>", db->fname);
+            return TWOM_IOERROR;
         }
-        file->base = map;
+        db->blobs.unsynced = 0;
     }
+    db->durable_seq = seq;
 
-    // reread header
-    r = read_header(db, file, &file->header);
-    if (r) goto done;
+    return 0;
+}
 
-    file->committed_size = file->header.current_size;
-    file->written_size = file->committed_size;
+// with TWOM_THREADSAFE, flushing waits for writes on other threads
+int twom_db_sync(struct twom_db *db)
+{
+    int gated = !threads_own_writer(db);
+    if (gated) {
+        int r = threads_write_begin(db, 0);
+        if (r) return r;
+    }
+    int r = db_sync(db);
+    if (gated) threads_write_end(db);
+    return r;
+}
 
-    if (txnp) {
-        if (!*txnp) *txnp = _newtxn_read(db);
-        else if (!(*txnp)->mvcc) {
-            // if we're not on this file, change file
-            if ((*txnp)->file != file) {
-                (*txnp)->file->refcount--;
-                (*txnp)->file = file;
-                (*txnp)->file->refcount++;
-            }
-            (*txnp)->end = file->written_size;
-        }
+size_t twom_db_commit_seq(struct twom_db *db)
+{
+    return db->commit_seq;
+}
 
-        return 0;
-    }
+size_t twom_db_durable_seq(struct twom_db *db)
+{
+    return db->durable_seq;
+}
 
- done:
-    unlock(db, file);
-    return r;
+void twom_db_stats(struct twom_db *db, struct twom_stats *stats)
+{
+    *stats = db->stats;
 }
 
-/***********************  OPEN AND CLOSE *************************************/
+void twom_db_reset_stats(struct twom_db *db)
+{
+    memset(&db->stats, 0, sizeof(db->stats));
+}
 
-static void errors_to_stderr(const char *msg, const char *fmt, ...)
-    __attribute__((format(printf, 2, 3)));
-static void errors_to_stderr(const char *msg, const char *fmt, ...)
+size_t twom_db_generation(struct twom_db *db)
 {
-    va_list args;
+    return db->openfile->header.generation;
+}
 
-    fprintf(stderr, "DBERROR: %s ", msg);
-    if (fmt) {
-        va_start(args, fmt);
-        vfprintf(stderr, fmt, args);
-        va_end(args);
-    }
-    if (errno)
-        fprintf(stderr, " errno=<%s>", strerror(errno));
-    fprintf(stderr, "%s", "\n");
+size_t twom_db_num_records(struct twom_db *db)
+{
+    return db->openfile->header.num_records;
+}
+
+size_t twom_db_size(struct twom_db *db)
+{
+    return db->openfile->header.current_size;
 }
 
-static void dispose_db(struct twom_db *db)
+const char *twom_db_uuid(struct twom_db *db)
 {
-    if (!db) return;
-    empty_db(db);
-    free(db->fname);
-    free(db);
+    tm_uuid_unparse(db->openfile->header.uuid, db->uuidstr);
+    return db->uuidstr;
 }
 
-static int initdb(struct twom_db *db, int flags)
+// check if the file is fully consistent (all the records are
+// in the right order, and all the skip levels link up)
+static int twom_txn_consistent(struct twom_txn *txn)
 {
-    char scratch[512]; // this is big enough, header plus dummy fits in 512
-    struct tm_header header;
-    size_t filesize = HEADER_SIZE + DUMMY_SIZE;
-    struct tm_file *file = db->openfile;
+    struct tm_loc *loc = (struct tm_loc *)twom_zmalloc(sizeof(struct tm_loc));
+    loc->file = txn->file;
+    /* check the transaction's own committed snapshot.  For a read-write
+     * transaction txn->end == written_size, so this is unchanged; for a
+     * read-only transaction it is the committed size at begin, which is
+     * exactly the region recovery would validate on a write lock. */
+    loc->end = txn->end;
+    int r = consistent1(txn, loc);
+    free(loc);
+    return r;
+}
 
-    // zero out our workspace
-    memset(scratch, 0, 512);
+// dump the content of the database to stdout in a somewhat human
+// understandable shape which gives offsets and details for
+// each record.
+static int twom_txn_dump(struct twom_txn *txn, int detail)
+{
+    char scratch[80];
+    const char *ptr;
+    size_t offset = DUMMY_OFFSET;
+    size_t i;
 
-    // prepare the header
-    tm_uuid_generate(header.uuid);
-    header.version = TWOM_VERSION;
-    header.flags = set_csum_engine(db, file, flags);
-    if (flags & TWOM_COMPAR_EXTERNAL)
-        header.flags |= TWOM_COMPAR_EXTERNAL;
-    header.generation = 1;
-    header.num_records = 0;
-    header.num_commits = 0;
-    header.dirty_size = 0;
-    header.repack_size = filesize;
-    header.current_size = filesize;
-    header.maxlevel = 0;
-    pack_header(&header, file, scratch);
+    struct tm_header *header = &txn->file->header;
+    struct twom_db *db = txn->db;
+    struct tm_loc *loc = TXNLOC(txn);
 
-    // write a blank dummy record
-    size_t headlen = HLCALC(DUMMY, MAXLEVEL);
-    char *base = scratch + DUMMY_OFFSET;
-    *((uint8_t *)(base)) = DUMMY;
-    *((uint8_t *)(base+1)) = MAXLEVEL;
-    *((uint32_t *)(base+headlen)) = htole32(file->csum(base, headlen));
+    int r = find_loc(txn, loc, NULL, 0);
+    if (r) return r;
 
-    // ensure that the data is written to the file!
-    size_t written;
-    for (written = 0; written < filesize; ) {
-        ssize_t n = write(file->fd, scratch + written, filesize - written);
-        if (n == -1) {
-            if (errno == EINTR) continue;
-            db->error("db creation failed",
-                      "filename=<%s>", db->fname);
-            return TWOM_IOERROR;
-        }
-        written += n;
-    }
+    scratch[79] = 0; // avoid overruns
 
-    return 0;
-}
+    printf("UUID: uuid=%s\nFNAME: fname=%s\n", twom_db_uuid(db), twom_db_fname(db));
+    printf("CHECKSUM ENGINE: %s\n", checksum_engine(txn->file));
+    printf("HEADER: v=%lu g=%llu fl=%08lX num=(%llu/%llu) sz=(%08llX/%08llX/%08llX) ml=%lu\n",
+          (LU)header->version,
+          (LLU)header->generation,
+          (LU)header->flags,
+          (LLU)header->num_records,
+          (LLU)header->num_commits,
+          (LLU)header->dirty_size,
+          (LLU)header->current_size,
+          (LLU)header->repack_size,
+          (LU)header->maxlevel);
 
-static int opendb(const char *fname, struct twom_open_data *setup, struct twom_db **ret, struct twom_txn **txnp)
-{
-    assert(setup);
-    int r = TWOM_IOERROR;
+    while (offset + 24 <= loc->file->size) {
+        if (!loc->file->base[offset]) {
+            // skip NULL blocks
+            offset += 8;
+            continue;
+        }
+        printf("%08llX ", (LLU)offset);
 
-    assert(fname);
-    assert(ret);
+        ptr = loc->file->base + offset;
+        uint8_t type = TYPE(ptr);
+        uint8_t level = LEVEL(ptr);
+        // sanity-check type and level before touching anything that
+        // indexes by type or computes RECLEN (which would otherwise
+        // dereference reclenfn[] out of range and crash)
+        if (type == 0 || type > MAXTYPE) {
+            printf("BAD TYPE %d AT %08llX\n", (int)type, (LLU)offset);
+            break;
+        }
+        if (level > MAXLEVEL) {
+            printf("BAD LEVEL %d AT %08llX\n", (int)level, (LLU)offset);
+            break;
+        }
+        // ensure the full head (including checksums) fits before we
+        // read any length fields used by RECLEN / KEYPTR
+        if (loc->file->size < offset + HEADLEN(ptr) + 8) {
+            printf("TRUNCATED HEAD AT %08llX\n", (LLU)offset);
+            break;
+        }
+        size_t reclen = RECLEN(ptr);
+        if (loc->file->size < offset + reclen) {
+            printf("TRUNCATED RECORD AT %08llX len=%llu\n",
+                   (LLU)offset, (LLU)reclen);
+            break;
+        }
 
-    struct twom_db *db = (struct twom_db *)twom_zmalloc(sizeof(struct twom_db));
-    db->readonly = (setup->flags & TWOM_SHARED) ? 1 : 0;
-    db->nocsum = (setup->flags & TWOM_NOCSUM) ? 1 : 0;
-    db->nosync = (setup->flags & TWOM_NOSYNC) ? 1 : 0;
-    db->noyield = (setup->flags & TWOM_NOYIELD) ? 1 : 0;
-    db->fname = strdup(fname);
-    db->foreach_lock_release = FOREACH_LOCK_RELEASE;
-    db->error = setup->error ? setup->error : errors_to_stderr;
-    db->external_csum = setup->csum;
-    db->external_compar = setup->compar;
+        if (check_headcsum(txn, loc->file, ptr, offset)) {
+            printf("ERROR [HEADCSUM %08lX %08lX] ",
+                    (long unsigned) HEADCSUM(ptr),
+                    (long unsigned) loc->file->csum(ptr, HEADLEN(ptr)));
+        }
 
-    db->openfile = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
+        if (check_tailcsum(txn, loc->file, ptr, offset)) {
+            printf("ERROR [TAILCSUM %08lX %08lX] ",
+                    (long unsigned) TAILCSUM(ptr),
+                    (long unsigned) loc->file->csum(KEYPTR(ptr), TAILLEN(ptr)));
+        }
 
-    int fd = open(db->fname, db->readonly ? O_RDONLY : O_RDWR, 0644);
-    db->openfile->fd = fd;
-    if (fd < 0) {
-        if (setup->flags & TWOM_CREATE) {
-            char *copy = strdup(fname);
-            const char *dir = dirname(copy);
-#if defined(O_DIRECTORY)
-            int dirfd = open(dir, O_RDONLY|O_DIRECTORY, 0600);
-#else
-            int dirfd = open(dir, O_RDONLY, 0600);
-#endif
-            free(copy);
-            if (dirfd < 0) {
-                if (errno == ENOENT) r = TWOM_NOTFOUND;
-                else r = TWOM_IOERROR;
-                goto done;
-            }
-            copy = strdup(fname);
-            const char *leaf = basename(copy);
-            fd = openat(dirfd, leaf, O_RDWR|O_CREAT, 0644);
-            free(copy);
-            db->openfile->fd = fd;
-            if (fd < 0) {
-                if (errno == ENOENT) r = TWOM_NOTFOUND;
-                else r = TWOM_IOERROR;
-                close(dirfd);
-                goto done;
+        if (type == COMMIT) {
+            printf("COMMIT start=%08llX\n", (LLU)NEXT0(ptr, 0));
+        }
+        else if (type == DELETE) {
+            size_t parent_offset = NEXT0(ptr, 0);
+            // the DELETE points to the record it tombstones; if that
+            // offset is out of range or points at an invalid record
+            // header we must not dereference its key pointer
+            if (parent_offset + 24 > loc->file->size) {
+                printf("DELETE BAD PARENT %08llX\n", (LLU)parent_offset);
             }
-            if (fsync(dirfd) < 0) {
-                r = TWOM_IOERROR;
-                close(dirfd);
-                goto done;
+            else {
+                const char *pptr = loc->file->base + parent_offset;
+                uint8_t ptype = TYPE(pptr);
+                if (ptype == 0 || ptype > MAXTYPE
+                    || parent_offset + HEADLEN(pptr) + 8 > loc->file->size
+                    || parent_offset + RECLEN(pptr) > loc->file->size) {
+                    printf("DELETE BAD PARENT %08llX\n", (LLU)parent_offset);
+                }
+                else {
+                    const char *key = KEYPTR(pptr);
+                    size_t len = KEYLEN(pptr);
+                    if (len > 79) len = 79;
+                    if (key && len) strncpy(scratch, key, len);
+                    scratch[len] = 0;
+                    for (i = 0; i < len; i++)
+                        if (!scratch[i]) scratch[i] = '-';
+                    printf("DELETE kl=%llu (%s)\n", (LLU)KEYLEN(pptr), scratch);
+                }
             }
-            close(dirfd);
-            r = initdb(db, setup->flags);
-            if (r) goto done;
+            printf("\t%08llX <-\n", (LLU)parent_offset);
         }
         else {
-            if (errno == ENOENT) r = TWOM_NOTFOUND;
-            goto done;
-        }
-    }
-
-    if (db->readonly || !txnp) {
-        /* grab a read lock to read the header */
-        r = read_lock(db, txnp, NULL, setup->flags);
-        if (r == TWOM_NOTFOUND && !db->readonly) {
-            r = initdb(db, setup->flags);
-            if (!r) r = read_lock(db, txnp, NULL, setup->flags);
-        }
-        if (r) goto done;
-    }
-    else {
-        /* go straight for a write lock and hold it */
-        r = write_lock(db, txnp, NULL, setup->flags);
-        if (r == TWOM_NOTFOUND) {
-            r = initdb(db, setup->flags);
-            if (!r) r = write_lock(db, txnp, NULL, setup->flags);
+            const char *key = KEYPTR(ptr);
+            size_t len = KEYLEN(ptr);
+            if (len > 79) len = 79;
+            if (key && len) strncpy(scratch, key, len);
+            scratch[len] = 0;
+            for (i = 0; i < len; i++)
+                if (!scratch[i]) scratch[i] = '-';
+            printf("%s kl=%llu dl=%llu lvl=%d (%s)\n",
+                   typestr[type],
+                   (LLU)KEYLEN(ptr), (LLU)record_vallen(ptr),
+                   LEVEL(ptr), scratch);
+            if (ancestoroffset[type]) {
+                printf("\t%08llX <-\n", (LLU)ANCESTOR(ptr));
+            }
+            if (blobrecord[type]) {
+                uint64_t boffset, blen;
+                uint32_t bcsum;
+                blob_ref(ptr, &boffset, &blen, &bcsum);
+                printf("\tblob %08llX len=%llu csum=%08X\n",
+                       (LLU)boffset, (LLU)blen, bcsum);
+            }
+            printf("\t%08llX %08llX", (LLU)NEXT0(ptr, 0), (LLU)NEXT0(ptr, 1));
+            for (i = 1; i < level; i++) {
+                if (!((i-1) % 8))
+                    printf("\n\t");
+                printf("%08llX ", (LLU)NEXTN(ptr, i));
+            }
+            printf("\n");
+            if (detail > 2) {
+                const char *val = NULL;
+                size_t len = 0;
+                if (record_value(txn, loc->file, ptr, &val, &len)) len = 0;
+                if (len > 79) len = 79;
+                if (val) strncpy(scratch, val, len);
+                scratch[len] = 0;
+                printf("\tv=(%s)\n", scratch);
+            }
         }
-        if (r) goto done;
+
+        offset += reclen;
     }
 
-    *ret = db;
+    return 0;
+}
 
- done:
-    if (r) dispose_db(db);
+/* a fetch with no lock, trusting the shm seq: if no writer has been near the
+ * file since we last had it locked, the mapping and header are still good, and
+ * if seq hasn't moved by the time we're done, nor did one start meanwhile.
+ * Committed keys and values never change, so what we return stays valid.
+ * TWOM_LOCKED means do it properly, with the lock */
+static int db_fetch_unlocked(struct twom_db *db,
+                             const char *key, size_t keylen,
+                             const char **foundkey, size_t *foundkeylen,
+                             const char **data, size_t *datalen,
+                             int flags)
+{
+    struct tm_shm *shm = db->shm;
+    struct tm_file *file = db->openfile;
+
+    // a lock we already hold costs nothing to share
+    if (!shm || db->threads || db->write_txn || file->has_datalock) return TWOM_LOCKED;
+
+    uint64_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || seq != file->shmseq) return TWOM_LOCKED;
+    if (!file->ino || __atomic_load_n(&shm->ino, __ATOMIC_RELAXED) != file->ino) return TWOM_LOCKED;
+
+    struct twom_txn *txn = _newtxn_read(db, 1);
+    txn->unlocked = 1;
+    int r = txn_fetch(txn, key, keylen, foundkey, foundkeylen, data, datalen, flags);
+    abort_locked(&txn);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq || (r && r != TWOM_NOTFOUND)) {
+        // anything we saw may have been half written, including where we got to
+        db->loc.end = 0;
+        return TWOM_LOCKED;
+    }
+    db->stats.unlocked_fetches++;
     return r;
 }
 
-static int abort_locked(struct twom_txn **txnp)
+int twom_db_fetch(struct twom_db *db,
+                  const char *key, size_t keylen,
+                  const char **foundkey, size_t *foundkeylen,
+                  const char **data, size_t *datalen,
+                  int flags)
 {
-    if (!*txnp) return 0;
-    struct twom_txn *txn = *txnp;
-    struct twom_db *db = txn->db;
-    if (txn != db->write_txn) {
-        struct twom_txn **ptr;
-        for (ptr = &db->read_txn; *ptr; ptr = &(*ptr)->next)
-            if (*ptr == txn) break;
-        assert(*ptr);
-        _remove_txn(ptr);
-        tm_cleanup(db);
-        return 0;
-    }
+    // if we're inside a write txn, use that
+    struct twom_txn *wtxn = current_write_txn(db);
+    if (wtxn)
+        return twom_txn_fetch(wtxn, key, keylen, foundkey, foundkeylen, data, datalen, flags);
 
-    // we use recovery to abort - it will undo any pointers past the end.
-    //
-    // NOTE: we don't (currently) truncate the file afterwards, so there
-    // could be junk at the end of the file until new transactions overwrite
-    // it or it gets repacked.
-    int r = recovery(db, txn->file);
-    txn->file->refcount--;
-    free(txn);
-    *txnp = NULL;
-    db->write_txn = NULL;
-    tm_cleanup(db);
+    // with TWOM_SHM, see if we can get away without a lock at all
+    int r = db_fetch_unlocked(db, key, keylen, foundkey, foundkeylen, data, datalen, flags);
+    if (r != TWOM_LOCKED) return r;
 
+    // otherwise a readonly transaction just for the duration and abort when done.
+    struct twom_txn *txn = NULL;
+    r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) return r;
+    r = twom_txn_fetch(txn, key, keylen, foundkey, foundkeylen, data, datalen, flags);
+    twom_txn_abort(&txn);
     return r;
 }
 
-static int commit_locked(struct twom_txn **txnp)
+int twom_db_foreach(struct twom_db *db,
+                    const char *prefix, size_t prefixlen,
+                    twom_cb *goodp, twom_cb *cb, void *rock,
+                    int flags)
 {
-    if (!*txnp) return 0;
-    struct twom_txn *txn = *txnp;
-    struct twom_db *db = txn->db;
-    if (txn != db->write_txn) {
-        struct twom_txn **ptr;
-        for (ptr = &db->read_txn; *ptr; ptr = &(*ptr)->next)
-            if (*ptr == txn) break;
-        assert(*ptr);
-        _remove_txn(ptr);
-        tm_cleanup(db);
-        return 0;
+    // if we're inside a write txn, use that
+    struct twom_txn *wtxn = current_write_txn(db);
+    if (wtxn)
+        return twom_txn_foreach(wtxn, prefix, prefixlen, goodp, cb, rock, flags);
+
+    // otherwise a readonly transaction just for the duration and abort when done.
+    struct twom_txn *txn = NULL;
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) return r;
+    r = twom_txn_foreach(txn, prefix, prefixlen, goodp, cb, rock, flags);
+    twom_txn_abort(&txn);
+    return r;
+}
+
+int twom_db_foreach_range(struct twom_db *db,
+                          const char *start, size_t startlen,
+                          const char *end, size_t endlen, size_t limit,
+                          twom_cb *goodp, twom_cb *cb, void *rock,
+                          int flags)
+{
+    // if we're inside a write txn, use that
+    struct twom_txn *wtxn = current_write_txn(db);
+    if (wtxn)
+        return twom_txn_foreach_range(wtxn, start, startlen, end, endlen, limit,
+                                      goodp, cb, rock, flags);
+
+    // otherwise a readonly transaction just for the duration and abort when done.
+    struct twom_txn *txn = NULL;
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) return r;
+    r = twom_txn_foreach_range(txn, start, startlen, end, endlen, limit, goodp, cb, rock, flags);
+    twom_txn_abort(&txn);
+    return r;
+}
+
+int twom_db_store(struct twom_db *db,
+                  const char *key, size_t keylen,
+                  const char *data, size_t datalen,
+                  int flags)
+{
+    // if we're inside a write txn, use that
+    struct twom_txn *wtxn = current_write_txn(db);
+    if (wtxn)
+        return twom_txn_store(wtxn, key, keylen, data, datalen, flags);
+
+    // otherwise a write transaction just for the duration, and commit or abort
+    // immediately
+    struct twom_txn *txn = NULL;
+    int r = twom_db_begin_txn(db, flags & TWOM_NOSYNC, &txn);
+    if (r) return r;
+    r = twom_txn_store(txn, key, keylen, data, datalen, flags);
+    if (r) {
+        int r2 = twom_txn_abort(&txn);
+        if (r2) r = r2;
+    }
+    else {
+        r = twom_txn_commit(&txn);
     }
+    return r;
+}
 
+int twom_db_bulkload(struct twom_db *db, size_t nrecords,
+                     const char * const *keys, const size_t *keylens,
+                     const char * const *vals, const size_t *vallens,
+                     int flags)
+{
+    // if we're inside a write txn, use that, otherwise commit or abort
+    // our own transaction at the end
+    struct twom_txn *txn = current_write_txn(db);
+    int owntxn = !txn;
+    size_t i;
     int r = 0;
 
-    assert(db);
-    assert(txn);
+    if (!nrecords) return 0;
+    assert(keys && keylens && vals && vallens);
 
-    struct tm_file *file = txn->file;
-    struct tm_header *header = &file->header;
+    if (owntxn) {
+        r = twom_db_begin_txn(db, flags & TWOM_NOSYNC, &txn);
+        if (r) return r;
+    }
 
-    /* no need to commit if we're not dirty */
-    if (!(header->flags & DIRTY))
+    // check the whole batch before appending any of it, so a bad one
+    // leaves the caller's transaction as it was
+    struct tm_file *file = txn->file;
+    for (i = 0; i < nrecords; i++) {
+        if (!keys[i] || !keylens[i] || !vals[i]) r = TWOM_BADUSAGE;
+        else if (i && COMPAR(file->compar, keys[i-1], keylens[i-1], keys[i], keylens[i]) >= 0)
+            r = TWOM_BADUSAGE;
+        if (r) goto done;
+    }
+    // and that the first (so all of them) sorts after everything in the file
+    struct tm_loc *loc = &db->loc;
+    r = find_loc(txn, loc, keys[0], keylens[0]);
+    if (r) goto done;
+    if (loc->offset || advance0(LOCBACKPTR(loc, 0), loc->end)) {
+        r = TWOM_BADUSAGE;
         goto done;
+    }
 
-    /* if we're committing we have a location */
-    struct tm_loc *loc = &db->loc;
-    assert(file == txn->file);
-    assert(file->has_datalock == 2);
+    // size the file for everything up front, rather than growing it a
+    // quarter at a time.  Levels are random, so assume the average of two.
+    size_t need = 0;
+    for (i = 0; i < nrecords; i++) {
+        int type = (keylens[i] > 0xFFFF || vallens[i] > 0xFFFFFFFFULL) ? FATADD
+                 : (file->header.flags & TWOM_KEYPREFIX) ? PFXADD : ADD;
+        need += HLCALC(type, 2) + 8 + TLCALC(type, keylens[i], vallens[i]);
+    }
+    r = tm_ensure(db, file->written_size + need + 24);
+    if (r) goto done;
 
-    size_t headlen = 16;
-    size_t reclen = 24;
+    for (i = 0; i < nrecords; i++) {
+        r = twom_txn_append_sorted(txn, keys[i], keylens[i], vals[i], vallens[i], flags);
+        if (r) goto done;
+    }
 
-    // could re-map, but it WON'T change the header
-    r = tm_ensure(db, file->written_size + reclen);
-    if (r) goto done;
+ done:
+    if (!owntxn) return r;
+    if (r) {
+        int r2 = twom_txn_abort(&txn);
+        if (r2) r = r2;
+    }
+    else {
+        r = twom_txn_commit(&txn);
+    }
+    return r;
+}
 
-    char *base = file->base + file->written_size;
-    memset(base, 0, reclen); // zero out the whole thing before we set just the bits we want
+int twom_db_dump(struct twom_db *db, int detail)
+{
+    struct twom_txn *txn = NULL;
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) return r;
+    int counted = threads_enter(db);
+    r = txn_lock(txn);
+    if (!r) r = twom_txn_dump(txn, detail);
+    threads_leave(db, counted);
+    twom_txn_abort(&txn);
+    return r;
+}
 
-    *((uint8_t *)(base)) = COMMIT;
-    *((uint64_t *)(base+8)) = htole64(header->current_size);
-    *((uint32_t *)(base+16)) = htole32(file->csum(base, headlen));
+/* Repair records whose keylen or vallen was silently truncated due to the
+ * skinny-record uint16_t/uint32_t overflow bug.
+ *
+ * Detection: for a skinny ADD/REPLACE, the byte immediately after the stored
+ * key must be NUL (store_here always writes a NUL terminator there).  If it is
+ * not, the true keylen must be stored_keylen + N*65536 for some N≥1.  We scan
+ * forward in 65536-byte steps until we find the NUL, then verify by
+ * re-computing the tail checksum with the candidate lengths.
+ *
+ * Repair: position the location (via find_loc with the truncated key) so that
+ * store_here replaces the broken record in-place in the skiplist and creates a
+ * correct FATADD/FATREPLACE record with the right 64-bit lengths.
+ *
+ * Returns TWOM_OK on success.  *nfixedp (if non-NULL) receives the count of
+ * records repaired. */
+int twom_db_repair(struct twom_db *db, size_t *nfixedp)
+{
+    struct twom_txn *txn = NULL;
+    int r = twom_db_begin_txn(db, 0, &txn);
+    if (r) return r;
 
-    file->written_size += reclen;
-    txn->end = file->written_size;
-    loc->end = file->written_size;
-    file->dirty = 1;
+    struct tm_file *file = txn->file;
 
-    /* commit ALL outstanding changes first, before
-     * rewriting the header */
-    r = tm_commit(db, file->written_size);
-    if (r) goto done;
+    /* ------------------------------------------------------------------ *
+     * Pass 1 — scan the live skiplist for broken records.
+     * ------------------------------------------------------------------ */
 
-    /* finally, update the header and commit again */
-    header->num_commits++;
-    header->current_size = file->written_size;
-    header->flags &= ~DIRTY;
-    r = commit_header(db, header);
-    if (r) goto done;
+    struct repair_item {
+        size_t keylen;   /* true keylen found via NUL scan     */
+        size_t vallen;   /* vallen (stored uint32_t, unchanged)*/
+        char  *key;      /* malloc'd copy of the full key      */
+        char  *val;      /* malloc'd copy of the value         */
+    };
 
-    file->committed_size = file->written_size;
+    size_t capacity = 16, nbroken = 0;
+    struct repair_item *broken = malloc(capacity * sizeof(*broken));
+    if (!broken) {
+        twom_txn_abort(&txn);
+        return TWOM_IOERROR;
+    }
 
- done:
-    if (r) {
-        /* error during commit; we must abort */
-        int r2 = abort_locked(txnp);
-        if (r2) {
-            db->error("commit AND abort failed",
-                      "filename=<%s>", db->fname);
+    /* initialise loc so advance_loc starts from the very first record */
+    struct tm_loc *loc = &db->loc;
+    r = find_loc(txn, loc, NULL, 0);
+    if (r) goto fail;
+
+    for (;;) {
+        r = advance_loc(txn, loc);
+        if (r == TWOM_DONE) {
+            r = 0;
+            break;
         }
-        return r;
-    }
+        if (r) goto fail;
 
-    txn->file->refcount--;
-    free(txn);
-    *txnp = NULL;
-    db->write_txn = NULL;
-    tm_cleanup(db);
+        /* deleted records don't need repair (no live tail) */
+        if (loc->deleted_offset) continue;
 
-    return 0;
-}
+        const char *ptr = safeptr(loc, loc->offset);
+        uint8_t type = TYPE(ptr);
 
-/**************** NOT YET SORTED *******************/
+        /* only skinny records can overflow — fat records already have
+         * 64-bit lengths and are correct by construction */
+        if (fatrecord[type]) continue;
 
-// play the rest of the records in a file from any point (used by repack
-// and could also be used by a recovery2 or similar to fix a file where
-// an external compar function had been lost)
-static int myreplay(struct twom_txn *txn,
-                    twom_cb *cb, void *rock)
-{
-    int r;
+        size_t stored_keylen = KLSKINNY(ptr);
+        size_t headlen = HEADLEN(ptr);
+        const char *keyptr = KEYPTR(ptr);
 
-    struct twom_db *db = txn->db;
-    struct tm_file *file = txn->file;
+        if (keyptr[stored_keylen] == '\0') continue;  /* looks fine */
 
-    while (txn->end + 24 <= file->committed_size) {
-        const char *ptr = file->base + txn->end;
-        size_t reclen = RECLEN(ptr);
-        // ensure the entire record fits!
-        if (txn->end + reclen > file->committed_size)
-            return TWOM_IOERROR;
+        /* scan forward in 65536-byte increments for the true NUL */
+        size_t real_keylen = stored_keylen + 65536;
+        size_t max_off = file->size - (loc->offset + headlen + 8 + 1);
+        while (real_keylen < max_off && keyptr[real_keylen] != '\0')
+            real_keylen += 65536;
 
-        // skip over commits, but replay all ADD, REPLACE or DELETE
-        if (TYPE(ptr) == COMMIT) {
-            // skip over
+        if (real_keylen >= max_off) {
+            db->error("repair: cannot find key terminator",
+                      "filename=<%s> offset=<%08llX> stored_keylen=<%zu>",
+                      db->fname, (LLU)loc->offset, stored_keylen);
+            continue;
         }
-        else if (TYPE(ptr) == DELETE) {
-            const char *aptr = file->base + ANCESTOR(ptr);
-            r = cb(rock, KEYPTR(aptr), KEYLEN(aptr), NULL, 0);
-            if (r) return r;
+
+        /* verify by re-computing the tail checksum with the real lengths */
+        size_t real_vallen = VALLEN(ptr);
+        size_t real_taillen = PAD8(real_keylen + real_vallen + 2);
+        if (loc->offset + headlen + 8 + real_taillen > file->size) {
+            db->error("repair: real record exceeds file size",
+                      "filename=<%s> offset=<%08llX>",
+                      db->fname, (LLU)loc->offset);
+            continue;
         }
-        else {
-            r = cb(rock, KEYPTR(ptr), KEYLEN(ptr), VALPTR(ptr), VALLEN(ptr));
-            if (r) return r;
+        uint32_t csum = file->csum(keyptr, real_taillen);
+        if (csum != TAILCSUM(ptr)) {
+            db->error("repair: NUL found but tailcsum mismatch",
+                      "filename=<%s> offset=<%08llX> real_keylen=<%zu>",
+                      db->fname, (LLU)loc->offset, real_keylen);
+            continue;
         }
-        // advance to the next record
-        txn->end += reclen;
 
-        // release every so often
-        txn->counter++;
-        if (txn->counter > db->foreach_lock_release) {
-            r = unlock(db, file);
-            if (r) return r;
-            /* as in twom_cursor_next: mostly ONELOCK, but periodically take
-             * the full double-lock so we don't starve a waiting writer */
-            int lockflags = (txn->nlocks++ % FOREACH_GATE_RELOCKS) ? TWOM_ONELOCK : 0;
-            r = read_lock(db, &txn, file, lockflags);
-            if (r) return r;
-            txn->counter = 0;
+        /* save copies — the mmap may move when store_here calls tm_ensure */
+        char *keycopy = malloc(real_keylen+1);
+        char *valcopy = malloc(real_vallen+1);
+        if (!keycopy || !valcopy) {
+            free(keycopy); free(valcopy);
+            r = TWOM_IOERROR;
+            goto fail;
         }
-    }
-
-    return 0;
-}
-
-/* helper function for all writes - wraps create and delete and the FORCE
- * logic for each */
-static int skipwrite(struct twom_txn *txn,
-                     const char *key, size_t keylen,
-                     const char *data, size_t datalen,
-                     int flags)
-{
-    struct tm_loc *loc = &txn->db->loc;
+        memcpy(keycopy, keyptr, real_keylen);
+        keycopy[real_keylen] = '\0';
+        memcpy(valcopy, keyptr + real_keylen + 1, real_vallen);
+        valcopy[real_vallen] = '\0';
 
-    int r = find_loc(txn, loc, key, keylen);
-    if (r) return r;
+        if (nbroken >= capacity) {
+            capacity *= 2;
+            struct repair_item *tmp = realloc(broken, capacity * sizeof(*broken));
+            if (!tmp) {
+                free(keycopy);
+                free(valcopy);
+                r = TWOM_IOERROR;
+                goto fail;
+            }
+            broken = tmp;
+        }
+        broken[nbroken++] = (struct repair_item){
+            real_keylen, real_vallen, keycopy, valcopy
+        };
 
-    const char *ptr = LOCPTR(loc);
-    /* could be a delete or a replace */
-    if (loc->offset && !loc->deleted_offset) {
-        // replacing existing record
-        if (flags & TWOM_IFNOTEXIST) return TWOM_EXISTS;
-        if (!data) return store_here(txn, key, keylen, NULL, 0);
-        /* unchanged?  Save the IO */
-        if (!COMPAR(loc->file->compar, data, datalen, VALPTR(ptr), VALLEN(ptr)))
-            return 0;
-        return store_here(txn, key, keylen, data, datalen);
-    }
+        // we need to be dirty
+        if (!(loc->file->header.flags & DIRTY)) {
+            loc->file->header.flags |= DIRTY;
+            r = commit_header(db, &loc->file->header);
+            if (r) goto fail;
+        }
 
-    if (flags & TWOM_IFEXIST) return TWOM_NOTFOUND;
+        // now zero out the existing record entirely from the chain, starting
+        // with the level 0 pointer.  We have to set both, because we don't know
+        // which is right!
+        char *backptr = LOCBACKPTR(loc, 0);
+        char *prevptr = backptr;
+        size_t offset0 = advance0(ptr, loc->end);
+        char *addr = backptr + ptroffset[TYPE(backptr)];
+        *((uint64_t *)(addr)) = htole64(offset0);
+        addr+= 8;
+        *((uint64_t *)(addr)) = htole64(offset0);
 
-    /* delete of already deleted is a NOOP */
-    if (data) return store_here(txn, key, keylen, data, datalen);
+        uint8_t level = LEVEL(ptr);
+        uint8_t n;
+        for (n = 1; n < level; n++) {
+            backptr = LOCBACKPTR(loc, n);
+            if (backptr != prevptr) _recsum(loc->file, prevptr);
+            prevptr = backptr;
+            SETN(backptr, n, NEXTN(loc, n));
+        }
 
-    return 0;
-}
+        _recsum(loc->file, prevptr);
 
-/* compress 'db', closing at the end.  Uses foreach to copy into a new
- * database, then rewrites over the old one */
-static int copy_cb(void *rock,
-                   const char *key, size_t keylen,
-                   const char *data, size_t datalen)
-{
-    struct twom_txn *txn = (struct twom_txn *)rock;
-    int i;
+        // we removed this record, account for it
+        loc->file->header.num_records--;
+        // you'd think so, but since this is invisible to the chain,
+        // the auditor doesn't know it's dirty
+        //loc->file->header.dirty_size += headlen + real_taillen;
 
-    /* minimal logic from find_loc and advance_loc knowing that we're
-     * always writing in order at the end of a file */
-    struct tm_loc *loc = &txn->db->loc;
-    if (loc->offset) {
-        const char *ptr = LOCPTR(loc);
-        uint8_t level = LEVEL(ptr);
-        for (i = 0; i < level; i++)
-            loc->backloc[i] = loc->offset;
-        loc->offset = 0;
+        // start again
+        r = locate(txn, loc, NULL, 0);
+        if (r) goto fail;
     }
-    return store_here(txn, key, keylen, data, datalen);
-}
 
-static int replay_cb(void *rock,
-                     const char *key, size_t keylen,
-                     const char *data, size_t datalen)
-{
-    struct twom_txn *txn = (struct twom_txn *)rock;
-    return skipwrite(txn, key, keylen, data, datalen, 0);
-}
+    /* ------------------------------------------------------------------ *
+     * Pass 2 — store the broken records
+     * ------------------------------------------------------------------ */
+    size_t nfixed = 0;
+    for (size_t i = 0; i < nbroken; i++) {
+        struct repair_item *item = &broken[i];
 
-static int tm_rename(struct twom_db *db, struct tm_file *oldfile, const char *newname)
-{
-    struct stat sbuf, sbuffile;
-    char *copyd = strdup(db->fname);
-    char *copyb = strdup(db->fname);
-    const char *dir = dirname(copyd);
-    const char *file = basename(copyb);
-    int r = 0;
-    int dirfd = -1;
+        r = twom_txn_store(txn, item->key, item->keylen, item->val, item->vallen, 0);
+        if (r) {
+            db->error("repair: twom_txn_store failed for broken record",
+                      "filename=<%s> key=<%s>",
+                      db->fname, item->key);
+            goto fail;
+        }
 
-#if defined(O_DIRECTORY)
-    dirfd = open(dir, O_RDONLY|O_DIRECTORY, 0600);
-#else
-    dirfd = open(dir, O_RDONLY, 0600);
-#endif
-    if (dirfd < 0) {
-        db->error("open directory failed",
-                  "filename=<%s> newname=<%s> directory=<%s>",
-                  db->fname, newname, dir);
-        r = TWOM_IOERROR;
-        goto done;
+        nfixed++;
     }
 
-    if (fstat(oldfile->fd, &sbuf) == -1) {
-        db->error("tm_rename fstat failed",
-                  "filename=<%s>", db->fname);
-        r = TWOM_IOERROR;
-        goto done;
+    for (size_t i = 0; i < nbroken; i++) {
+        free(broken[i].key);
+        free(broken[i].val);
     }
+    free(broken);
 
-    if (stat(db->fname, &sbuffile) == -1) {
-        db->error("tm_rename stat failed",
-                  "filename=<%s>", db->fname);
-        r = TWOM_IOERROR;
-        goto done;
-    }
+    if (nfixedp) *nfixedp = nfixed;
 
-    if (sbuf.st_ino != sbuffile.st_ino) {
-        db->error("tm_rename file has changed under us",
-                  "filename=<%s>", db->fname);
-        r = TWOM_IOERROR;
-        goto done;
+    if (nfixed == 0) {
+        twom_txn_abort(&txn);
+        return TWOM_OK;
     }
+    return twom_txn_commit(&txn);
 
-    r = renameat(AT_FDCWD, newname, dirfd, file);
-    if (r) goto done;
-
-    if (!db->nosync) {
-        if (fsync(dirfd) < 0) {
-            db->error("fsync directory failed",
-                      "filename=<%s> newname=<%s> directory=<%s>",
-                      db->fname, newname, dir);
-            // but we can't abort now, we've already renamed, so we need to
-            // carry on and update our object
-        }
+fail:
+    for (size_t i = 0; i < nbroken; i++) {
+        free(broken[i].key);
+        free(broken[i].val);
     }
-
- done:
-    if (dirfd >= 0) close(dirfd);
-    free(copyd);
-    free(copyb);
+    free(broken);
+    twom_txn_abort(&txn);
+    return r;
+}
+
+int twom_db_check_consistency(struct twom_db *db)
+{
+    struct twom_txn *txn = NULL;
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) return r;
+    int counted = threads_enter(db);
+    r = txn_lock(txn);
+    if (!r) r = twom_txn_consistent(txn);
+    threads_leave(db, counted);
+    twom_txn_abort(&txn);
     return r;
 }
 
-/* perform some basic consistency checks - key order, ancestor key match,
- * links in order at every level */
-static int consistent1(struct twom_txn *txn, struct tm_loc *loc)
+// check an MVCC snapshot of the file like twom_db_check_consistency, and
+// all the checksums, on 'jobs' threads, a slice at a time (see scrub_slice).
+// With a rate, sleep between slices to read no more than that many bytes a
+// second.  After each slice (and again when it's finished) the callback gets
+// the progress so far; if it returns non-zero, the scrub stops there.
+int twom_db_scrub(struct twom_db *db, int jobs, size_t rate,
+                  twom_scrub_cb *cb, void *rock)
 {
-    size_t next[MAXLEVEL];
-    size_t num_records = 0;
-    size_t dirty_size = 0;
-    const char *ptr;
-    int cmp;
-    int i;
+    struct twom_txn *txn = NULL;
+    struct twom_scrub_progress progress;
+    struct tm_scrub sc;
+    pthread_t *threads = NULL;
+    size_t *splits = NULL;
+    size_t nsplits = 0;
+    size_t num_records, dirty_size;
+    size_t i;
+    int r;
 
-    assert(txn->file->size >= txn->end);
+    if (jobs < 1) jobs = 1;
+    memset(&progress, 0, sizeof(progress));
+    memset(&sc, 0, sizeof(sc));
 
-    struct tm_file *file = txn->file;
-    struct twom_db *db = txn->db;
+    r = twom_db_begin_txn(db, TWOM_SHARED|TWOM_MVCC, &txn);
+    if (r) return r;
 
-    /* set up the location pointers */
-    ptr = safeptr(loc, DUMMY_OFFSET);
-    if (!ptr) {
-        txn->db->error("failed to read DUMMY for consistent",
-                  "fname=<%s>", db->fname);
-        return TWOM_IOERROR;
+    int counted = threads_enter(db);
+    r = txn_lock(txn);
+    if (r) {
+        threads_leave(db, counted);
+        twom_txn_abort(&txn);
+        return r;
     }
-    next[0] = advance0(ptr, loc->end);
-    for (i = 1; i < MAXLEVEL; i++)
-        next[i] = NEXTN(ptr, i);
 
-    while (next[0]) {
-        const char *nextptr = safeptr(loc, next[0]);
-        size_t deleted_offset = 0;
-        if (!nextptr) {
-            db->error("failed to read next record for consistent",
-                      "fname=<%s> prev_key=<%.*s> offset=<%08llX>",
-                    db->fname, (int)KEYLEN(ptr), KEYPTR(ptr), (LLU)next[0]);
-            return TWOM_IOERROR;
-        }
-        if (TYPE(nextptr) == DELETE) {
-            deleted_offset = next[0];
-            dirty_size += 24;
-            next[0] = ANCESTOR(nextptr);
-            if (!next[0]) return TWOM_IOERROR;
-            nextptr = safeptr(loc, next[0]);
-            if (!nextptr) return TWOM_IOERROR;
-        }
+    sc.txn = txn;
+    sc.loc.file = txn->file;
+    sc.loc.end = txn->end;
+    sc.now = sc.loc;
+    num_records = txn->file->header.num_records;
+    dirty_size = txn->file->header.dirty_size;
+
+    nsplits = scrub_splits(&sc.loc, (size_t)jobs * SCRUB_RANGES_PER_JOB - 1, &splits);
+    sc.nranges = nsplits + 1;
+    sc.ranges = (struct tm_scrub_range *)twom_zmalloc(sc.nranges * sizeof(struct tm_scrub_range));
+    for (i = 0; !r && i < sc.nranges; i++) {
+        sc.ranges[i].stop = i < nsplits ? splits[i] : 0;
+        r = scrub_start(&sc, &sc.ranges[i], i ? splits[i-1] : DUMMY_OFFSET);
+    }
+    free(splits);
+    threads_leave(db, counted);
+    if (r) {
+        db->error("failed to start scrub",
+                  "filename=<%s>", db->fname);
+        goto done;
+    }
 
-        cmp = COMPAR(file->compar, KEYPTR(nextptr), KEYLEN(nextptr),
-                     KEYPTR(ptr), KEYLEN(ptr));
-        if (cmp <= 0) {
-            db->error("out of order for consistent",
-                      "fname=<%s> key=<%.*s> offset=<%08llX> prev_key=<%.*s>",
-                      db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr),
-                      (LLU)next[0], (int)KEYLEN(ptr), KEYPTR(ptr));
-            return TWOM_IOERROR;
-        }
+    pthread_mutex_init(&sc.lock, NULL);
+    threads = (pthread_t *)twom_zmalloc(jobs * sizeof(pthread_t));
+    progress.ranges = sc.nranges;
+    progress.total_bytes = sc.loc.end;
 
-        size_t ancestor = ANCESTOR(nextptr);
-        while (ancestor) {
-            const char *aptr = safeptr(loc, ancestor);
-            if (!aptr) {
-                db->error("failed to read ancestor for consistent",
-                          "fname=<%s> key=<%.*s> offset=<%08llX>",
-                          db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr),
-                          (LLU)ancestor);
-                return TWOM_IOERROR;
-            }
-            if (TYPE(aptr) == DELETE) {
-                dirty_size += 24;
-                ancestor = ANCESTOR(aptr);
-                if (!ancestor) return TWOM_IOERROR;
-                aptr = safeptr(loc, ancestor);
-                if (!aptr) return TWOM_IOERROR;
+    for (;;) {
+        size_t active = 0;
+        for (i = 0; i < sc.nranges; i++)
+            if (!sc.ranges[i].done) active++;
+        if (!active) break;
+
+        uint64_t began = tm_usec();
+        uint64_t bytes = progress.bytes;
+
+        counted = threads_enter(db);
+        r = txn_lock(txn);
+        if (!r) {
+            // what's been committed since can be read too, to find the way on
+            sc.now.end = txn->file->committed_size;
+            sc.budget = SCRUB_SLICE;
+            if (rate) {
+                sc.budget = rate / (1000000 / SCRUB_SLICE_USEC) / active;
+                if (sc.budget < 1024) sc.budget = 1024;
             }
-            cmp = COMPAR(file->compar, KEYPTR(aptr), KEYLEN(aptr),
-                         KEYPTR(nextptr), KEYLEN(nextptr));
-            if (cmp) {
-                db->error("mismatched ancestor for consistent",
-                          "fname=<%s> key=<%.*s> offset=<%08llX>"
-                          " parent_key=<%.*s> parent_offset=<%08llX)",
-                          db->fname, (int)KEYLEN(nextptr), KEYPTR(nextptr), (LLU)next[0],
-                          (int)KEYLEN(aptr), KEYPTR(aptr), (LLU)ancestor);
-                return TWOM_IOERROR;
+            sc.nexttake = 0;
+
+            // this thread is one of the jobs
+            int nthreads = 0;
+            while ((size_t)nthreads + 1 < active && nthreads + 1 < jobs) {
+                if (pthread_create(&threads[nthreads], NULL, scrub_worker, &sc)) break;
+                nthreads++;
             }
-            dirty_size += RECLEN(aptr);
-            ancestor = ANCESTOR(aptr);
+            scrub_worker(&sc);
+            while (nthreads--)
+                pthread_join(threads[nthreads], NULL);
         }
+        threads_leave(db, counted);
+        if (r) goto done;
 
-        uint8_t level = LEVEL(nextptr);
-        for (i = 1; i < level; i++) {
-            /* check the old pointer was to here.  On a read-only
-             * transaction a higher-level pointer into the future (at or
-             * past our snapshot end) is a "future link" left by a writer
-             * that extended the file after we started, or by a crashed
-             * write transaction: recovery on a write lock would re-stitch
-             * it, so tolerate it here and resync rather than reporting
-             * broken linkage. */
-            if (next[i] != next[0]
-                && !(txn->readonly && next[i] >= loc->end)) {
-                db->error("broken linkage for consistent",
-                          "fname=<%s> offset=<%08llX> level=<%d>"
-                          " expected=<%08llX>",
-                          db->fname, (LLU)next[0], i, (LLU)next[i]);
-                return TWOM_IOERROR;
-            }
-            /* and advance to the new pointer */
-            next[i] = NEXTN(nextptr, i);
+        progress.records = 0;
+        progress.bytes = 0;
+        progress.ranges_done = 0;
+        progress.ranges_bad = 0;
+        for (i = 0; i < sc.nranges; i++) {
+            struct tm_scrub_range *rg = &sc.ranges[i];
+            progress.records += rg->records;
+            progress.bytes += rg->bytes;
+            if (rg->done) progress.ranges_done++;
+            if (rg->r) progress.ranges_bad++;
         }
-        next[0] = advance0(nextptr, loc->end);
 
-        // count if record or tombstone
-        if (deleted_offset) dirty_size += RECLEN(nextptr);
-        else num_records++;
+        twom_txn_yield(txn);
+        if (progress.ranges_done == sc.nranges) break;
 
-        ptr = nextptr;
-    }
+        if (cb) {
+            r = cb(rock, &progress);
+            if (r) goto done;
+        }
 
-    for (i = 0; i < MAXLEVEL; i++) {
-        if (next[i]) {
-            /* as above: a higher-level future link left dangling at the
-             * tail (a pointer at or past our snapshot end) is fine for a
-             * read-only transaction; recovery would zero it. */
-            if (i && txn->readonly && next[i] >= loc->end)
-                continue;
-            db->error("broken tail for consistent",
-                      "filename=<%s> offset=<%08llX> level=<%d>",
-                      db->fname, (LLU)next[i], i);
-            return TWOM_IOERROR;
+        if (rate) {
+            uint64_t want = (progress.bytes - bytes) * 1000000 / rate;
+            uint64_t took = tm_usec() - began;
+            if (want > took) {
+                struct timespec ts;
+                ts.tv_sec = (want - took) / 1000000;
+                ts.tv_nsec = ((want - took) % 1000000) * 1000;
+                nanosleep(&ts, NULL);
+            }
         }
     }
 
-    /* we walked the whole file and saw every pointer */
+    // report the first range to go wrong
+    for (i = 0; !r && i < sc.nranges; i++)
+        r = sc.ranges[i].r;
 
-    if (num_records != txn->file->header.num_records) {
-        db->error("record count mismatch for consistent",
-                  "filename=<%s> num_records=<%llu> expected_records=<%llu>",
-                  db->fname, (LLU)num_records, (LLU)txn->file->header.num_records);
-        return TWOM_IOERROR;
+    if (!r) {
+        size_t found_records = 0;
+        size_t found_dirty = 0;
+        for (i = 0; i < sc.nranges; i++) {
+            found_records += sc.ranges[i].num_records;
+            found_dirty += sc.ranges[i].dirty_size;
+        }
+        if (found_records != num_records) {
+            db->error("record count mismatch for scrub",
+                      "filename=<%s> num_records=<%llu> expected_records=<%llu>",
+                      db->fname, (LLU)found_records, (LLU)num_records);
+            r = TWOM_IOERROR;
+        }
+        else if (found_dirty != dirty_size) {
+            db->error("dirty_size mismatch for scrub",
+                      "filename=<%s> dirty_size=<%llu> expected_size=<%llu>",
+                      db->fname, (LLU)found_dirty, (LLU)dirty_size);
+            r = TWOM_IOERROR;
+        }
     }
 
-    if (dirty_size != txn->file->header.dirty_size) {
-        db->error("dirty_size mismatch for consistent",
-                  "filename=<%s> dirty_size=<%llu> expected_size=<%llu>",
-                  db->fname, (LLU)dirty_size, (LLU)txn->file->header.dirty_size);
-        return TWOM_IOERROR;
+    progress.finished = 1;
+    progress.result = r;
+    if (cb) cb(rock, &progress);
+
+ done:
+    for (i = 0; i < sc.nranges; i++) {
+        db->stats.headcsums += sc.ranges[i].headcsums;
+        db->stats.tailcsums += sc.ranges[i].tailcsums;
+    }
+    if (threads) {
+        pthread_mutex_destroy(&sc.lock);
+        free(threads);
     }
+    free(sc.ranges);
+    twom_txn_abort(&txn);
+    return r;
+}
+
+// twom_db_backup: copy the file while writers carry on, without reading it
+// record by record.  Records are only ever appended, so a byte copy of
+// everything committed is nearly right.  The only bytes which change are the
+// pointers (and head checksum) of the records just before a new record, which
+// are changed to point at it.  A pointer only ever moves on to a new offset
+// past the end, so once something has been copied, the only way it can differ
+// from the file is by pointing at a record written since.
+//
+// So the copy is made a chunk at a time, yielding the lock in between, with
+// copy_file_range where there is one (which the filesystem can do as a reflink).
+// Once it has caught up with the end, every record written since the copy
+// started is looked up again, and the records before it at each of its levels
+// copied again as they are now.  Those are the records a writer changed for it
+// (just as in recovery_tail).  That repeats, from where the last round got to,
+// until what was written since is small or it's been round a few times.  The
+// last round is done without letting go of the lock, and finishes with the
+// header, so what's left is the database as it was then, clean.
+//
+// The MVCC transaction keeps the file we started on, so a repack by someone
+// else only means we finish copying the file it replaced.
 
+// copy [offset, offset+len) of the file at srcfd (mapped at base) to the same place in dstfd
+static int backup_copy(int srcfd, const char *base, int dstfd, size_t offset, size_t len)
+{
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    while (srcfd >= 0 && len) {
+        int64_t in = offset, out = offset;
+        long n = syscall(SYS_copy_file_range, srcfd, &in, dstfd, &out, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        // not supported between these files, or can't be, so write it out instead
+        if (n <= 0) break;
+        offset += n;
+        len -= n;
+    }
+#else
+    (void)srcfd;
+#endif
+    while (len) {
+        ssize_t n = pwrite(dstfd, base + offset, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return TWOM_IOERROR;
+        offset += n;
+        len -= n;
+    }
     return 0;
 }
 
-/*********************** PUBLIC API ******************************/
+static int cmp_offset(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
 
-// we refcount the database object by filename, so if you open twice in
-// the same process, we don't have flock shenanigans, because flock state
-// is process-wise, not file-descriptor specific, so it's not safe to just
-// open the file in separate objects and lock it separately.
-int twom_db_open(const char *fname, struct twom_open_data *setup,
-                 struct twom_db **ret, struct twom_txn **txnp)
+// copy again, as they are now, the records before every record in [from, end) at
+// each of its levels
+static int backup_fix(struct twom_txn *txn, int fd, size_t from, size_t end)
 {
-    struct twom_db *mydb;
+    struct twom_db *db = txn->db;
+    struct tm_file *file = txn->file;
+    size_t *fix = NULL;
+    size_t nfix = 0, afix = 0;
+    size_t offset, i;
     int r = 0;
 
-    /* do we already have this DB open? */
-    for (mydb = open_twom; mydb; mydb = mydb->next) {
-        if (strcmp(mydb->fname, fname)) continue;
-        if (txnp) {
-            r = twom_db_begin_txn(mydb, setup->flags, txnp);
-            if (r) return r;
+    // the live file, not the transaction's snapshot of it
+    struct tm_loc loc;
+    memset(&loc, 0, sizeof(loc));
+    loc.file = file;
+    loc.end = end;
+
+    for (offset = from; offset < end; ) {
+        const char *ptr = safeptr(&loc, offset);
+        if (!ptr) {
+            db->error("failed to read record for backup",
+                      "filename=<%s> offset=<%08llX>", db->fname, (LLU)offset);
+            r = TWOM_IOERROR;
+            goto done;
         }
-        // XXX: we should check that setup->flags are compatible with the
-        // flags that the DB was originally opened with and reject if they
-        // aren't, e.g. NOSYNC
-        mydb->refcount++;
-        *ret = mydb;
-        return 0;
+        offset += RECLEN(ptr);
+        if (TYPE(ptr) == COMMIT) continue;
+
+        // a delete is found by the key it deletes, and changes just level 0
+        uint8_t levels = TYPE(ptr) == DELETE ? 1 : LEVEL(ptr);
+        while (TYPE(ptr) == DELETE) {
+            ptr = safeptr(&loc, ANCESTOR(ptr));
+            if (!ptr) {
+                r = TWOM_IOERROR;
+                goto done;
+            }
+        }
+        r = locate(txn, &loc, KEYPTR(ptr), KEYLEN(ptr));
+        if (r) goto done;
+
+        if (nfix + levels > afix) {
+            afix = (nfix + levels) * 2;
+            fix = (size_t *)realloc(fix, afix * sizeof(size_t));
+            if (!fix) {
+                r = TWOM_IOERROR;
+                goto done;
+            }
+        }
+        for (i = 0; i < levels; i++)
+            fix[nfix++] = loc.backloc[i];
     }
 
-    r = opendb(fname, setup, &mydb, txnp);
-    if (r) return r;
+    if (nfix) qsort(fix, nfix, sizeof(size_t), cmp_offset);
+    for (i = 0; i < nfix; i++) {
+        if (i && fix[i] == fix[i-1]) continue;
+        const char *ptr = file->base + fix[i];
+        r = backup_copy(-1, file->base, fd, fix[i], RECLEN(ptr));
+        if (r) goto done;
+    }
 
-    /* track this database in the open list */
-    mydb->refcount = 1;
-    mydb->next = open_twom;
-    open_twom = mydb;
+ done:
+    free(fix);
+    return r;
+}
 
-    /* return the open DB */
-    *ret = mydb;
+// bring the copy of the blob file up to date, all of it or a chunk at a time.
+// It's only ever appended to, so the copy is just what's new
+static int backup_blobs(struct twom_db *db, int blobfd, size_t *copiedp, int all, int *donep)
+{
+    int r;
 
-    return 0;
+    threads_lock(db);
+    r = blob_open(db);
+    struct stat sbuf;
+    if (!r && fstat(db->blobs.fd, &sbuf) < 0) r = TWOM_IOERROR;
+    size_t size = r ? 0 : (size_t)sbuf.st_size;
+    if (!r && size > *copiedp) r = blob_map(db, size);
+    while (!r && size > *copiedp) {
+        size_t len = size - *copiedp;
+        if (!all && len > BACKUP_CHUNK) len = BACKUP_CHUNK;
+        r = backup_copy(db->blobs.fd, db->blobs.base, blobfd, *copiedp, len);
+        if (!r) *copiedp += len;
+        if (!all) break;
+    }
+    threads_unlock(db);
+
+    if (r) {
+        db->error("failed to copy blob file for backup",
+                  "filename=<%s>", db->fname);
+    }
+    if (donep) *donep = (*copiedp >= size);
+    return r;
 }
 
-int twom_db_close(struct twom_db **dbp)
+static int backup_run(struct twom_db *db, int fd, int blobfd, int *usedblobs)
 {
-    struct twom_db *mydb = open_twom;
-    struct twom_db *prev = NULL;
+    struct twom_txn *txn = NULL;
+    size_t copied = 0;
+    size_t blobcopied = 0;
+    size_t fixfrom = 0;
+    int blobsdone = 0;
+    int rounds = 0;
+    int finished = 0;
+    int r;
 
-    if (!*dbp) return 0;
+    if (db->write_txn) return TWOM_LOCKED;
 
-    /* remove this DB from the open list */
-    while (mydb && mydb != *dbp) {
-        prev = mydb;
-        mydb = mydb->next;
-    }
-    assert(mydb);
+    r = twom_db_begin_txn(db, TWOM_SHARED|TWOM_MVCC, &txn);
+    if (r) return r;
 
-    if (--mydb->refcount <= 0) {
-        if (prev) prev->next = mydb->next;
-        else open_twom = mydb->next;
-        dispose_db(mydb);
+    // like repack, a file which needs recovery has to wait for a writer
+    if (!db_is_clean(db, txn->file)) {
+        twom_txn_abort(&txn);
+        return TWOM_LOCKED;
+    }
+    int blobs = (txn->file->header.flags & TWOM_BLOBS) ? 1 : 0;
+    if (blobs && blobfd < 0) {
+        db->error("can't back up a database with a blob file to a file descriptor",
+                  "filename=<%s>", db->fname);
+        twom_txn_abort(&txn);
+        return TWOM_BADUSAGE;
+    }
+    // anything changed from here on will point at something written since
+    fixfrom = txn->end;
+
+    while (!finished) {
+        int counted = threads_enter(db);
+        r = txn_lock(txn);
+        if (!r) {
+            struct tm_file *file = txn->file;
+            size_t end = file->committed_size;
+            if (copied < end) {
+                size_t len = end - copied;
+                if (len > BACKUP_CHUNK) len = BACKUP_CHUNK;
+                r = backup_copy(file->fd, file->base, fd, copied, len);
+                if (r) {
+                    db->error("failed to copy for backup",
+                              "filename=<%s> offset=<%08llX>", db->fname, (LLU)copied);
+                }
+                copied += len;
+            }
+            else if (blobs && !blobsdone) {
+                r = backup_blobs(db, blobfd, &blobcopied, 0, &blobsdone);
+            }
+            else if (end - fixfrom <= BACKUP_FINAL || rounds >= BACKUP_ROUNDS) {
+                // the last round, holding the lock throughout
+                r = backup_fix(txn, fd, fixfrom, end);
+                if (!r && blobs) r = backup_blobs(db, blobfd, &blobcopied, 1, NULL);
+                if (!r) r = backup_copy(-1, file->base, fd, 0, HEADER_SIZE);
+                if (!r && ftruncate(fd, end) < 0) r = TWOM_IOERROR;
+                if (r) {
+                    db->error("failed to finish backup",
+                              "filename=<%s>", db->fname);
+                }
+                finished = 1;
+            }
+            else {
+                r = backup_fix(txn, fd, fixfrom, end);
+                fixfrom = end;
+                blobsdone = 0;
+                rounds++;
+            }
+        }
+        threads_leave(db, counted);
+        if (r) break;
+        twom_txn_yield(txn);
     }
 
-    *dbp = NULL;
+    twom_txn_abort(&txn);
+    if (r) return r;
 
+    if (!db->nosync) {
+        if (fsync(fd) < 0 || (blobs && fsync(blobfd) < 0)) {
+            db->error("failed to sync backup",
+                      "filename=<%s>", db->fname);
+            return TWOM_IOERROR;
+        }
+    }
+    if (usedblobs) *usedblobs = blobs;
     return 0;
 }
 
-// if this is called instead of the txn_yield, it yields all
-// readonly-locked files in the database, not just the current one.
-int twom_db_yield(struct twom_db *db)
+int twom_db_backup_fd(struct twom_db *db, int fd)
 {
-    if (!db) return 0;
-    if (db->write_txn) return TWOM_LOCKED;
-    // we don't check transactions for noyield, because they don't
-    // control yield on other transactions; if you want to restrict
-    // it entirely, it's only at the DB level that you we check
-    if (db->noyield) return TWOM_LOCKED;
-    struct tm_file *file;
-    for (file = db->openfile; file; file = file->next)
-        if (file->has_datalock == 1) unlock(db, file);
-    return 0;
+    return backup_run(db, fd, -1, NULL);
 }
 
-// with a readonly transaction, call this if you know you have
-// a lot of other work to do, so other processes can make
-// changes which you will either see or ignore depending on the
-// TWOM_MVCC flag used to create the transaction.
-int twom_txn_yield(struct twom_txn *txn)
+// into fname.NEW (and fname.BLOBS.NEW), renamed into place once it's all there
+int twom_db_backup(struct twom_db *db, const char *fname)
 {
-    if (!txn) return 0;
-    if (!txn->readonly) return TWOM_LOCKED;
-    if (txn->file->has_datalock == 1) unlock(txn->db, txn->file);
-    return 0;
-}
+    char newfname[1024];
+    char blobfname[1024];
+    char newblobfname[1024];
+    int usedblobs = 0;
+    int r;
 
-// all database activity happens through transactions, either explicitly
-// or via one implicitly created for a single call
-int twom_db_begin_txn(struct twom_db *db, int flags, struct twom_txn **txnp)
-{
-    struct twom_txn *txn = *txnp;
-    // you can call begin on an existing transaction, and it just refreshes
-    // the read_lock if yield or another action has released it meanwhile
-    if (txn) {
-        assert (txn->file);
-        if (txn->file->has_datalock == 2) return 0;
-        if (!txn->readonly) return TWOM_LOCKED;
-        if (txn->file->has_datalock) return 0;
-        return read_lock(db, txnp, txn->file, flags);
-    }
+    snprintf(newfname, sizeof(newfname), "%s.NEW", fname);
+    snprintf(blobfname, sizeof(blobfname), "%s%s", fname, BLOB_SUFFIX);
+    snprintf(newblobfname, sizeof(newblobfname), "%s%s.NEW", fname, BLOB_SUFFIX);
 
-    // you can have multiple read-only transactions on a single database
-    if (flags & TWOM_SHARED) {
-        /* if we're already in a lock, that's fine! */
-        if (db->openfile->has_datalock) {
-            *txnp = _newtxn_read(db);
-        }
-        else {
-            int r = read_lock(db, txnp, NULL, flags);
-            if (r) return r;
-        }
+    unlink(newfname);
+    unlink(newblobfname);
+    int fd = open(newfname, O_RDWR|O_CREAT, 0644);
+    int blobfd = open(newblobfname, O_RDWR|O_CREAT, 0644);
+    if (fd < 0 || blobfd < 0) {
+        db->error("failed to create backup",
+                  "filename=<%s> backup=<%s>", db->fname, fname);
+        r = TWOM_IOERROR;
+        goto done;
     }
-    else {
-        // you can't start another writable transaction if the file is
-        // already locked for writing!
-        if (db->openfile->has_datalock == 2) return TWOM_LOCKED;
 
-        // if it's already read-locked, then we're fine to release that
-        // lock, the caller will notice and refresh on next read if the
-        // file has changed or extended; and it's fine to read from a
-        // exclusively locked file.
-        if (db->openfile->has_datalock == 1) unlock(db, db->openfile);
+    r = backup_run(db, fd, blobfd, &usedblobs);
+    if (r) goto done;
 
-        int r = write_lock(db, txnp, NULL, flags);
-        if (r) return r;
+    if ((usedblobs && rename(newblobfname, blobfname) < 0)
+        || rename(newfname, fname) < 0) {
+        db->error("failed to rename backup",
+                  "filename=<%s> backup=<%s>", db->fname, fname);
+        r = TWOM_IOERROR;
+    }
+    else if (!db->nosync) {
+        r = fsync_dir(db, fname);
     }
 
-    if (flags & TWOM_MVCC)
-        (*txnp)->mvcc = 1;
-    if (flags & TWOM_NOSYNC)
-        (*txnp)->nosync = 1;
-    if (flags & TWOM_NOYIELD)
-        (*txnp)->noyield = 1;
+ done:
+    if (fd >= 0) close(fd);
+    if (blobfd >= 0) close(blobfd);
+    if (r) unlink(newfname);
+    if (r || !usedblobs) unlink(newblobfname);
+    return r;
+}
 
+bool twom_db_should_repack(struct twom_db *db)
+{
+    struct tm_file *file = db->openfile;
+    struct tm_header *header = &file->header;
+    if (header->dirty_size <= MINREWRITE) return 0;
+    // a quarter of the file is dead
+    if (header->current_size < REPACK_DIRTY_RATIO * header->dirty_size) return 1;
+    // or quite a lot of it in bytes, even if that's not yet a quarter
+    if (header->dirty_size > REPACK_DIRTY_BYTES
+        && header->current_size < REPACK_DIRTY_BYTES_RATIO * header->dirty_size) return 1;
     return 0;
 }
 
-int twom_txn_abort(struct twom_txn **txnp)
+// twom_db_repack: given an existing database, repack the content
+// to save space.  This can be called explicitly, and you can
+// check twom_db_should_repack to see if it's advised.
+//
+// We use an MVCC read transaction first to (with unlocks along
+// the way) go through all the records in order at the time we
+// started, then replay any new commits which happened in the
+// meantime until we hit the end of the file.
+//
+// Once we're finished, we keep the read-only transaction so no
+// more writes can happen while we update the generation number
+// and tracking stats, then rename the .NEW file over the existing
+// file, meaning that any other reader gets either of those two
+// files and a consistent read without lost writes.
+//
+// This does mean that the resulting DB may contain some
+// REPLACE or DELETE records as well, but we can do this
+// without ever holding a long lock, and the REPLACE and
+// DELETES will only be whatever happened after we started
+// this repack.
+//
+// Since we ONLY lock the .NEW file exclusively, we could lose
+// a race - but we lock with a non-blocking lock, so one process
+// will return immediately and the other will finish the task.
+//
+// We also cross check the generation and UUID to make sure we
+// don't accidentally pick up a file from another process which
+// was doing the repack.
+//
+// The copy can also be done a slice at a time with twom_db_repack_step.
+// Between slices the repack keeps its MVCC transaction (yielded), a
+// cursor into it, and the write-locked .NEW file outside the db's list
+// of open files; each slice swaps them in so that the usual write path
+// (store_here, tm_ensure, commit_locked) works on the new file.
+
+struct tm_repack {
+    struct twom_txn *txn;       // MVCC read transaction on the file being repacked
+    struct twom_cursor *cur;    // how far the copy has got
+    struct tm_file *oldfile;
+    struct tm_file *newfile;    // fname.NEW, write locked throughout
+    struct twom_txn *newtxn;
+    struct tm_loc loc;          // the writer's location in the new file
+    int oldfd;
+    char newfname[1024];
+};
+
+static void unlock_generation(int fd)
 {
-    if (!txnp || !*txnp) return 0;
-    struct twom_db *db = (*txnp)->db;
-    int r = abort_locked(txnp);
-    *txnp = 0;
-    if (!db->write_txn) unlock(db, NULL);
-    return r;
+    struct flock fl;
+    fl.l_type= F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = OFFSET_GENERATION;
+    fl.l_len = 8;
+    for (;;) {
+        if (fcntl(fd, F_SETLKW, &fl) < 0)
+            if (errno == EINTR) continue;
+        break;
+    }
 }
 
-int twom_txn_commit(struct twom_txn **txnp)
+// make the new file the db's current one, as far as writing is concerned
+static void repack_enter(struct twom_db *db, struct tm_repack *rp, struct tm_loc *saveloc)
 {
-    if (!txnp || !*txnp) return 0;
-    struct twom_db *db = (*txnp)->db;
-    int r = commit_locked(txnp);
-    *txnp = 0;
-    if (!db->write_txn) unlock(db, NULL);
-    return r;
+    rp->newfile->next = db->openfile;
+    db->openfile = rp->newfile;
+    *saveloc = db->loc;
+    db->loc = rp->loc;
+    db->write_txn = rp->newtxn;
+    db->blobs.copying = 1;
+    // we're just doing small copies, release less frequently
+    db->foreach_lock_release *= 64;
+    // and reading the old file in key order, which is file order up to its last repack
+    if (rp->oldfile->header.repack_size >= SEQUENTIAL_MIN)
+        tm_advise(rp->oldfile, rp->oldfile->header.repack_size, TWOM_ADVICE_SEQUENTIAL);
 }
 
-// this API is a bit weird, but allows us to return the actual
-// key if we were a FETCHNEXT.
-int twom_txn_fetch(struct twom_txn *txn,
-                   const char *key, size_t keylen,
-                   const char **foundkey, size_t *foundkeylen,
-                   const char **data, size_t *datalen,
-                   int flags)
+// put back the db's own advice for the old file's mapping
+static void repack_unadvise(struct twom_db *db, struct tm_repack *rp)
 {
-    struct twom_db *db = txn->db;
-    int r = 0;
+    if (rp->oldfile->header.repack_size >= SEQUENTIAL_MIN)
+        tm_advise(rp->oldfile, rp->oldfile->header.repack_size, db->advice);
+}
 
-    if (datalen) assert(data);
+// and put the db back as it was for everybody else between slices
+static void repack_leave(struct twom_db *db, struct tm_repack *rp, struct tm_loc *saveloc)
+{
+    rp->loc = db->loc;
+    db->loc = *saveloc;
+    rp->newtxn = db->write_txn;
+    db->write_txn = NULL;
+    db->openfile = rp->newfile->next;
+    rp->newfile->next = NULL;
+    db->blobs.copying = 0;
+    db->foreach_lock_release /= 64; // don't leave things weird!
+    repack_unadvise(db, rp);
+}
 
-    if (data) *data = NULL;
-    if (datalen) *datalen = 0;
+// unwind the new file and new txn.  This is for if we abort AFTER
+// we start writing to the new file.  In this case, the new file
+// contains rubish so we'll unlink it before unlocking.  Called entered,
+// and puts back the caller's write transaction (if any) at the end.
+static void repack_fail(struct twom_db *db, struct tm_repack *rp, struct tm_loc *saveloc,
+                        struct twom_txn *writer)
+{
+    twom_cursor_fini(&rp->cur);
+    if (db->loc.file) tm_unref(db->loc.file);
+    memset(&db->loc, 0, sizeof(struct tm_loc));
+    unlink(rp->newfname);
+    if (rp->newfile->bloom) {
+        char bloomnew[1024];
+        bloom_fname(db, bloomnew, sizeof(bloomnew));
+        unlink(bloomnew);
+    }
+    abort_locked(&db->write_txn);
+    // we patch out the new file again, so db contains the oldfile again
+    // (read locked) before we clean it up.  Caller will still have oldfile
+    // open for its next operation, but unlocked.
+    close(rp->newfile->fd);
+    db->openfile = rp->newfile->next;
+    rp->newfile->next = NULL;
+    bloom_free(db, rp->newfile);
+    free(rp->newfile);
+    db->loc = *saveloc;
+    db->write_txn = writer;
+    db->blobs.copying = 0;
+    db->foreach_lock_release /= 64;
+    repack_unadvise(db, rp);
+
+    unlock_generation(rp->oldfd);
+    twom_txn_abort(&rp->txn);
+    free(rp);
+    db->repack = NULL;
+}
 
-    struct tm_loc *loc = &db->loc;
+// start a repack: lock out other repackers, and set up the new file
+static int repack_begin(struct twom_db *db, int check)
+{
+    struct twom_txn *txn = NULL;
+    int oldfd = db->openfile->fd;
+    int newfd = -1;
+    char newfname[1024];
 
-    r = find_loc(txn, loc, key, keylen);
-    if (r) return r;
+    // lock exclusively against another process repacking
+    struct flock fl;
+    fl.l_type= F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = OFFSET_GENERATION;
+    fl.l_len = 8;
+    for (;;) {
+        if (fcntl(oldfd, F_SETLK, &fl) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return TWOM_LOCKED;
+            return TWOM_IOERROR;
+        }
+        break;
+    }
 
-    if (flags & TWOM_FETCHNEXT) {
-again:
-        r = advance_loc(txn, loc);
-        if (r == TWOM_DONE) return TWOM_NOTFOUND;
-        if (r) return r;
+    // if the file is dirty (unclean shutdown), we can't safely repack.
+    // a read-only transaction won't run recovery, and the consistency
+    // check will fail on uncommitted records.  The next writer will
+    // run recovery, and then repack can succeed.
+    if (!db_is_clean(db, db->openfile)) {
+        unlock_generation(oldfd);
+        return TWOM_LOCKED;
     }
 
-    // if there's no match, this key never existed
-    if (!loc->offset) return TWOM_NOTFOUND;
+    int r = twom_db_begin_txn(db, TWOM_SHARED|TWOM_MVCC, &txn);
+    if (r) {
+        unlock_generation(oldfd);
+        return r;
+    }
 
-    // if we're in an MVCC read, might need to find an ancestor
+    if (txn->file->fd != oldfd) {
+        // we lost a race here! When the transaction locked the file,
+        // it got a new inode, so another process has repacked meanwhile.
+        r = TWOM_LOCKED;
+        goto badfile;
+    }
 
-    size_t offset = loc->deleted_offset ? loc->deleted_offset : loc->offset;
-    const char *ptr = safeptr(loc, offset);
-    if (!ptr) return TWOM_IOERROR;
-    while (offset >= txn->end) {
-        offset = ANCESTOR(ptr);
-        if (!offset) return TWOM_NOTFOUND;
-        ptr = safeptr(loc, offset);
-        if (!ptr) return TWOM_IOERROR;
+    // don't make things worse with a broken file.  Sliced repacks skip this
+    // pass over the whole file, and rely on the checksums of each record as
+    // the copy reads it
+    if (check) {
+        r = twom_txn_consistent(txn);
+        if (r) {
+            db->error("inconsistent pre-repack",
+                      "filename=<%s>", db->fname);
+            goto badfile;
+        }
     }
 
-    /* active ancestor is a delete */
-    if (TYPE(ptr) == DELETE) {
-        if (flags & TWOM_FETCHNEXT) goto again;
-        return TWOM_NOTFOUND;
+    /* open fname.NEW */
+    snprintf(newfname, sizeof(newfname), "%s.NEW", db->fname);
+
+    int flags = TWOM_NONBLOCKING | TWOM_ONELOCK; // if another file has already locked it, something is broken
+    if (db->external_csum)
+        flags |= TWOM_CSUM_EXTERNAL;
+    else if (db->nocsum)
+        flags |= TWOM_CSUM_NULL;
+    else
+        flags |= TWOM_CSUM_XXH64;
+    if (db->external_compar)
+        flags |= TWOM_COMPAR_EXTERNAL;
+    // keep the prefixes, or add them if this open asked for them
+    if (db->keyprefix || (db->openfile->header.flags & TWOM_KEYPREFIX))
+        flags |= TWOM_KEYPREFIX;
+    // and the blob references, which also can't be turned off again
+    if (db->blobs_wanted || (db->openfile->header.flags & TWOM_BLOBS))
+        flags |= TWOM_BLOBS;
+    // and the key filter
+    if (db->bloom_wanted || (db->openfile->header.flags & TWOM_BLOOM))
+        flags |= TWOM_BLOOM;
+    // the readers trusting the segment will be reading the new file too
+    if (db->openfile->header.flags & SHMHINTS)
+        flags |= TWOM_SHM;
+    // but compression is whatever this open has: initdb marks the new file
+    // COMPRESSED for a compress function, and copy_cb hands it every value
+    // already decompressed
+    if (db->nosync)
+        flags |= TWOM_NOSYNC;
+
+    /* we hand-open the new file and make it the first openfile, so it has
+     * the write_txn against it and all the sanity checks make sense */
+    unlink(newfname);
+    newfd = open(newfname, O_RDWR|O_CREAT, 0644);
+    if (newfd < 0) {
+        r = TWOM_IOERROR;
+        goto badfile;
     }
 
-    r = check_tailcsum(txn, loc->file, ptr, offset);
-    if (r) return r;
+    struct tm_repack *rp = (struct tm_repack *)twom_zmalloc(sizeof(struct tm_repack));
+    rp->txn = txn;
+    rp->oldfile = db->openfile;
+    rp->oldfd = oldfd;
+    memcpy(rp->newfname, newfname, sizeof(newfname));
+    rp->newfile = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
+    rp->newfile->fd = newfd;
+    db->repack = rp;
+
+    struct tm_loc saveloc;
+    repack_enter(db, rp, &saveloc);
+
+    // initdb will create a new header on the new file:
+    // It will have a different UUID, no records, and be generation 1
+    r = initdb(db, flags);
+    if (r) goto fail;
+
+    // make sure we have all the locks set up
+    r = write_lock(db, &db->write_txn, db->openfile, flags);
+    if (r) goto fail;
+
+    // we'll likely need about enough space for the current
+    // database, minus the dirty bytes, minus 24 bytes per
+    // extra commit.  This isn't exact, because new records
+    // will have diferent random levels
+    tm_ensure(db, rp->oldfile->header.current_size
+                - rp->oldfile->header.dirty_size
+                - (rp->oldfile->header.num_commits-1) * 24);
+
+    // initialise the writer location on the new file
+    r = find_loc(db->write_txn, &db->loc, NULL, 0);
+    if (r) goto fail;
 
-    if (foundkey) *foundkey = KEYPTR(ptr);
-    if (foundkeylen) *foundkeylen = KEYLEN(ptr);
-    if (data) *data = VALPTR(ptr);
-    if (datalen) *datalen = VALLEN(ptr);
+    // mvcc process all the existing records, from the start
+    r = txn_begin_cursor(txn, NULL, 0, &rp->cur, 0);
+    if (r) goto fail;
 
+    repack_leave(db, rp, &saveloc);
     return 0;
-}
 
-int twom_db_begin_cursor(struct twom_db *db,
-                         const char *prefix, size_t prefixlen,
-                         struct twom_cursor **curp, int flags)
-{
-    struct twom_txn *txn = NULL;
-    int r = twom_db_begin_txn(db, flags, &txn);
-    if (r) return r;
-    r = twom_txn_begin_cursor(txn, prefix, prefixlen, curp, flags);
-    if (r) {
-        int r2 = twom_txn_abort(&txn);
-        return r2 ? r2 : r;
-    }
-    return 0;
+ fail:
+    repack_fail(db, rp, &saveloc, NULL);
+    return r;
+
+ badfile:
+    unlock_generation(oldfd);
+    twom_txn_abort(&txn);
+    return r;
 }
 
-// advance an existing cursor
-int twom_cursor_next(struct twom_cursor *cur,
-                     const char **foundkey, size_t *foundkeylen,
-                     const char **data, size_t *datalen)
+// copy until the budget runs out (0: no limit), and once the copy is done, finish
+static int repack_run(struct twom_db *db, size_t budget_bytes, size_t budget_usec)
 {
+    struct tm_repack *rp = db->repack;
+    struct tm_loc saveloc;
+    const char *key, *data;
+    size_t keylen, datalen;
+    uint64_t began = tm_usec();
     int r;
 
-    struct twom_txn *txn = cur->txn;
-    struct tm_loc *loc = &cur->loc;
+    // the write transaction slot is needed for the new file
+    if (db->write_txn) return TWOM_LOCKED;
 
- again:
-    if (txn->readonly) {
-        // release locks every N records if readonly
-        if (!txn->db->noyield && !txn->noyield && txn->counter++ > txn->db->foreach_lock_release) {
-            r = twom_txn_yield(txn);
-            if (r) return r;
-        }
+    repack_enter(db, rp, &saveloc);
+    struct tm_file *newfile = rp->newfile;
+    size_t start = newfile->written_size;
 
-        if (!txn->file->has_datalock) {
-            /* usually re-lock cheaply with ONELOCK (skipping the header gate),
-             * but every FOREACH_GATE_RELOCKS re-locks take the full double-lock
-             * so a writer waiting on the gate isn't starved by this foreach */
-            int lockflags = (txn->nlocks++ % FOREACH_GATE_RELOCKS) ? TWOM_ONELOCK : 0;
-            r = read_lock(txn->db, &txn, txn->mvcc ? txn->file : NULL, lockflags);
-            if (r) return r;
-            txn->counter = 0;
+    while (!(r = cursor_next(rp->cur, &key, &keylen, &data, &datalen))) {
+        r = copy_cb(db->write_txn, key, keylen, data, datalen);
+        if (r) goto fail;
+        if (budget_bytes && newfile->written_size - start >= budget_bytes) break;
+        if (budget_usec && tm_usec() - began >= budget_usec) break;
+    }
+    if (r && r != TWOM_DONE) goto fail;
+
+    if (!r) {
+        // out of budget: write out what we've copied, so the IO is spread over
+        // the slices rather than all landing at the final commit, and let the
+        // writers in
+        if (!db->nosync && tm_msync(db, newfile, newfile->written_size)) {
+            db->error("msync failed",
+                      "filename=<%s>", rp->newfname);
+            r = TWOM_IOERROR;
+            goto fail;
         }
+        r = txn_yield(rp->txn, 1);
+        if (r) goto fail;
+        repack_leave(db, rp, &saveloc);
+        return 0;
     }
+    twom_cursor_fini(&rp->cur);
 
-    // otherwise we need to get the next key
-    // (returns TWOM_DONE at end of file)
-    r = advance_loc(txn, loc);
-    if (r) return r;
+    struct twom_txn *txn = rp->txn;
+    struct tm_file *oldfile = rp->oldfile;
 
-    // do we need an MVCC ancestor?
-    size_t offset = loc->deleted_offset ? loc->deleted_offset : loc->offset;
-    const char *ptr = safeptr(loc, offset);
-    if (!ptr) return TWOM_IOERROR;
-    while (offset >= txn->end) {
-        offset = ANCESTOR(ptr);
-        if (!offset) goto again; // record didn't exist
-        ptr = safeptr(loc, offset);
-        if (!ptr) return TWOM_IOERROR;
-    }
+    /* remember the repack size at this point, because that's everything
+     * which is in order!  The remaing replayed items might be deletes or
+     * replaces, so they still dirty up the ordering as much as new changes. */
+    newfile->header.repack_size = db->write_txn->end;
 
-    // have we left our prefix?
-    if (cur->prefixlen) {
-        const char *this = ptr;
-        if (TYPE(ptr) == DELETE)
-            this = safeptr(loc, ANCESTOR(ptr));
-        size_t keylen = KEYLEN(this);
-        if (keylen < cur->prefixlen) return TWOM_DONE;
-        const char *key = KEYPTR(this);
-        if (COMPAR(txn->file->compar, key, cur->prefixlen, cur->prefix, cur->prefixlen))
-            return TWOM_DONE;
-    }
+    // replay all the remaining changes to the end of the file
+    r = txn_lock(txn);
+    if (r) goto fail;
+    r = myreplay(txn, replay_cb, db->write_txn);
+    if (r) goto fail;
 
-    // latest is a delete?  move along
-    if (TYPE(ptr) == DELETE) goto again;
+    // we still need a read-lock at this point.  This is the critical
+    // section; we must either abort, or hold the lock until the rename
+    // is completed
+    assert(oldfile->has_datalock);
 
-    // we have a returnable value!
-    r = check_tailcsum(txn, loc->file, ptr, offset);
-    if (r) return r;
+    /* same uuid */
+    memcpy(newfile->header.uuid, oldfile->header.uuid, 16);
 
-    // we have to check the tailcsum BEFORE yielding, because another
-    // process could change pointers, but we can yield now because the
-    // lengths and contents are never changed after being written, so
-    // it's safe to access them unlocked.
-    if (txn->readonly && cur->alwaysyield) {
-        r = twom_txn_yield(txn);
-        if (r) return r;
-        txn->counter = 0;
-    }
+    /* increase the generation count */
+    newfile->header.generation = oldfile->header.generation + 1;
+    bloom_stamp(newfile);
 
-    if (foundkey) *foundkey = KEYPTR(ptr);
-    if (foundkeylen) *foundkeylen = KEYLEN(ptr);
-    if (data) *data = VALPTR(ptr);
-    if (datalen) *datalen = VALLEN(ptr);
+    r = commit_locked(&db->write_txn);
+    if (r) goto fail;
 
-    return 0;
-}
+    /* the new filter goes first, so nobody finds the new file without it */
+    if (newfile->bloom) {
+        char bloomname[1024], bloomnew[1024];
+        bloom_fname(db, bloomnew, sizeof(bloomnew));
+        snprintf(bloomname, sizeof(bloomname), "%s%s", db->fname, BLOOM_SUFFIX);
+        if (rename(bloomnew, bloomname) < 0) {
+            // the file doesn't need it, searches will just do without
+            db->error("key filter rename failed",
+                      "filename=<%s>", bloomnew);
+        }
+    }
 
-// note: unused so far!  But this seems a useful API to provide
-int twom_cursor_replace(struct twom_cursor *cur,
-                        const char *data, size_t datalen, int flags)
-{
-    if (cur->txn->readonly) return TWOM_READONLY;
-    if (!cur->loc.offset) return TWOM_NOTFOUND;
-    const char *ptr = LOCPTR(&cur->loc);
-    const char *key = KEYPTR(ptr);
-    size_t keylen = KEYLEN(ptr);
+    /* move new file to original file name */
+    r = tm_rename(db, oldfile, rp->newfname);
+    if (r) goto fail;
+    shm_renamed(db, newfile);
 
-    /* position db->loc at the key so store_here can rewire skip pointers */
-    int r = find_loc(cur->txn, &cur->txn->db->loc, key, keylen);
-    if (r) return r;
+    // rename is done, we can now safely unlock the old file
+    unlock(db, oldfile);
+    abort_locked(&txn);
+    unlock_generation(rp->oldfd);
 
-    /* could be a delete or a replace */
-    if (hastail[TYPE(ptr)]) {
-        // replacing existing record
-        if (flags & TWOM_IFNOTEXIST) return TWOM_EXISTS;
-        if (!data) return store_here(cur->txn, key, keylen, NULL, 0);
-        /* unchanged?  Save the IO */
-        if (!COMPAR(cur->loc.file->compar, data, datalen, VALPTR(ptr), VALLEN(ptr)))
-            return 0;
-        return store_here(cur->txn, key, keylen, data, datalen);
-    }
+    // and unlock the new file too - this is the point that new
+    // processes will start work
+    unlock(db, NULL);
 
-    if (flags & TWOM_IFEXIST) return TWOM_NOTFOUND;
+    // the new file stays at the head of the list, and our location with it
+    if (saveloc.file) tm_unref(saveloc.file);
+    db->blobs.copying = 0;
+    db->foreach_lock_release /= 64;
+    free(rp);
+    db->repack = NULL;
+    tm_cleanup(db);
 
-    /* delete of already deleted is a NOOP */
-    if (data) return store_here(cur->txn, key, keylen, data, datalen);
+    return TWOM_DONE;
 
-    return 0;
+ fail:
+    repack_fail(db, rp, &saveloc, NULL);
+    return r;
 }
 
-int twom_cursor_abort(struct twom_cursor **curp)
+static int repack_step(struct twom_db *db, size_t budget_bytes, size_t budget_usec)
 {
-    struct twom_cursor *cur = *curp;
-    if (cur->loc.file) {
-        cur->loc.file->refcount--;
-        cur->loc.file = NULL;
+    if (!db->repack) {
+        if (db->write_txn) return TWOM_LOCKED;
+        int r = repack_begin(db, 0);
+        if (r) return r;
     }
-    int r = twom_txn_abort(&cur->txn);
-    free(cur->prefix);
-    free(cur);
-    *curp = NULL;
-    return r;
+    return repack_run(db, budget_bytes, budget_usec);
 }
 
-int twom_cursor_commit(struct twom_cursor **curp)
+// with TWOM_THREADSAFE, a repack (or a slice of one) keeps the other threads
+// out like a write transaction does
+int twom_db_repack_step(struct twom_db *db, size_t budget_bytes, size_t budget_usec)
 {
-    struct twom_cursor *cur = *curp;
-    if (cur->loc.file) {
-        cur->loc.file->refcount--;
-        cur->loc.file = NULL;
+    int gated = !threads_own_writer(db);
+    if (gated) {
+        int r = threads_write_begin(db, 0);
+        if (r) return r;
     }
-    int r = twom_txn_commit(&cur->txn); // will call abort itself on error
-    free(cur->prefix);
-    free(cur);
-    *curp = NULL;
+    int r = repack_step(db, budget_bytes, budget_usec);
+    if (gated) threads_write_end(db);
     return r;
 }
 
-// begin a transaction with a cursor (use _fini below to close it)
-int twom_txn_begin_cursor(struct twom_txn *txn,
-                          const char *prefix, size_t prefixlen,
-                          struct twom_cursor **curp, int flags)
+// give up on a sliced repack, leaving the database as it was
+static int repack_abandon(struct twom_db *db)
 {
-    struct twom_cursor *cur = (struct twom_cursor *)twom_zmalloc(sizeof(struct twom_cursor));
-    cur->txn = txn;
-    if (flags & TWOM_ALWAYSYIELD) cur->alwaysyield = 1;
-    if ((flags & TWOM_CURSOR_PREFIX) && prefix && prefixlen) {
-        cur->prefix = twom_zmalloc(prefixlen);
-        memcpy(cur->prefix, prefix, prefixlen);
-        cur->prefixlen = prefixlen;
-    }
-
-    int r = find_loc(cur->txn, &cur->loc, prefix, prefixlen);
-    if (r) goto done;
+    struct tm_repack *rp = db->repack;
+    struct tm_loc saveloc;
+    if (!rp) return 0;
+    // a write transaction of the caller's can stand aside while we unwind
+    struct twom_txn *writer = db->write_txn;
+    db->write_txn = NULL;
+    repack_enter(db, rp, &saveloc);
+    repack_fail(db, rp, &saveloc, writer);
+    return 0;
+}
 
-    // unless we're skipping the first record, mark this location
-    // as inexact, so advance_loc will find the key first, which
-    // allows us to still re-seek all the way back to this record
-    // and then advance from there if the file gets changed between
-    // starting the cursor and our first read.
-    if (!(flags & TWOM_SKIPROOT)) {
-        cur->loc.deleted_offset = 0;
-        cur->loc.offset = 0;
+int twom_db_repack_abort(struct twom_db *db)
+{
+    int gated = !threads_own_writer(db);
+    if (gated) {
+        int r = threads_write_begin(db, 0);
+        if (r) return r;
     }
-
- done:
-    if (r) twom_cursor_fini(&cur);
-    else *curp = cur;
-
+    int r = repack_abandon(db);
+    if (gated) threads_write_end(db);
     return r;
 }
 
-// useful for when you started with an external transaction that you're
-// not finished with, just clean up the cursor
-void twom_cursor_fini(struct twom_cursor **curp)
+static int repack_all(struct twom_db *db)
 {
-    struct twom_cursor *cur = *curp;
-    if (!cur) return;
-    if (cur->loc.file) {
-        cur->loc.file->refcount--;
-        cur->loc.file = NULL;
+    int r;
+    if (!db->repack) {
+        r = repack_begin(db, 1);
+        if (r) return r;
     }
-    free(cur->prefix);
-    free(cur);
-    *curp = NULL;
-    return;
+    r = repack_run(db, 0, 0);
+    return r == TWOM_DONE ? 0 : r;
 }
 
-/* foreach allows for subsidiary operations in 'cb',
- * if there's a transaction then cb must use it.
- * If cb returns a non-zero result, then it gets
- * returned to the caller.  NOTE the values -128 to +1
- * are reserved.  This is a sucky interface really,
- * there should be another way to return errors.
- *
- * If you really need to return anything more complex, you
- * can store the return value inside 'rock' instead.
-*/
-int twom_txn_foreach(struct twom_txn *txn,
-                     const char *prefix, size_t prefixlen,
-                     twom_cb *goodp, twom_cb *cb, void *rock,
-                     int flags)
+int twom_db_repack(struct twom_db *db)
 {
-    int r = 0, cb_r = 0;
-    const char *key = NULL;
-    size_t keylen = 0;
-    const char *data = NULL;
-    size_t datalen = 0;
-    struct twom_cursor *cur = NULL;
+    int gated = !threads_own_writer(db);
+    if (gated) {
+        int r = threads_write_begin(db, 0);
+        if (r) return r;
+    }
+    int r = repack_all(db);
+    if (gated) threads_write_end(db);
+    return r;
+}
 
-    assert(cb);
-    if (prefixlen) assert(prefix);
+/************** SHARDS ****************/
 
-    r = twom_txn_begin_cursor(txn, prefix, prefixlen, &cur, flags | TWOM_CURSOR_PREFIX);
-    if (r) goto done;
+/* A sharded database is a directory of ordinary twom files, each with the
+ * keys from one hash bucket or one key range, so writers to different shards
+ * take different locks and sync different files.  shards.twom beside them
+ * keeps the layout, written once when the directory is created, and the
+ * journal of commits which span shards.
+ *
+ * A transaction keeps its changes in memory, sorted per shard, and takes no
+ * locks until it commits.  Then the shards are written in ascending order, so
+ * two commits can't deadlock, each with twom_txn_store_batch.  Without the
+ * journal a crash part way leaves the earlier shards committed.  With it
+ * ('atomic'), a commit takes the journal's write lock and then every shard's,
+ * writes each its changes, and before committing any of them commits a
+ * journal entry with those changes and where each shard's file ended.  Once
+ * they're all committed the entry goes.
+ *
+ * Opening the directory finishes any entry left behind, and so does every
+ * write through the handle (an atomic commit finds it already holding the
+ * journal lock), so nothing this code writes lands on top of an unfinished
+ * part.  It's done holding the journal lock, so no other commit or recovery
+ * is under way.  A shard which still ends where it did never got its part.
+ * One which has moved on got it if the next commit there starts with exactly
+ * those changes: only the changes which alter a shard are written, so each
+ * of them is one record.  Otherwise something wrote to the shard file
+ * directly since, and that's newer, so only the keys it didn't change are
+ * written.  If the shard has been repacked since, that's lost: it has the
+ * part if it has those values now, and if not there's no telling what's
+ * newer, so it's left alone. */
+
+#define SHARDS_CONTROL "shards.twom"
+#define SHARDS_FNAME "%s/shard%04zu.twom"
+#define SHARDS_MAX 10000
+#define SHARDS_MAGIC "twomshd1"
+#define SHARDS_LAYOUT "layout"
+#define SHARDS_PENDING "pending."
+#define SHARDS_PENDING_LEN (8)
+#define SHARDS_DELETE UINT64_MAX
+
+// a change to make at commit
+struct shards_change {
+    char *key;          // the key, then the value, in one allocation
+    size_t keylen;
+    const char *val;    // NULL to delete
+    size_t vallen;
+    int flags;          // TWOM_IFEXIST or TWOM_IFNOTEXIST, on what's committed
+};
 
-    while ((r = twom_cursor_next(cur, &key, &keylen, &data, &datalen)) == 0) {
-        if ((!goodp || goodp(rock, key, keylen, data, datalen))) {
-            /* make callback */
-            cb_r = cb(rock, key, keylen, data, datalen);
-            if (cb_r) break;
-        }
-    }
+// a transaction's changes to one shard, in key order
+struct shards_pending {
+    struct shards_change *changes;
+    size_t n;
+    size_t alloc;
+};
 
-    // safely finished
-    if (r == TWOM_DONE) r = 0;
+// the same, in the shape twom_txn_store_batch takes
+struct shards_batch {
+    const char **keys;
+    size_t *keylens;
+    const char **vals;
+    size_t *vallens;
+    size_t n;
+};
 
- done:
-    twom_cursor_fini(&cur);
+// one shard's part in an atomic commit
+struct shards_part {
+    size_t shard;
+    struct twom_txn *txn;
+    char uuid[37];
+    uint64_t generation;
+    uint64_t offset;        // where its file ended when the commit locked it
+    struct shards_batch batch;
+};
 
-    return r ? r : cb_r;
-}
+struct twom_shards {
+    char *dirname;
+    struct twom_db *control;
+    size_t nshards;
+    struct twom_db **dbs;
+    char **splits;          // by key range, the first key of each shard after the first
+    size_t *splitlens;      // (NULL by hash)
+    twom_compar *compar;
+    void (*error)(const char *msg, const char *fmt, ...);
+    unsigned readonly:1;
+    unsigned atomic:1;
+};
+
+struct twom_shards_txn {
+    struct twom_shards *shards;
+    struct shards_pending *pending;     // one per shard
+};
+
+// where one shard's cursor is
+struct shards_head {
+    struct twom_cursor *cur;
+    const char *key;
+    size_t keylen;
+    const char *val;
+    size_t vallen;
+};
+
+struct twom_shards_cursor {
+    struct twom_shards *shards;
+    struct shards_head *heads;
+    size_t nheads;
+    size_t *heap;       // the heads with records left, the next in order on top
+    size_t nheap;
+    unsigned moved:1;   // the top has been returned, step it first
+    unsigned reverse:1;
+};
+
+// a growing buffer, for the layout and journal entries
+struct shards_buf {
+    char *s;
+    size_t len;
+    size_t alloc;
+};
 
-int twom_txn_store(struct twom_txn *txn,
-                   const char *key, size_t keylen,
-                   const char *data, size_t datalen,
-                   int flags)
+static void shards_buf_add(struct shards_buf *buf, const void *p, size_t len)
 {
-    /* no writing a readonly database */
-    if (txn->db->readonly)
-        return TWOM_READONLY;
-
-    assert(txn == txn->db->write_txn);
-    assert(key && keylen);
+    if (buf->len + len > buf->alloc) {
+        buf->alloc = (buf->len + len) * 2;
+        buf->s = realloc(buf->s, buf->alloc);
+        assert(buf->s);
+    }
+    if (len) memcpy(buf->s + buf->len, p, len);
+    buf->len += len;
+}
 
-    return skipwrite(txn, key, keylen, data, datalen, flags);
+static void shards_buf_add64(struct shards_buf *buf, uint64_t v)
+{
+    uint64_t le = htole64(v);
+    shards_buf_add(buf, &le, 8);
 }
 
-const char *twom_db_fname(struct twom_db *db)
+// and reading them back: 'bad' once anything was missing
+struct shards_reader {
+    const char *p;
+    size_t left;
+    int bad;
+};
+
+static const char *shards_read(struct shards_reader *rd, uint64_t len)
 {
-    return db->fname;
+    if (rd->bad || len > rd->left) {
+        rd->bad = 1;
+        return NULL;
+    }
+    const char *p = rd->p;
+    rd->p += len;
+    rd->left -= len;
+    return p;
 }
 
-int twom_db_sync(struct twom_db *db)
+static uint64_t shards_read64(struct shards_reader *rd)
 {
-    if (!db->openfile) return 0;
-    return tm_commit(db, db->openfile->size);
+    uint64_t le = 0;
+    const char *p = shards_read(rd, 8);
+    if (p) memcpy(&le, p, 8);
+    return le64toh(le);
 }
 
-size_t twom_db_generation(struct twom_db *db)
+size_t twom_shards_which(struct twom_shards *shards, const char *key, size_t keylen)
 {
-    return db->openfile->header.generation;
+    if (!shards->splits) {
+        // the low half, since the key filter picks its block with the high half
+        uint64_t hash = XXH3_64bits_internal(key, keylen, 0, XXH3_kSecret, sizeof(XXH3_kSecret),
+                                             tm_xxh3_long);
+        return (hash & 0xffffffff) * shards->nshards >> 32;
+    }
+
+    // the number of split keys at or before it
+    size_t lo = 0, hi = shards->nshards - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (COMPAR(shards->compar, shards->splits[mid], shards->splitlens[mid], key, keylen) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-size_t twom_db_num_records(struct twom_db *db)
+size_t twom_shards_count(struct twom_shards *shards)
 {
-    return db->openfile->header.num_records;
+    return shards->nshards;
 }
 
-size_t twom_db_size(struct twom_db *db)
+struct twom_db *twom_shards_db(struct twom_shards *shards, size_t shard)
 {
-    return db->openfile->header.current_size;
+    return shard < shards->nshards ? shards->dbs[shard] : NULL;
 }
 
-const char *twom_db_uuid(struct twom_db *db)
+/* LAYOUT: the magic, the number of shards and of split keys, then each split
+ * key with its length in front, the numbers all 64 bit little endian */
+
+static void shards_layout_encode(struct twom_shards *shards, struct shards_buf *buf)
 {
-    tm_uuid_unparse(db->openfile->header.uuid, db->uuidstr);
-    return db->uuidstr;
+    size_t nsplits = shards->splits ? shards->nshards - 1 : 0;
+    size_t i;
+    shards_buf_add(buf, SHARDS_MAGIC, 8);
+    shards_buf_add64(buf, shards->nshards);
+    shards_buf_add64(buf, nsplits);
+    for (i = 0; i < nsplits; i++) {
+        shards_buf_add64(buf, shards->splitlens[i]);
+        shards_buf_add(buf, shards->splits[i], shards->splitlens[i]);
+    }
 }
 
-// check if the file is fully consistent (all the records are
-// in the right order, and all the skip levels link up)
-static int twom_txn_consistent(struct twom_txn *txn)
+static void shards_set_splits(struct twom_shards *shards, size_t nsplits,
+                              const char * const *splits, const size_t *splitlens)
 {
-    struct tm_loc *loc = (struct tm_loc *)twom_zmalloc(sizeof(struct tm_loc));
-    loc->file = txn->file;
-    /* check the transaction's own committed snapshot.  For a read-write
-     * transaction txn->end == written_size, so this is unchanged; for a
-     * read-only transaction it is the committed size at begin, which is
-     * exactly the region recovery would validate on a write lock. */
-    loc->end = txn->end;
-    int r = consistent1(txn, loc);
-    free(loc);
-    return r;
+    size_t i;
+    shards->nshards = nsplits + 1;
+    if (!nsplits) return;
+    shards->splits = (char **)twom_zmalloc(nsplits * sizeof(char *));
+    shards->splitlens = (size_t *)twom_zmalloc(nsplits * sizeof(size_t));
+    for (i = 0; i < nsplits; i++) {
+        shards->splits[i] = malloc(splitlens[i]);
+        assert(shards->splits[i]);
+        memcpy(shards->splits[i], splits[i], splitlens[i]);
+        shards->splitlens[i] = splitlens[i];
+    }
 }
 
-// dump the content of the database to stdout in a somewhat human
-// understandable shape which gives offsets and details for
-// each record.
-static int twom_txn_dump(struct twom_txn *txn, int detail)
+static int shards_layout_decode(struct twom_shards *shards, const char *val, size_t vallen)
 {
-    char scratch[80];
-    const char *ptr;
-    size_t offset = DUMMY_OFFSET;
+    struct shards_reader rd = { val, vallen, 0 };
+    const char *magic = shards_read(&rd, 8);
+    uint64_t nshards = shards_read64(&rd);
+    uint64_t nsplits = shards_read64(&rd);
     size_t i;
 
-    struct tm_header *header = &txn->file->header;
-    struct twom_db *db = txn->db;
-    struct tm_loc *loc = &db->loc;
+    if (rd.bad || memcmp(magic, SHARDS_MAGIC, 8) || !nshards || nshards > SHARDS_MAX
+        || (nsplits && nsplits != nshards - 1)) {
+        shards->error("twom_shards: bad layout", "dirname=<%s>", shards->dirname);
+        return TWOM_BADFORMAT;
+    }
 
-    int r = find_loc(txn, loc, NULL, 0);
-    if (r) return r;
+    const char **splits = (const char **)twom_zmalloc((nsplits + 1) * sizeof(char *));
+    size_t *splitlens = (size_t *)twom_zmalloc((nsplits + 1) * sizeof(size_t));
+    for (i = 0; i < nsplits; i++) {
+        splitlens[i] = shards_read64(&rd);
+        splits[i] = shards_read(&rd, splitlens[i]);
+    }
+    if (rd.bad) {
+        free(splits);
+        free(splitlens);
+        shards->error("twom_shards: bad layout", "dirname=<%s>", shards->dirname);
+        return TWOM_BADFORMAT;
+    }
+    if (nsplits) shards_set_splits(shards, nsplits, splits, splitlens);
+    else shards->nshards = nshards;
+    free(splits);
+    free(splitlens);
+    return 0;
+}
 
-    scratch[79] = 0; // avoid overruns
+// the layout asked for when creating
+static int shards_layout_setup(struct twom_shards *shards, const struct twom_shards_open_data *setup)
+{
+    size_t i;
 
-    printf("UUID: uuid=%s\nFNAME: fname=%s\n", twom_db_uuid(db), twom_db_fname(db));
-    printf("CHECKSUM ENGINE: %s\n", checksum_engine(txn->file));
-    printf("HEADER: v=%lu g=%llu fl=%08lX num=(%llu/%llu) sz=(%08llX/%08llX/%08llX) ml=%lu\n",
-          (LU)header->version,
-          (LLU)header->generation,
-          (LU)header->flags,
-          (LLU)header->num_records,
-          (LLU)header->num_commits,
-          (LLU)header->dirty_size,
-          (LLU)header->current_size,
-          (LLU)header->repack_size,
-          (LU)header->maxlevel);
+    if (!setup->nsplits) {
+        if (!setup->nshards || setup->nshards > SHARDS_MAX) goto bad;
+        shards->nshards = setup->nshards;
+        return 0;
+    }
 
-    while (offset + 24 <= loc->file->size) {
-        if (!loc->file->base[offset]) {
-            // skip NULL blocks
-            offset += 8;
-            continue;
-        }
-        printf("%08llX ", (LLU)offset);
+    if (setup->nsplits >= SHARDS_MAX || !setup->splits || !setup->splitlens) goto bad;
+    if (setup->nshards && setup->nshards != setup->nsplits + 1) goto bad;
+    for (i = 0; i < setup->nsplits; i++) {
+        if (!setup->splits[i] || !setup->splitlens[i]) goto bad;
+        if (i && COMPAR(shards->compar, setup->splits[i-1], setup->splitlens[i-1],
+                        setup->splits[i], setup->splitlens[i]) >= 0)
+            goto bad;
+    }
+    shards_set_splits(shards, setup->nsplits, setup->splits, setup->splitlens);
+    return 0;
 
-        ptr = loc->file->base + offset;
-        uint8_t type = TYPE(ptr);
-        uint8_t level = LEVEL(ptr);
-        // sanity-check type and level before touching anything that
-        // indexes by type or computes RECLEN (which would otherwise
-        // dereference reclenfn[] out of range and crash)
-        if (type == 0 || type > COMMIT) {
-            printf("BAD TYPE %d AT %08llX\n", (int)type, (LLU)offset);
-            break;
-        }
-        if (level > MAXLEVEL) {
-            printf("BAD LEVEL %d AT %08llX\n", (int)level, (LLU)offset);
-            break;
-        }
-        // ensure the full head (including checksums) fits before we
-        // read any length fields used by RECLEN / KEYPTR
-        if (loc->file->size < offset + HEADLEN(ptr) + 8) {
-            printf("TRUNCATED HEAD AT %08llX\n", (LLU)offset);
-            break;
-        }
-        size_t reclen = RECLEN(ptr);
-        if (loc->file->size < offset + reclen) {
-            printf("TRUNCATED RECORD AT %08llX len=%llu\n",
-                   (LLU)offset, (LLU)reclen);
-            break;
-        }
+bad:
+    shards->error("twom_shards: bad layout in setup", "dirname=<%s>", shards->dirname);
+    return TWOM_BADUSAGE;
+}
 
-        if (check_headcsum(txn, loc->file, ptr, offset)) {
-            printf("ERROR [HEADCSUM %08lX %08lX] ",
-                    (long unsigned) HEADCSUM(ptr),
-                    (long unsigned) loc->file->csum(ptr, HEADLEN(ptr)));
-        }
+// does the setup ask for anything other than the layout we have?
+static int shards_layout_differs(struct twom_shards *shards, const struct twom_shards_open_data *setup)
+{
+    size_t i;
+    if (!setup->nshards && !setup->nsplits) return 0;
+    if (!setup->nsplits) return shards->splits || setup->nshards != shards->nshards;
+    if (!shards->splits || setup->nsplits != shards->nshards - 1) return 1;
+    if (!setup->splits || !setup->splitlens) return 1;
+    for (i = 0; i < setup->nsplits; i++) {
+        if (setup->splitlens[i] != shards->splitlens[i]) return 1;
+        if (memcmp(setup->splits[i], shards->splits[i], shards->splitlens[i])) return 1;
+    }
+    return 0;
+}
 
-        if (check_tailcsum(txn, loc->file, ptr, offset)) {
-            printf("ERROR [TAILCSUM %08lX %08lX] ",
-                    (long unsigned) TAILCSUM(ptr),
-                    (long unsigned) loc->file->csum(KEYPTR(ptr), TAILLEN(ptr)));
-        }
+// read the layout, or when creating the directory, write it
+static int shards_layout(struct twom_shards *shards, const struct twom_shards_open_data *setup)
+{
+    struct twom_txn *txn = NULL;
+    const char *val;
+    size_t vallen;
 
-        if (type == COMMIT) {
-            printf("COMMIT start=%08llX\n", (LLU)NEXT0(ptr, 0));
-        }
-        else if (type == DELETE) {
-            size_t parent_offset = NEXT0(ptr, 0);
-            // the DELETE points to the record it tombstones; if that
-            // offset is out of range or points at an invalid record
-            // header we must not dereference its key pointer
-            if (parent_offset + 24 > loc->file->size) {
-                printf("DELETE BAD PARENT %08llX\n", (LLU)parent_offset);
-            }
-            else {
-                const char *pptr = loc->file->base + parent_offset;
-                uint8_t ptype = TYPE(pptr);
-                if (ptype == 0 || ptype > COMMIT
-                    || parent_offset + HEADLEN(pptr) + 8 > loc->file->size
-                    || parent_offset + RECLEN(pptr) > loc->file->size) {
-                    printf("DELETE BAD PARENT %08llX\n", (LLU)parent_offset);
-                }
-                else {
-                    const char *key = KEYPTR(pptr);
-                    size_t len = KEYLEN(pptr);
-                    if (len > 79) len = 79;
-                    if (key && len) strncpy(scratch, key, len);
-                    scratch[len] = 0;
-                    for (i = 0; i < len; i++)
-                        if (!scratch[i]) scratch[i] = '-';
-                    printf("DELETE kl=%llu (%s)\n", (LLU)KEYLEN(pptr), scratch);
-                }
-            }
-            printf("\t%08llX <-\n", (LLU)parent_offset);
+    int r = twom_db_begin_txn(shards->control, shards->readonly ? TWOM_SHARED : 0, &txn);
+    if (r) return r;
+
+    r = twom_txn_fetch(txn, SHARDS_LAYOUT, strlen(SHARDS_LAYOUT), NULL, NULL, &val, &vallen, 0);
+    if (!r) {
+        r = shards_layout_decode(shards, val, vallen);
+        if (!r && shards_layout_differs(shards, setup)) {
+            shards->error("twom_shards: layout doesn't match the setup", "dirname=<%s>",
+                          shards->dirname);
+            r = TWOM_BADUSAGE;
         }
-        else {
-            const char *key = KEYPTR(ptr);
-            size_t len = KEYLEN(ptr);
-            if (len > 79) len = 79;
-            if (key && len) strncpy(scratch, key, len);
-            scratch[len] = 0;
-            for (i = 0; i < len; i++)
-                if (!scratch[i]) scratch[i] = '-';
-            printf("%s kl=%llu dl=%llu lvl=%d (%s)\n",
-                   typestr[type],
-                   (LLU)KEYLEN(ptr), (LLU)VALLEN(ptr),
-                   LEVEL(ptr), scratch);
-            if (ancestoroffset[type]) {
-                printf("\t%08llX <-\n", (LLU)ANCESTOR(ptr));
-            }
-            printf("\t%08llX %08llX", (LLU)NEXT0(ptr, 0), (LLU)NEXT0(ptr, 1));
-            for (i = 1; i < level; i++) {
-                if (!((i-1) % 8))
-                    printf("\n\t");
-                printf("%08llX ", (LLU)NEXTN(ptr, i));
-            }
-            printf("\n");
-            if (detail > 2) {
-                const char *val = VALPTR(ptr);
-                size_t len = VALLEN(ptr);
-                if (len > 79) len = 79;
-                if (val) strncpy(scratch, val, len);
-                scratch[len] = 0;
-                printf("\tv=(%s)\n", scratch);
-            }
+    }
+    else if (r == TWOM_NOTFOUND && !shards->readonly && (setup->db.flags & TWOM_CREATE)) {
+        r = shards_layout_setup(shards, setup);
+        if (!r) {
+            struct shards_buf buf = { NULL, 0, 0 };
+            shards_layout_encode(shards, &buf);
+            r = twom_txn_store(txn, SHARDS_LAYOUT, strlen(SHARDS_LAYOUT), buf.s, buf.len, 0);
+            free(buf.s);
         }
-
-        offset += reclen;
+    }
+    else if (r == TWOM_NOTFOUND) {
+        shards->error("twom_shards: no layout", "dirname=<%s>", shards->dirname);
+        r = TWOM_BADFORMAT;
     }
 
-    return 0;
+    if (r) {
+        twom_txn_abort(&txn);
+        return r;
+    }
+    return twom_txn_commit(&txn);
 }
 
-int twom_db_fetch(struct twom_db *db,
-                  const char *key, size_t keylen,
-                  const char **foundkey, size_t *foundkeylen,
-                  const char **data, size_t *datalen,
-                  int flags)
-{
-    // if we're inside a write txn, use that
-    if (db->write_txn)
-        return twom_txn_fetch(db->write_txn, key, keylen, foundkey, foundkeylen, data, datalen, flags);
+/* JOURNAL: each entry is keyed "pending." and a 64 bit big endian sequence
+ * number, and holds the number of shards, then for each one its number, the
+ * UUID as a string, generation and offset when the commit locked it, and the
+ * number of changes, then each key and value with their lengths in front
+ * (SHARDS_DELETE for no value) */
 
-    // otherwise a readonly transaction just for the duration and abort when done.
-    struct twom_txn *txn = NULL;
-    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
-    if (r) return r;
-    r = twom_txn_fetch(txn, key, keylen, foundkey, foundkeylen, data, datalen, flags);
-    twom_txn_abort(&txn);
-    return r;
+static void shards_batch_alloc(struct shards_batch *batch, size_t n)
+{
+    batch->keys = (const char **)twom_zmalloc((n + 1) * sizeof(char *));
+    batch->keylens = (size_t *)twom_zmalloc((n + 1) * sizeof(size_t));
+    batch->vals = (const char **)twom_zmalloc((n + 1) * sizeof(char *));
+    batch->vallens = (size_t *)twom_zmalloc((n + 1) * sizeof(size_t));
+    batch->n = 0;
 }
 
-int twom_db_foreach(struct twom_db *db,
-                    const char *prefix, size_t prefixlen,
-                    twom_cb *goodp, twom_cb *cb, void *rock,
-                    int flags)
+static void shards_batch_free(struct shards_batch *batch)
 {
-    // if we're inside a write txn, use that
-    if (db->write_txn)
-        return twom_txn_foreach(db->write_txn, prefix, prefixlen, goodp, cb, rock, flags);
-
-    // otherwise a readonly transaction just for the duration and abort when done.
-    struct twom_txn *txn = NULL;
-    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
-    if (r) return r;
-    r = twom_txn_foreach(txn, prefix, prefixlen, goodp, cb, rock, flags);
-    twom_txn_abort(&txn);
-    return r;
+    free(batch->keys);
+    free(batch->keylens);
+    free(batch->vals);
+    free(batch->vallens);
+    memset(batch, 0, sizeof(struct shards_batch));
 }
 
-int twom_db_store(struct twom_db *db,
-                  const char *key, size_t keylen,
-                  const char *data, size_t datalen,
-                  int flags)
+static void shards_batch_add(struct shards_batch *batch, const char *key, size_t keylen,
+                             const char *val, size_t vallen)
 {
-    // if we're inside a write txn, use that
-    if (db->write_txn)
-        return twom_txn_store(db->write_txn, key, keylen, data, datalen, flags);
-
-    // otherwise a write transaction just for the duration, and commit or abort
-    // immediately
-    struct twom_txn *txn = NULL;
-    int r = twom_db_begin_txn(db, 0, &txn);
-    if (r) return r;
-    r = twom_txn_store(txn, key, keylen, data, datalen, flags);
-    if (r) {
-        int r2 = twom_txn_abort(&txn);
-        if (r2) r = r2;
-    }
-    else {
-        r = twom_txn_commit(&txn);
+    batch->keys[batch->n] = key;
+    batch->keylens[batch->n] = keylen;
+    batch->vals[batch->n] = val;
+    batch->vallens[batch->n] = val ? vallen : 0;
+    batch->n++;
+}
+
+// write the part's changes in its transaction and commit it
+static int shards_part_write(struct shards_part *part)
+{
+    struct shards_batch *batch = &part->batch;
+    int r = twom_txn_store_batch(part->txn, batch->n, batch->keys, batch->keylens,
+                                 batch->vals, batch->vallens, NULL, NULL);
+    if (r) {
+        twom_txn_abort(&part->txn);
+        return r;
     }
-    return r;
+    return twom_txn_commit(&part->txn);
 }
 
-int twom_db_dump(struct twom_db *db, int detail)
+static void shards_entry_encode(struct shards_part *parts, size_t nparts, struct shards_buf *buf)
 {
-    struct twom_txn *txn = NULL;
-    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
-    if (r) return r;
-    r = twom_txn_dump(txn, detail);
-    twom_txn_abort(&txn);
-    return r;
+    size_t i, j;
+    shards_buf_add64(buf, nparts);
+    for (i = 0; i < nparts; i++) {
+        struct shards_batch *batch = &parts[i].batch;
+        shards_buf_add64(buf, parts[i].shard);
+        shards_buf_add(buf, parts[i].uuid, 36);
+        shards_buf_add64(buf, parts[i].generation);
+        shards_buf_add64(buf, parts[i].offset);
+        shards_buf_add64(buf, batch->n);
+        for (j = 0; j < batch->n; j++) {
+            shards_buf_add64(buf, batch->keylens[j]);
+            shards_buf_add(buf, batch->keys[j], batch->keylens[j]);
+            shards_buf_add64(buf, batch->vals[j] ? batch->vallens[j] : SHARDS_DELETE);
+            if (batch->vals[j]) shards_buf_add(buf, batch->vals[j], batch->vallens[j]);
+        }
+    }
 }
 
-/* Repair records whose keylen or vallen was silently truncated due to the
- * skinny-record uint16_t/uint32_t overflow bug.
- *
- * Detection: for a skinny ADD/REPLACE, the byte immediately after the stored
- * key must be NUL (store_here always writes a NUL terminator there).  If it is
- * not, the true keylen must be stored_keylen + N*65536 for some N≥1.  We scan
- * forward in 65536-byte steps until we find the NUL, then verify by
- * re-computing the tail checksum with the candidate lengths.
- *
- * Repair: position the location (via find_loc with the truncated key) so that
- * store_here replaces the broken record in-place in the skiplist and creates a
- * correct FATADD/FATREPLACE record with the right 64-bit lengths.
- *
- * Returns TWOM_OK on success.  *nfixedp (if non-NULL) receives the count of
- * records repaired. */
-int twom_db_repair(struct twom_db *db, size_t *nfixedp)
+// the key for a new journal entry, after any there already
+static int shards_entry_key(struct twom_txn *jtxn, char *key, size_t *keylenp)
 {
-    struct twom_txn *txn = NULL;
-    int r = twom_db_begin_txn(db, 0, &txn);
-    if (r) return r;
+    struct twom_cursor *cur = NULL;
+    const char *last;
+    size_t lastlen;
+    uint64_t seq = 1, be;
 
-    struct tm_file *file = txn->file;
+    int r = twom_txn_begin_cursor(jtxn, SHARDS_PENDING, SHARDS_PENDING_LEN, &cur,
+                                  TWOM_CURSOR_PREFIX|TWOM_REVERSE);
+    if (r) return r;
+    r = twom_cursor_next(cur, &last, &lastlen, NULL, NULL);
+    if (!r && lastlen == SHARDS_PENDING_LEN + 8) {
+        memcpy(&be, last + SHARDS_PENDING_LEN, 8);
+        seq = be64toh(be) + 1;
+    }
+    twom_cursor_fini(&cur);
+    if (r && r != TWOM_DONE) return r;
 
-    /* ------------------------------------------------------------------ *
-     * Pass 1 — scan the live skiplist for broken records.
-     * ------------------------------------------------------------------ */
+    be = htobe64(seq);
+    memcpy(key, SHARDS_PENDING, SHARDS_PENDING_LEN);
+    memcpy(key + SHARDS_PENDING_LEN, &be, 8);
+    *keylenp = SHARDS_PENDING_LEN + 8;
+    return 0;
+}
 
-    struct repair_item {
-        size_t keylen;   /* true keylen found via NUL scan     */
-        size_t vallen;   /* vallen (stored uint32_t, unchanged)*/
-        char  *key;      /* malloc'd copy of the full key      */
-        char  *val;      /* malloc'd copy of the value         */
-    };
+// how far the changes since a commit match a part
+struct shards_match {
+    const struct shards_batch *batch;
+    size_t matched;
+};
 
-    size_t capacity = 16, nbroken = 0;
-    struct repair_item *broken = malloc(capacity * sizeof(*broken));
-    if (!broken) {
-        twom_txn_abort(&txn);
-        return TWOM_IOERROR;
-    }
+static int shards_match_cb(void *rock,
+                           const char *key, size_t keylen,
+                           const char *data, size_t datalen)
+{
+    struct shards_match *m = (struct shards_match *)rock;
+    const struct shards_batch *batch = m->batch;
+    size_t i = m->matched;
+
+    if (keylen != batch->keylens[i] || memcmp(key, batch->keys[i], keylen))
+        return TWOM_DONE;
+    if (!data != !batch->vals[i]) return TWOM_DONE;
+    if (data && (datalen != batch->vallens[i] || memcmp(data, batch->vals[i], datalen)))
+        return TWOM_DONE;
+    return ++m->matched == batch->n ? TWOM_DONE : 0;
+}
 
-    /* initialise loc so advance_loc starts from the very first record */
-    struct tm_loc *loc = &db->loc;
-    r = find_loc(txn, loc, NULL, 0);
-    if (r) goto fail;
+// the part's keys which commits since its offset have changed
+struct shards_since {
+    struct twom_shards *shards;
+    const struct shards_batch *batch;
+    char *changed;      // one for each change in the batch
+};
 
-    for (;;) {
-        r = advance_loc(txn, loc);
-        if (r == TWOM_DONE) {
-            r = 0;
+static int shards_since_cb(void *rock,
+                           const char *key, size_t keylen,
+                           const char *data __attribute__((unused)),
+                           size_t datalen __attribute__((unused)))
+{
+    struct shards_since *since = (struct shards_since *)rock;
+    const struct shards_batch *batch = since->batch;
+    size_t lo = 0, hi = batch->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = COMPAR(since->shards->compar, batch->keys[mid], batch->keylens[mid], key, keylen);
+        if (!cmp) {
+            since->changed[mid] = 1;
             break;
         }
-        if (r) goto fail;
-
-        /* deleted records don't need repair (no live tail) */
-        if (loc->deleted_offset) continue;
-
-        const char *ptr = safeptr(loc, loc->offset);
-        uint8_t type = TYPE(ptr);
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return 0;
+}
 
-        /* only skinny records can overflow — fat records already have
-         * 64-bit lengths and are correct by construction */
-        if (fatrecord[type]) continue;
+// does the shard have this part of a journal entry?  If not, and it can
+// tell, mark which of its keys have been changed since, and say where the
+// shard had got to.  If it can't tell (it's been repacked), *reachedp is 0
+static int shards_part_done(struct twom_shards *shards, struct shards_part *part,
+                            char *changed, size_t *reachedp, int *donep)
+{
+    struct twom_db *db = shards->dbs[part->shard];
+    size_t i;
+    int r;
 
-        size_t stored_keylen = KLSKINNY(ptr);
-        size_t headlen = HEADLEN(ptr);
-        const char *keyptr = KEYPTR(ptr);
+    *donep = 0;
+    *reachedp = 0;
+    if (!strcmp(twom_db_uuid(db), part->uuid) && twom_db_generation(db) == part->generation) {
+        // the first commit since, if it got there at all
+        struct twom_changepos pos = TWOM_CHANGEPOS_INITIALIZER;
+        struct shards_match m = { &part->batch, 0 };
+        memcpy(pos.uuid, part->uuid, sizeof(pos.uuid));
+        pos.generation = part->generation;
+        pos.offset = part->offset;
+        r = twom_db_changes_since(db, &pos, shards_match_cb, &m);
+        if (r < 0 && r != TWOM_NOTFOUND) return r;
+        if (r != TWOM_NOTFOUND && m.matched == part->batch.n) {
+            *donep = 1;
+            return 0;
+        }
+        if (r != TWOM_NOTFOUND) {
+            // it didn't, and everything since came after it
+            struct shards_since since = { shards, &part->batch, changed };
+            memset(changed, 0, part->batch.n);
+            pos.offset = part->offset;
+            r = twom_db_changes_since(db, &pos, shards_since_cb, &since);
+            if (r < 0 && r != TWOM_NOTFOUND) return r;
+            if (r != TWOM_NOTFOUND) {
+                *reachedp = pos.offset;
+                return 0;
+            }
+        }
+    }
 
-        if (keyptr[stored_keylen] == '\0') continue;  /* looks fine */
+    // repacked since: it's there if the values are
+    for (i = 0; i < part->batch.n; i++) {
+        const char *val;
+        size_t vallen;
+        r = twom_db_fetch(db, part->batch.keys[i], part->batch.keylens[i],
+                          NULL, NULL, &val, &vallen, 0);
+        if (r && r != TWOM_NOTFOUND) return r;
+        if (!part->batch.vals[i] != (r == TWOM_NOTFOUND)) return 0;
+        if (!r && (vallen != part->batch.vallens[i] || memcmp(val, part->batch.vals[i], vallen)))
+            return 0;
+    }
+    *donep = 1;
+    return 0;
+}
 
-        /* scan forward in 65536-byte increments for the true NUL */
-        size_t real_keylen = stored_keylen + 65536;
-        size_t max_off = file->size - (loc->offset + headlen + 8 + 1);
-        while (real_keylen < max_off && keyptr[real_keylen] != '\0')
-            real_keylen += 65536;
+static int shards_recover_part(struct twom_shards *shards, struct shards_part *part)
+{
+    struct twom_db *db = shards->dbs[part->shard];
+    struct shards_batch *batch = &part->batch;
+    char *changed = (char *)twom_zmalloc(batch->n + 1);
+    size_t reached, i, n;
+    int done, r;
 
-        if (real_keylen >= max_off) {
-            db->error("repair: cannot find key terminator",
-                      "filename=<%s> offset=<%08llX> stored_keylen=<%zu>",
-                      db->fname, (LLU)loc->offset, stored_keylen);
-            continue;
+    for (;;) {
+        r = twom_db_begin_txn(db, 0, &part->txn);
+        if (r) break;
+        // still where the commit left it, so its changes never got here
+        if (!strcmp(twom_db_uuid(db), part->uuid) && twom_db_generation(db) == part->generation
+            && twom_db_size(db) == part->offset) {
+            r = shards_part_write(part);
+            break;
+        }
+        r = twom_txn_abort(&part->txn);
+        if (r) break;
+
+        r = shards_part_done(shards, part, changed, &reached, &done);
+        if (r || done) break;
+        if (!reached) {
+            // a repack lost track of what came after it, and writing the
+            // lot now could undo a later commit, so leave it be
+            shards->error("twom_shards: can't finish a journal entry after a repack",
+                          "dirname=<%s> shard=<%zu>", shards->dirname, part->shard);
+            break;
         }
 
-        /* verify by re-computing the tail checksum with the real lengths */
-        size_t real_vallen = VALLEN(ptr);
-        size_t real_taillen = PAD8(real_keylen + real_vallen + 2);
-        if (loc->offset + headlen + 8 + real_taillen > file->size) {
-            db->error("repair: real record exceeds file size",
-                      "filename=<%s> offset=<%08llX>",
-                      db->fname, (LLU)loc->offset);
+        // whatever committed there since is newer, so only the rest is
+        // written, as long as nothing else got in meanwhile
+        r = twom_db_begin_txn(db, 0, &part->txn);
+        if (r) break;
+        if (twom_db_size(db) != reached) {
+            r = twom_txn_abort(&part->txn);
+            if (r) break;
             continue;
         }
-        uint32_t csum = file->csum(keyptr, real_taillen);
-        if (csum != TAILCSUM(ptr)) {
-            db->error("repair: NUL found but tailcsum mismatch",
-                      "filename=<%s> offset=<%08llX> real_keylen=<%zu>",
-                      db->fname, (LLU)loc->offset, real_keylen);
-            continue;
+        for (i = n = 0; i < batch->n; i++) {
+            if (changed[i]) continue;
+            batch->keys[n] = batch->keys[i];
+            batch->keylens[n] = batch->keylens[i];
+            batch->vals[n] = batch->vals[i];
+            batch->vallens[n] = batch->vallens[i];
+            n++;
         }
+        batch->n = n;
+        r = shards_part_write(part);
+        break;
+    }
 
-        /* save copies — the mmap may move when store_here calls tm_ensure */
-        char *keycopy = malloc(real_keylen+1);
-        char *valcopy = malloc(real_vallen+1);
-        if (!keycopy || !valcopy) {
-            free(keycopy); free(valcopy);
-            r = TWOM_IOERROR;
-            goto fail;
-        }
-        memcpy(keycopy, keyptr, real_keylen);
-        keycopy[real_keylen] = '\0';
-        memcpy(valcopy, keyptr + real_keylen + 1, real_vallen);
-        valcopy[real_vallen] = '\0';
+    free(changed);
+    return r;
+}
 
-        if (nbroken >= capacity) {
-            capacity *= 2;
-            struct repair_item *tmp = realloc(broken, capacity * sizeof(*broken));
-            if (!tmp) {
-                free(keycopy);
-                free(valcopy);
-                r = TWOM_IOERROR;
-                goto fail;
-            }
-            broken = tmp;
-        }
-        broken[nbroken++] = (struct repair_item){
-            real_keylen, real_vallen, keycopy, valcopy
-        };
+static int shards_recover_entry(struct twom_shards *shards, const char *val, size_t vallen)
+{
+    struct shards_reader rd = { val, vallen, 0 };
+    uint64_t nparts = shards_read64(&rd);
+    uint64_t i, j, n;
+    int r = 0;
 
-        // we need to be dirty
-        if (!(loc->file->header.flags & DIRTY)) {
-            loc->file->header.flags |= DIRTY;
-            r = commit_header(db, &loc->file->header);
-            if (r) goto fail;
+    for (i = 0; !rd.bad && i < nparts; i++) {
+        struct shards_part part;
+        memset(&part, 0, sizeof(part));
+        part.shard = shards_read64(&rd);
+        const char *uuid = shards_read(&rd, 36);
+        part.generation = shards_read64(&rd);
+        part.offset = shards_read64(&rd);
+        n = shards_read64(&rd);
+        if (rd.bad || part.shard >= shards->nshards || n > rd.left / 16) {
+            rd.bad = 1;
+            break;
         }
+        memcpy(part.uuid, uuid, 36);
+
+        shards_batch_alloc(&part.batch, n);
+        for (j = 0; j < n; j++) {
+            uint64_t keylen = shards_read64(&rd);
+            const char *key = shards_read(&rd, keylen);
+            uint64_t len = shards_read64(&rd);
+            const char *data = len == SHARDS_DELETE ? NULL : shards_read(&rd, len);
+            if (rd.bad) break;
+            shards_batch_add(&part.batch, key, keylen, data, len);
+        }
+        if (!rd.bad) r = shards_recover_part(shards, &part);
+        shards_batch_free(&part.batch);
+        if (r) return r;
+    }
 
-        // now zero out the existing record entirely from the chain, starting
-        // with the level 0 pointer.  We have to set both, because we don't know
-        // which is right!
-        char *backptr = LOCBACKPTR(loc, 0);
-        char *prevptr = backptr;
-        size_t offset0 = advance0(ptr, loc->end);
-        char *addr = backptr + ptroffset[TYPE(backptr)];
-        *((uint64_t *)(addr)) = htole64(offset0);
-        addr+= 8;
-        *((uint64_t *)(addr)) = htole64(offset0);
+    if (rd.bad) {
+        shards->error("twom_shards: bad journal entry", "dirname=<%s>", shards->dirname);
+        return TWOM_BADFORMAT;
+    }
+    return 0;
+}
 
-        uint8_t level = LEVEL(ptr);
-        uint8_t n;
-        for (n = 1; n < level; n++) {
-            backptr = LOCBACKPTR(loc, n);
-            if (backptr != prevptr) _recsum(loc->file, prevptr);
-            prevptr = backptr;
-            SETN(backptr, n, NEXTN(loc, n));
-        }
+static int shards_copy_cb(void *rock,
+                          const char *key, size_t keylen,
+                          const char *data, size_t datalen)
+{
+    struct shards_buf *buf = (struct shards_buf *)rock;
+    shards_buf_add64(buf, keylen);
+    shards_buf_add(buf, key, keylen);
+    shards_buf_add64(buf, datalen);
+    shards_buf_add(buf, data, datalen);
+    return 0;
+}
 
-        _recsum(loc->file, prevptr);
+// finish the entries in the journal, holding its write lock in jtxn
+static int shards_recover_locked(struct twom_shards *shards, struct twom_txn *jtxn)
+{
+    struct shards_buf entries = { NULL, 0, 0 };
+    const char *key;
+    size_t keylen;
+
+    int r = twom_txn_foreach(jtxn, SHARDS_PENDING, SHARDS_PENDING_LEN, NULL, shards_copy_cb, &entries, 0);
+
+    struct shards_reader rd = { entries.s, entries.len, 0 };
+    while (!r && rd.left) {
+        keylen = shards_read64(&rd);
+        key = shards_read(&rd, keylen);
+        uint64_t vallen = shards_read64(&rd);
+        const char *val = shards_read(&rd, vallen);
+        r = shards_recover_entry(shards, val, vallen);
+        if (!r) r = twom_txn_store(jtxn, key, keylen, NULL, 0, 0);
+    }
+    free(entries.s);
+    return r;
+}
 
-        // we removed this record, account for it
-        loc->file->header.num_records--;
-        // you'd think so, but since this is invisible to the chain,
-        // the auditor doesn't know it's dirty
-        //loc->file->header.dirty_size += headlen + real_taillen;
+// finish the commits a crash left in the journal, before writing anything
+// which they could otherwise be finished on top of
+static int shards_recover(struct twom_shards *shards)
+{
+    struct twom_txn *jtxn = NULL;
+    const char *key;
+    size_t keylen;
+
+    // usually there's nothing, and no need for the write lock
+    int r = twom_db_fetch(shards->control, SHARDS_PENDING, SHARDS_PENDING_LEN,
+                          &key, &keylen, NULL, NULL, TWOM_FETCHNEXT);
+    if (r == TWOM_NOTFOUND) return 0;
+    if (r) return r;
+    if (keylen < SHARDS_PENDING_LEN || memcmp(key, SHARDS_PENDING, SHARDS_PENDING_LEN))
+        return 0;
 
-        // start again
-        r = locate(txn, loc, NULL, 0);
-        if (r) goto fail;
+    r = twom_db_begin_txn(shards->control, 0, &jtxn);
+    if (r) return r;
+    r = shards_recover_locked(shards, jtxn);
+    if (r) {
+        twom_txn_abort(&jtxn);
+        return r;
     }
+    return twom_txn_commit(&jtxn);
+}
 
-    /* ------------------------------------------------------------------ *
-     * Pass 2 — store the broken records
-     * ------------------------------------------------------------------ */
-    size_t nfixed = 0;
-    for (size_t i = 0; i < nbroken; i++) {
-        struct repair_item *item = &broken[i];
+/* OPEN AND CLOSE */
 
-        r = twom_txn_store(txn, item->key, item->keylen, item->val, item->vallen, 0);
-        if (r) {
-            db->error("repair: twom_txn_store failed for broken record",
-                      "filename=<%s> key=<%s>",
-                      db->fname, item->key);
-            goto fail;
-        }
+int twom_shards_open(const char *dirname, struct twom_shards_open_data *setup,
+                     struct twom_shards **shardsp)
+{
+    struct twom_shards *shards = (struct twom_shards *)twom_zmalloc(sizeof(struct twom_shards));
+    char fname[1024];
+    size_t i;
+    int r = 0;
 
-        nfixed++;
+    shards->dirname = strdup(dirname);
+    shards->error = setup->db.error ? setup->db.error : errors_to_stderr;
+    shards->compar = (setup->db.flags & TWOM_COMPAR_EXTERNAL) ? setup->db.compar : compar_raw;
+    shards->readonly = !!(setup->db.flags & TWOM_SHARED);
+    shards->atomic = !!setup->atomic;
+
+    if (!shards->compar) {
+        shards->error("twom_shards: no comparator", "dirname=<%s>", dirname);
+        r = TWOM_BADUSAGE;
+        goto done;
     }
 
-    for (size_t i = 0; i < nbroken; i++) {
-        free(broken[i].key);
-        free(broken[i].val);
+    if ((setup->db.flags & TWOM_CREATE) && mkdir(dirname, 0777) && errno != EEXIST) {
+        shards->error("twom_shards: mkdir failed", "dirname=<%s> errno=<%s>",
+                      dirname, strerror(errno));
+        r = TWOM_IOERROR;
+        goto done;
     }
-    free(broken);
 
-    if (nfixedp) *nfixedp = nfixed;
+    // the layout and journal are in a plain file, whatever the shards are
+    struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+    cinit.flags = setup->db.flags & (TWOM_CREATE|TWOM_SHARED|TWOM_NOSYNC|TWOM_FDATASYNC
+                                     |TWOM_NONBLOCKING|TWOM_THREADSAFE);
+    cinit.error = setup->db.error;
+    snprintf(fname, sizeof(fname), "%s/%s", dirname, SHARDS_CONTROL);
+    r = twom_db_open(fname, &cinit, &shards->control, NULL);
+    if (r) goto done;
 
-    if (nfixed == 0) {
-        twom_txn_abort(&txn);
-        return TWOM_OK;
+    r = shards_layout(shards, setup);
+    if (r) goto done;
+
+    shards->dbs = (struct twom_db **)twom_zmalloc(shards->nshards * sizeof(struct twom_db *));
+    for (i = 0; i < shards->nshards; i++) {
+        snprintf(fname, sizeof(fname), SHARDS_FNAME, dirname, i);
+        r = twom_db_open(fname, &setup->db, &shards->dbs[i], NULL);
+        if (r) goto done;
     }
-    return twom_txn_commit(&txn);
 
-fail:
-    for (size_t i = 0; i < nbroken; i++) {
-        free(broken[i].key);
-        free(broken[i].val);
+    if (!shards->readonly) r = shards_recover(shards);
+
+done:
+    if (r) twom_shards_close(&shards);
+    *shardsp = shards;
+    return r;
+}
+
+int twom_shards_close(struct twom_shards **shardsp)
+{
+    struct twom_shards *shards = *shardsp;
+    size_t i;
+    int r = 0;
+
+    if (!shards) return 0;
+
+    for (i = 0; shards->dbs && i < shards->nshards; i++) {
+        int r2 = twom_db_close(&shards->dbs[i]);
+        if (r2 && !r) r = r2;
     }
-    free(broken);
-    twom_txn_abort(&txn);
+    int r2 = twom_db_close(&shards->control);
+    if (r2 && !r) r = r2;
+
+    for (i = 0; shards->splits && i < shards->nshards - 1; i++)
+        free(shards->splits[i]);
+    free(shards->splits);
+    free(shards->splitlens);
+    free(shards->dbs);
+    free(shards->dirname);
+    free(shards);
+    *shardsp = NULL;
     return r;
 }
 
-int twom_db_check_consistency(struct twom_db *db)
+/* NON-TRANSACTIONAL: straight to the shard */
+
+int twom_shards_fetch(struct twom_shards *shards,
+                      const char *key, size_t keylen,
+                      const char **valp, size_t *vallenp,
+                      int flags)
 {
-    struct twom_txn *txn = NULL;
-    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    // the next key could be in any shard: that's a cursor's job
+    if (flags & TWOM_FETCHNEXT) return TWOM_BADUSAGE;
+    struct twom_db *db = shards->dbs[twom_shards_which(shards, key, keylen)];
+    return twom_db_fetch(db, key, keylen, NULL, NULL, valp, vallenp, flags);
+}
+
+int twom_shards_store(struct twom_shards *shards,
+                      const char *key, size_t keylen,
+                      const char *val, size_t vallen,
+                      int flags)
+{
+    struct twom_db *db = shards->dbs[twom_shards_which(shards, key, keylen)];
+    int r = shards_recover(shards);
     if (r) return r;
-    r = twom_txn_consistent(txn);
-    twom_txn_abort(&txn);
-    return r;
+    return twom_db_store(db, key, keylen, val, vallen, flags);
 }
 
-bool twom_db_should_repack(struct twom_db *db)
+/* TRANSACTIONS */
+
+int twom_shards_begin_txn(struct twom_shards *shards, struct twom_shards_txn **txnp)
 {
-    struct tm_file *file = db->openfile;
-    struct tm_header *header = &file->header;
-    if (header->dirty_size > MINREWRITE
-        && header->current_size < 4 * header->dirty_size) return 1;
+    struct twom_shards_txn *txn = (struct twom_shards_txn *)twom_zmalloc(sizeof(struct twom_shards_txn));
+    txn->shards = shards;
+    txn->pending = (struct shards_pending *)twom_zmalloc(shards->nshards * sizeof(struct shards_pending));
+    *txnp = txn;
     return 0;
 }
 
-// twom_db_repack: given an existing database, repack the content
-// to save space.  This can be called explicitly, and you can
-// check twom_db_should_repack to see if it's advised.
-//
-// We use an MVCC read transaction first to (with unlocks along
-// the way) go through all the records in order at the time we
-// started, then replay any new commits which happened in the
-// meantime until we hit the end of the file.
-//
-// Once we're finished, we keep the read-only transaction so no
-// more writes can happen while we update the generation number
-// and tracking stats, then rename the .NEW file over the existing
-// file, meaning that any other reader gets either of those two
-// files and a consistent read without lost writes.
-//
-// This does mean that the resulting DB may contain some
-// REPLACE or DELETE records as well, but we can do this
-// without ever holding a long lock, and the REPLACE and
-// DELETES will only be whatever happened after we started
-// this repack.
-//
-// Since we ONLY lock the .NEW file exclusively, we could lose
-// a race - but we lock with a non-blocking lock, so one process
-// will return immediately and the other will finish the task.
-//
-// We also cross check the generation and UUID to make sure we
-// don't accidentally pick up a file from another process which
-// was doing the repack.
-int twom_db_repack(struct twom_db *db)
+static void shards_txn_free(struct twom_shards_txn *txn)
 {
-    char newfname[1024];
-    struct twom_txn *txn = NULL;
-    struct twom_txn *newtxn = NULL;
-    int oldfd = db->openfile->fd;
-    int newfd = -1;
+    size_t i, j;
+    for (i = 0; i < txn->shards->nshards; i++) {
+        struct shards_pending *pend = &txn->pending[i];
+        for (j = 0; j < pend->n; j++)
+            free(pend->changes[j].key);
+        free(pend->changes);
+    }
+    free(txn->pending);
+    free(txn);
+}
 
-    // lock exclusively against another process repacking
-    struct flock fl;
-    fl.l_type= F_WRLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = OFFSET_GENERATION;
-    fl.l_len = 8;
-    for (;;) {
-        if (fcntl(oldfd, F_SETLK, &fl) < 0) {
-            if (errno == EINTR) continue;
-            if (errno == EAGAIN) return TWOM_LOCKED;
-            return TWOM_IOERROR;
+// where the key is, or would go, in a shard's changes
+static size_t shards_pending_find(struct twom_shards *shards, struct shards_pending *pend,
+                                  const char *key, size_t keylen, int *foundp)
+{
+    size_t lo = 0, hi = pend->n;
+    *foundp = 0;
+
+    // keys are mostly written in order: try after the last first
+    if (hi) {
+        struct shards_change *last = &pend->changes[hi - 1];
+        int cmp = COMPAR(shards->compar, last->key, last->keylen, key, keylen);
+        if (cmp < 0) return hi;
+        if (!cmp) {
+            *foundp = 1;
+            return hi - 1;
         }
-        break;
     }
 
-    // if the file is dirty (unclean shutdown), we can't safely repack.
-    // a read-only transaction won't run recovery, and the consistency
-    // check will fail on uncommitted records.  The next writer will
-    // run recovery, and then repack can succeed.
-    if (!db_is_clean(db, db->openfile)) return TWOM_LOCKED;
-
-    int r = twom_db_begin_txn(db, TWOM_SHARED|TWOM_MVCC, &txn);
-    if (r) return r;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct shards_change *change = &pend->changes[mid];
+        int cmp = COMPAR(shards->compar, change->key, change->keylen, key, keylen);
+        if (!cmp) {
+            *foundp = 1;
+            return mid;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-    if (txn->file->fd != oldfd) {
-        // we lost a race here! When the transaction locked the file,
-        // it got a new inode, so another process has repacked meanwhile.
-        r = TWOM_LOCKED;
-        goto badfile;
+int twom_shards_txn_fetch(struct twom_shards_txn *txn,
+                          const char *key, size_t keylen,
+                          const char **valp, size_t *vallenp,
+                          int flags)
+{
+    struct twom_shards *shards = txn->shards;
+    if (flags & TWOM_FETCHNEXT) return TWOM_BADUSAGE;
+
+    size_t shard = twom_shards_which(shards, key, keylen);
+    struct shards_pending *pend = &txn->pending[shard];
+    int found;
+    size_t i = shards_pending_find(shards, pend, key, keylen, &found);
+    if (found) {
+        struct shards_change *change = &pend->changes[i];
+        if (!change->val) return TWOM_NOTFOUND;
+        if (valp) *valp = change->val;
+        if (vallenp) *vallenp = change->vallen;
+        return 0;
     }
 
-    // don't make things worse with a broken file
-    r = twom_txn_consistent(txn);
-    if (r) {
-        db->error("inconsistent pre-repack",
-                  "filename=<%s>", db->fname);
-        goto badfile;
+    return twom_db_fetch(shards->dbs[shard], key, keylen, NULL, NULL, valp, vallenp, flags);
+}
+
+int twom_shards_txn_store(struct twom_shards_txn *txn,
+                          const char *key, size_t keylen,
+                          const char *val, size_t vallen,
+                          int flags)
+{
+    struct twom_shards *shards = txn->shards;
+    if (shards->readonly) return TWOM_READONLY;
+    if (!key || !keylen) return TWOM_BADUSAGE;
+
+    size_t shard = twom_shards_which(shards, key, keylen);
+    struct shards_pending *pend = &txn->pending[shard];
+    int found;
+    size_t i = shards_pending_find(shards, pend, key, keylen, &found);
+
+    // checked now, against what's committed, and again at the commit when
+    // it's locked: until then someone else could change it
+    flags &= TWOM_IFEXIST|TWOM_IFNOTEXIST;
+    if (flags) {
+        int exists;
+        if (found) exists = !!pend->changes[i].val;
+        else {
+            int r = twom_db_fetch(shards->dbs[shard], key, keylen, NULL, NULL, NULL, NULL, 0);
+            if (r && r != TWOM_NOTFOUND) return r;
+            exists = !r;
+        }
+        if ((flags & TWOM_IFNOTEXIST) && exists) return TWOM_EXISTS;
+        if ((flags & TWOM_IFEXIST) && !exists) return TWOM_NOTFOUND;
     }
 
-    /* open fname.NEW */
-    snprintf(newfname, sizeof(newfname), "%s.NEW", db->fname);
+    if (!val) vallen = 0;
+    char *copy = malloc(keylen + vallen + 1);
+    assert(copy);
+    memcpy(copy, key, keylen);
+    if (val) memcpy(copy + keylen, val, vallen);
 
-    int flags = TWOM_NONBLOCKING | TWOM_ONELOCK; // if another file has already locked it, something is broken
-    if (db->external_csum)
-        flags |= TWOM_CSUM_EXTERNAL;
-    else if (db->nocsum)
-        flags |= TWOM_CSUM_NULL;
-    else
-        flags |= TWOM_CSUM_XXH64;
-    if (db->external_compar)
-        flags |= TWOM_COMPAR_EXTERNAL;
-    if (db->nosync)
-        flags |= TWOM_NOSYNC;
+    if (found) {
+        // a condition on this key is on what came before the first change
+        free(pend->changes[i].key);
+        flags = pend->changes[i].flags;
+    }
+    else {
+        if (pend->n == pend->alloc) {
+            pend->alloc = pend->alloc ? pend->alloc * 2 : 16;
+            pend->changes = realloc(pend->changes, pend->alloc * sizeof(struct shards_change));
+            assert(pend->changes);
+        }
+        memmove(pend->changes + i + 1, pend->changes + i, (pend->n - i) * sizeof(struct shards_change));
+        pend->n++;
+    }
+    pend->changes[i].key = copy;
+    pend->changes[i].keylen = keylen;
+    pend->changes[i].val = val ? copy + keylen : NULL;
+    pend->changes[i].vallen = vallen;
+    pend->changes[i].flags = flags;
+    return 0;
+}
 
-    /* we hand-open the new file and make it the first openfile, so it has
-     * the write_txn against it and all the sanity checks make sense */
-    unlink(newfname);
-    newfd = open(newfname, O_RDWR|O_CREAT, 0644);
-    if (newfd < 0) {
-        r = TWOM_IOERROR;
-        goto badfile;
+// are the conditions still met, now that the shard is locked in txn?
+static int shards_part_check(struct twom_txn *txn, const struct shards_pending *pend)
+{
+    size_t i;
+    for (i = 0; i < pend->n; i++) {
+        const struct shards_change *change = &pend->changes[i];
+        if (!change->flags) continue;
+        int r = twom_txn_fetch(txn, change->key, change->keylen, NULL, NULL, NULL, NULL, 0);
+        if (r && r != TWOM_NOTFOUND) return r;
+        if ((change->flags & TWOM_IFNOTEXIST) && !r) return TWOM_EXISTS;
+        if ((change->flags & TWOM_IFEXIST) && r) return TWOM_NOTFOUND;
     }
+    return 0;
+}
 
-    struct tm_file *oldfile = db->openfile;
-    db->openfile = (struct tm_file *)twom_zmalloc(sizeof(struct tm_file));
-    db->openfile->fd = newfd;
-    db->openfile->next = oldfile;
+// the changes which will alter the shard: writing the rest would add no records
+static int shards_part_changes(struct twom_shards *shards, struct shards_part *part,
+                               const struct shards_pending *pend)
+{
+    size_t i;
+    shards_batch_alloc(&part->batch, pend->n);
+    for (i = 0; i < pend->n; i++) {
+        const struct shards_change *change = &pend->changes[i];
+        const char *val;
+        size_t vallen;
+        int r = twom_txn_fetch(part->txn, change->key, change->keylen, NULL, NULL, &val, &vallen, 0);
+        if (r == TWOM_NOTFOUND) {
+            if (!change->val) continue;
+        }
+        else if (r) return r;
+        // the same test twom_txn_store uses to skip rewriting a value
+        else if (change->val && !COMPAR(shards->compar, change->val, change->vallen, val, vallen))
+            continue;
+        shards_batch_add(&part->batch, change->key, change->keylen, change->val, change->vallen);
+    }
+    return 0;
+}
 
-    // we're just doing small copies, release less frequently
-    db->foreach_lock_release *= 64;
+// each shard on its own, in order
+static int shards_commit_each(struct twom_shards_txn *txn)
+{
+    struct twom_shards *shards = txn->shards;
+    size_t i, j;
+    int r = shards_recover(shards);
+
+    for (i = 0; !r && i < shards->nshards; i++) {
+        struct shards_pending *pend = &txn->pending[i];
+        struct shards_part part;
+        if (!pend->n) continue;
+        memset(&part, 0, sizeof(part));
+        shards_batch_alloc(&part.batch, pend->n);
+        for (j = 0; j < pend->n; j++)
+            shards_batch_add(&part.batch, pend->changes[j].key, pend->changes[j].keylen,
+                             pend->changes[j].val, pend->changes[j].vallen);
+        r = twom_db_begin_txn(shards->dbs[i], 0, &part.txn);
+        if (!r) r = shards_part_check(part.txn, pend);
+        if (!r) r = shards_part_write(&part);
+        else if (part.txn) twom_txn_abort(&part.txn);
+        shards_batch_free(&part.batch);
+    }
+    return r;
+}
 
-    // initdb will create a new header on the new file:
-    // It will have a different UUID, no records, and be generation 1
-    r = initdb(db, flags);
-    if (r) goto fail;
+// all of the shards or none, through the journal
+static int shards_commit_atomic(struct twom_shards_txn *txn)
+{
+    struct twom_shards *shards = txn->shards;
+    struct shards_part *parts = (struct shards_part *)twom_zmalloc(shards->nshards * sizeof(struct shards_part));
+    struct shards_buf buf = { NULL, 0, 0 };
+    struct twom_txn *jtxn = NULL;
+    char key[SHARDS_PENDING_LEN + 8];
+    size_t keylen, nparts = 0, i;
+
+    // the journal first, then the shards in order, just like recovery.  Any
+    // entry already there is finished first, or this could be written over it
+    int r = twom_db_begin_txn(shards->control, 0, &jtxn);
+    if (r) goto done;
+    r = shards_recover_locked(shards, jtxn);
+    if (r) goto done;
 
-    // make sure we have all the locks set up
-    r = write_lock(db, &newtxn, db->openfile, flags);
-    if (r) goto fail;
+    for (i = 0; i < shards->nshards; i++) {
+        if (!txn->pending[i].n) continue;
+        struct shards_part *part = &parts[nparts++];
+        struct twom_db *db = shards->dbs[i];
+        part->shard = i;
+        r = twom_db_begin_txn(db, 0, &part->txn);
+        if (r) goto done;
+        r = shards_part_check(part->txn, &txn->pending[i]);
+        if (r) goto done;
+        r = shards_part_changes(shards, part, &txn->pending[i]);
+        if (r) goto done;
+        if (!part->batch.n) {
+            shards_batch_free(&part->batch);
+            r = twom_txn_abort(&part->txn);
+            nparts--;
+            if (r) goto done;
+            continue;
+        }
+        memcpy(part->uuid, twom_db_uuid(db), sizeof(part->uuid));
+        part->generation = twom_db_generation(db);
+        part->offset = twom_db_size(db);
+        r = twom_txn_store_batch(part->txn, part->batch.n, part->batch.keys, part->batch.keylens,
+                                 part->batch.vals, part->batch.vallens, NULL, NULL);
+        if (r) goto done;
+    }
 
-    // we'll likely need about enough space for the current
-    // database, minus the dirty bytes, minus 24 bytes per
-    // extra commit.  This isn't exact, because new records
-    // will have diferent random levels
-    tm_ensure(db, oldfile->header.current_size
-                - oldfile->header.dirty_size
-                - (oldfile->header.num_commits-1) * 24);
+    // with one shard (or none) to change, its own commit will do (but
+    // keep what recovery did to the journal)
+    if (nparts <= 1) {
+        r = twom_txn_commit(&jtxn);
+        if (!r && nparts) r = twom_txn_commit(&parts[0].txn);
+        goto done;
+    }
 
-    // initialise the writer location on the new file
-    r = find_loc(newtxn, &db->loc, NULL, 0);
-    if (r) goto fail;
+    r = shards_entry_key(jtxn, key, &keylen);
+    if (r) goto done;
+    shards_entry_encode(parts, nparts, &buf);
+    r = twom_txn_store(jtxn, key, keylen, buf.s, buf.len, 0);
+    if (!r) r = twom_txn_commit(&jtxn);
+    if (r) goto done;
 
-    // mvcc process all the existing records
-    r = twom_txn_foreach(txn, NULL, 0, NULL, copy_cb, newtxn, /*flags*/0);
-    if (r) goto fail;
+    // from here a crash is finished by the next open, and so is a failure
+    for (i = 0; i < nparts; i++) {
+        r = twom_txn_commit(&parts[i].txn);
+        if (r) goto done;
+    }
+    r = twom_db_store(shards->control, key, keylen, NULL, 0, 0);
 
-    /* remember the repack size at this point, because that's everything
-     * which is in order!  The remaing replayed items might be deletes or
-     * replaces, so they still dirty up the ordering as much as new changes. */
-    newtxn->file->header.repack_size = newtxn->end;
+done:
+    for (i = 0; i < nparts; i++) {
+        if (parts[i].txn) twom_txn_abort(&parts[i].txn);
+        shards_batch_free(&parts[i].batch);
+    }
+    if (jtxn) twom_txn_abort(&jtxn);
+    free(parts);
+    free(buf.s);
+    return r;
+}
 
-    // replay all the remaining changes to the end of the file
-    r = myreplay(txn, replay_cb, newtxn);
-    if (r) goto fail;
+int twom_shards_txn_commit(struct twom_shards_txn **txnp)
+{
+    struct twom_shards_txn *txn = *txnp;
+    if (!txn) return 0;
+    int r = txn->shards->atomic ? shards_commit_atomic(txn) : shards_commit_each(txn);
+    shards_txn_free(txn);
+    *txnp = NULL;
+    return r;
+}
 
-    // we still need a read-lock at this point.  This is the critical
-    // section; we must either abort, or hold the lock until the rename
-    // is completed
-    assert(oldfile->has_datalock);
+int twom_shards_txn_abort(struct twom_shards_txn **txnp)
+{
+    if (!*txnp) return 0;
+    shards_txn_free(*txnp);
+    *txnp = NULL;
+    return 0;
+}
 
-    /* same uuid */
-    memcpy(newtxn->file->header.uuid, oldfile->header.uuid, 16);
+/* CURSORS: a cursor on each shard, merged through a heap on their keys */
 
-    /* increase the generation count */
-    newtxn->file->header.generation = oldfile->header.generation + 1;
+static int shards_head_before(struct twom_shards_cursor *cur, size_t a, size_t b)
+{
+    struct shards_head *ha = &cur->heads[a];
+    struct shards_head *hb = &cur->heads[b];
+    int cmp = COMPAR(cur->shards->compar, ha->key, ha->keylen, hb->key, hb->keylen);
+    if (cur->reverse) cmp = -cmp;
+    return cmp ? cmp < 0 : a < b;
+}
 
-    r = commit_locked(&newtxn);
-    if (r) goto fail;
+static void shards_heap_down(struct twom_shards_cursor *cur, size_t i)
+{
+    for (;;) {
+        size_t best = i, child = 2 * i + 1;
+        if (child < cur->nheap && shards_head_before(cur, cur->heap[child], cur->heap[best]))
+            best = child;
+        child++;
+        if (child < cur->nheap && shards_head_before(cur, cur->heap[child], cur->heap[best]))
+            best = child;
+        if (best == i) return;
+        size_t tmp = cur->heap[i];
+        cur->heap[i] = cur->heap[best];
+        cur->heap[best] = tmp;
+        i = best;
+    }
+}
 
-    /* move new file to original file name */
-    r = tm_rename(db, oldfile, newfname);
-    if (r) goto fail;
+// with key ranges, can the shard have nothing the cursor will return?
+static int shards_cursor_skip(struct twom_shards *shards, size_t shard,
+                              const char *key, size_t keylen, int flags)
+{
+    if (!shards->splits || !key || !keylen) return 0;
+    const char *lo = shard ? shards->splits[shard - 1] : NULL;
+    size_t lolen = shard ? shards->splitlens[shard - 1] : 0;
+    const char *hi = shard < shards->nshards - 1 ? shards->splits[shard] : NULL;
+    size_t hilen = hi ? shards->splitlens[shard] : 0;
+
+    if (flags & TWOM_CURSOR_PREFIX) {
+        // all its keys are before the prefix, or (bytewise) after everything in it
+        if (hi && COMPAR(shards->compar, hi, hilen, key, keylen) <= 0) return 1;
+        return lo && shards->compar == compar_raw && compar_raw(lo, lolen, key, keylen) > 0
+            && (lolen < keylen || memcmp(lo, key, keylen));
+    }
+    if (flags & TWOM_REVERSE)
+        return lo && COMPAR(shards->compar, lo, lolen, key, keylen) > 0;
+    return hi && COMPAR(shards->compar, hi, hilen, key, keylen) <= 0;
+}
 
-    // rename is done, we can now safely unlock the old file
-    unlock(db, oldfile);
-    abort_locked(&txn);
+int twom_shards_begin_cursor(struct twom_shards *shards,
+                             const char *key, size_t keylen,
+                             struct twom_shards_cursor **curp, int flags)
+{
+    struct twom_shards_cursor *cur = (struct twom_shards_cursor *)twom_zmalloc(sizeof(struct twom_shards_cursor));
+    size_t i;
+    int r = 0;
 
-    fl.l_type= F_UNLCK;
-    for (;;) {
-        if (fcntl(oldfd, F_SETLKW, &fl) < 0)
-            if (errno == EINTR) continue;
-        break;
+    cur->shards = shards;
+    cur->heads = (struct shards_head *)twom_zmalloc(shards->nshards * sizeof(struct shards_head));
+    cur->heap = (size_t *)twom_zmalloc(shards->nshards * sizeof(size_t));
+    cur->reverse = !!(flags & TWOM_REVERSE);
+
+    for (i = 0; i < shards->nshards; i++) {
+        if (shards_cursor_skip(shards, i, key, keylen, flags)) continue;
+        struct shards_head *head = &cur->heads[cur->nheads++];
+        r = twom_db_begin_cursor(shards->dbs[i], key, keylen, &head->cur, flags | TWOM_SHARED);
+        if (r) goto fail;
+        r = twom_cursor_next(head->cur, &head->key, &head->keylen, &head->val, &head->vallen);
+        if (r == TWOM_DONE) {
+            r = twom_cursor_abort(&head->cur);
+            if (r) goto fail;
+            continue;
+        }
+        if (r) goto fail;
+        cur->heap[cur->nheap++] = cur->nheads - 1;
     }
 
-    // and unlock the new file too - this is the point that new
-    // processes will start work
-    unlock(db, NULL);
+    for (i = cur->nheap / 2; i-- > 0; )
+        shards_heap_down(cur, i);
+    *curp = cur;
+    return 0;
 
-    db->foreach_lock_release /= 64; // don't leave things weird!
+fail:
+    twom_shards_cursor_fini(&cur);
+    return r;
+}
 
+int twom_shards_cursor_next(struct twom_shards_cursor *cur,
+                            const char **keyp, size_t *keylenp,
+                            const char **valp, size_t *vallenp)
+{
+    if (cur->moved && cur->nheap) {
+        struct shards_head *head = &cur->heads[cur->heap[0]];
+        int r = twom_cursor_next(head->cur, &head->key, &head->keylen, &head->val, &head->vallen);
+        if (r == TWOM_DONE) {
+            // this shard is finished with, so let others write to it
+            r = twom_cursor_abort(&head->cur);
+            cur->heap[0] = cur->heap[--cur->nheap];
+        }
+        if (r) return r;
+        shards_heap_down(cur, 0);
+    }
+    cur->moved = 0;
+    if (!cur->nheap) return TWOM_DONE;
+
+    struct shards_head *head = &cur->heads[cur->heap[0]];
+    if (keyp) *keyp = head->key;
+    if (keylenp) *keylenp = head->keylen;
+    if (valp) *valp = head->val;
+    if (vallenp) *vallenp = head->vallen;
+    cur->moved = 1;
     return 0;
+}
 
- fail:
-    // unwind the new file and new txn.  This is for if we abort AFTER
-    // we start writing to the new file.  In this case, the new file
-    // contains rubish so we'll unlink it before unlocking.
-    if (db->loc.file) db->loc.file->refcount--;
-    memset(&db->loc, 0, sizeof(struct tm_loc));
-    unlink(newfname);
-    abort_locked(&newtxn);
-    // we patch out the new file again, so db contains the oldfile again
-    // (read locked) before we clean it up.  Caller will still have oldfile
-    // open for its next operation, but unlocked.
-    close(newfd);
-    free(db->openfile);
-    db->openfile = oldfile;
+void twom_shards_cursor_fini(struct twom_shards_cursor **curp)
+{
+    struct twom_shards_cursor *cur = *curp;
+    size_t i;
+    if (!cur) return;
+    for (i = 0; i < cur->nheads; i++)
+        if (cur->heads[i].cur) twom_cursor_abort(&cur->heads[i].cur);
+    free(cur->heads);
+    free(cur->heap);
+    free(cur);
+    *curp = NULL;
+}
 
- badfile:
-    fl.l_type= F_UNLCK;
+int twom_shards_foreach(struct twom_shards *shards,
+                        const char *prefix, size_t prefixlen,
+                        twom_cb *p, twom_cb *cb, void *rock,
+                        int flags)
+{
+    struct twom_shards_cursor *cur = NULL;
+    const char *key, *val;
+    size_t keylen, vallen;
+
+    if (prefixlen) flags |= TWOM_CURSOR_PREFIX;
+    int r = twom_shards_begin_cursor(shards, prefix, prefixlen, &cur, flags);
+    if (r) return r;
     for (;;) {
-        if (fcntl(oldfd, F_SETLKW, &fl) < 0)
-            if (errno == EINTR) continue;
-        break;
+        r = twom_shards_cursor_next(cur, &key, &keylen, &val, &vallen);
+        if (r) {
+            if (r == TWOM_DONE) r = 0;
+            break;
+        }
+        if (p && !p(rock, key, keylen, val, vallen)) continue;
+        r = cb(rock, key, keylen, val, vallen);
+        if (r) break;
     }
-    db->foreach_lock_release /= 64; // don't leave things weird!
-    twom_txn_abort(&txn);
+    twom_shards_cursor_fini(&cur);
     return r;
 }
 
@@ -3749,6 +9936,9 @@ const char *twom_strerror(int r)
     case TWOM_NOTFOUND: return "Not Found";
     case TWOM_LOCKED: return "Database is locked";
     case TWOM_READONLY: return "Database is read-only";
+    case TWOM_BADFORMAT: return "Bad format";
+    case TWOM_BADUSAGE: return "Bad usage";
+    case TWOM_BADCHECKSUM: return "Bad checksum";
     default: return "Unknown error";
     }
 }
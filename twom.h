@@ -16,6 +16,9 @@
 struct twom_db;
 struct twom_txn;
 struct twom_cursor;
+struct twom_shards;
+struct twom_shards_txn;
+struct twom_shards_cursor;
 
 enum twom_ret {
     TWOM_OK = 0,
@@ -40,6 +43,9 @@ enum twom_flagspec {
     TWOM_NOSYNC          = 1<<3,    /* Don't msync/fsync on write */
     TWOM_NONBLOCKING     = 1<<4,    /* When taking a lock, return immediately if the file is already locked */
     TWOM_ONELOCK         = 1<<5,    /* When locking, skip the double-lock process */
+    TWOM_FDATASYNC       = 1<<6,    /* Commit with fdatasync on the file rather than msync of the changed pages */
+    TWOM_FALLOCATE       = 1<<7,    /* Allocate disk blocks when extending the file, rather than leaving it sparse */
+    TWOM_CSUMCACHE       = 1<<8,    /* Remember which large records have passed their tail checksum, and skip re-checking them */
 
     TWOM_ALWAYSYIELD     = 1<<9,    /* Yield foreach before every callback */
     TWOM_NOYIELD         = 1<<10,   /* Never yield a read transaction lock */
@@ -49,27 +55,124 @@ enum twom_flagspec {
     TWOM_SKIPROOT        = 1<<14,   /* For foreach or cursor, skip the first record if it matches exactly */
     TWOM_MVCC            = 1<<15,   /* For cursor or transaction, operate in serializable isolation (MVCC) mode */
     TWOM_CURSOR_PREFIX   = 1<<16,   /* For cursor or transaction, only iterate inside the prefix */
+    TWOM_SORTEDKEYS      = 1<<17,   /* For fetch_many, the keys are already in sorted order */
+    TWOM_REVERSE         = 1<<18,   /* For cursor, iterate backwards from the key (or the end of the prefix) */
+    TWOM_INCLUSIVE       = 1<<19,   /* For a range foreach or cursor end, include the end key itself */
+    TWOM_EXACT           = 1<<20,   /* For estimate_range, count every record rather than estimating */
+    TWOM_THREADSAFE      = 1<<21,   /* Share the handle between threads: one mapping, and in-process locking in front of the file locks */
+    TWOM_SHM             = 1<<22,   /* when creating, mark the file to keep lock hints in shared memory named for the UUID, so readers mostly skip the locking syscalls */
+    TWOM_WARMUP          = 1<<23,   /* Start reading in the top skip levels of each file as it's first locked, before the first searches fault them in */
+    TWOM_BLOOM           = 1<<24,   /* keep a filter of the keys in fname.BLOOM when creating or repacking, so most fetches of missing keys don't search */
 
+    TWOM_BLOBS           = 1<<25,   /* keep values over blob_threshold in fname.BLOBS when creating or repacking */
+    TWOM_KEYPREFIX       = 1<<26,   /* store the first 8 bytes of each key in the record head when creating or repacking */
     TWOM_CSUM_NULL       = 1<<27,   /* use the NULL checksum when creating or repacking database */
     TWOM_CSUM_XXH64      = 1<<28,   /* use the XXH64 checksum algorithm when creating or repacking */
+    TWOM_CSUM_XXH3       = 1<<28,   /* the same engine by its accurate name: it has always been XXH3_64bits */
     TWOM_CSUM_EXTERNAL   = 1<<29,   /* use an external checksum algorithm (must be passed in init) */
     TWOM_COMPAR_EXTERNAL = 1<<30    /* use an external comparison function (must be passed in init) */
 };
 
+// how the process expects to read the database, see twom_db_advise
+enum twom_advice {
+    TWOM_ADVICE_NORMAL = 0,     /* the kernel's usual readahead */
+    TWOM_ADVICE_RANDOM = 1,     /* mostly point lookups: don't read ahead around each fault */
+    TWOM_ADVICE_SEQUENTIAL = 2, /* mostly whole-database scans: read ahead further */
+    TWOM_ADVICE_WILLNEED = 3,   /* just once: start reading in the whole file now */
+};
+
 typedef int twom_cb(void *rock,
                     const char *key, size_t keylen,
                     const char *data, size_t datalen);
 typedef int twom_compar(const char *s1, size_t l1, const char *s2, size_t l2);
 typedef uint32_t twom_csum(const char *s, size_t l);
+/* compress src into dst, which has room for dstlen bytes, returning the length
+ * used.  0 (or anything not shorter than srclen) keeps this value as it is */
+typedef size_t twom_compress(const char *src, size_t srclen, char *dst, size_t dstlen);
+/* the reverse: dst has room for exactly the original dstlen bytes, and anything
+ * other than dstlen returned is an error */
+typedef size_t twom_decompress(const char *src, size_t srclen, char *dst, size_t dstlen);
 
 struct twom_open_data {
     uint32_t flags;
     twom_compar *compar;
     twom_csum *csum;
     void (*error)(const char *msg, const char *fmt, ...);
+    size_t reserve;     /* address space to reserve so the mapping can grow in place (0: none) */
+    size_t growth;      /* extend the file by at least this much at a time (0: just 25%) */
+    size_t blob_threshold;  /* with TWOM_BLOBS, values larger than this go in the blob file (0: 64KB) */
+    twom_compress *compress;    /* compress values when creating or repacking (NULL: don't) */
+    twom_decompress *decompress;    /* needed to read a file with compressed values */
+    size_t compress_threshold;  /* with compress, values larger than this are compressed (0: 256 bytes) */
+};
+
+#define TWOM_OPEN_DATA_INITIALIZER { 0, NULL, NULL, NULL, 0, 0, 0, NULL, NULL, 0 }
+
+// counters kept per database handle, see twom_db_stats
+struct twom_stats {
+    uint64_t locates;           /* searches from the top of the skiplist */
+    uint64_t locate_levels;     /* skip levels descended while searching */
+    uint64_t compars;           /* key comparisons while searching */
+    uint64_t findloc_fast;      /* lookups answered from the previous location */
+    uint64_t findloc_finger;    /* lookups ahead of the previous location, climbing from there */
+    uint64_t findloc_full;      /* lookups which needed a full locate */
+    uint64_t relocates;         /* iterations re-located because the file changed */
+    uint64_t locs_kept;         /* locations still right after the file was extended, so not searched again */
+    uint64_t headcsums;         /* record head checksums verified */
+    uint64_t tailcsums;         /* record tail checksums verified */
+    uint64_t tailcsums_cached;  /* tail checksums skipped, already verified (TWOM_CSUMCACHE) */
+    uint64_t extends;           /* file extended to make space for writes */
+    uint64_t remaps;            /* file mapped or remapped (including extends) */
+    uint64_t syncs;             /* msync or fdatasync calls */
+    uint64_t sync_bytes;        /* bytes passed to msync */
+    uint64_t sync_usec;         /* time spent syncing */
+    uint64_t headlocks;         /* header (gate) locks taken */
+    uint64_t headlock_usec;     /* time spent waiting for them */
+    uint64_t datalocks;         /* data locks taken */
+    uint64_t datalock_usec;     /* time spent waiting for them */
+    uint64_t yields;            /* read locks released during a long foreach or cursor */
+    uint64_t gate_relocks;      /* relocks after a yield which took the header lock too */
+    uint64_t unlocked_fetches;  /* fetches answered without taking a lock (TWOM_SHM) */
+    uint64_t recoveries;        /* dirty files recovered, after a crash or an abort */
+    uint64_t tail_recoveries;   /* of those, done from just the uncommitted records */
+    uint64_t bloom_negatives;   /* fetches answered NOTFOUND by the key filter, without searching (TWOM_BLOOM) */
+    uint64_t compressions;      /* values written compressed */
+    uint64_t decompressions;    /* compressed values read back */
+};
+
+// how far a twom_db_scrub has got, passed to its callback after each slice
+struct twom_scrub_progress {
+    size_t ranges;              /* ranges the keyspace was split into */
+    size_t ranges_done;         /* of those, checked to the end (or until they failed) */
+    size_t ranges_bad;          /* of those, failed */
+    uint64_t records;           /* records read, including old versions and tombstones */
+    uint64_t bytes;             /* bytes read, including blob values */
+    uint64_t total_bytes;       /* the size of the snapshot */
+    int finished;               /* this is the last call */
+    int result;                 /* when finished, what twom_db_scrub returns */
+};
+
+typedef int twom_scrub_cb(void *rock, const struct twom_scrub_progress *progress);
+
+// where twom_db_changes_since got to, to carry on from there next time
+struct twom_changepos {
+    char uuid[37];              /* the database's UUID, or empty to start from the beginning */
+    uint64_t generation;        /* which file: a repack starts a new one, and the offsets with it */
+    uint64_t offset;            /* just after the last commit delivered */
 };
 
-#define TWOM_OPEN_DATA_INITIALIZER { 0, NULL, NULL, NULL }
+#define TWOM_CHANGEPOS_INITIALIZER { "", 0, 0 }
+
+// how a sharded database splits its keys between files, see twom_shards_open
+struct twom_shards_open_data {
+    struct twom_open_data db;   /* how each shard is opened */
+    size_t nshards;             /* when creating: this many shards, chosen by key hash */
+    size_t nsplits;             /* or nsplits+1 shards by key range, each split key (ascending) starting the next */
+    const char * const *splits;
+    const size_t *splitlens;
+    int atomic;                 /* commit transactions through a journal, so a crash leaves all of one or none */
+};
+#define TWOM_SHARDS_OPEN_DATA_INITIALIZER { TWOM_OPEN_DATA_INITIALIZER, 0, 0, NULL, NULL, 0 }
 
 // database operations
 int twom_db_open(const char *fname, struct twom_open_data *setup,
@@ -87,21 +190,49 @@ int twom_db_foreach(struct twom_db *db,
                     const char *prefix, size_t prefixlen,
                     twom_cb *p, twom_cb *cb, void *rock,
                     int flags);
+int twom_db_foreach_range(struct twom_db *db,
+                          const char *start, size_t startlen,
+                          const char *end, size_t endlen, size_t limit,
+                          twom_cb *p, twom_cb *cb, void *rock,
+                          int flags);
 int twom_db_store(struct twom_db *db,
                   const char *key, size_t keylen,
                   const char *val, size_t vallen,
                   int flags);
+int twom_db_bulkload(struct twom_db *db, size_t nrecords,
+                     const char * const *keys, const size_t *keylens,
+                     const char * const *vals, const size_t *vallens,
+                     int flags);
 
 // utility
 int twom_db_dump(struct twom_db *, int detail);
 int twom_db_repair(struct twom_db *db, size_t *nfixedp);
 int twom_db_check_consistency(struct twom_db *db);
+// the same against an MVCC snapshot, checksums too, on 'jobs' threads at up to 'rate' bytes/sec (0: no limit)
+int twom_db_scrub(struct twom_db *db, int jobs, size_t rate,
+                  twom_scrub_cb *cb, void *rock);
 int twom_db_repack(struct twom_db *db);
+// copy the database as it is, while writers carry on, to fname (and fname.BLOBS);
+// or to an open file, for databases without a blob file
+int twom_db_backup(struct twom_db *db, const char *fname);
+int twom_db_backup_fd(struct twom_db *db, int fd);
+// replication: call cb for each change committed since pos (NULL data for a delete),
+// in order, and move pos along.  TWOM_NOTFOUND if a repack has made pos meaningless
+int twom_db_changes_since(struct twom_db *db, struct twom_changepos *pos,
+                          twom_cb *cb, void *rock);
 bool twom_db_should_repack(struct twom_db *db); // returns 1 for true
+// repack a slice at a time: 0 while there's more to do, TWOM_DONE when finished
+int twom_db_repack_step(struct twom_db *db, size_t budget_bytes, size_t budget_usec);
+int twom_db_repack_abort(struct twom_db *db);
 
 // release any read lock if doing something else for a while
 int twom_db_yield(struct twom_db *db);
 
+// page cache hints: how the mapping will be read (enum twom_advice), and
+// start reading in everything under a prefix before a big scan of it
+int twom_db_advise(struct twom_db *db, int advice);
+int twom_db_prefetch(struct twom_db *db, const char *prefix, size_t prefixlen);
+
 // cursor operations
 int twom_db_begin_cursor(struct twom_db *db,
                          const char *key, size_t keylen,
@@ -110,6 +241,13 @@ int twom_cursor_next(struct twom_cursor *cur,
                      const char **keyp, size_t *keylenp,
                      const char **valp, size_t *vallenp);
 
+int twom_cursor_prev(struct twom_cursor *cur,
+                     const char **keyp, size_t *keylenp,
+                     const char **valp, size_t *vallenp);
+
+int twom_cursor_set_end(struct twom_cursor *cur,
+                        const char *end, size_t endlen,
+                        size_t limit, int flags);
 int twom_cursor_replace(struct twom_cursor *cur,
                         const char *val, size_t vallen,
                         int flags);
@@ -132,15 +270,80 @@ int twom_txn_fetch(struct twom_txn *txn,
                    const char **keyp, size_t *keylenp,
                    const char **valp, size_t *vallenp,
                    int flags);
+int twom_txn_fetch_many(struct twom_txn *txn, size_t nkeys,
+                        const char * const *keys, const size_t *keylens,
+                        twom_cb *cb, void *rock, int flags);
 int twom_txn_foreach(struct twom_txn *txn,
                      const char *prefix, size_t prefixlen,
                      twom_cb *p, twom_cb *cb, void *rock,
                      int flags);
+int twom_txn_foreach_range(struct twom_txn *txn,
+                           const char *start, size_t startlen,
+                           const char *end, size_t endlen, size_t limit,
+                           twom_cb *p, twom_cb *cb, void *rock,
+                           int flags);
+int twom_txn_estimate_range(struct twom_txn *txn,
+                            const char *start, size_t startlen,
+                            const char *end, size_t endlen,
+                            size_t *nrecordsp, size_t *nbytesp,
+                            int flags);
 int twom_txn_store(struct twom_txn *txn,
                    const char *key, size_t keylen,
                    const char *val, size_t vallen,
                    int flags);
+int twom_txn_append_sorted(struct twom_txn *txn,
+                           const char *key, size_t keylen,
+                           const char *val, size_t vallen,
+                           int flags);
+// keys in ascending order, NULL vals delete; flags and rets (one each per record) may be NULL
+int twom_txn_store_batch(struct twom_txn *txn, size_t nrecords,
+                         const char * const *keys, const size_t *keylens,
+                         const char * const *vals, const size_t *vallens,
+                         const int *flags, int *rets);
+// changes from twom_db_changes_since, in the order they were made; NULL vals delete
+int twom_txn_apply_changes(struct twom_txn *txn, size_t nchanges,
+                           const char * const *keys, const size_t *keylens,
+                           const char * const *vals, const size_t *vallens);
 
+// sharded databases: several files in a directory, each with its own lock
+int twom_shards_open(const char *dirname, struct twom_shards_open_data *setup,
+                     struct twom_shards **shardsp);
+int twom_shards_close(struct twom_shards **shardsp);
+size_t twom_shards_count(struct twom_shards *shards);
+size_t twom_shards_which(struct twom_shards *shards, const char *key, size_t keylen);
+struct twom_db *twom_shards_db(struct twom_shards *shards, size_t shard);
+int twom_shards_fetch(struct twom_shards *shards,
+                      const char *key, size_t keylen,
+                      const char **valp, size_t *vallenp,
+                      int flags);
+int twom_shards_store(struct twom_shards *shards,
+                      const char *key, size_t keylen,
+                      const char *val, size_t vallen,
+                      int flags);
+int twom_shards_foreach(struct twom_shards *shards,
+                        const char *prefix, size_t prefixlen,
+                        twom_cb *p, twom_cb *cb, void *rock,
+                        int flags);
+// changes are kept in memory and written to each shard in turn at commit
+int twom_shards_begin_txn(struct twom_shards *shards, struct twom_shards_txn **txnp);
+int twom_shards_txn_fetch(struct twom_shards_txn *txn,
+                          const char *key, size_t keylen,
+                          const char **valp, size_t *vallenp,
+                          int flags);
+int twom_shards_txn_store(struct twom_shards_txn *txn,
+                          const char *key, size_t keylen,
+                          const char *val, size_t vallen,
+                          int flags);
+int twom_shards_txn_commit(struct twom_shards_txn **txnp);
+int twom_shards_txn_abort(struct twom_shards_txn **txnp);
+// reads every shard at once, merging them into key order
+int twom_shards_begin_cursor(struct twom_shards *shards,
+                             const char *key, size_t keylen,
+                             struct twom_shards_cursor **curp, int flags);
+int twom_shards_cursor_next(struct twom_shards_cursor *cur,
+                            const char **keyp, size_t *keylenp,
+                            const char **valp, size_t *vallenp);
+void twom_shards_cursor_fini(struct twom_shards_cursor **curp);
 // header info
 size_t twom_db_generation(struct twom_db *db);
 size_t twom_db_num_records(struct twom_db *db);
@@ -148,6 +351,10 @@ size_t twom_db_size(struct twom_db *db);
 const char *twom_db_fname(struct twom_db *db);
 const char *twom_db_uuid(struct twom_db *db);
 int twom_db_sync(struct twom_db *db);
+size_t twom_db_commit_seq(struct twom_db *db);
+size_t twom_db_durable_seq(struct twom_db *db);
+void twom_db_stats(struct twom_db *db, struct twom_stats *stats);
+void twom_db_reset_stats(struct twom_db *db);
 const char *twom_strerror(int r);
 
 #endif /* INCLUDED_TWOM_H */
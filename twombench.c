@@ -0,0 +1,668 @@
+/* twombench.c -- workload benchmarks for twom databases
+ *
+ * Available under any of: CC0-1.0, 0BSD, or MIT-0
+ * See LICENSE-CC0, LICENSE-0BSD, or LICENSE-MIT-0 for details.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "twom.h"
+
+struct bench_opts {
+    const char *dir;
+    size_t count;
+    size_t batch;
+    size_t vallen;
+    int readers;
+    unsigned seed;
+    uint32_t flags;
+};
+
+struct bench_result {
+    const char *name;
+    size_t ops;
+    double seconds;
+    uint64_t *lat;      // per-op latency in nanoseconds
+    size_t nlat;
+    size_t start_size;
+    size_t end_size;
+    size_t msync_bytes;
+    size_t commits;
+};
+
+static struct bench_opts opts = {
+    NULL, 100000, 1000, 64, 4, 1, 0
+};
+
+static char fname[PATH_MAX];
+static char *valbuf;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift, so that runs with the same seed do the same work on every platform */
+static uint64_t rng_state;
+
+static void rng_seed(unsigned seed)
+{
+    rng_state = 0x9E3779B97F4A7C15ULL * (seed + 1);
+}
+
+static uint64_t rng_next(void)
+{
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+static size_t make_key(char *buf, size_t n)
+{
+    return snprintf(buf, 32, "key%012zu", n);
+}
+
+static size_t make_misskey(char *buf, size_t n)
+{
+    return snprintf(buf, 32, "key%012zu-miss", n);
+}
+
+static void die(const char *what, int r)
+{
+    fprintf(stderr, "twombench: %s: %s\n", what, twom_strerror(r));
+    exit(1);
+}
+
+static struct twom_db *bench_open(uint32_t extra)
+{
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    struct twom_db *db = NULL;
+    init.flags = TWOM_CREATE | opts.flags | extra;
+    int r = twom_db_open(fname, &init, &db, NULL);
+    if (r) die("open", r);
+    return db;
+}
+
+static size_t file_size(void)
+{
+    struct stat sbuf;
+    if (stat(fname, &sbuf)) return 0;
+    return sbuf.st_size;
+}
+
+/* the library counts what it passes to msync, since the workload started */
+static void note_commit(struct twom_db *db, struct bench_result *res)
+{
+    struct twom_stats stats;
+    twom_db_stats(db, &stats);
+    res->commits++;
+    res->msync_bytes = stats.sync_bytes;
+}
+
+static void result_init(struct bench_result *res, const char *name, size_t nlat)
+{
+    memset(res, 0, sizeof(*res));
+    res->name = name;
+    res->lat = calloc(nlat ? nlat : 1, sizeof(uint64_t));
+    res->start_size = file_size();
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *lat, size_t n, double pct)
+{
+    if (!n) return 0;
+    size_t i = (size_t)(pct * (n - 1));
+    return lat[i] / 1000.0;
+}
+
+static void result_print(struct bench_result *res)
+{
+    res->end_size = file_size();
+    qsort(res->lat, res->nlat, sizeof(uint64_t), cmp_u64);
+    printf("%-14s %9zu ops %10.0f ops/s  p50 %8.2fus  p99 %8.2fus  p999 %8.2fus"
+           "  growth %+10lld  msync %12zu  commits %zu\n",
+           res->name, res->ops,
+           res->seconds > 0 ? res->ops / res->seconds : 0.0,
+           percentile_us(res->lat, res->nlat, 0.50),
+           percentile_us(res->lat, res->nlat, 0.99),
+           percentile_us(res->lat, res->nlat, 0.999),
+           (long long)res->end_size - (long long)res->start_size,
+           res->msync_bytes, res->commits);
+    fflush(stdout);
+    free(res->lat);
+    res->lat = NULL;
+}
+
+static void reset_db(void)
+{
+    unlink(fname);
+}
+
+/* store opts.count keys in the given order, committing every opts.batch */
+static void insert_keys(struct twom_db *db, size_t *order, struct bench_result *res)
+{
+    struct twom_txn *txn = NULL;
+    char key[32];
+    int r;
+
+    if (res) twom_db_reset_stats(db);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < opts.count; i++) {
+        uint64_t t0 = now_ns();
+        if (!txn) {
+            r = twom_db_begin_txn(db, 0, &txn);
+            if (r) die("begin_txn", r);
+        }
+        size_t keylen = make_key(key, order ? order[i] : i);
+        r = twom_txn_store(txn, key, keylen, valbuf, opts.vallen, 0);
+        if (r) die("store", r);
+        if ((i + 1) % opts.batch == 0 || i + 1 == opts.count) {
+            r = twom_txn_commit(&txn);
+            if (r) die("commit", r);
+            if (res) note_commit(db, res);
+        }
+        if (res) res->lat[res->nlat++] = now_ns() - t0;
+    }
+    if (res) {
+        res->seconds = (now_ns() - start) / 1e9;
+        res->ops = opts.count;
+    }
+}
+
+static size_t *shuffled(size_t n)
+{
+    size_t *order = malloc(n * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    for (size_t i = n; i > 1; i--) {
+        size_t j = rng_next() % i;
+        size_t tmp = order[i-1];
+        order[i-1] = order[j];
+        order[j] = tmp;
+    }
+    return order;
+}
+
+static void preload(void)
+{
+    reset_db();
+    struct twom_db *db = bench_open(0);
+    insert_keys(db, NULL, NULL);
+    twom_db_close(&db);
+}
+
+/*************** workloads ***************/
+
+static void bench_seqinsert(void)
+{
+    struct bench_result res;
+    reset_db();
+    result_init(&res, "seqinsert", opts.count);
+    struct twom_db *db = bench_open(0);
+    insert_keys(db, NULL, &res);
+    twom_db_close(&db);
+    result_print(&res);
+}
+
+static void bench_randinsert(void)
+{
+    struct bench_result res;
+    size_t *order = shuffled(opts.count);
+    reset_db();
+    result_init(&res, "randinsert", opts.count);
+    struct twom_db *db = bench_open(0);
+    insert_keys(db, order, &res);
+    twom_db_close(&db);
+    result_print(&res);
+    free(order);
+}
+
+/* the same records as seqinsert, through the sorted append path */
+static void bench_bulkload(void)
+{
+    struct bench_result res;
+    struct twom_txn *txn = NULL;
+    char key[32];
+    int r;
+
+    reset_db();
+    result_init(&res, "bulkload", opts.count);
+    struct twom_db *db = bench_open(0);
+    twom_db_reset_stats(db);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < opts.count; i++) {
+        uint64_t t0 = now_ns();
+        if (!txn) {
+            r = twom_db_begin_txn(db, 0, &txn);
+            if (r) die("begin_txn", r);
+        }
+        size_t keylen = make_key(key, i);
+        r = twom_txn_append_sorted(txn, key, keylen, valbuf, opts.vallen, 0);
+        if (r) die("append_sorted", r);
+        if ((i + 1) % opts.batch == 0 || i + 1 == opts.count) {
+            r = twom_txn_commit(&txn);
+            if (r) die("commit", r);
+            note_commit(db, &res);
+        }
+        res.lat[res.nlat++] = now_ns() - t0;
+    }
+    res.seconds = (now_ns() - start) / 1e9;
+    res.ops = opts.count;
+
+    twom_db_close(&db);
+    result_print(&res);
+}
+
+/* one record per commit, with the commits made durable opts.batch at a time */
+static void bench_groupcommit(void)
+{
+    struct bench_result res;
+    char key[32];
+    int r;
+
+    reset_db();
+    result_init(&res, "groupcommit", opts.count);
+    struct twom_db *db = bench_open(0);
+    twom_db_reset_stats(db);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < opts.count; i++) {
+        uint64_t t0 = now_ns();
+        size_t keylen = make_key(key, i);
+        r = twom_db_store(db, key, keylen, valbuf, opts.vallen, TWOM_NOSYNC);
+        if (r) die("store", r);
+        if ((i + 1) % opts.batch == 0 || i + 1 == opts.count) {
+            r = twom_db_sync(db);
+            if (r) die("sync", r);
+            note_commit(db, &res);
+        }
+        res.lat[res.nlat++] = now_ns() - t0;
+    }
+    res.seconds = (now_ns() - start) / 1e9;
+    res.ops = opts.count;
+    res.commits = opts.count;
+
+    twom_db_close(&db);
+    result_print(&res);
+}
+
+static void run_lookups(const char *name, size_t (*mkkey)(char *, size_t), int want)
+{
+    struct bench_result res;
+    struct twom_txn *txn = NULL;
+    char key[32];
+
+    preload();
+    result_init(&res, name, opts.count);
+    struct twom_db *db = bench_open(TWOM_SHARED);
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) die("begin_txn", r);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < opts.count; i++) {
+        size_t keylen = mkkey(key, rng_next() % opts.count);
+        const char *val = NULL;
+        size_t vallen = 0;
+        uint64_t t0 = now_ns();
+        r = twom_txn_fetch(txn, key, keylen, NULL, NULL, &val, &vallen, 0);
+        res.lat[res.nlat++] = now_ns() - t0;
+        if (r != want) die("fetch", r);
+    }
+    res.seconds = (now_ns() - start) / 1e9;
+    res.ops = opts.count;
+
+    twom_txn_abort(&txn);
+    twom_db_close(&db);
+    result_print(&res);
+}
+
+static void bench_lookuphit(void)
+{
+    run_lookups("lookup-hit", make_key, TWOM_OK);
+}
+
+static void bench_lookupmiss(void)
+{
+    run_lookups("lookup-miss", make_misskey, TWOM_NOTFOUND);
+}
+
+static void bench_prefixscan(void)
+{
+    struct bench_result res;
+    struct twom_txn *txn = NULL;
+    char prefix[32];
+    size_t nscans = opts.count / 1000 + 1;
+    size_t records = 0;
+
+    preload();
+    result_init(&res, "prefixscan", nscans);
+    struct twom_db *db = bench_open(TWOM_SHARED);
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) die("begin_txn", r);
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < nscans; i++) {
+        /* the first 12 characters of a key cover 1000 records */
+        make_key(prefix, rng_next() % opts.count);
+        struct twom_cursor *cur = NULL;
+        uint64_t t0 = now_ns();
+        r = twom_txn_begin_cursor(txn, prefix, 12, &cur, TWOM_CURSOR_PREFIX);
+        if (r) die("begin_cursor", r);
+        const char *key, *val;
+        size_t keylen, vallen;
+        while (!twom_cursor_next(cur, &key, &keylen, &val, &vallen))
+            records++;
+        twom_cursor_fini(&cur);
+        res.lat[res.nlat++] = now_ns() - t0;
+    }
+    res.seconds = (now_ns() - start) / 1e9;
+    res.ops = nscans;
+
+    twom_txn_abort(&txn);
+    twom_db_close(&db);
+    result_print(&res);
+    printf("%-14s %9zu records scanned\n", "", records);
+}
+
+/* child process which does random fetches until it's killed, and reports
+ * the number of lookups and its worst-case latency through the pipe */
+static volatile sig_atomic_t stopping;
+
+static void on_term(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+static void reader_child(int fd)
+{
+    char key[32];
+    uint64_t counts[2] = { 0, 0 };
+
+    signal(SIGTERM, on_term);
+    struct twom_db *db = bench_open(TWOM_SHARED);
+    while (!stopping) {
+        size_t keylen = make_key(key, rng_next() % opts.count);
+        uint64_t t0 = now_ns();
+        int r = twom_db_fetch(db, key, keylen, NULL, NULL, NULL, NULL, 0);
+        uint64_t lat = now_ns() - t0;
+        if (r && r != TWOM_NOTFOUND) die("fetch", r);
+        counts[0]++;
+        if (lat > counts[1]) counts[1] = lat;
+    }
+    twom_db_close(&db);
+    if (write(fd, counts, sizeof(counts)) != sizeof(counts)) _exit(1);
+    _exit(0);
+}
+
+/* child process which stores random keys in small transactions until killed */
+static void writer_child(int fd)
+{
+    char key[32];
+    uint64_t counts[2] = { 0, 0 };
+
+    signal(SIGTERM, on_term);
+    struct twom_db *db = bench_open(0);
+    while (!stopping) {
+        size_t keylen = make_key(key, rng_next() % opts.count);
+        uint64_t t0 = now_ns();
+        int r = twom_db_store(db, key, keylen, valbuf, opts.vallen, 0);
+        uint64_t lat = now_ns() - t0;
+        if (r) die("store", r);
+        counts[0]++;
+        if (lat > counts[1]) counts[1] = lat;
+    }
+    twom_db_close(&db);
+    if (write(fd, counts, sizeof(counts)) != sizeof(counts)) _exit(1);
+    _exit(0);
+}
+
+static pid_t spawn(void (*fn)(int), int fd, unsigned seed)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (!pid) {
+        rng_seed(seed);
+        fn(fd);
+    }
+    return pid;
+}
+
+static void reap(const char *role, pid_t *pids, int n, int fd)
+{
+    uint64_t total = 0, worst = 0;
+    for (int i = 0; i < n; i++) kill(pids[i], SIGTERM);
+    for (int i = 0; i < n; i++) {
+        uint64_t counts[2];
+        if (read(fd, counts, sizeof(counts)) == sizeof(counts)) {
+            total += counts[0];
+            if (counts[1] > worst) worst = counts[1];
+        }
+        waitpid(pids[i], NULL, 0);
+    }
+    printf("%-14s %9llu ops by %d %s processes, max latency %.2fus\n", "",
+           (unsigned long long)total, n, role, worst / 1000.0);
+}
+
+static void bench_mixed(void)
+{
+    struct bench_result res;
+    pid_t pids[opts.readers > 0 ? opts.readers : 1];
+    int fds[2];
+
+    preload();
+    if (pipe(fds)) {
+        perror("pipe");
+        exit(1);
+    }
+    for (int i = 0; i < opts.readers; i++)
+        pids[i] = spawn(reader_child, fds[1], opts.seed + 100 + i);
+
+    result_init(&res, "mixed", opts.count);
+    size_t *order = shuffled(opts.count);
+    struct twom_db *db = bench_open(0);
+    insert_keys(db, order, &res);
+    twom_db_close(&db);
+    free(order);
+
+    result_print(&res);
+    reap("reader", pids, opts.readers, fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void bench_repack(void)
+{
+    struct bench_result res;
+    pid_t pids[opts.readers > 0 ? opts.readers : 1];
+    int fds[2];
+    size_t nrepacks = 10;
+
+    preload();
+    if (pipe(fds)) {
+        perror("pipe");
+        exit(1);
+    }
+    for (int i = 0; i < opts.readers; i++)
+        pids[i] = spawn(writer_child, fds[1], opts.seed + 200 + i);
+
+    result_init(&res, "repack", nrepacks);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < nrepacks; i++) {
+        struct twom_db *db = bench_open(0);
+        uint64_t t0 = now_ns();
+        int r = twom_db_repack(db);
+        res.lat[res.nlat++] = now_ns() - t0;
+        if (r) die("repack", r);
+        twom_db_close(&db);
+    }
+    res.seconds = (now_ns() - start) / 1e9;
+    res.ops = nrepacks;
+
+    result_print(&res);
+    reap("writer", pids, opts.readers, fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} workloads[] = {
+    { "seqinsert",   bench_seqinsert },
+    { "randinsert",  bench_randinsert },
+    { "bulkload",    bench_bulkload },
+    { "groupcommit", bench_groupcommit },
+    { "lookup-hit",  bench_lookuphit },
+    { "lookup-miss", bench_lookupmiss },
+    { "prefixscan",  bench_prefixscan },
+    { "mixed",       bench_mixed },
+    { "repack",      bench_repack },
+    { NULL, NULL }
+};
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [options] [<workload>...]\n", progname);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -d, --dir <path>      directory for the benchmark database (default $TMPDIR or /tmp)\n");
+    fprintf(stderr, "  -c, --count <n>       number of records / operations (default 100000)\n");
+    fprintf(stderr, "  -b, --batch <n>       records per write transaction (default 1000)\n");
+    fprintf(stderr, "  -v, --vallen <n>      value length in bytes (default 64)\n");
+    fprintf(stderr, "  -p, --procs <n>       reader/writer processes for mixed and repack (default 4)\n");
+    fprintf(stderr, "  -s, --seed <n>        random seed (default 1)\n");
+    fprintf(stderr, "  -K, --keyprefix       store key prefixes in the record heads\n");
+    fprintf(stderr, "  -N, --no-checksum     disable checksums\n");
+    fprintf(stderr, "  -S, --no-sync         don't fsync writes\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Workloads (default: all):\n");
+    for (int i = 0; workloads[i].name; i++)
+        fprintf(stderr, "  %s\n", workloads[i].name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char short_options[] = "b:c:d:KNSp:s:v:";
+
+    static const struct option long_options[] = {
+        { "batch",       required_argument, NULL, 'b' },
+        { "count",       required_argument, NULL, 'c' },
+        { "dir",         required_argument, NULL, 'd' },
+        { "keyprefix",   no_argument,       NULL, 'K' },
+        { "no-checksum", no_argument,       NULL, 'N' },
+        { "no-sync",     no_argument,       NULL, 'S' },
+        { "procs",       required_argument, NULL, 'p' },
+        { "seed",        required_argument, NULL, 's' },
+        { "vallen",      required_argument, NULL, 'v' },
+        { 0, 0, 0, 0 },
+    };
+
+    int opt;
+    while (-1 != (opt = getopt_long(argc, argv, short_options,
+                                    long_options, NULL)))
+    {
+        switch (opt) {
+        case 'b':
+            opts.batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            opts.count = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            opts.dir = optarg;
+            break;
+        case 'K':
+            opts.flags |= TWOM_KEYPREFIX;
+            break;
+        case 'N':
+            opts.flags |= TWOM_NOCSUM | TWOM_CSUM_NULL;
+            break;
+        case 'S':
+            opts.flags |= TWOM_NOSYNC;
+            break;
+        case 'p':
+            opts.readers = atoi(optarg);
+            break;
+        case 's':
+            opts.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            opts.vallen = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!opts.count || !opts.batch || opts.readers < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        int j;
+        for (j = 0; workloads[j].name; j++)
+            if (!strcmp(argv[i], workloads[j].name)) break;
+        if (!workloads[j].name) {
+            fprintf(stderr, "unknown workload: %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!opts.dir) opts.dir = getenv("TMPDIR");
+    if (!opts.dir) opts.dir = "/tmp";
+    snprintf(fname, sizeof(fname), "%s/twombench.%d.db", opts.dir, (int)getpid());
+
+    valbuf = malloc(opts.vallen + 1);
+    memset(valbuf, 'v', opts.vallen);
+
+    printf("twombench: count=%zu batch=%zu vallen=%zu procs=%d seed=%u%s%s%s\n",
+           opts.count, opts.batch, opts.vallen, opts.readers, opts.seed,
+           (opts.flags & TWOM_NOSYNC) ? " nosync" : "",
+           (opts.flags & TWOM_NOCSUM) ? " nocsum" : "",
+           (opts.flags & TWOM_KEYPREFIX) ? " keyprefix" : "");
+
+    for (int i = 0; workloads[i].name; i++) {
+        if (optind < argc) {
+            int j;
+            for (j = optind; j < argc; j++)
+                if (!strcmp(argv[j], workloads[i].name)) break;
+            if (j == argc) continue;
+        }
+        rng_seed(opts.seed);
+        workloads[i].fn();
+    }
+
+    reset_db();
+    free(valbuf);
+    return 0;
+}
@@ -10,9 +10,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -3188,6 +3191,9 @@ static void test_strerror(void)
     s = twom_strerror(TWOM_READONLY);
     ASSERT_NOT_NULL(s);
 
+    s = twom_strerror(TWOM_BADFORMAT);
+    ASSERT_STR_EQ(s, "Bad format");
+
     /* unknown code should still return something */
     s = twom_strerror(-999);
     ASSERT_NOT_NULL(s);
@@ -3722,6 +3728,315 @@ static void test_delete_readd(void)
     ASSERT_OK(r);
 }
 
+/*
+ * ============================================================
+ * test_backup
+ *
+ * A backup is a clean copy of the database as it was, blob
+ * file and all, which later changes to the original don't
+ * touch.  A backup to a file descriptor can't take the blob
+ * file with it, and neither kind can be made from inside a
+ * write transaction.
+ * ============================================================
+ */
+static void test_backup(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_db *bdb = NULL;
+    struct twom_txn *txn = NULL;
+    char path[PATH_MAX];
+    char key[32];
+    char val[3000];
+    int r, n, fd;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE | TWOM_BLOBS;
+    init.blob_threshold = 1000;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    memset(val, 'v', sizeof(val));
+    for (n = 0; n < 1000; n++) {
+        snprintf(key, sizeof(key), "key%04d", n);
+        CANSTORE(key, strlen(key), val, n % 10 ? 100 : sizeof(val));
+    }
+    CANCOMMIT();
+    CANDELETE("key0005", 7);
+    CANSTORE("key0006", 7, "new", 3);
+    CANCOMMIT();
+
+    r = twom_db_backup(db, filename2);
+    ASSERT_OK(r);
+
+    /* changes afterwards aren't in it */
+    CANSTORE("key0007", 7, "after", 5);
+    CANSTORE("key0010", 7, "after", 5);
+    CANSTORE("late", 4, "after", 5);
+    CANCOMMIT();
+
+    struct twom_open_data binit = TWOM_OPEN_DATA_INITIALIZER;
+    r = twom_db_open(filename2, &binit, &bdb, NULL);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_num_records(bdb), 999);
+    ASSERT_STR_EQ(twom_db_uuid(bdb), twom_db_uuid(db));
+    r = twom_db_check_consistency(bdb);
+    ASSERT_OK(r);
+    r = twom_db_scrub(bdb, 1, 0, NULL, NULL);
+    ASSERT_OK(r);
+    r = twom_db_fetch(bdb, "key0005", 7, NULL, NULL, NULL, NULL, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    r = twom_db_fetch(bdb, "late", 4, NULL, NULL, NULL, NULL, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    {
+        const char *v;
+        size_t vl;
+        r = twom_db_fetch(bdb, "key0006", 7, NULL, NULL, &v, &vl, 0);
+        ASSERT_OK(r);
+        ASSERT_EQ(vl, 3);
+        ASSERT_MEM_EQ(v, "new", 3);
+        r = twom_db_fetch(bdb, "key0010", 7, NULL, NULL, &v, &vl, 0);
+        ASSERT_OK(r);
+        ASSERT_EQ(vl, sizeof(val));
+        ASSERT_MEM_EQ(v, val, sizeof(val));
+    }
+    /* and it's a database like any other */
+    r = twom_db_store(bdb, "more", 4, "x", 1, 0);
+    ASSERT_OK(r);
+    r = twom_db_close(&bdb);
+    ASSERT_OK(r);
+
+    /* a file descriptor can't take the blob file */
+    snprintf(path, sizeof(path), "%s.copy", filename2);
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    r = twom_db_backup_fd(db, fd);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+
+    /* nor from the middle of a write */
+    CANSTORE("key0001", 7, "busy", 4);
+    r = twom_db_backup(db, filename2);
+    ASSERT_EQ(r, TWOM_LOCKED);
+    CANCOMMIT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* without blobs it can */
+    unlink(filename);
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    for (n = 0; n < 100; n++) {
+        snprintf(key, sizeof(key), "key%04d", n);
+        CANSTORE(key, strlen(key), val, 10);
+    }
+    CANCOMMIT();
+    r = twom_db_backup_fd(db, fd);
+    ASSERT_OK(r);
+    close(fd);
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    r = twom_db_open(path, &binit, &bdb, NULL);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_num_records(bdb), 100);
+    r = twom_db_check_consistency(bdb);
+    ASSERT_OK(r);
+    r = twom_db_close(&bdb);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_changes_since
+ *
+ * Tail the changes from one database and apply them to
+ * another: each call delivers just what was committed since
+ * the last, a callback which stops leaves the position at the
+ * start of that commit, and a repack makes the old position
+ * useless so the replica has to start again.
+ * ============================================================
+ */
+#define MAXCHANGES 256
+struct changes_rock {
+    size_t n;
+    size_t stop;        /* fail on this change (1-based), if set */
+    char *keys[MAXCHANGES];
+    size_t keylens[MAXCHANGES];
+    char *vals[MAXCHANGES];
+    size_t vallens[MAXCHANGES];
+};
+
+static int changes_cb(void *rock, const char *key, size_t keylen,
+                      const char *data, size_t datalen)
+{
+    struct changes_rock *cr = (struct changes_rock *)rock;
+    if (cr->stop && cr->n + 1 == cr->stop) return 99;
+    if (cr->n >= MAXCHANGES) return TWOM_INTERNAL;
+    cr->keys[cr->n] = malloc(keylen);
+    memcpy(cr->keys[cr->n], key, keylen);
+    cr->keylens[cr->n] = keylen;
+    cr->vals[cr->n] = NULL;
+    if (data) {
+        cr->vals[cr->n] = malloc(datalen + 1);
+        memcpy(cr->vals[cr->n], data, datalen);
+    }
+    cr->vallens[cr->n] = datalen;
+    cr->n++;
+    return 0;
+}
+
+static void changes_free(struct changes_rock *cr)
+{
+    size_t i;
+    for (i = 0; i < cr->n; i++) {
+        free(cr->keys[i]);
+        free(cr->vals[i]);
+    }
+    memset(cr, 0, sizeof(*cr));
+}
+
+static int changes_apply(struct twom_db *rdb, struct changes_rock *cr)
+{
+    struct twom_txn *rtxn = NULL;
+    int r = twom_db_begin_txn(rdb, 0, &rtxn);
+    if (r) return r;
+    r = twom_txn_apply_changes(rtxn, cr->n,
+                               (const char * const *)cr->keys, cr->keylens,
+                               (const char * const *)cr->vals, cr->vallens);
+    if (r) {
+        twom_txn_abort(&rtxn);
+        return r;
+    }
+    return twom_txn_commit(&rtxn);
+}
+
+static void test_changes_since(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_db *rdb = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_changepos pos = TWOM_CHANGEPOS_INITIALIZER;
+    struct twom_changepos saved;
+    struct changes_rock cr;
+    const char *v;
+    size_t vl;
+    char key[32];
+    int r, n;
+
+    memset(&cr, 0, sizeof(cr));
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    r = twom_db_open(filename2, &init, &rdb, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 50; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        CANSTORE(key, strlen(key), key, strlen(key));
+    }
+    CANCOMMIT();
+    CANDELETE("key10", 5);
+    CANSTORE("key11", 5, "", 0);
+    CANSTORE("key12", 5, "new", 3);
+    CANCOMMIT();
+
+    /* everything so far, from the start */
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_OK(r);
+    ASSERT_EQ(cr.n, 53);
+    ASSERT_STR_EQ(pos.uuid, twom_db_uuid(db));
+    ASSERT_EQ(pos.generation, twom_db_generation(db));
+    ASSERT_EQ(pos.offset, twom_db_size(db));
+    ASSERT(cr.vals[50] == NULL);
+    ASSERT(cr.vals[51] != NULL);
+    ASSERT_EQ(cr.vallens[51], 0);
+    r = changes_apply(rdb, &cr);
+    ASSERT_OK(r);
+    changes_free(&cr);
+    ASSERT_EQ(twom_db_num_records(rdb), 49);
+    r = twom_db_fetch(rdb, "key10", 5, NULL, NULL, NULL, NULL, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    r = twom_db_fetch(rdb, "key11", 5, NULL, NULL, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(vl, 0);
+    r = twom_db_fetch(rdb, "key12", 5, NULL, NULL, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(vl, 3);
+    ASSERT_MEM_EQ(v, "new", 3);
+
+    /* nothing new, nothing delivered */
+    saved = pos;
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_OK(r);
+    ASSERT_EQ(cr.n, 0);
+    ASSERT_EQ(pos.offset, saved.offset);
+
+    /* then just the new commit */
+    CANSTORE("key20", 5, "twenty", 6);
+    CANDELETE("key21", 5);
+    CANSTORE("key99", 5, "last", 4);
+    CANCOMMIT();
+
+    /* a callback which stops leaves the position before that commit */
+    cr.stop = 2;
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_EQ(r, 99);
+    ASSERT_EQ(pos.offset, saved.offset);
+    changes_free(&cr);
+
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_OK(r);
+    ASSERT_EQ(cr.n, 3);
+    ASSERT_MEM_EQ(cr.keys[1], "key21", 5);
+    ASSERT(cr.vals[1] == NULL);
+    r = changes_apply(rdb, &cr);
+    ASSERT_OK(r);
+    /* and applying them twice is harmless */
+    r = changes_apply(rdb, &cr);
+    ASSERT_OK(r);
+    changes_free(&cr);
+    ASSERT_EQ(twom_db_num_records(rdb), 49);
+    r = twom_db_fetch(rdb, "key20", 5, NULL, NULL, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(v, "twenty", 6);
+
+    /* positions which aren't after a commit, or are for another database */
+    saved = pos;
+    pos.offset -= 8;
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    pos = saved;
+    r = twom_db_changes_since(rdb, &pos, changes_cb, &cr);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    ASSERT_EQ(cr.n, 0);
+
+    /* a repack means starting again */
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    ASSERT_EQ(cr.n, 0);
+    memset(&pos, 0, sizeof(pos));
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_OK(r);
+    ASSERT_EQ(cr.n, 49);
+    ASSERT_EQ(pos.generation, twom_db_generation(db));
+    changes_free(&cr);
+
+    /* not from inside a write */
+    CANSTORE("key40", 5, "busy", 4);
+    r = twom_db_changes_since(db, &pos, changes_cb, &cr);
+    ASSERT_EQ(r, TWOM_LOCKED);
+    CANCOMMIT();
+
+    r = twom_db_close(&rdb);
+    ASSERT_OK(r);
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
 /*
  * ============================================================
  * test_mmap_val_reuse
@@ -4033,53 +4348,189 @@ static void test_consistent_future_links(void)
 
 /*
  * ============================================================
- * test_csum_null
+ * test_recovery_tail
  *
- * Open a database with the null checksum engine (always returns 0).
+ * A writer crashes part way through a transaction with adds, replaces
+ * and deletes of committed keys, and uncommitted keys replaced and
+ * deleted again.  Recovery only needs to look at what it wrote, and so
+ * does an abort; but a tail that doesn't check out gets the full walk,
+ * and so does one whose pages were lost, leaving pointers into nothing.
  * ============================================================
  */
-static void test_csum_null(void)
+
+static void recovery_tail_child(int round)
+{
+    struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+    struct twom_db *cdb = NULL;
+    struct twom_txn *ctxn = NULL;
+    char ck[32];
+    int cr = twom_db_open(filename, &cinit, &cdb, NULL);
+    if (!cr) cr = twom_db_begin_txn(cdb, 0, &ctxn);
+    for (int i = 1; !cr && i < 600; i += 2) {
+        int kl = snprintf(ck, sizeof(ck), "key%06d", i);
+        cr = twom_txn_store(ctxn, ck, kl, "new", 3, 0);
+    }
+    if (!cr) cr = twom_txn_store(ctxn, "key000004", 9, "replaced", 8, 0);
+    if (!cr) cr = twom_txn_store(ctxn, "key000006", 9, NULL, 0, 0);
+    if (!cr) cr = twom_txn_store(ctxn, "key000010", 9, "back", 4, 0);
+    if (!cr) cr = twom_txn_store(ctxn, "key000001", 9, "again", 5, 0);
+    if (!cr) cr = twom_txn_store(ctxn, "key000003", 9, NULL, 0, 0);
+    if (!cr && round) cr = twom_txn_store(ctxn, "zzz", 3, "last", 4, 0);
+    /* crash: leave the transaction uncommitted and unaborted */
+    _exit(cr ? 1 : 0);
+}
+
+static void test_recovery_tail(void)
 {
     struct twom_db *db = NULL;
     struct twom_txn *txn = NULL;
-    int r;
+    struct twom_stats stats;
+    char key[32];
+    int r, i, status;
+    pid_t pid;
 
     struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
-    init.flags = TWOM_CREATE | TWOM_CSUM_NULL;
+    init.flags = TWOM_CREATE;
     r = twom_db_open(filename, &init, &db, NULL);
     ASSERT_OK(r);
-
-    CANSTORE("key1", 4, "val1", 4);
-    CANSTORE("key2", 4, "val2", 4);
+    for (i = 0; i < 600; i += 2) {
+        int kl = snprintf(key, sizeof(key), "key%06d", i);
+        CANSTORE(key, kl, "old", 3);
+    }
+    CANCOMMIT();
+    CANDELETE("key000010", 9);
     CANCOMMIT();
+    ASSERT_EQ(twom_db_num_records(db), 299);
+    size_t size = twom_db_size(db);
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
 
-    CANFETCH_NOTXN("key1", 4, "val1", 4);
-    CANFETCH_NOTXN("key2", 4, "val2", 4);
-    ASSERT_EQ(twom_db_num_records(db), 2);
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) recovery_tail_child(0);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    /* the first write lock runs recovery */
+    init.flags = 0;
+    r = twom_db_open(filename, &init, &db, &txn);
+    ASSERT_OK(r);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    twom_db_stats(db, &stats);
+    ASSERT_EQ(stats.recoveries, 1);
+    ASSERT_EQ(stats.tail_recoveries, 1);
     ISCONSISTENT();
+    ASSERT_EQ(twom_db_num_records(db), 299);
+    ASSERT_EQ(twom_db_size(db), size);
+    CANFETCH_NOTXN("key000004", 9, "old", 3);
+    CANFETCH_NOTXN("key000006", 9, "old", 3);
+    CANNOTFETCH_NOTXN("key000010", 9, TWOM_NOTFOUND);
+    CANNOTFETCH_NOTXN("key000001", 9, TWOM_NOTFOUND);
+    CANNOTFETCH_NOTXN("key000003", 9, TWOM_NOTFOUND);
 
-    /* replace and delete */
-    CANSTORE("key1", 4, "new1", 4);
-    CANCOMMIT();
-    CANDELETE("key2", 4);
+    /* an abort goes the same way */
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    for (i = 1; i < 600; i += 4) {
+        int kl = snprintf(key, sizeof(key), "key%06d", i);
+        CANSTORE(key, kl, "new", 3);
+    }
+    CANSTORE("key000002", 9, "replaced", 8);
+    CANDELETE("key000008", 9);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    twom_db_stats(db, &stats);
+    ASSERT_EQ(stats.recoveries, 2);
+    ASSERT_EQ(stats.tail_recoveries, 2);
+    ISCONSISTENT();
+    CANFETCH_NOTXN("key000002", 9, "old", 3);
+    CANFETCH_NOTXN("key000008", 9, "old", 3);
+    CANNOTFETCH_NOTXN("key000005", 9, TWOM_NOTFOUND);
+
+    /* and the next commit still works */
+    CANSTORE("key000005", 9, "five", 4);
     CANCOMMIT();
-    ASSERT_EQ(twom_db_num_records(db), 1);
-    CANFETCH_NOTXN("key1", 4, "new1", 4);
+    ASSERT_EQ(twom_db_num_records(db), 300);
+    size = twom_db_size(db);
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
 
-    /* repack */
-    r = twom_db_repack(db);
+    /* crash again, then damage the first record the crashed writer wrote */
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) recovery_tail_child(1);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    {
+        int fd = open(filename, O_RDWR);
+        ASSERT(fd >= 0);
+        char c = 0x55;
+        ASSERT_EQ(pwrite(fd, &c, 1, size + 8), 1);
+        close(fd);
+    }
+
+    r = twom_db_open(filename, &init, &db, &txn);
     ASSERT_OK(r);
-    CANFETCH_NOTXN("key1", 4, "new1", 4);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    twom_db_stats(db, &stats);
+    ASSERT_EQ(stats.recoveries, 1);
+    ASSERT_EQ(stats.tail_recoveries, 0);
     ISCONSISTENT();
-
-    /* close and reopen */
+    ASSERT_EQ(twom_db_num_records(db), 300);
+    CANFETCH_NOTXN("key000005", 9, "five", 4);
+    CANFETCH_NOTXN("key000004", 9, "old", 3);
+    CANNOTFETCH_NOTXN("zzz", 3, TWOM_NOTFOUND);
+    size = twom_db_size(db);
     r = twom_db_close(&db);
     ASSERT_OK(r);
-    init.flags = TWOM_CSUM_NULL;
-    r = twom_db_open(filename, &init, &db, NULL);
+
+    /* crash again, and lose every page the crashed writer wrote: what's
+     * left looks like the end of the records, but the committed records
+     * still point into it */
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) recovery_tail_child(0);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    {
+        struct stat sbuf;
+        char zeros[4096];
+        int fd = open(filename, O_RDWR);
+        ASSERT(fd >= 0);
+        ASSERT_OK(fstat(fd, &sbuf));
+        memset(zeros, 0, sizeof(zeros));
+        off_t off;
+        for (off = size; off < sbuf.st_size; off += sizeof(zeros))
+            ASSERT(pwrite(fd, zeros, sizeof(zeros), off) > 0);
+        close(fd);
+    }
+
+    r = twom_db_open(filename, &init, &db, &txn);
     ASSERT_OK(r);
-    CANFETCH_NOTXN("key1", 4, "new1", 4);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    twom_db_stats(db, &stats);
+    ASSERT_EQ(stats.recoveries, 1);
+    ASSERT_EQ(stats.tail_recoveries, 0);
+    ISCONSISTENT();
+    ASSERT_EQ(twom_db_num_records(db), 300);
+
+    /* and the records written over the lost ones don't get tangled up */
+    for (i = 0; i < 50; i++) {
+        int kl = snprintf(key, sizeof(key), "a%03d", i);
+        CANSTORE(key, kl, "after", 5);
+    }
+    CANCOMMIT();
     ISCONSISTENT();
+    ASSERT_EQ(twom_db_num_records(db), 350);
+    CANFETCH_NOTXN("a000", 4, "after", 5);
+    CANFETCH_NOTXN("key000004", 9, "old", 3);
+    CANNOTFETCH_NOTXN("key000001", 9, TWOM_NOTFOUND);
 
     r = twom_db_close(&db);
     ASSERT_OK(r);
@@ -4087,61 +4538,236 @@ static void test_csum_null(void)
 
 /*
  * ============================================================
- * test_csum_external
+ * test_scrub
  *
- * Open a database with a caller-provided checksum function.
+ * twom_db_scrub checks the same things as twom_db_check_consistency, on
+ * several threads over ranges of the keyspace, and the checksums too.  It
+ * works on an MVCC snapshot and yields the lock between slices, so writers
+ * can change the file under it (using both level 0 slots of records it
+ * hasn't got to yet) and it still reads the snapshot.  A flipped value
+ * byte, which the consistency check can't see, fails it.
  * ============================================================
  */
-static uint32_t my_csum(const char *base, size_t len)
+static int scrub_calls = 0;
+static size_t scrub_ranges = 0;
+static uint64_t scrub_records = 0;
+static int scrub_result = 1;
+
+static int scrub_writer_cb(void *rock, const struct twom_scrub_progress *progress)
 {
-    /* simple additive hash for testing */
-    uint32_t h = 0;
-    for (size_t i = 0; i < len; i++)
-        h = h * 31 + (unsigned char)base[i];
-    return h;
+    struct twom_db *db = (struct twom_db *)rock;
+    char key[32];
+    int i, pass;
+
+    if (progress->finished) {
+        scrub_ranges = progress->ranges;
+        scrub_records = progress->records;
+        scrub_result = progress->result;
+        return 0;
+    }
+    if (!db) return 0;
+
+    /* two commits each putting a new record straight after the same ones */
+    for (pass = 0; pass < 2; pass++) {
+        struct twom_txn *wtxn = NULL;
+        if (twom_db_begin_txn(db, 0, &wtxn)) return TWOM_INTERNAL;
+        for (i = scrub_calls % 2; i < 2000; i += 97) {
+            int kl = snprintf(key, sizeof(key), "key%05d%c", i * 2, pass ? 'a' : 'b');
+            if (twom_txn_store(wtxn, key, kl, "new", 3, 0)) return TWOM_INTERNAL;
+            kl = snprintf(key, sizeof(key), "key%05d", i * 2 + 50);
+            if (twom_txn_store(wtxn, key, kl, pass ? NULL : "changed", pass ? 0 : 7, 0))
+                return TWOM_INTERNAL;
+        }
+        if (twom_txn_commit(&wtxn)) return TWOM_INTERNAL;
+    }
+    scrub_calls++;
+    return 0;
 }
 
-static void test_csum_external(void)
+static void test_scrub(void)
 {
     struct twom_db *db = NULL;
     struct twom_txn *txn = NULL;
-    int r;
+    char key[32];
+    int r, i;
 
     struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
-    init.flags = TWOM_CREATE | TWOM_CSUM_EXTERNAL;
-    init.csum = my_csum;
+    init.flags = TWOM_CREATE;
     r = twom_db_open(filename, &init, &db, NULL);
     ASSERT_OK(r);
-
-    CANSTORE("alpha", 5, "one", 3);
-    CANSTORE("beta", 4, "two", 3);
-    CANSTORE("gamma", 5, "three", 5);
+    for (i = 0; i < 4000; i += 2) {
+        int kl = snprintf(key, sizeof(key), "key%05d", i);
+        CANSTORE(key, kl, "value", 5);
+    }
+    CANSTORE("key01001", 8, "scrub-me-please", 15);
+    CANCOMMIT();
+    CANDELETE("key00100", 8);
+    CANSTORE("key00200", 8, "replaced", 8);
     CANCOMMIT();
 
-    CANFETCH_NOTXN("alpha", 5, "one", 3);
-    CANFETCH_NOTXN("beta", 4, "two", 3);
-    CANFETCH_NOTXN("gamma", 5, "three", 5);
-    ASSERT_EQ(twom_db_num_records(db), 3);
-    ISCONSISTENT();
-
-    /* repack with external checksum */
-    r = twom_db_repack(db);
+    r = twom_db_scrub(db, 4, 0, scrub_writer_cb, NULL);
     ASSERT_OK(r);
-    CANFETCH_NOTXN("alpha", 5, "one", 3);
-    ISCONSISTENT();
+    ASSERT_EQ(scrub_result, 0);
+    ASSERT(scrub_ranges > 1);
+    ASSERT(scrub_records >= twom_db_num_records(db));
 
-    /* close and reopen with the same csum function */
-    r = twom_db_close(&db);
-    ASSERT_OK(r);
-    init.flags = TWOM_CSUM_EXTERNAL;
-    r = twom_db_open(filename, &init, &db, NULL);
+    /* slices small enough that writers get in many times along the way */
+    size_t num_records = twom_db_num_records(db);
+    scrub_result = 1;
+    r = twom_db_scrub(db, 3, 200 * 1024, scrub_writer_cb, db);
     ASSERT_OK(r);
-    CANFETCH_NOTXN("beta", 4, "two", 3);
+    ASSERT_EQ(scrub_result, 0);
+    ASSERT(scrub_calls >= 4);
+    ASSERT(twom_db_num_records(db) != num_records);
     ISCONSISTENT();
+    r = twom_db_scrub(db, 1, 0, NULL, NULL);
+    ASSERT_OK(r);
 
     r = twom_db_close(&db);
     ASSERT_OK(r);
-}
+
+    /* damage a value: its length and the links are all still fine */
+    {
+        int fd = open(filename, O_RDWR);
+        ASSERT(fd >= 0);
+        struct stat sbuf;
+        ASSERT_EQ(fstat(fd, &sbuf), 0);
+        char *buf = malloc(sbuf.st_size);
+        ASSERT_EQ(pread(fd, buf, sbuf.st_size, 0), sbuf.st_size);
+        off_t o;
+        for (o = 0; o + 15 <= sbuf.st_size; o++)
+            if (!memcmp(buf + o, "scrub-me-please", 15)) break;
+        ASSERT(o + 15 <= sbuf.st_size);
+        char c = 'S';
+        ASSERT_EQ(pwrite(fd, &c, 1, o), 1);
+        free(buf);
+        close(fd);
+    }
+
+    init.flags = 0;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    ISCONSISTENT();
+    scrub_result = 0;
+    r = twom_db_scrub(db, 2, 0, scrub_writer_cb, NULL);
+    ASSERT_EQ(r, TWOM_BADCHECKSUM);
+    ASSERT_EQ(scrub_result, TWOM_BADCHECKSUM);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_csum_null
+ *
+ * Open a database with the null checksum engine (always returns 0).
+ * ============================================================
+ */
+static void test_csum_null(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    int r;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE | TWOM_CSUM_NULL;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    CANSTORE("key1", 4, "val1", 4);
+    CANSTORE("key2", 4, "val2", 4);
+    CANCOMMIT();
+
+    CANFETCH_NOTXN("key1", 4, "val1", 4);
+    CANFETCH_NOTXN("key2", 4, "val2", 4);
+    ASSERT_EQ(twom_db_num_records(db), 2);
+    ISCONSISTENT();
+
+    /* replace and delete */
+    CANSTORE("key1", 4, "new1", 4);
+    CANCOMMIT();
+    CANDELETE("key2", 4);
+    CANCOMMIT();
+    ASSERT_EQ(twom_db_num_records(db), 1);
+    CANFETCH_NOTXN("key1", 4, "new1", 4);
+
+    /* repack */
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    CANFETCH_NOTXN("key1", 4, "new1", 4);
+    ISCONSISTENT();
+
+    /* close and reopen */
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    init.flags = TWOM_CSUM_NULL;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    CANFETCH_NOTXN("key1", 4, "new1", 4);
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_csum_external
+ *
+ * Open a database with a caller-provided checksum function.
+ * ============================================================
+ */
+static uint32_t my_csum(const char *base, size_t len)
+{
+    /* simple additive hash for testing */
+    uint32_t h = 0;
+    for (size_t i = 0; i < len; i++)
+        h = h * 31 + (unsigned char)base[i];
+    return h;
+}
+
+static void test_csum_external(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    int r;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE | TWOM_CSUM_EXTERNAL;
+    init.csum = my_csum;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    CANSTORE("alpha", 5, "one", 3);
+    CANSTORE("beta", 4, "two", 3);
+    CANSTORE("gamma", 5, "three", 5);
+    CANCOMMIT();
+
+    CANFETCH_NOTXN("alpha", 5, "one", 3);
+    CANFETCH_NOTXN("beta", 4, "two", 3);
+    CANFETCH_NOTXN("gamma", 5, "three", 5);
+    ASSERT_EQ(twom_db_num_records(db), 3);
+    ISCONSISTENT();
+
+    /* repack with external checksum */
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    CANFETCH_NOTXN("alpha", 5, "one", 3);
+    ISCONSISTENT();
+
+    /* close and reopen with the same csum function */
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    init.flags = TWOM_CSUM_EXTERNAL;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    CANFETCH_NOTXN("beta", 4, "two", 3);
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
 
 /*
  * ============================================================
@@ -5240,6 +5866,3556 @@ static void test_dump_corrupt(void)
     ASSERT_OK(r);
 }
 
+/*
+ * ============================================================
+ * test_fetch_many
+ *
+ * Batched lookup of a shuffled set of keys, some of which are
+ * missing or deleted.  Results come back in sorted order, and
+ * must match what twom_txn_fetch returns one key at a time.
+ * ============================================================
+ */
+struct fetch_many_rock {
+    int count;
+    char last[32];
+};
+
+static int fetch_many_cb(void *rock,
+                         const char *key, size_t keylen,
+                         const char *data, size_t datalen)
+{
+    struct fetch_many_rock *fr = (struct fetch_many_rock *)rock;
+    char expect[32];
+
+    CB_ASSERT(keylen < sizeof(fr->last));
+    CB_ASSERT(memcmp(key, "key", 3) == 0);
+    snprintf(expect, sizeof(expect), "val%.*s", (int)keylen - 3, key + 3);
+    CB_ASSERT_EQ(datalen, strlen(expect));
+    CB_ASSERT(memcmp(data, expect, datalen) == 0);
+
+    /* sorted order, and no missing or deleted keys */
+    char buf[32];
+    memcpy(buf, key, keylen);
+    buf[keylen] = '\0';
+    CB_ASSERT(strcmp(fr->last, buf) < 0);
+    CB_ASSERT(atoi(buf + 3) % 2 == 0);
+    CB_ASSERT(atoi(buf + 3) % 10 != 4);
+    strcpy(fr->last, buf);
+
+    fr->count++;
+    return 0;
+}
+
+static int fetch_many_stop_cb(void *rock,
+                              const char *key __attribute__((unused)),
+                              size_t keylen __attribute__((unused)),
+                              const char *data __attribute__((unused)),
+                              size_t datalen __attribute__((unused)))
+{
+    int *count = (int *)rock;
+    return ++(*count) == 3 ? 42 : 0;
+}
+
+static void test_fetch_many(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    char keys[1000][16];
+    const char *keyp[1000];
+    size_t keylens[1000];
+    char val[16];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    /* store the even keys, then delete every one ending in 4 */
+    for (n = 0; n < 1000; n += 2) {
+        snprintf(keys[n], sizeof(keys[n]), "key%05d", n);
+        snprintf(val, sizeof(val), "val%05d", n);
+        CANSTORE(keys[n], strlen(keys[n]), val, strlen(val));
+    }
+    CANCOMMIT();
+    for (n = 4; n < 1000; n += 10) {
+        CANDELETE(keys[n], strlen(keys[n]));
+    }
+    CANCOMMIT();
+
+    /* ask for every key, in a scrambled order */
+    for (n = 0; n < 1000; n++) {
+        int k = (n * 337) % 1000;
+        snprintf(keys[n], sizeof(keys[n]), "key%05d", k);
+        keyp[n] = keys[n];
+        keylens[n] = strlen(keys[n]);
+    }
+
+    struct fetch_many_rock fr;
+    memset(&fr, 0, sizeof(fr));
+    cb_failures = 0;
+    r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    ASSERT_OK(r);
+    r = twom_txn_fetch_many(txn, 1000, keyp, keylens, fetch_many_cb, &fr, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(fr.count, 400);
+
+    /* pre-sorted input takes the same path without the sort */
+    for (n = 0; n < 1000; n++) {
+        snprintf(keys[n], sizeof(keys[n]), "key%05d", n);
+        keylens[n] = strlen(keys[n]);
+    }
+    memset(&fr, 0, sizeof(fr));
+    r = twom_txn_fetch_many(txn, 1000, keyp, keylens, fetch_many_cb, &fr, TWOM_SORTEDKEYS);
+    ASSERT_OK(r);
+    ASSERT_EQ(fr.count, 400);
+    ASSERT_EQ(cb_failures, 0);
+
+    /* a callback can stop the batch early */
+    int count = 0;
+    r = twom_txn_fetch_many(txn, 1000, keyp, keylens, fetch_many_stop_cb, &count, TWOM_SORTEDKEYS);
+    ASSERT_EQ(r, 42);
+    ASSERT_EQ(count, 3);
+
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    /* uncommitted writes are visible inside the writing transaction */
+    snprintf(val, sizeof(val), "val%05d", 1);
+    CANSTORE("key00001", 8, val, strlen(val));
+    count = 0;
+    r = twom_txn_fetch_many(txn, 4, keyp, keylens, fetch_many_stop_cb, &count, 0);
+    ASSERT_EQ(r, 42);
+    ASSERT_EQ(count, 3);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_bulkload
+ *
+ * Load records in sorted order through twom_db_bulkload and
+ * twom_txn_append_sorted, and check that anything which isn't
+ * strictly after the last key in the file is refused.
+ * ============================================================
+ */
+static void test_bulkload(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    char keys[1000][16];
+    char vals[1000][16];
+    const char *keyp[1000];
+    const char *valp[1000];
+    size_t keylens[1000];
+    size_t vallens[1000];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 1000; n++) {
+        snprintf(keys[n], sizeof(keys[n]), "key%05d", n);
+        snprintf(vals[n], sizeof(vals[n]), "val%05d", n);
+        keyp[n] = keys[n];
+        valp[n] = vals[n];
+        keylens[n] = strlen(keys[n]);
+        vallens[n] = strlen(vals[n]);
+    }
+
+    /* the first half in one call with its own transaction */
+    r = twom_db_bulkload(db, 500, keyp, keylens, valp, vallens, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_num_records(db), 500);
+    ISCONSISTENT();
+
+    /* out of order batches are refused and leave nothing behind */
+    r = twom_db_bulkload(db, 2, keyp + 499, keylens + 499, valp + 499, vallens + 499, 0);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    ASSERT_EQ(twom_db_num_records(db), 500);
+
+    /* the rest appended one at a time inside a transaction */
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    for (n = 500; n < 1000; n++) {
+        r = twom_txn_append_sorted(txn, keyp[n], keylens[n], valp[n], vallens[n], 0);
+        ASSERT_OK(r);
+    }
+
+    /* equal, earlier and empty keys, and deletes */
+    r = twom_txn_append_sorted(txn, keyp[999], keylens[999], "x", 1, 0);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    r = twom_txn_append_sorted(txn, "key00500x", 9, "x", 1, 0);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    r = twom_txn_append_sorted(txn, "", 0, "x", 1, 0);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    r = twom_txn_append_sorted(txn, "zzz", 3, NULL, 0, 0);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    CANCOMMIT();
+    ISCONSISTENT();
+
+    /* a deleted key still counts as the end of the file */
+    CANDELETE(keyp[999], keylens[999]);
+    CANCOMMIT();
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    r = twom_txn_append_sorted(txn, "key00998x", 9, "x", 1, 0);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    r = twom_txn_append_sorted(txn, "key01000", 8, "val01000", 8, 0);
+    ASSERT_OK(r);
+    {
+        /* a bad batch in the caller's transaction appends none of it */
+        const char *bk[] = { "key01001", "key01003", "key01002" };
+        size_t bl[] = { 8, 8, 8 };
+        r = twom_db_bulkload(db, 3, bk, bl, bk, bl, 0);
+        ASSERT_EQ(r, TWOM_BADUSAGE);
+    }
+    CANCOMMIT();
+    CANNOTFETCH("key01001", 8, TWOM_NOTFOUND);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    CANREOPEN();
+    ISCONSISTENT();
+    ASSERT_EQ(twom_db_num_records(db), 1000);
+    for (n = 0; n < 999; n++) {
+        CANFETCH(keyp[n], keylens[n], valp[n], vallens[n]);
+    }
+    CANNOTFETCH(keyp[999], keylens[999], TWOM_NOTFOUND);
+    CANFETCH("key01000", 8, "val01000", 8);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_group_commit
+ *
+ * Commits from NOSYNC transactions are counted but not durable
+ * until a twom_db_sync, which flushes all of them at once.  A
+ * normal commit flushes everything before it too.
+ * ============================================================
+ */
+static void test_group_commit(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    char key[16];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_commit_seq(db), 0);
+    ASSERT_EQ(twom_db_durable_seq(db), 0);
+
+    /* a batch of deferred commits */
+    for (n = 0; n < 10; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        r = twom_db_begin_txn(db, TWOM_NOSYNC, &txn);
+        ASSERT_OK(r);
+        CANSTORE(key, strlen(key), "value", 5);
+        CANCOMMIT();
+        ASSERT_EQ(twom_db_commit_seq(db), (size_t)n + 1);
+        ASSERT_EQ(twom_db_durable_seq(db), 0);
+    }
+
+    /* and through the non-transactional API */
+    r = twom_db_store(db, "key10", 5, "value", 5, TWOM_NOSYNC);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_commit_seq(db), 11);
+    ASSERT_EQ(twom_db_durable_seq(db), 0);
+
+    /* one flush makes them all durable */
+    r = twom_db_sync(db);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_durable_seq(db), 11);
+
+    /* a commit with no changes doesn't count */
+    r = twom_db_begin_txn(db, TWOM_NOSYNC, &txn);
+    ASSERT_OK(r);
+    CANCOMMIT();
+    ASSERT_EQ(twom_db_commit_seq(db), 11);
+
+    /* a normal commit covers the deferred ones before it */
+    r = twom_db_store(db, "key11", 5, "value", 5, TWOM_NOSYNC);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_durable_seq(db), 11);
+    r = twom_db_store(db, "key12", 5, "value", 5, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_commit_seq(db), 13);
+    ASSERT_EQ(twom_db_durable_seq(db), 13);
+
+    /* nothing outstanding: sync is cheap and changes nothing */
+    r = twom_db_sync(db);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_durable_seq(db), 13);
+
+    CANREOPEN();
+    ISCONSISTENT();
+    ASSERT_EQ(twom_db_num_records(db), 13);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_sync_ranges
+ *
+ * Commits only msync the pages they touched.  Exercise both
+ * the page list and the fallback range (a transaction which
+ * updates pointers all over a large file), deferred commits,
+ * another process's nosync commit, and TWOM_FDATASYNC, and
+ * check everything reads back.
+ * ============================================================
+ */
+static void sync_ranges_child(void)
+{
+    struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+    struct twom_db *cdb = NULL;
+    int cr = twom_db_open(filename, &cinit, &cdb, NULL);
+    if (!cr) cr = twom_db_store(cdb, "key000013", 9, "value", 5, TWOM_NOSYNC);
+    if (!cr) cr = twom_db_close(&cdb);
+    _exit(cr ? 1 : 0);
+}
+
+static void test_sync_ranges(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_stats st;
+    struct stat sbuf;
+    char key[32];
+    int r, n, status;
+    pid_t pid;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    /* a file big enough to span plenty of pages */
+    for (n = 0; n < 20000; n += 2) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "value", 5);
+    }
+    CANCOMMIT();
+
+    /* small commits touch a handful of pages each */
+    for (n = 1; n < 200; n += 20) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        r = twom_db_store(db, key, strlen(key), "value", 5, 0);
+        ASSERT_OK(r);
+    }
+
+    /* one transaction splicing in everywhere overflows the page list */
+    for (n = 3; n < 20000; n += 40) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "value", 5);
+    }
+    CANCOMMIT();
+
+    /* deferred commits accumulate pages until the sync */
+    for (n = 5; n < 20000; n += 400) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        r = twom_db_store(db, key, strlen(key), "value", 5, TWOM_NOSYNC);
+        ASSERT_OK(r);
+    }
+    r = twom_db_sync(db);
+    ASSERT_OK(r);
+    ISCONSISTENT();
+
+    /* after another process's nosync commit we can't know which of
+     * its pages are on disk, so the next commit syncs all of them */
+    pid = fork();
+    if (pid == 0) sync_ranges_child();
+    ASSERT(pid > 0);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    twom_db_reset_stats(db);
+    r = twom_db_store(db, "key000015", 9, "value", 5, 0);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    r = stat(filename, &sbuf);
+    ASSERT_EQ(r, 0);
+    ASSERT(st.sync_bytes >= (uint64_t)sbuf.st_size / 2);
+    /* and then it's back to just the pages touched */
+    twom_db_reset_stats(db);
+    r = twom_db_store(db, "key000017", 9, "value", 5, 0);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    ASSERT(st.sync_bytes < (uint64_t)sbuf.st_size / 2);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* and with fdatasync instead */
+    init.flags = TWOM_FDATASYNC;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    for (n = 7; n < 20000; n += 400) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        r = twom_db_store(db, key, strlen(key), "value", 5, 0);
+        ASSERT_OK(r);
+    }
+    r = twom_db_store(db, "key000009", 9, "value", 5, TWOM_NOSYNC);
+    ASSERT_OK(r);
+    r = twom_db_sync(db);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_durable_seq(db), twom_db_commit_seq(db));
+
+    CANREOPEN();
+    ISCONSISTENT();
+    ASSERT_EQ(twom_db_num_records(db), 10000 + 10 + 500 + 50 + 3 + 50 + 1);
+    CANFETCH("key000009", 9, "value", 5);
+    CANFETCH("key019963", 9, "value", 5);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_reserve_growth
+ *
+ * With address space reserved, growing the file maps it in
+ * place, so a value fetched before the growth is still there
+ * after it.  The file grows by at least the growth setting.
+ * ============================================================
+ */
+static void test_reserve_growth(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    const char *val = NULL;
+    size_t vallen = 0;
+    struct stat sbuf;
+    char key[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE|TWOM_FALLOCATE;
+    init.reserve = 64 * 1024 * 1024;
+    init.growth = 1024 * 1024;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    CANSTORE("early", 5, "still here", 10);
+    r = twom_txn_fetch(txn, "early", 5, NULL, NULL, &val, &vallen, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(vallen, 10);
+
+    /* enough data to outgrow the first extension several times */
+    for (n = 0; n < 50000; n++) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "0123456789abcdef0123456789abcdef", 32);
+    }
+    ASSERT_MEM_EQ(val, "still here", 10);
+    CANCOMMIT();
+
+    r = stat(filename, &sbuf);
+    ASSERT_EQ(r, 0);
+    ASSERT((size_t)sbuf.st_size >= init.growth);
+    ASSERT_EQ(sbuf.st_size % (1<<14), 0);
+
+    /* past the reservation it keeps working, just not in place */
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    init.reserve = 1024 * 1024;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    for (n = 50000; n < 60000; n++) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "0123456789abcdef0123456789abcdef", 32);
+    }
+    CANCOMMIT();
+
+    CANREOPEN();
+    ISCONSISTENT();
+    ASSERT_EQ(twom_db_num_records(db), 60001);
+    CANFETCH("early", 5, "still here", 10);
+    CANFETCH("key059999", 9, "0123456789abcdef0123456789abcdef", 32);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_stats
+ *
+ * The counters move with the work done, and reset to zero.
+ * ============================================================
+ */
+static void test_stats(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_stats st;
+    char key[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 5000; n++) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "value", 5);
+    }
+    CANCOMMIT();
+
+    twom_db_stats(db, &st);
+    ASSERT(st.extends > 0);
+    ASSERT(st.remaps >= st.extends);
+    ASSERT(st.syncs > 0);
+    ASSERT(st.sync_bytes > 0);
+    ASSERT(st.datalocks > 0);
+    /* appending in order mostly finds the next slot without a search */
+    ASSERT(st.findloc_fast > 4000);
+
+    twom_db_reset_stats(db);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.locates, 0);
+    ASSERT_EQ(st.compars, 0);
+    ASSERT_EQ(st.syncs, 0);
+
+    /* random order lookups each need a search, from the top or climbing
+     * from the previous key when they land ahead of it */
+    for (n = 0; n < 100; n++) {
+        snprintf(key, sizeof(key), "key%06d", (n * 2039) % 5000);
+        CANFETCH(key, strlen(key), "value", 5);
+    }
+    twom_db_stats(db, &st);
+    ASSERT(st.locates + st.findloc_finger >= 90);
+    ASSERT(st.locates > 0);
+    ASSERT(st.findloc_finger > 0);
+    ASSERT(st.locate_levels > 0);
+    ASSERT(st.compars > st.locates);
+    ASSERT_EQ(st.headcsums, st.tailcsums);
+    ASSERT(st.headcsums >= 100);
+    ASSERT_EQ(st.syncs, 0);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_keyprefix
+ *
+ * With TWOM_KEYPREFIX the records carry the first 8 bytes of
+ * the key, and searches compare those first.  Keys full of
+ * NULs and 0xff, shorter than the prefix and sharing all of it
+ * must still sort and find exactly as without, and repack must
+ * convert an old file.
+ * ============================================================
+ */
+struct keyprefix_order {
+    char prev[64];
+    size_t prevlen;
+    int count;
+    int bad;
+};
+
+static int keyprefix_order_cb(void *rock, const char *key, size_t keylen,
+                              const char *data, size_t datalen)
+{
+    (void)data; (void)datalen;
+    struct keyprefix_order *o = (struct keyprefix_order *)rock;
+    size_t min = keylen < o->prevlen ? keylen : o->prevlen;
+    int cmp = memcmp(o->prev, key, min);
+    if (o->count && (cmp > 0 || (!cmp && o->prevlen >= keylen)))
+        o->bad++;
+    memcpy(o->prev, key, keylen);
+    o->prevlen = keylen;
+    o->count++;
+    return 0;
+}
+
+static size_t keyprefix_key(char *buf, int n)
+{
+    static const char alphabet[3] = { '\0', 'a', '\xff' };
+    size_t len = 0;
+    if (n >= 3279) {
+        /* all the same 8 byte prefix */
+        return snprintf(buf, 64, "prefix00%d", n);
+    }
+    /* every string of length 1-7 over the alphabet */
+    int width = 1, base = 3;
+    while (n >= base) {
+        n -= base;
+        base *= 3;
+        width++;
+    }
+    for (len = 0; (int)len < width; len++) {
+        buf[len] = alphabet[n % 3];
+        n /= 3;
+    }
+    return len;
+}
+
+static void test_keyprefix(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct keyprefix_order order;
+    char key[64];
+    size_t keylen;
+    uint32_t version;
+    int r, i, n, fd;
+    const int nkeys = 3279 + 500;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE|TWOM_KEYPREFIX;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    /* scrambled order, so the skiplist is built every which way */
+    for (i = 0; i < nkeys; i++) {
+        n = (int)(((long)i * 1237) % nkeys);
+        keylen = keyprefix_key(key, n);
+        CANSTORE(key, keylen, "first", 5);
+    }
+    CANCOMMIT();
+
+    /* replace every third, delete every seventh */
+    for (n = 0; n < nkeys; n += 3) {
+        keylen = keyprefix_key(key, n);
+        CANSTORE(key, keylen, "second", 6);
+    }
+    for (n = 0; n < nkeys; n += 7) {
+        keylen = keyprefix_key(key, n);
+        CANDELETE(key, keylen);
+    }
+    CANCOMMIT();
+
+    CANREOPEN();
+    ISCONSISTENT();
+    fd = open(filename, O_RDONLY);
+    ASSERT(fd >= 0);
+    pread(fd, &version, 4, 32); /* OFFSET_VERSION = 32 */
+    close(fd);
+    ASSERT_EQ(le32toh(version), 2);
+
+    for (n = 0; n < nkeys; n++) {
+        keylen = keyprefix_key(key, n);
+        if (n % 7 == 0)
+            CANNOTFETCH(key, keylen, TWOM_NOTFOUND);
+        else if (n % 3 == 0)
+            CANFETCH(key, keylen, "second", 6);
+        else
+            CANFETCH(key, keylen, "first", 5);
+    }
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    memset(&order, 0, sizeof(order));
+    r = twom_db_foreach(db, NULL, 0, NULL, keyprefix_order_cb, &order, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(order.bad, 0);
+    ASSERT_EQ(order.count, nkeys - (nkeys + 6) / 7);
+    ASSERT_EQ((size_t)order.count, twom_db_num_records(db));
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* a plain file opened with TWOM_KEYPREFIX is converted by repack */
+    unlink(filename);
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    for (n = 0; n < 1000; n++) {
+        keylen = keyprefix_key(key, n);
+        CANSTORE(key, keylen, "old", 3);
+    }
+    CANCOMMIT();
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    init.flags = TWOM_KEYPREFIX;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    fd = open(filename, O_RDONLY);
+    ASSERT(fd >= 0);
+    pread(fd, &version, 4, 32);
+    close(fd);
+    ASSERT_EQ(le32toh(version), 2);
+
+    ISCONSISTENT();
+    for (n = 0; n < 1000; n++) {
+        keylen = keyprefix_key(key, n);
+        CANFETCH(key, keylen, "old", 3);
+    }
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_csum_xxh3
+ *
+ * The built in engine may hash long inputs with a different
+ * SIMD kernel from the one it was built for.  Write a file with
+ * the reference XXH3 as an external checksum, relabel it as
+ * the built in engine, and check every record verifies.
+ * ============================================================
+ */
+static void test_csum_xxh3(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    char key[32];
+    char *val = malloc(4096);
+    char header[96];
+    uint32_t flags;
+    int r, n, fd;
+
+    for (n = 0; n < 4096; n++) val[n] = (char)(n * 7 + 3);
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE|TWOM_CSUM_EXTERNAL;
+    init.csum = test_xxcsum;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    /* tails from a few bytes to well past the 240 byte short-input limit */
+    for (n = 0; n < 200; n++) {
+        snprintf(key, sizeof(key), "key%03d", n);
+        CANSTORE(key, strlen(key), val, (size_t)n * 19);
+    }
+    CANCOMMIT();
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    fd = open(filename, O_RDWR);
+    ASSERT(fd >= 0);
+    ASSERT_EQ(pread(fd, header, 96, 0), 96);
+    memcpy(&flags, header + TH_OFF_FLAGS, 4);
+    flags = le32toh(flags);
+    flags = (flags & ~TWOM_CSUM_EXTERNAL) | TWOM_CSUM_XXH3;
+    th_write32le(header + TH_OFF_FLAGS, flags);
+    th_write32le(header + TH_OFF_CSUM, test_xxcsum(header, TH_OFF_CSUM));
+    ASSERT_EQ(pwrite(fd, header, 96, 0), 96);
+    close(fd);
+
+    init.flags = 0;
+    init.csum = NULL;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    for (n = 0; n < 200; n++) {
+        snprintf(key, sizeof(key), "key%03d", n);
+        CANFETCH(key, strlen(key), val, (size_t)n * 19);
+    }
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    free(val);
+}
+
+/*
+ * ============================================================
+ * test_csumcache
+ *
+ * With TWOM_CSUMCACHE a committed large record has its tail
+ * checksum verified once, and later reads skip it.  Small
+ * records and uncommitted ones are always checked.
+ * ============================================================
+ */
+static void test_csumcache(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_stats st;
+    char *big = malloc(2000);
+    int r, n;
+
+    memset(big, 'x', 2000);
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE|TWOM_CSUMCACHE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    CANSTORE("big", 3, big, 2000);
+    CANSTORE("small", 5, "value", 5);
+    /* not committed yet, so not cached */
+    CANFETCH("big", 3, big, 2000);
+    CANFETCH("big", 3, big, 2000);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.tailcsums_cached, 0);
+    CANCOMMIT();
+
+    twom_db_reset_stats(db);
+    for (n = 0; n < 10; n++) {
+        CANFETCH("big", 3, big, 2000);
+        CANFETCH("small", 5, "value", 5);
+    }
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.tailcsums_cached, 9);
+    ASSERT_EQ(st.tailcsums, 11);
+
+    /* a replacement is a new record, checked afresh */
+    big[0] = 'y';
+    CANSTORE("big", 3, big, 2000);
+    CANCOMMIT();
+    twom_db_reset_stats(db);
+    CANFETCH("big", 3, big, 2000);
+    CANFETCH("big", 3, big, 2000);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.tailcsums_cached, 1);
+    ASSERT_EQ(st.tailcsums, 1);
+
+    /* and after a repack everything is a new record again */
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    twom_db_reset_stats(db);
+    CANFETCH("big", 3, big, 2000);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.tailcsums_cached, 0);
+    ASSERT_EQ(st.tailcsums, 1);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    free(big);
+}
+
+/*
+ * ============================================================
+ * test_finger_search
+ *
+ * Lookups ahead of the previous one climb from its back
+ * pointers rather than searching from the top, whether the
+ * key is present, missing, or being stored.  Going backwards
+ * still does a full search.
+ * ============================================================
+ */
+static void test_finger_search(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_stats st;
+    char key[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 20000; n += 2) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "value", 5);
+    }
+    CANCOMMIT();
+
+    /* ascending, with strides of varying length */
+    CANFETCH("key000000", 9, "value", 5);
+    twom_db_reset_stats(db);
+    for (n = 1; n < 20000; n += 1 + (n % 97)) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        if (n % 2) CANNOTFETCH(key, strlen(key), TWOM_NOTFOUND);
+        else CANFETCH(key, strlen(key), "value", 5);
+    }
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.locates, 0);
+    ASSERT_EQ(st.findloc_full, 0);
+    ASSERT(st.findloc_finger > 100);
+
+    /* backwards needs a fresh search */
+    CANFETCH("key000100", 9, "value", 5);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.locates, 1);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    /* fill in the odd keys in order, checking the neighbours as we go */
+    for (n = 1; n < 20000; n += 2) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANNOTFETCH(key, strlen(key), TWOM_NOTFOUND);
+        CANSTORE(key, strlen(key), "odd", 3);
+        if (n % 101 == 1 && n + 1 < 20000) {
+            snprintf(key, sizeof(key), "key%06d", n + 1);
+            CANFETCH(key, strlen(key), "value", 5);
+        }
+    }
+    CANCOMMIT();
+    ISCONSISTENT();
+
+    for (n = 0; n < 20000; n += 3) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        if (n % 2) CANFETCH(key, strlen(key), "odd", 3);
+        else CANFETCH(key, strlen(key), "value", 5);
+    }
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_locs_kept
+ *
+ * A cursor whose next record hasn't changed carries on from
+ * where it was when the file is extended by stores elsewhere,
+ * rather than searching again.  A store between it and the
+ * record before it makes it search again, and it carries on to
+ * the new record after it either way.
+ * ============================================================
+ */
+static void test_locs_kept(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_cursor *cur = NULL;
+    struct twom_stats st;
+    const char *k, *v;
+    size_t kl, vl;
+    char key[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 1000; n += 2) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "value", 5);
+    }
+    CANCOMMIT();
+
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    r = twom_txn_begin_cursor(txn, "key", 3, &cur, 0);
+    ASSERT_OK(r);
+    twom_db_reset_stats(db);
+
+    /* stores well away from the cursor */
+    for (n = 0; n < 200; n += 2) {
+        r = twom_cursor_next(cur, &k, &kl, &v, &vl);
+        ASSERT_OK(r);
+        snprintf(key, sizeof(key), "key%06d", n);
+        ASSERT_EQ(kl, strlen(key));
+        ASSERT_MEM_EQ(k, key, kl);
+        snprintf(key, sizeof(key), "other%06d", n);
+        r = twom_txn_store(txn, key, strlen(key), "x", 1, 0);
+        ASSERT_OK(r);
+    }
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.relocates, 0);
+    ASSERT(st.locs_kept >= 99);
+
+    /* one straight after it is found from where it is */
+    r = twom_txn_store(txn, "key000198a", 10, "new", 3, 0);
+    ASSERT_OK(r);
+    /* but one just before it changes the record it points back from */
+    r = twom_txn_store(txn, "key000197", 9, "new", 3, 0);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &k, &kl, &v, &vl);
+    ASSERT_OK(r);
+    ASSERT_EQ(kl, 10);
+    ASSERT_MEM_EQ(k, "key000198a", 10);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.relocates, 1);
+    r = twom_cursor_next(cur, &k, &kl, &v, &vl);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(k, "key000200", 9);
+
+    twom_cursor_fini(&cur);
+    CANCOMMIT();
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_cursor_reverse
+ *
+ * TWOM_REVERSE cursors walk backwards from a key, or from the
+ * end of a prefix, skipping deleted records, and
+ * twom_cursor_prev steps the other way.  Reading the last few
+ * keys of a long prefix doesn't scan it.
+ * ============================================================
+ */
+static void test_cursor_reverse(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_cursor *cur = NULL;
+    struct twom_stats st;
+    const char *key, *val;
+    size_t keylen, vallen;
+    char buf[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    CANSTORE("apple", 5, "val_a", 5);
+    CANSTORE("banana", 6, "val_b", 5);
+    CANSTORE("cherry", 6, "val_c", 5);
+    CANSTORE("cranberry", 9, "val_cr", 6);
+    CANSTORE("date", 4, "val_d", 5);
+    CANCOMMIT();
+
+    /* the whole database, from the end */
+    r = twom_db_begin_cursor(db, NULL, 0, &cur, TWOM_REVERSE);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 4); ASSERT(memcmp(key, "date", 4) == 0);
+    ASSERT_EQ(vallen, 5); ASSERT(memcmp(val, "val_d", 5) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 9); ASSERT(memcmp(key, "cranberry", 9) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    /* and back the other way */
+    r = twom_cursor_prev(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 9); ASSERT(memcmp(key, "cranberry", 9) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "banana", 6) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 5); ASSERT(memcmp(key, "apple", 5) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_EQ(r, TWOM_DONE);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    /* inside a prefix */
+    r = twom_db_begin_cursor(db, "c", 1, &cur, TWOM_REVERSE|TWOM_CURSOR_PREFIX);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 9); ASSERT(memcmp(key, "cranberry", 9) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_EQ(r, TWOM_DONE);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    /* an empty prefix in the middle */
+    r = twom_db_begin_cursor(db, "bz", 2, &cur, TWOM_REVERSE|TWOM_CURSOR_PREFIX);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_EQ(r, TWOM_DONE);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    /* from a key, which is included unless TWOM_SKIPROOT */
+    r = twom_db_begin_cursor(db, "cherry", 6, &cur, TWOM_REVERSE);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+    r = twom_db_begin_cursor(db, "cherry", 6, &cur, TWOM_REVERSE|TWOM_SKIPROOT);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "banana", 6) == 0);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+    r = twom_db_begin_cursor(db, "coconut", 7, &cur, TWOM_REVERSE);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    /* a forward cursor can step back too */
+    r = twom_db_begin_cursor(db, "cherry", 6, &cur, 0);
+    ASSERT_OK(r);
+    r = twom_cursor_prev(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "banana", 6) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    /* uncommitted deletes and replaces are seen by a cursor in the transaction */
+    CANDELETE("cranberry", 9);
+    CANDELETE("apple", 5);
+    CANSTORE("banana", 6, "new_b", 5);
+    r = twom_txn_begin_cursor(txn, NULL, 0, &cur, TWOM_REVERSE);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 4); ASSERT(memcmp(key, "date", 4) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "banana", 6) == 0);
+    ASSERT_EQ(vallen, 5); ASSERT(memcmp(val, "new_b", 5) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_EQ(r, TWOM_DONE);
+    twom_cursor_fini(&cur);
+    CANCOMMIT();
+
+    /* the newest few of a long prefix, between two others */
+    for (n = 0; n < 3000; n++) {
+        snprintf(buf, sizeof(buf), "mbox.%d.%05d", n % 3, n);
+        CANSTORE(buf, strlen(buf), "msg", 3);
+    }
+    CANCOMMIT();
+    twom_db_reset_stats(db);
+    r = twom_db_begin_cursor(db, "mbox.1.", 7, &cur, TWOM_REVERSE|TWOM_CURSOR_PREFIX);
+    ASSERT_OK(r);
+    for (n = 0; n < 50; n++) {
+        r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+        ASSERT_OK(r);
+        snprintf(buf, sizeof(buf), "mbox.1.%05d", 2998 - 3 * n);
+        ASSERT_EQ(keylen, strlen(buf)); ASSERT(memcmp(key, buf, keylen) == 0);
+    }
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    /* a search per step, not a walk over the other 950 */
+    ASSERT(st.locates <= 51);
+    ASSERT(st.compars < 50 * 50);
+
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_mvcc_reverse_cursor
+ *
+ * A reverse MVCC cursor has the same view as a forward one:
+ * records written after it started aren't seen, and replaced
+ * or deleted ones still are.
+ * ============================================================
+ */
+static void test_mvcc_reverse_cursor(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_cursor *cur = NULL;
+    int r;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    CANSTORE("apple", 5, "old_a", 5);
+    CANSTORE("banana", 6, "old_b", 5);
+    CANSTORE("cherry", 6, "old_c", 5);
+    CANCOMMIT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    db = NULL;
+
+    int p2c[2], c2p[2];
+    r = pipe(p2c);
+    ASSERT_EQ(r, 0);
+    r = pipe(c2p);
+    ASSERT_EQ(r, 0);
+
+    pid_t pid = fork();
+    ASSERT(pid >= 0);
+
+    if (pid == 0) {
+        /* === CHILD === */
+        close(p2c[1]);
+        close(c2p[0]);
+
+        wait_for_peer(p2c[0]);
+
+        struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+        struct twom_db *cdb = NULL;
+        struct twom_txn *ctxn = NULL;
+
+        int cr = twom_db_open(filename, &cinit, &cdb, NULL);
+        assert(cr == TWOM_OK);
+        cr = twom_db_begin_txn(cdb, 0, &ctxn);
+        assert(cr == TWOM_OK);
+        cr = twom_txn_store(ctxn, "banana", 6, "new_b", 5, 0);
+        assert(cr == TWOM_OK);
+        cr = twom_txn_store(ctxn, "cherry", 6, NULL, 0, 0);
+        assert(cr == TWOM_OK);
+        cr = twom_txn_store(ctxn, "date", 4, "new_d", 5, 0);
+        assert(cr == TWOM_OK);
+        cr = twom_txn_commit(&ctxn);
+        assert(cr == TWOM_OK);
+        cr = twom_db_close(&cdb);
+        assert(cr == TWOM_OK);
+
+        signal_peer(c2p[1]);
+        wait_for_peer(p2c[0]);
+
+        close(p2c[0]);
+        close(c2p[1]);
+        _exit(0);
+    }
+
+    /* === PARENT === */
+    close(p2c[0]);
+    close(c2p[1]);
+
+    init.flags = 0;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    r = twom_db_begin_cursor(db, NULL, 0, &cur, TWOM_SHARED|TWOM_MVCC|TWOM_REVERSE);
+    ASSERT_OK(r);
+    r = twom_db_yield(db);
+    ASSERT_OK(r);
+
+    signal_peer(p2c[1]);
+    wait_for_peer(c2p[0]);
+
+    const char *key, *val;
+    size_t keylen, vallen;
+
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "cherry", 6) == 0);
+    ASSERT_EQ(vallen, 5); ASSERT(memcmp(val, "old_c", 5) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "banana", 6) == 0);
+    ASSERT_EQ(vallen, 5); ASSERT(memcmp(val, "old_b", 5) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 5); ASSERT(memcmp(key, "apple", 5) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_EQ(r, TWOM_DONE);
+
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    /* a fresh reverse cursor sees the new state */
+    r = twom_db_begin_cursor(db, NULL, 0, &cur, TWOM_REVERSE);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 4); ASSERT(memcmp(key, "date", 4) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 6); ASSERT(memcmp(key, "banana", 6) == 0);
+    ASSERT_EQ(vallen, 5); ASSERT(memcmp(val, "new_b", 5) == 0);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    signal_peer(p2c[1]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    close(p2c[1]);
+    close(c2p[0]);
+}
+
+/*
+ * ============================================================
+ * test_foreach_range
+ *
+ * Range foreach and cursor ends: an end key (exclusive unless
+ * TWOM_INCLUSIVE) and a record limit, in either direction.
+ * Records beyond the end aren't checksummed.
+ * ============================================================
+ */
+struct range_rock {
+    int count;
+    char first[32];
+    char last[32];
+};
+
+static int range_cb(void *rock, const char *key, size_t keylen,
+                    const char *data __attribute__((unused)),
+                    size_t datalen __attribute__((unused)))
+{
+    struct range_rock *rr = (struct range_rock *)rock;
+    if (!rr->count) snprintf(rr->first, sizeof(rr->first), "%.*s", (int)keylen, key);
+    snprintf(rr->last, sizeof(rr->last), "%.*s", (int)keylen, key);
+    rr->count++;
+    return 0;
+}
+
+static void test_foreach_range(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_cursor *cur = NULL;
+    struct twom_stats st;
+    struct range_rock rr;
+    const char *key;
+    size_t keylen;
+    char buf[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 100; n++) {
+        snprintf(buf, sizeof(buf), "k%02d", n);
+        CANSTORE(buf, strlen(buf), "value", 5);
+    }
+    CANDELETE("k15", 3);
+    CANCOMMIT();
+
+    /* [k10, k20) */
+    memset(&rr, 0, sizeof(rr));
+    twom_db_reset_stats(db);
+    r = twom_db_foreach_range(db, "k10", 3, "k20", 3, 0, NULL, range_cb, &rr, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 9);
+    ASSERT_STR_EQ(rr.first, "k10");
+    ASSERT_STR_EQ(rr.last, "k19");
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.tailcsums, 9);
+
+    /* [k10, k20] */
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach_range(db, "k10", 3, "k20", 3, 0, NULL, range_cb, &rr, TWOM_INCLUSIVE);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 10);
+    ASSERT_STR_EQ(rr.last, "k20");
+
+    /* (k10, k20), with an end key which doesn't exist */
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach_range(db, "k10", 3, "k195", 4, 0, NULL, range_cb, &rr,
+                              TWOM_SKIPROOT|TWOM_INCLUSIVE);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 8);
+    ASSERT_STR_EQ(rr.first, "k11");
+    ASSERT_STR_EQ(rr.last, "k19");
+
+    /* the first five from the start, and to the end */
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach_range(db, NULL, 0, NULL, 0, 5, NULL, range_cb, &rr, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 5);
+    ASSERT_STR_EQ(rr.last, "k04");
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach_range(db, "k95", 3, NULL, 0, 0, NULL, range_cb, &rr, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 5);
+    ASSERT_STR_EQ(rr.last, "k99");
+
+    /* backwards, start is the top */
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach_range(db, "k20", 3, "k10", 3, 0, NULL, range_cb, &rr, TWOM_REVERSE);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 9);
+    ASSERT_STR_EQ(rr.first, "k20");
+    ASSERT_STR_EQ(rr.last, "k11");
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach_range(db, NULL, 0, NULL, 0, 3, NULL, range_cb, &rr, TWOM_REVERSE);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 3);
+    ASSERT_STR_EQ(rr.first, "k99");
+    ASSERT_STR_EQ(rr.last, "k97");
+
+    /* and a prefix foreach can go backwards too */
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach(db, "k1", 2, NULL, range_cb, &rr, TWOM_REVERSE);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 9);
+    ASSERT_STR_EQ(rr.first, "k19");
+    ASSERT_STR_EQ(rr.last, "k10");
+
+    /* in a read transaction, the lock goes as soon as the range is done */
+    r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    ASSERT_OK(r);
+    memset(&rr, 0, sizeof(rr));
+    r = twom_txn_foreach_range(txn, "k50", 3, NULL, 0, 2, NULL, range_cb, &rr, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 2);
+    pid_t pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) {
+        /* a writer in another process doesn't have to wait for us */
+        struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+        struct twom_db *cdb = NULL;
+        struct twom_txn *ctxn = NULL;
+        cinit.flags = TWOM_NONBLOCKING;
+        int cr = twom_db_open(filename, &cinit, &cdb, NULL);
+        if (!cr) cr = twom_db_begin_txn(cdb, TWOM_NONBLOCKING, &ctxn);
+        _exit(cr == TWOM_OK ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    /* and the next fetch takes it back, so now a writer would have to wait */
+    CANFETCH("k50", 3, "value", 5);
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) {
+        struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+        struct twom_db *cdb = NULL;
+        struct twom_txn *ctxn = NULL;
+        cinit.flags = TWOM_NONBLOCKING;
+        int cr = twom_db_open(filename, &cinit, &cdb, NULL);
+        if (!cr) cr = twom_db_begin_txn(cdb, TWOM_NONBLOCKING, &ctxn);
+        _exit(cr == TWOM_LOCKED ? 0 : 1);
+    }
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    /* a cursor with an end, which can be moved */
+    r = twom_db_begin_cursor(db, "k30", 3, &cur, 0);
+    ASSERT_OK(r);
+    r = twom_cursor_set_end(cur, "k32", 3, 0, 0);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, NULL, NULL);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 3); ASSERT(memcmp(key, "k30", 3) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, NULL, NULL);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 3); ASSERT(memcmp(key, "k31", 3) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, NULL, NULL);
+    ASSERT_EQ(r, TWOM_DONE);
+    r = twom_cursor_set_end(cur, NULL, 0, 1, 0);
+    ASSERT_OK(r);
+    r = twom_cursor_next(cur, &key, &keylen, NULL, NULL);
+    ASSERT_OK(r);
+    ASSERT_EQ(keylen, 3); ASSERT(memcmp(key, "k32", 3) == 0);
+    r = twom_cursor_next(cur, &key, &keylen, NULL, NULL);
+    ASSERT_EQ(r, TWOM_DONE);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_estimate_range
+ *
+ * Range estimates from the skip levels land near the real
+ * count, small ranges are counted exactly, and TWOM_EXACT
+ * always is.
+ * ============================================================
+ */
+static void test_estimate_range(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_stats st;
+    size_t nrecords, nbytes;
+    char key[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 20000; n++) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), "value", 5);
+    }
+    for (n = 100; n < 200; n++) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANDELETE(key, strlen(key));
+    }
+    CANCOMMIT();
+
+    r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    ASSERT_OK(r);
+
+    /* everything, and half of it, cheaply */
+    twom_db_reset_stats(db);
+    r = twom_txn_estimate_range(txn, NULL, 0, NULL, 0, &nrecords, &nbytes, 0);
+    ASSERT_OK(r);
+    ASSERT(nrecords > 10000 && nrecords < 40000);
+    ASSERT(nbytes > 10000 * 14 && nbytes < 40000 * 14);
+    r = twom_txn_estimate_range(txn, "key005000", 9, "key015000", 9, &nrecords, NULL, 0);
+    ASSERT_OK(r);
+    ASSERT(nrecords > 5000 && nrecords < 20000);
+    twom_db_stats(db, &st);
+    ASSERT(st.compars < 1000);
+    ASSERT_EQ(st.tailcsums, 0);
+
+    /* a small range is counted at level 0, and there the deletes are seen */
+    r = twom_txn_estimate_range(txn, "key001000", 9, "key001010", 9, &nrecords, &nbytes, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(nrecords, 10);
+    ASSERT_EQ(nbytes, 10 * 14);
+    r = twom_txn_estimate_range(txn, "key000150", 9, "key000152", 9, &nrecords, &nbytes, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(nrecords, 0);
+    ASSERT_EQ(nbytes, 0);
+
+    /* exact */
+    r = twom_txn_estimate_range(txn, NULL, 0, NULL, 0, &nrecords, &nbytes, TWOM_EXACT);
+    ASSERT_OK(r);
+    ASSERT_EQ(nrecords, 19900);
+    ASSERT_EQ(nbytes, 19900 * 14);
+    twom_db_reset_stats(db);
+    r = twom_txn_estimate_range(txn, "key000050", 9, "key010000", 9, &nrecords, &nbytes, TWOM_EXACT);
+    ASSERT_OK(r);
+    ASSERT_EQ(nrecords, 9850);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.tailcsums, 0);
+
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_advise_prefetch
+ *
+ * Page cache hints don't change what's read: TWOM_WARMUP at
+ * open, each twom_db_advise (and a bad one is refused), and
+ * twom_db_prefetch of a prefix, an empty prefix and a prefix
+ * with nothing in it, before and after a repack puts the file
+ * in key order, inside a write transaction, and with values in
+ * the blob file.
+ * ============================================================
+ */
+static void test_advise_prefetch(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct range_rock rr;
+    char key[32];
+    char val[2000];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE | TWOM_WARMUP | TWOM_BLOBS;
+    init.blob_threshold = 1000;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    memset(val, 'v', sizeof(val));
+    for (n = 0; n < 5000; n++) {
+        snprintf(key, sizeof(key), "key%06d", n);
+        CANSTORE(key, strlen(key), val, 200);
+    }
+    for (n = 0; n < 10; n++) {
+        snprintf(key, sizeof(key), "blob%02d", n);
+        CANSTORE(key, strlen(key), val, sizeof(val));
+    }
+    CANCOMMIT();
+
+    r = twom_db_advise(db, TWOM_ADVICE_RANDOM);
+    ASSERT_OK(r);
+    r = twom_db_advise(db, 4);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    r = twom_db_advise(db, -1);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+
+    r = twom_db_prefetch(db, "key0001", 7);
+    ASSERT_OK(r);
+    r = twom_db_prefetch(db, NULL, 0);
+    ASSERT_OK(r);
+    r = twom_db_prefetch(db, "nothing", 7);
+    ASSERT_OK(r);
+    r = twom_db_prefetch(db, "zzz", 3);
+    ASSERT_OK(r);
+    r = twom_db_prefetch(db, "blob", 4);
+    ASSERT_OK(r);
+
+    /* in key order, with some more written after it */
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    CANSTORE("key0001zz", 9, "new", 3);
+    CANDELETE("key000150", 9);
+    CANCOMMIT();
+    r = twom_db_prefetch(db, "key0001", 7);
+    ASSERT_OK(r);
+
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach(db, "key0001", 7, NULL, range_cb, &rr, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 100);
+    ASSERT_EQ(strcmp(rr.last, "key0001zz"), 0);
+
+    /* a whole database foreach over the repacked file */
+    r = twom_db_advise(db, TWOM_ADVICE_NORMAL);
+    ASSERT_OK(r);
+    memset(&rr, 0, sizeof(rr));
+    r = twom_db_foreach(db, NULL, 0, NULL, range_cb, &rr, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(rr.count, 5010);
+    ASSERT_EQ(strcmp(rr.first, "blob00"), 0);
+
+    /* inside a write transaction it sees the new records */
+    CANSTORE("key9", 4, "last", 4);
+    r = twom_db_prefetch(db, "key9", 4);
+    ASSERT_OK(r);
+    CANCOMMIT();
+
+    r = twom_db_advise(db, TWOM_ADVICE_SEQUENTIAL);
+    ASSERT_OK(r);
+    r = twom_db_advise(db, TWOM_ADVICE_WILLNEED);
+    ASSERT_OK(r);
+    CANFETCH_NOTXN("key004999", 9, val, 200);
+    CANFETCH_NOTXN("blob09", 6, val, sizeof(val));
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* and warmed up again at the next open */
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    CANFETCH_NOTXN("key000000", 9, val, 200);
+    CANFETCH_NOTXN("key9", 4, "last", 4);
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_repack_step
+ *
+ * A repack done in small slices, with commits in between, ends
+ * up with every change; an abandoned one leaves the file as it
+ * was; and a full repack finishes off one already under way.
+ * ============================================================
+ */
+static void test_repack_step(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    char key[32], val[32], newfname[PATH_MAX];
+    size_t gen;
+    int r, n, steps;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 2000; n++) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        CANSTORE(key, strlen(key), "value", 5);
+    }
+    CANCOMMIT();
+    for (n = 0; n < 2000; n += 2) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        CANSTORE(key, strlen(key), "newvalue", 8);
+    }
+    CANCOMMIT();
+    gen = twom_db_generation(db);
+    snprintf(newfname, sizeof(newfname), "%s.NEW", filename);
+
+    /* a few KB at a time, changing things between the slices */
+    for (steps = 0; ; steps++) {
+        r = twom_db_repack_step(db, 4096, 0);
+        if (r == TWOM_DONE) break;
+        ASSERT_OK(r);
+        ASSERT_EQ(twom_db_generation(db), gen);
+        snprintf(key, sizeof(key), "key%05d", steps * 7);
+        snprintf(val, sizeof(val), "step%d", steps);
+        r = twom_db_store(db, key, strlen(key), val, strlen(val), 0);
+        ASSERT_OK(r);
+        snprintf(key, sizeof(key), "key%05d", steps * 7 + 1);
+        r = twom_db_store(db, key, strlen(key), NULL, 0, 0);
+        ASSERT_OK(r);
+        /* a write transaction holds the repack off */
+        r = twom_db_begin_txn(db, 0, &txn);
+        ASSERT_OK(r);
+        r = twom_db_repack_step(db, 4096, 0);
+        ASSERT_EQ(r, TWOM_LOCKED);
+        CANCOMMIT();
+    }
+    ASSERT(steps > 5);
+    ASSERT_EQ(twom_db_generation(db), gen + 1);
+    ISCONSISTENT();
+
+    for (n = 0; n < 2000; n++) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        if (n / 7 < steps && n % 7 == 1) {
+            CANNOTFETCH_NOTXN(key, strlen(key), TWOM_NOTFOUND);
+        }
+        else if (n / 7 < steps && n % 7 == 0) {
+            snprintf(val, sizeof(val), "step%d", n / 7);
+            CANFETCH_NOTXN(key, strlen(key), val, strlen(val));
+        }
+        else if (n % 2) {
+            CANFETCH_NOTXN(key, strlen(key), "value", 5);
+        }
+        else {
+            CANFETCH_NOTXN(key, strlen(key), "newvalue", 8);
+        }
+    }
+
+    /* give up part way, and nothing has changed */
+    size_t size = twom_db_size(db);
+    r = twom_db_repack_step(db, 4096, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(fexists(newfname), 0);
+    r = twom_db_repack_abort(db);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_generation(db), gen + 1);
+    ASSERT_EQ(twom_db_size(db), size);
+    ASSERT_EQ(fexists(newfname), -ENOENT);
+    CANSTORE("key00003", 8, "after", 5);
+    CANCOMMIT();
+    CANFETCH_NOTXN("key00003", 8, "after", 5);
+
+    /* and twom_db_repack picks up where a slice left off */
+    r = twom_db_repack_step(db, 4096, 0);
+    ASSERT_OK(r);
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_generation(db), gen + 2);
+    CANFETCH_NOTXN("key00003", 8, "after", 5);
+    CANFETCH_NOTXN("key01999", 8, "value", 5);
+    ISCONSISTENT();
+
+    /* closing with a repack under way throws it away */
+    r = twom_db_repack_step(db, 4096, 0);
+    ASSERT_OK(r);
+    CANREOPEN();
+    ASSERT_EQ(fexists(newfname), -ENOENT);
+    ASSERT_EQ(twom_db_generation(db), gen + 2);
+    CANFETCH_NOTXN("key00003", 8, "after", 5);
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_blobs
+ *
+ * With TWOM_BLOBS, big values live in fname.BLOBS: the main
+ * file stays small, reads still see the values, repack copies
+ * only the references, and a damaged blob fails its checksum.
+ * ============================================================
+ */
+static size_t blob_value(char *buf, int n, int version)
+{
+    size_t len = 2000 + (n % 17) * 100;
+    size_t i;
+    for (i = 0; i < len; i++)
+        buf[i] = (char)('a' + (n + version + i) % 26);
+    return len;
+}
+
+struct blob_rock {
+    int count;
+    int bad;
+};
+
+static int blob_check_cb(void *rock,
+                         const char *key, size_t keylen,
+                         const char *data, size_t datalen)
+{
+    struct blob_rock *br = (struct blob_rock *)rock;
+    char buf[4000];
+    int n = atoi(key + 3);
+    size_t len = blob_value(buf, n, n % 3 ? 0 : 1);
+    (void)keylen;
+    if (datalen != len || memcmp(data, buf, len)) br->bad++;
+    br->count++;
+    return 0;
+}
+
+static void test_blobs(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct blob_rock br;
+    char blobfname[PATH_MAX];
+    char key[32], buf[4000];
+    const char *val;
+    size_t len, vallen;
+    uint32_t version;
+    struct stat sbuf;
+    int r, n, fd;
+
+    snprintf(blobfname, sizeof(blobfname), "%s.BLOBS", filename);
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE | TWOM_BLOBS;
+    init.blob_threshold = 1000;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < 200; n++) {
+        snprintf(key, sizeof(key), "key%04d", n);
+        len = blob_value(buf, n, 0);
+        CANSTORE(key, strlen(key), buf, len);
+    }
+    CANSTORE("small", 5, "value", 5);
+    CANCOMMIT();
+
+    /* the values went to the blob file */
+    ASSERT(twom_db_size(db) < 200 * 1000);
+    ASSERT_OK(stat(blobfname, &sbuf));
+    ASSERT((size_t)sbuf.st_size > 200 * 2000);
+    fd = open(filename, O_RDONLY);
+    ASSERT(fd >= 0);
+    pread(fd, &version, 4, 32); /* OFFSET_VERSION = 32 */
+    close(fd);
+    ASSERT_EQ(le32toh(version), 3);
+
+    len = blob_value(buf, 42, 0);
+    CANFETCH_NOTXN("key0042", 7, buf, len);
+    CANFETCH_NOTXN("small", 5, "value", 5);
+
+    /* replace every third in the same transaction it's read in */
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    for (n = 0; n < 200; n += 3) {
+        snprintf(key, sizeof(key), "key%04d", n);
+        len = blob_value(buf, n, 1);
+        CANSTORE(key, strlen(key), buf, len);
+        r = twom_txn_fetch(txn, key, strlen(key), NULL, NULL, &val, &vallen, 0);
+        ASSERT_OK(r);
+        ASSERT_EQ(vallen, len);
+        ASSERT(!memcmp(val, buf, len));
+    }
+    CANCOMMIT();
+
+    /* a repack copies the references, leaving the blob file alone */
+    ASSERT_OK(stat(blobfname, &sbuf));
+    off_t blobsize = sbuf.st_size;
+    size_t oldsize = twom_db_size(db);
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    ASSERT(twom_db_size(db) < oldsize);
+    ASSERT_OK(stat(blobfname, &sbuf));
+    ASSERT_EQ(sbuf.st_size, blobsize);
+    ISCONSISTENT();
+
+    CANREOPEN();
+    memset(&br, 0, sizeof(br));
+    r = twom_db_foreach(db, "key", 3, NULL, blob_check_cb, &br, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(br.count, 200);
+    ASSERT_EQ(br.bad, 0);
+    CANFETCH_NOTXN("small", 5, "value", 5);
+
+    /* a write in the middle of a blob is caught by its checksum: key0001's
+     * blob is the second one, after the header and key0000's first value */
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    fd = open(blobfname, O_RDWR);
+    ASSERT(fd >= 0);
+    len = blob_value(buf, 1, 0);
+    char copy[4000];
+    ASSERT_EQ(pread(fd, copy, len, 16 + 2000), (ssize_t)len);
+    ASSERT(!memcmp(copy, buf, len));
+    pwrite(fd, "!", 1, 16 + 2000 + 10);
+    close(fd);
+
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    r = twom_db_fetch(db, "key0001", 7, NULL, NULL, &val, &vallen, 0);
+    ASSERT_EQ(r, TWOM_BADCHECKSUM);
+    len = blob_value(buf, 2, 0);
+    CANFETCH_NOTXN("key0002", 7, buf, len);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_bloom
+ *
+ * With TWOM_BLOOM, fetches of missing keys are mostly turned
+ * away by the key filter without a search, and keys that are
+ * there (committed, or stored earlier in the same transaction)
+ * are always found.  A filter that has fallen behind the file is
+ * ignored until the next commit catches it up, one from another
+ * generation is never used, and repack builds a new one.
+ * ============================================================
+ */
+static void bloom_check_all(struct twom_db *db, int n)
+{
+    char key[32];
+    int i, r;
+    for (i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key%05d", i);
+        r = twom_db_fetch(db, key, strlen(key), NULL, NULL, NULL, NULL, 0);
+        ASSERT_OK(r);
+    }
+}
+
+static void bloom_misses(struct twom_db *db, int n, uint64_t *negatives)
+{
+    struct twom_stats st;
+    char key[32];
+    int i, r;
+    *negatives = UINT64_MAX;
+    twom_db_reset_stats(db);
+    for (i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "nokey%05d", i);
+        r = twom_db_fetch(db, key, strlen(key), NULL, NULL, NULL, NULL, 0);
+        ASSERT_EQ(r, TWOM_NOTFOUND);
+    }
+    twom_db_stats(db, &st);
+    *negatives = st.bloom_negatives;
+}
+
+static void test_bloom(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct stat sbuf;
+    char bloomname[PATH_MAX];
+    char savename[PATH_MAX];
+    char key[32];
+    uint64_t neg;
+    int r, n, fd;
+
+    snprintf(bloomname, sizeof(bloomname), "%s.BLOOM", filename);
+    snprintf(savename, sizeof(savename), "%s.BLOOM.SAVE", filename);
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE | TWOM_BLOOM;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    ASSERT_EQ(stat(bloomname, &sbuf), 0);
+
+    for (n = 0; n < 1000; n++) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        CANSTORE(key, strlen(key), "val", 3);
+    }
+    CANCOMMIT();
+    bloom_check_all(db, 1000);
+    bloom_misses(db, 1000, &neg);
+    ASSERT(neg > 950 && neg <= 1000);
+    /* FETCHNEXT still finds the key after a missing one */
+    {
+        const char *k;
+        size_t kl;
+        r = twom_db_fetch(db, "key00010x", 9, &k, &kl, NULL, NULL, TWOM_FETCHNEXT);
+        ASSERT_OK(r);
+        ASSERT_MEM_EQ(k, "key00011", 8);
+    }
+
+    /* a key stored in this transaction is found in it, and gone after an abort */
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    r = twom_txn_store(txn, "nokey00001", 10, "here", 4, 0);
+    ASSERT_OK(r);
+    r = twom_txn_fetch(txn, "nokey00001", 10, NULL, NULL, NULL, NULL, 0);
+    ASSERT_OK(r);
+    r = twom_txn_abort(&txn);
+    ASSERT_OK(r);
+    r = twom_db_fetch(db, "nokey00001", 10, NULL, NULL, NULL, NULL, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    CANDELETE("key00002", 8);
+    CANCOMMIT();
+    r = twom_db_fetch(db, "key00002", 8, NULL, NULL, NULL, NULL, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    CANSTORE("key00002", 8, "val", 3);
+    CANCOMMIT();
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* as if written by something which didn't keep the filter up to date:
+     * no bits, and covering just the empty file.  It's ignored... */
+    fd = open(bloomname, O_RDWR);
+    ASSERT(fd >= 0);
+    {
+        char *zero = calloc(1, sbuf.st_size - 64);
+        uint64_t covered = htole64(96 + 24 + 8 * 31);
+        ASSERT_EQ(pwrite(fd, zero, sbuf.st_size - 64, 64), sbuf.st_size - 64);
+        ASSERT_EQ(pwrite(fd, &covered, 8, 32), 8);
+        free(zero);
+    }
+    close(fd);
+    init.flags = 0;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    bloom_check_all(db, 1000);
+    bloom_misses(db, 100, &neg);
+    ASSERT_EQ(neg, 0);
+
+    /* ...until the next commit puts everything back in it */
+    CANSTORE("key01000", 8, "val", 3);
+    CANCOMMIT();
+    bloom_check_all(db, 1001);
+    bloom_misses(db, 1000, &neg);
+    ASSERT(neg > 950 && neg <= 1000);
+
+    /* repack builds a filter for the new generation */
+    fd = open(bloomname, O_RDONLY);
+    ASSERT(fd >= 0);
+    {
+        int out = open(savename, O_RDWR|O_CREAT|O_TRUNC, 0644);
+        char buf[65536];
+        ssize_t len;
+        ASSERT(out >= 0);
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+            ASSERT_EQ(write(out, buf, len), len);
+        close(out);
+    }
+    close(fd);
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_db_generation(db), 2);
+    bloom_check_all(db, 1001);
+    bloom_misses(db, 1000, &neg);
+    ASSERT(neg > 950 && neg <= 1000);
+    CANSTORE("added00003", 10, "now", 3);
+    CANCOMMIT();
+    r = twom_db_fetch(db, "added00003", 10, NULL, NULL, NULL, NULL, 0);
+    ASSERT_OK(r);
+    ISCONSISTENT();
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* and one from the last generation is never used */
+    r = rename(savename, bloomname);
+    ASSERT_EQ(r, 0);
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    bloom_check_all(db, 1001);
+    bloom_misses(db, 100, &neg);
+    ASSERT_EQ(neg, 0);
+    r = twom_db_fetch(db, "added00003", 10, NULL, NULL, NULL, NULL, 0);
+    ASSERT_OK(r);
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_compress
+ *
+ * With a compress function, values over the threshold that
+ * come out shorter are stored compressed, and read back
+ * (by fetch, foreach and cursors) decompressed.  The file
+ * can't be opened without a decompressor, and a repack
+ * rewrites every value with whatever compressor this open
+ * has, or none.
+ * ============================================================
+ */
+/* run-length coding: a tag byte naming the "algorithm", then (count, byte)
+ * pairs.  'S' just stores the counts the other way up */
+static size_t rle_encode(char tag, const char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    size_t i = 0, n = 0;
+    if (dstlen < 1) return 0;
+    dst[n++] = tag;
+    while (i < srclen) {
+        size_t run = 1;
+        while (i + run < srclen && run < 255 && src[i + run] == src[i]) run++;
+        if (n + 2 > dstlen) return 0;
+        dst[n++] = (char)(tag == 'S' ? 255 - run : run);
+        dst[n++] = src[i];
+        i += run;
+    }
+    return n;
+}
+
+static size_t rle_compress(const char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    return rle_encode('R', src, srclen, dst, dstlen);
+}
+
+static size_t rle2_compress(const char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    return rle_encode('S', src, srclen, dst, dstlen);
+}
+
+static size_t rle_decode(const char *tags, const char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    size_t i, n = 0;
+    if (!srclen || !strchr(tags, src[0])) return 0;
+    for (i = 1; i + 1 < srclen; i += 2) {
+        size_t run = (unsigned char)src[i];
+        if (src[0] == 'S') run = 255 - run;
+        if (n + run > dstlen) return 0;
+        memset(dst + n, src[i + 1], run);
+        n += run;
+    }
+    return n;
+}
+
+static size_t rle_decompress(const char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    return rle_decode("RS", src, srclen, dst, dstlen);
+}
+
+static size_t rle2_decompress(const char *src, size_t srclen, char *dst, size_t dstlen)
+{
+    return rle_decode("S", src, srclen, dst, dstlen);
+}
+
+// a value which compresses well for even n, and not at all for odd
+static size_t compress_value(char *buf, int n)
+{
+    size_t len = 1000 + n * 10;
+    size_t i;
+    for (i = 0; i < len; i++)
+        buf[i] = (n & 1) ? (char)(i * 7 + n) : (char)('a' + (i / 100 + n) % 26);
+    return len;
+}
+
+static int compress_check_cb(void *rock,
+                             const char *key, size_t keylen,
+                             const char *data, size_t datalen)
+{
+    struct blob_rock *br = (struct blob_rock *)rock;
+    char buf[2000];
+    size_t len = compress_value(buf, atoi(key + 3));
+    (void)keylen;
+    if (datalen != len || memcmp(data, buf, len)) br->bad++;
+    br->count++;
+    return 0;
+}
+
+static void compress_check_all(struct twom_db *db)
+{
+    struct twom_cursor *cur = NULL;
+    struct blob_rock br;
+    const char *key, *val;
+    size_t keylen, vallen;
+    int r;
+
+    memset(&br, 0, sizeof(br));
+    r = twom_db_foreach(db, "key", 3, NULL, compress_check_cb, &br, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(br.count, 50);
+    ASSERT_EQ(br.bad, 0);
+
+    memset(&br, 0, sizeof(br));
+    r = twom_db_begin_cursor(db, "key", 3, &cur, TWOM_CURSOR_PREFIX);
+    ASSERT_OK(r);
+    while (!(r = twom_cursor_next(cur, &key, &keylen, &val, &vallen)))
+        compress_check_cb(&br, key, keylen, val, vallen);
+    ASSERT_EQ(r, TWOM_DONE);
+    r = twom_cursor_abort(&cur);
+    ASSERT_OK(r);
+    ASSERT_EQ(br.count, 50);
+    ASSERT_EQ(br.bad, 0);
+}
+
+static void test_compress(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_stats st;
+    char key[32], buf[2000], buf2[2000];
+    const char *val, *val2;
+    size_t len, len2, vallen, vallen2;
+    uint32_t version;
+    int r, n, fd;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    init.compress = rle_compress;
+    init.decompress = rle_decompress;
+
+    /* compressing without being able to read it back is a mistake */
+    init.decompress = NULL;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    init.decompress = rle_decompress;
+
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    for (n = 0; n < 50; n++) {
+        snprintf(key, sizeof(key), "key%04d", n);
+        len = compress_value(buf, n);
+        CANSTORE(key, strlen(key), buf, len);
+    }
+    CANSTORE("small", 5, "aaaaaaaaaa", 10);
+    CANCOMMIT();
+
+    /* only the even values were worth it, and the small one is under the threshold */
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.compressions, 25);
+    ASSERT(twom_db_size(db) < 25 * 1500 + 25 * 100 + 16384);
+    fd = open(filename, O_RDONLY);
+    ASSERT(fd >= 0);
+    pread(fd, &version, 4, 32); /* OFFSET_VERSION = 32 */
+    close(fd);
+    ASSERT_EQ(le32toh(version), 4);
+
+    compress_check_all(db);
+    len = compress_value(buf, 42);
+    CANFETCH_NOTXN("key0042", 7, buf, len);
+    CANFETCH_NOTXN("small", 5, "aaaaaaaaaa", 10);
+
+    /* a value from twom_db_fetch outlives the transaction it was read in */
+    r = twom_db_fetch(db, "key0010", 7, NULL, NULL, &val, &vallen, 0);
+    ASSERT_OK(r);
+    r = twom_db_fetch(db, "key0011", 7, NULL, NULL, &val2, &vallen2, 0);
+    ASSERT_OK(r);
+    len = compress_value(buf, 10);
+    ASSERT_EQ(vallen, len);
+    ASSERT(!memcmp(val, buf, len));
+
+    /* storing the same value again is still spotted, and a value just
+     * fetched in the transaction can be stored straight back */
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    r = twom_txn_fetch(txn, "key0020", 7, NULL, NULL, &val, &vallen, 0);
+    ASSERT_OK(r);
+    CANSTORE("key0020", 7, val, vallen);
+    CANSTORE("copy", 4, val, vallen);
+    CANCOMMIT();
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.compressions, 26);
+    len = compress_value(buf, 20);
+    CANFETCH_NOTXN("copy", 4, buf, len);
+    ISCONSISTENT();
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* no decompressor, no database */
+    struct twom_open_data plain = TWOM_OPEN_DATA_INITIALIZER;
+    r = twom_db_open(filename, &plain, &db, NULL);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+
+    /* change the algorithm offline: read with both, write the new one */
+    init.flags = 0;
+    init.compress = rle2_compress;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    ISCONSISTENT();
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    /* and now only the new one is needed */
+    init.compress = NULL;
+    init.decompress = rle2_decompress;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    compress_check_all(db);
+    len = compress_value(buf, 20);
+    CANFETCH_NOTXN("copy", 4, buf, len);
+    /* a handle without a compressor writes values as they are */
+    len = compress_value(buf, 30);
+    len2 = compress_value(buf2, 32);
+    CANSTORE("key0030", 7, buf2, len2);
+    CANCOMMIT();
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.compressions, 0);
+
+    /* repacking without one decompresses everything */
+    r = twom_db_repack(db);
+    ASSERT_OK(r);
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    r = twom_db_open(filename, &plain, &db, NULL);
+    ASSERT_OK(r);
+    CANFETCH_NOTXN("key0030", 7, buf2, len2);
+    CANSTORE("key0030", 7, buf, len);
+    CANCOMMIT();
+    compress_check_all(db);
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_compress_threads
+ *
+ * With TWOM_THREADSAFE, each thread's decompressed values stay
+ * good until its own next call, whatever the other threads
+ * fetch and write meanwhile.
+ * ============================================================
+ */
+#define CT_THREADS 4
+#define CT_ROUNDS 2000
+
+struct ct_rock {
+    struct twom_db *db;
+    int seed;
+    int bad;
+    int errors;
+};
+
+static void *ct_reader(void *arg)
+{
+    struct ct_rock *cr = (struct ct_rock *)arg;
+    char key[32], buf[2000];
+    const char *val;
+    size_t vallen, len;
+    int i;
+
+    for (i = 0; i < CT_ROUNDS; i++) {
+        int n = ((i * 7 + cr->seed * 13) % 25) * 2;
+        snprintf(key, sizeof(key), "key%04d", n);
+        if (twom_db_fetch(cr->db, key, strlen(key), NULL, NULL, &val, &vallen, 0)) {
+            cr->errors++;
+            continue;
+        }
+        /* let the others finish a few transactions of their own */
+        if (!(i % 16)) sched_yield();
+        len = compress_value(buf, n);
+        if (vallen != len || memcmp(val, buf, len)) cr->bad++;
+    }
+    return NULL;
+}
+
+static void *ct_writer(void *arg)
+{
+    struct ct_rock *cr = (struct ct_rock *)arg;
+    char key[32], buf[2000];
+    size_t len;
+    int i;
+
+    for (i = 0; i < CT_ROUNDS / 10; i++) {
+        snprintf(key, sizeof(key), "new%04d", i);
+        len = compress_value(buf, (i % 25) * 2);
+        if (twom_db_store(cr->db, key, strlen(key), buf, len, 0)) cr->errors++;
+    }
+    return NULL;
+}
+
+static void test_compress_threads(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct ct_rock rocks[CT_THREADS + 1];
+    pthread_t threads[CT_THREADS + 1];
+    char key[32], buf[2000];
+    size_t len;
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE | TWOM_THREADSAFE;
+    init.compress = rle_compress;
+    init.decompress = rle_decompress;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    for (n = 0; n < 50; n += 2) {
+        snprintf(key, sizeof(key), "key%04d", n);
+        len = compress_value(buf, n);
+        CANSTORE(key, strlen(key), buf, len);
+    }
+    CANCOMMIT();
+
+    memset(rocks, 0, sizeof(rocks));
+    for (n = 0; n <= CT_THREADS; n++) {
+        rocks[n].db = db;
+        rocks[n].seed = n;
+        ASSERT_OK(pthread_create(&threads[n], NULL,
+                                 n < CT_THREADS ? ct_reader : ct_writer, &rocks[n]));
+    }
+    for (n = 0; n <= CT_THREADS; n++) {
+        pthread_join(threads[n], NULL);
+        ASSERT_EQ(rocks[n].errors, 0);
+        ASSERT_EQ(rocks[n].bad, 0);
+    }
+
+    ISCONSISTENT();
+    len = compress_value(buf, 8);
+    CANFETCH_NOTXN("new0004", 7, buf, len);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_shards
+ *
+ * A database split by key hash: each key is in the shard
+ * twom_shards_which names, the merged cursor reads them all in
+ * order (forwards, backwards, in a prefix, after a key), a
+ * transaction sees its own changes before they're committed
+ * and none of them after an abort, and reopening finds the
+ * layout it was created with.
+ * ============================================================
+ */
+static int shards_count_cb(void *rock, const char *key __attribute__((unused)),
+                           size_t keylen __attribute__((unused)),
+                           const char *data __attribute__((unused)),
+                           size_t datalen __attribute__((unused)))
+{
+    (*(int *)rock)++;
+    return 0;
+}
+
+static void test_shards(void)
+{
+    struct twom_shards *shards = NULL;
+    struct twom_shards_txn *stxn = NULL;
+    struct twom_shards_cursor *cur = NULL;
+    char dirname[PATH_MAX];
+    char key[32], val[32];
+    const char *k, *v;
+    size_t kl, vl, i;
+    int r, n;
+
+    snprintf(dirname, sizeof(dirname), "%s.shards", filename);
+
+    /* a new directory needs a layout */
+    struct twom_shards_open_data init = TWOM_SHARDS_OPEN_DATA_INITIALIZER;
+    init.db.flags = TWOM_CREATE;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    ASSERT(!shards);
+
+    init.nshards = 4;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_shards_count(shards), 4);
+
+    for (n = 0; n < 1000; n++) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        snprintf(val, sizeof(val), "val%d", n);
+        r = twom_shards_store(shards, key, strlen(key), val, strlen(val), 0);
+        ASSERT_OK(r);
+    }
+    for (i = 0; i < 4; i++)
+        ASSERT(twom_db_num_records(twom_shards_db(shards, i)) > 150);
+    for (n = 0; n < 1000; n += 7) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        snprintf(val, sizeof(val), "val%d", n);
+        r = twom_shards_fetch(shards, key, strlen(key), &v, &vl, 0);
+        ASSERT_OK(r);
+        ASSERT_MEM_EQ(v, val, vl);
+        struct twom_db *sdb = twom_shards_db(shards, twom_shards_which(shards, key, strlen(key)));
+        r = twom_db_fetch(sdb, key, strlen(key), NULL, NULL, NULL, NULL, 0);
+        ASSERT_OK(r);
+    }
+    r = twom_shards_fetch(shards, "key00001", 8, &v, &vl, TWOM_FETCHNEXT);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+
+    /* the cursor merges the shards back into order */
+    r = twom_shards_begin_cursor(shards, NULL, 0, &cur, 0);
+    ASSERT_OK(r);
+    for (n = 0; (r = twom_shards_cursor_next(cur, &k, &kl, &v, &vl)) == 0; n++) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        snprintf(val, sizeof(val), "val%d", n);
+        ASSERT_EQ(kl, strlen(key));
+        ASSERT_MEM_EQ(k, key, kl);
+        ASSERT_MEM_EQ(v, val, vl);
+    }
+    ASSERT_EQ(r, TWOM_DONE);
+    ASSERT_EQ(n, 1000);
+    twom_shards_cursor_fini(&cur);
+
+    r = twom_shards_begin_cursor(shards, NULL, 0, &cur, TWOM_REVERSE);
+    ASSERT_OK(r);
+    for (n = 999; (r = twom_shards_cursor_next(cur, &k, &kl, NULL, NULL)) == 0; n--) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        ASSERT_MEM_EQ(k, key, kl);
+    }
+    ASSERT_EQ(r, TWOM_DONE);
+    ASSERT_EQ(n, -1);
+    twom_shards_cursor_fini(&cur);
+
+    r = twom_shards_begin_cursor(shards, "key001", 6, &cur, TWOM_CURSOR_PREFIX);
+    ASSERT_OK(r);
+    for (n = 100; (r = twom_shards_cursor_next(cur, &k, &kl, NULL, NULL)) == 0; n++) {
+        snprintf(key, sizeof(key), "key%05d", n);
+        ASSERT_MEM_EQ(k, key, kl);
+    }
+    ASSERT_EQ(n, 200);
+    twom_shards_cursor_fini(&cur);
+
+    r = twom_shards_begin_cursor(shards, "key00500", 8, &cur, TWOM_SKIPROOT);
+    ASSERT_OK(r);
+    r = twom_shards_cursor_next(cur, &k, &kl, NULL, NULL);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(k, "key00501", kl);
+    twom_shards_cursor_fini(&cur);
+
+    n = 0;
+    r = twom_shards_foreach(shards, "key009", 6, NULL, shards_count_cb, &n, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(n, 100);
+
+    /* a transaction sees its own changes, and nobody else does until the commit */
+    r = twom_shards_begin_txn(shards, &stxn);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(stxn, "key00001", 8, "new", 3, 0);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(stxn, "key00002", 8, NULL, 0, 0);
+    ASSERT_OK(r);
+    for (n = 0; n < 20; n++) {
+        snprintf(key, sizeof(key), "txn%02d", n);
+        r = twom_shards_txn_store(stxn, key, strlen(key), "t", 1, 0);
+        ASSERT_OK(r);
+    }
+    r = twom_shards_txn_store(stxn, "key00003", 8, "dup", 3, TWOM_IFNOTEXIST);
+    ASSERT_EQ(r, TWOM_EXISTS);
+    r = twom_shards_txn_store(stxn, "txn05", 5, "dup", 3, TWOM_IFNOTEXIST);
+    ASSERT_EQ(r, TWOM_EXISTS);
+    r = twom_shards_txn_store(stxn, "nothere", 7, NULL, 0, TWOM_IFEXIST);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    r = twom_shards_txn_fetch(stxn, "key00001", 8, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(v, "new", vl);
+    r = twom_shards_txn_fetch(stxn, "key00002", 8, &v, &vl, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    r = twom_shards_txn_fetch(stxn, "key00004", 8, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(v, "val4", vl);
+    r = twom_shards_fetch(shards, "key00001", 8, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(v, "val1", vl);
+    r = twom_shards_txn_abort(&stxn);
+    ASSERT_OK(r);
+    ASSERT(!stxn);
+    r = twom_shards_fetch(shards, "txn05", 5, &v, &vl, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+
+    r = twom_shards_begin_txn(shards, &stxn);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(stxn, "key00001", 8, "new", 3, 0);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(stxn, "key00002", 8, NULL, 0, 0);
+    ASSERT_OK(r);
+    for (n = 19; n >= 0; n--) {
+        snprintf(key, sizeof(key), "txn%02d", n);
+        r = twom_shards_txn_store(stxn, key, strlen(key), "t", 1, 0);
+        ASSERT_OK(r);
+    }
+    r = twom_shards_txn_commit(&stxn);
+    ASSERT_OK(r);
+    r = twom_shards_fetch(shards, "key00001", 8, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(v, "new", vl);
+    r = twom_shards_fetch(shards, "key00002", 8, &v, &vl, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    n = 0;
+    r = twom_shards_foreach(shards, NULL, 0, NULL, shards_count_cb, &n, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(n, 1019);
+
+    /* the conditions are checked again at the commit, when it's locked */
+    struct twom_shards_txn *other = NULL;
+    r = twom_shards_begin_txn(shards, &stxn);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(stxn, "racer", 5, "mine", 4, TWOM_IFNOTEXIST);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(stxn, "key00005", 8, "mine", 4, TWOM_IFEXIST);
+    ASSERT_OK(r);
+    r = twom_shards_begin_txn(shards, &other);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(other, "racer", 5, "theirs", 6, TWOM_IFNOTEXIST);
+    ASSERT_OK(r);
+    r = twom_shards_txn_commit(&other);
+    ASSERT_OK(r);
+    r = twom_shards_txn_commit(&stxn);
+    ASSERT_EQ(r, TWOM_EXISTS);
+    ASSERT(!stxn);
+    r = twom_shards_fetch(shards, "racer", 5, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(v, "theirs", vl);
+
+    r = twom_shards_begin_txn(shards, &stxn);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(stxn, "key00005", 8, "mine", 4, TWOM_IFEXIST);
+    ASSERT_OK(r);
+    r = twom_shards_store(shards, "key00005", 8, NULL, 0, 0);
+    ASSERT_OK(r);
+    r = twom_shards_txn_commit(&stxn);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    r = twom_shards_fetch(shards, "key00005", 8, &v, &vl, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+
+    r = twom_shards_close(&shards);
+    ASSERT_OK(r);
+
+    /* the layout is read back, and another one refused */
+    init.db.flags = 0;
+    init.nshards = 0;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_shards_count(shards), 4);
+    r = twom_shards_fetch(shards, "txn19", 5, &v, &vl, 0);
+    ASSERT_OK(r);
+    r = twom_shards_close(&shards);
+    ASSERT_OK(r);
+
+    init.nshards = 8;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+}
+
+/*
+ * ============================================================
+ * test_shards_ranges
+ *
+ * A database split by key range keeps each key in the shard
+ * whose range it falls in, and a cursor over everything, or
+ * from a key, or in a prefix, reads them back in order.
+ * ============================================================
+ */
+static void test_shards_ranges(void)
+{
+    struct twom_shards *shards = NULL;
+    struct twom_shards_cursor *cur = NULL;
+    char dirname[PATH_MAX];
+    const char *k;
+    size_t kl, i;
+    int r, n;
+    static const char *words[] = {
+        "apple", "banana", "cherry", "g", "grape", "kiwi", "lemon",
+        "mango", "p", "peach", "pear", "plum", "quince", "zebra",
+    };
+    static const size_t inshard[] = { 0, 0, 0, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2 };
+    size_t nwords = sizeof(words) / sizeof(words[0]);
+    const char *splits[] = { "g", "p" };
+    size_t splitlens[] = { 1, 1 };
+    const char *badsplits[] = { "p", "g" };
+
+    snprintf(dirname, sizeof(dirname), "%s.ranges", filename);
+
+    struct twom_shards_open_data init = TWOM_SHARDS_OPEN_DATA_INITIALIZER;
+    init.db.flags = TWOM_CREATE;
+    init.nsplits = 2;
+    init.splits = badsplits;
+    init.splitlens = splitlens;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+
+    init.splits = splits;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_OK(r);
+    ASSERT_EQ(twom_shards_count(shards), 3);
+
+    /* stored out of order */
+    for (i = nwords; i-- > 0; ) {
+        ASSERT_EQ(twom_shards_which(shards, words[i], strlen(words[i])), inshard[i]);
+        r = twom_shards_store(shards, words[i], strlen(words[i]), "v", 1, 0);
+        ASSERT_OK(r);
+        r = twom_db_fetch(twom_shards_db(shards, inshard[i]), words[i], strlen(words[i]),
+                          NULL, NULL, NULL, NULL, 0);
+        ASSERT_OK(r);
+    }
+    ASSERT_EQ(twom_db_num_records(twom_shards_db(shards, 0)), 3);
+
+    r = twom_shards_begin_cursor(shards, NULL, 0, &cur, 0);
+    ASSERT_OK(r);
+    for (n = 0; (r = twom_shards_cursor_next(cur, &k, &kl, NULL, NULL)) == 0; n++) {
+        ASSERT_EQ(kl, strlen(words[n]));
+        ASSERT_MEM_EQ(k, words[n], kl);
+    }
+    ASSERT_EQ(n, (int)nwords);
+    twom_shards_cursor_fini(&cur);
+
+    /* backwards from between two keys */
+    r = twom_shards_begin_cursor(shards, "m", 1, &cur, TWOM_REVERSE);
+    ASSERT_OK(r);
+    for (n = 6; (r = twom_shards_cursor_next(cur, &k, &kl, NULL, NULL)) == 0; n--)
+        ASSERT_MEM_EQ(k, words[n], kl);
+    ASSERT_EQ(n, -1);
+    twom_shards_cursor_fini(&cur);
+
+    r = twom_shards_begin_cursor(shards, "pe", 2, &cur, TWOM_CURSOR_PREFIX);
+    ASSERT_OK(r);
+    for (n = 9; (r = twom_shards_cursor_next(cur, &k, &kl, NULL, NULL)) == 0; n++)
+        ASSERT_MEM_EQ(k, words[n], kl);
+    ASSERT_EQ(n, 11);
+    twom_shards_cursor_fini(&cur);
+
+    r = twom_shards_begin_cursor(shards, "h", 1, &cur, 0);
+    ASSERT_OK(r);
+    for (n = 5; (r = twom_shards_cursor_next(cur, &k, &kl, NULL, NULL)) == 0; n++)
+        ASSERT_MEM_EQ(k, words[n], kl);
+    ASSERT_EQ(n, (int)nwords);
+    twom_shards_cursor_fini(&cur);
+
+    r = twom_shards_close(&shards);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_shards_atomic
+ *
+ * An atomic commit across three shards, with the writer killed
+ * part way through committing them, after the first shard has
+ * its changes.  Another writer gets to the shards straight
+ * through their files, changing a few of the same keys.  Then a
+ * store through a handle opened before the crash finishes the
+ * commit in the shards which didn't get it, except for those
+ * newer changes, and leaves the journal empty.
+ * ============================================================
+ */
+static int shards_crash_armed = 0;
+
+static uint32_t shards_crash_csum(const char *base, size_t len)
+{
+    /* the second COMMIT record written since arming */
+    if (shards_crash_armed && len == 16 && base[0] == 7 && ++shards_crash_armed == 3)
+        _exit(7);
+    return my_csum(base, len);
+}
+
+static int shards_crashed_count(const char *dirname, int *np)
+{
+    struct twom_shards *shards = NULL;
+    struct twom_shards_open_data init = TWOM_SHARDS_OPEN_DATA_INITIALIZER;
+    char key[32];
+    const char *v;
+    size_t vl;
+    int r, n;
+
+    init.db.flags = TWOM_SHARED | TWOM_CSUM_EXTERNAL;
+    init.db.csum = shards_crash_csum;
+    r = twom_shards_open(dirname, &init, &shards);
+    if (r) return r;
+    *np = 0;
+    for (n = 0; n < 30; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        r = twom_shards_fetch(shards, key, strlen(key), &v, &vl, 0);
+        if (r) break;
+        if (vl == 5 && !memcmp(v, "crash", 5)) (*np)++;
+    }
+    twom_shards_close(&shards);
+    return r;
+}
+
+static void test_shards_atomic(void)
+{
+    struct twom_shards *shards = NULL;
+    struct twom_shards_txn *stxn = NULL;
+    struct twom_shards *early = NULL;
+    struct twom_db *cdb = NULL;
+    char dirname[PATH_MAX], fname[PATH_MAX + 32];
+    char key[32];
+    const char *k, *v;
+    size_t kl, vl, i;
+    int newer[30], pershard[3] = { 0, 0, 0 };
+    int r, n, status, later = -1;
+
+    snprintf(dirname, sizeof(dirname), "%s.atomic", filename);
+
+    struct twom_shards_open_data init = TWOM_SHARDS_OPEN_DATA_INITIALIZER;
+    init.db.flags = TWOM_CREATE | TWOM_CSUM_EXTERNAL;
+    init.db.csum = shards_crash_csum;
+    init.nshards = 3;
+    init.atomic = 1;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_OK(r);
+
+    /* an ordinary atomic commit */
+    r = twom_shards_begin_txn(shards, &stxn);
+    ASSERT_OK(r);
+    for (n = 0; n < 30; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        r = twom_shards_txn_store(stxn, key, strlen(key), "first", 5, 0);
+        ASSERT_OK(r);
+    }
+    r = twom_shards_txn_commit(&stxn);
+    ASSERT_OK(r);
+    for (i = 0; i < 3; i++)
+        ASSERT(twom_db_num_records(twom_shards_db(shards, i)) > 0);
+    r = twom_shards_fetch(shards, "key29", 5, &v, &vl, 0);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(v, "first", vl);
+
+    /* a condition that fails at the commit leaves every shard alone */
+    struct twom_shards_txn *other = NULL;
+    r = twom_shards_begin_txn(shards, &stxn);
+    ASSERT_OK(r);
+    for (n = 0; n < 30; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        r = twom_shards_txn_store(stxn, key, strlen(key), "second", 6, 0);
+        ASSERT_OK(r);
+    }
+    r = twom_shards_txn_store(stxn, "racer", 5, "mine", 4, TWOM_IFNOTEXIST);
+    ASSERT_OK(r);
+    r = twom_shards_begin_txn(shards, &other);
+    ASSERT_OK(r);
+    r = twom_shards_txn_store(other, "racer", 5, "theirs", 6, 0);
+    ASSERT_OK(r);
+    r = twom_shards_txn_commit(&other);
+    ASSERT_OK(r);
+    r = twom_shards_txn_commit(&stxn);
+    ASSERT_EQ(r, TWOM_EXISTS);
+    for (n = 0; n < 30; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        r = twom_shards_fetch(shards, key, strlen(key), &v, &vl, 0);
+        ASSERT_OK(r);
+        ASSERT_MEM_EQ(v, "first", vl);
+    }
+    r = twom_shards_store(shards, "racer", 5, NULL, 0, 0);
+    ASSERT_OK(r);
+    r = twom_shards_close(&shards);
+    ASSERT_OK(r);
+
+    /* a handle which is still open after the crash */
+    init.db.flags = TWOM_CSUM_EXTERNAL;
+    r = twom_shards_open(dirname, &init, &early);
+    ASSERT_OK(r);
+    for (n = 0; n < 30; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        i = twom_shards_which(early, key, strlen(key));
+        newer[n] = pershard[i]++ < 2;
+        if (!newer[n] && later < 0) later = n;
+    }
+
+    pid_t pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) {
+        /* === CHILD === */
+        init.db.flags = TWOM_CSUM_EXTERNAL;
+        int cr = twom_shards_open(dirname, &init, &shards);
+        assert(cr == TWOM_OK);
+        cr = twom_shards_begin_txn(shards, &stxn);
+        assert(cr == TWOM_OK);
+        for (n = 0; n < 30; n++) {
+            snprintf(key, sizeof(key), "key%02d", n);
+            cr = twom_shards_txn_store(stxn, key, strlen(key), "crash", 5, 0);
+            assert(cr == TWOM_OK);
+        }
+        shards_crash_armed = 1;
+        twom_shards_txn_commit(&stxn);
+        _exit(0);
+    }
+
+    /* === PARENT === */
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 7);
+
+    /* the journal has the commit, and only some of the shards do */
+    struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+    snprintf(fname, sizeof(fname), "%s/shards.twom", dirname);
+    r = twom_db_open(fname, &cinit, &cdb, NULL);
+    ASSERT_OK(r);
+    r = twom_db_fetch(cdb, "pending.", 8, &k, &kl, NULL, NULL, TWOM_FETCHNEXT);
+    ASSERT_OK(r);
+    ASSERT_MEM_EQ(k, "pending.", 8);
+    r = twom_db_close(&cdb);
+    ASSERT_OK(r);
+    r = shards_crashed_count(dirname, &n);
+    ASSERT_OK(r);
+    ASSERT(n > 0 && n < 30);
+
+    /* someone else writes to every shard meanwhile, two of the same
+     * keys in each */
+    struct twom_open_data sinit = TWOM_OPEN_DATA_INITIALIZER;
+    sinit.flags = TWOM_CSUM_EXTERNAL;
+    sinit.csum = shards_crash_csum;
+    for (i = 0; i < 3; i++) {
+        struct twom_db *sdb = NULL;
+        snprintf(fname, sizeof(fname), "%s/shard%04zu.twom", dirname, i);
+        r = twom_db_open(fname, &sinit, &sdb, NULL);
+        ASSERT_OK(r);
+        snprintf(key, sizeof(key), "other%zu", i);
+        r = twom_db_store(sdb, key, strlen(key), "o", 1, 0);
+        ASSERT_OK(r);
+        for (n = 0; n < 30; n++) {
+            snprintf(key, sizeof(key), "key%02d", n);
+            if (!newer[n] || twom_shards_which(early, key, strlen(key)) != i) continue;
+            r = twom_db_store(sdb, key, strlen(key), "newer", 5, 0);
+            ASSERT_OK(r);
+        }
+        r = twom_db_close(&sdb);
+        ASSERT_OK(r);
+    }
+
+    /* the next store through the old handle finishes it first, but
+     * not over the newer values */
+    snprintf(key, sizeof(key), "key%02d", later);
+    r = twom_shards_store(early, key, strlen(key), "later", 5, 0);
+    ASSERT_OK(r);
+    r = twom_shards_close(&early);
+    ASSERT_OK(r);
+    r = shards_crashed_count(dirname, &n);
+    ASSERT_OK(r);
+    ASSERT_EQ(n, 30 - 6 - 1);
+    init.db.flags = TWOM_CSUM_EXTERNAL;
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_OK(r);
+    for (n = 0; n < 30; n++) {
+        snprintf(key, sizeof(key), "key%02d", n);
+        r = twom_shards_fetch(shards, key, strlen(key), &v, &vl, 0);
+        ASSERT_OK(r);
+        if (newer[n]) ASSERT_MEM_EQ(v, "newer", vl);
+        else if (n == later) ASSERT_MEM_EQ(v, "later", vl);
+        else ASSERT_MEM_EQ(v, "crash", vl);
+    }
+    r = twom_shards_close(&shards);
+    ASSERT_OK(r);
+    snprintf(fname, sizeof(fname), "%s/shards.twom", dirname);
+    r = twom_db_open(fname, &cinit, &cdb, NULL);
+    ASSERT_OK(r);
+    r = twom_db_fetch(cdb, "pending.", 8, &k, &kl, NULL, NULL, TWOM_FETCHNEXT);
+    ASSERT(r == TWOM_NOTFOUND || kl < 8 || memcmp(k, "pending.", 8));
+    r = twom_db_close(&cdb);
+    ASSERT_OK(r);
+
+    r = twom_shards_open(dirname, &init, &shards);
+    ASSERT_OK(r);
+    for (i = 0; i < 3; i++) {
+        snprintf(key, sizeof(key), "other%zu", i);
+        r = twom_db_fetch(twom_shards_db(shards, i), key, strlen(key), NULL, NULL, NULL, NULL, 0);
+        ASSERT_OK(r);
+    }
+    r = twom_shards_close(&shards);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_threadsafe
+ *
+ * With TWOM_THREADSAFE one handle is shared by several threads:
+ * readers see whole transactions while a writer (and repack)
+ * keep changing things, and the handle keeps other threads
+ * out while one of them has a write transaction open.
+ * ============================================================
+ */
+#define TS_READERS 4
+#define TS_KEYS 100
+#define TS_ROUNDS 200
+
+struct ts_rock {
+    struct twom_db *db;
+    int stop;
+    int rounds;
+    int bad;
+    int errors;
+    int count;
+};
+
+static int ts_count_cb(void *rock,
+                       const char *key, size_t keylen,
+                       const char *data, size_t datalen)
+{
+    struct ts_rock *tr = (struct ts_rock *)rock;
+    (void)key;
+    (void)keylen;
+    (void)data;
+    (void)datalen;
+    tr->count++;
+    return 0;
+}
+
+static void *ts_writer(void *arg)
+{
+    struct ts_rock *tr = (struct ts_rock *)arg;
+    char key[32], val[32];
+    int i, n;
+
+    for (i = 1; i <= TS_ROUNDS; i++) {
+        struct twom_txn *txn = NULL;
+        if (twom_db_begin_txn(tr->db, 0, &txn)) goto fail;
+        snprintf(val, sizeof(val), "%d", i);
+        if (twom_txn_store(txn, "a", 1, val, strlen(val), 0)) goto fail;
+        for (n = i % 10; n < TS_KEYS; n += 10) {
+            snprintf(key, sizeof(key), "k%03d", n);
+            if (twom_txn_store(txn, key, strlen(key), val, strlen(val), 0)) goto fail;
+        }
+        if (twom_txn_store(txn, "b", 1, val, strlen(val), 0)) goto fail;
+        if (twom_txn_commit(&txn)) goto fail;
+        if (!(i % 50) && twom_db_repack(tr->db)) goto fail;
+        __atomic_store_n(&tr->rounds, i, __ATOMIC_RELEASE);
+    }
+    return NULL;
+
+ fail:
+    __atomic_add_fetch(&tr->errors, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void *ts_reader(void *arg)
+{
+    struct ts_rock *shared = (struct ts_rock *)arg;
+    struct ts_rock tr = { shared->db, 0, 0, 0, 0, 0 };
+    const char *a, *b;
+    size_t alen, blen;
+
+    while (!__atomic_load_n(&shared->stop, __ATOMIC_ACQUIRE)) {
+        /* a snapshot sees both ends of a transaction, or neither */
+        struct twom_txn *txn = NULL;
+        if (twom_db_begin_txn(tr.db, TWOM_SHARED|TWOM_MVCC, &txn)) {
+            tr.errors++;
+            break;
+        }
+        int r = twom_txn_fetch(txn, "a", 1, NULL, NULL, &a, &alen, 0);
+        if (!r) r = twom_txn_fetch(txn, "b", 1, NULL, NULL, &b, &blen, 0);
+        if (r == TWOM_NOTFOUND) r = 0;
+        else if (!r && (alen != blen || memcmp(a, b, alen))) tr.bad++;
+        if (r) tr.errors++;
+        if (twom_txn_abort(&txn)) tr.errors++;
+
+        /* and a foreach sees all the keys, however many times they change */
+        tr.count = 0;
+        if (twom_db_foreach(tr.db, "k", 1, NULL, ts_count_cb, &tr, 0)) tr.errors++;
+        if (tr.count != TS_KEYS) tr.bad++;
+
+        if (twom_db_fetch(tr.db, "k042", 4, NULL, NULL, &a, &alen, 0)) tr.errors++;
+        tr.rounds++;
+    }
+
+    __atomic_add_fetch(&shared->bad, tr.bad, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared->errors, tr.errors, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared->count, tr.rounds, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void *ts_try_write(void *arg)
+{
+    struct ts_rock *tr = (struct ts_rock *)arg;
+    struct twom_txn *txn = NULL;
+    tr->errors = twom_db_begin_txn(tr->db, TWOM_NONBLOCKING, &txn);
+    if (!tr->errors) twom_txn_abort(&txn);
+    return NULL;
+}
+
+static int ts_write_cb(void *rock,
+                       const char *key, size_t keylen,
+                       const char *data, size_t datalen)
+{
+    struct ts_rock *tr = (struct ts_rock *)rock;
+    (void)data;
+    (void)datalen;
+    tr->errors = twom_db_store(tr->db, key, keylen, "x", 1, 0);
+    return 0;
+}
+
+static void test_threadsafe(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    pthread_t readers[TS_READERS], writer;
+    char key[32];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE|TWOM_THREADSAFE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    for (n = 0; n < TS_KEYS; n++) {
+        snprintf(key, sizeof(key), "k%03d", n);
+        CANSTORE(key, strlen(key), "0", 1);
+    }
+    CANCOMMIT();
+
+    struct ts_rock tr = { db, 0, 0, 0, 0, 0 };
+    for (n = 0; n < TS_READERS; n++)
+        ASSERT_OK(pthread_create(&readers[n], NULL, ts_reader, &tr));
+    ASSERT_OK(pthread_create(&writer, NULL, ts_writer, &tr));
+    pthread_join(writer, NULL);
+    __atomic_store_n(&tr.stop, 1, __ATOMIC_RELEASE);
+    for (n = 0; n < TS_READERS; n++)
+        pthread_join(readers[n], NULL);
+
+    ASSERT_EQ(tr.errors, 0);
+    ASSERT_EQ(tr.bad, 0);
+    ASSERT_EQ(tr.rounds, TS_ROUNDS);
+    ASSERT(tr.count > 0);
+    ISCONSISTENT();
+
+    /* a write transaction keeps the other threads' writes out */
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+    struct ts_rock other = { db, 0, 0, 0, 0, 0 };
+    ASSERT_OK(pthread_create(&writer, NULL, ts_try_write, &other));
+    pthread_join(writer, NULL);
+    ASSERT_EQ(other.errors, TWOM_LOCKED);
+    CANSTORE("a", 1, "mine", 4);
+    CANFETCH_NOTXN("a", 1, "mine", 4);
+    CANCOMMIT();
+    ASSERT_OK(pthread_create(&writer, NULL, ts_try_write, &other));
+    pthread_join(writer, NULL);
+    ASSERT_OK(other.errors);
+
+    /* but a read can't wait for itself: no writes from inside a foreach */
+    other.errors = 0;
+    r = twom_db_foreach(db, "a", 1, NULL, ts_write_cb, &other, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(other.errors, TWOM_LOCKED);
+    CANFETCH_NOTXN("a", 1, "mine", 4);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_shm
+ *
+ * With TWOM_SHM a fetch takes no lock while nobody writes, yet
+ * sees a write or a repack from another process straight away,
+ * even one which didn't ask for TWOM_SHM itself: the file says so.
+ * Reads skip the header lock and the periodic yields while no
+ * writer is waiting.  A file created without it never trusts
+ * the hints, whoever opens it.
+ * ============================================================
+ */
+static void shm_child(int mode)
+{
+    struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+    struct twom_db *cdb = NULL;
+    int cr = twom_db_open(filename, &cinit, &cdb, NULL);
+    if (!cr && mode == 1) cr = twom_db_repack(cdb);
+    if (!cr && mode == 2) cr = twom_db_store(cdb, "cherry", 6, "c1", 2, 0);
+    if (!cr) cr = twom_db_store(cdb, mode ? "banana" : "apple", mode ? 6 : 5,
+                                mode ? "b1" : "a2", 2, 0);
+    if (!cr) cr = twom_db_close(&cdb);
+    _exit(cr ? 1 : 0);
+}
+
+// opens the database, says so, and when told to, blocks trying to write
+static void shm_waiter_child(int ready, int go)
+{
+    struct twom_open_data cinit = TWOM_OPEN_DATA_INITIALIZER;
+    struct twom_db *cdb = NULL;
+    char c = 'x';
+    int cr = twom_db_open(filename, &cinit, &cdb, NULL);
+    if (write(ready, &c, 1) != 1 || read(go, &c, 1) != 1) cr = 1;
+    if (!cr) cr = twom_db_store(cdb, "damson", 6, "d1", 2, 0);
+    _exit(cr ? 1 : 0);
+}
+
+// how many slots in the segment say a writer is waiting
+static int shm_waiters(const char *name)
+{
+    struct stat sbuf;
+    int fd = shm_open(name, O_RDONLY, 0);
+    int i, n = 0;
+    if (fd < 0) return -1;
+    if (fstat(fd, &sbuf) < 0) {
+        close(fd);
+        return -1;
+    }
+    const uint64_t *words = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (words == MAP_FAILED) return -1;
+    /* magic, seq and ino, then the slots */
+    for (i = 3; i < (int)(sbuf.st_size / 8); i++)
+        if (words[i]) n++;
+    munmap((void *)words, sbuf.st_size);
+    return n;
+}
+
+static void test_shm_in(char *name)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_stats st;
+    char key[32];
+    const char *uuid;
+    uint32_t version;
+    size_t gen;
+    int r, n, fd, status;
+    int ready[2], go[2];
+    char c = 'x';
+    pid_t pid;
+
+    /* a file made without it doesn't start trusting hints later */
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename2, &init, &db, NULL);
+    ASSERT_OK(r);
+    CANSTORE("apple", 5, "a1", 2);
+    CANCOMMIT();
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+    init.flags = TWOM_SHM;
+    r = twom_db_open(filename2, &init, &db, NULL);
+    ASSERT_OK(r);
+    twom_db_reset_stats(db);
+    for (n = 0; n < 5; n++) {
+        r = twom_db_fetch(db, "apple", 5, NULL, NULL, NULL, NULL, 0);
+        ASSERT_OK(r);
+    }
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.unlocked_fetches, 0);
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+
+    init.flags = TWOM_CREATE | TWOM_SHM;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+    fd = open(filename, O_RDONLY);
+    ASSERT(fd >= 0);
+    pread(fd, &version, 4, 32); /* OFFSET_VERSION = 32 */
+    close(fd);
+    ASSERT_EQ(le32toh(version), 5);
+
+    /* the segment is named for the first 96 bits of the UUID */
+    uuid = twom_db_uuid(db);
+    strcpy(name, "/twom-");
+    for (n = 6; *uuid && n < 30; uuid++)
+        if (*uuid != '-') name[n++] = *uuid;
+    name[n] = '\0';
+
+    CANSTORE("apple", 5, "a1", 2);
+    for (n = 0; n < 3000; n++) {
+        snprintf(key, sizeof(key), "key%04d", n);
+        CANSTORE(key, strlen(key), "v", 1);
+    }
+    CANCOMMIT();
+
+    /* the first fetch after a write takes the lock, the rest don't */
+    CANFETCH_NOTXN("apple", 5, "a1", 2);
+    twom_db_reset_stats(db);
+    for (n = 0; n < 10; n++)
+        CANFETCH_NOTXN("apple", 5, "a1", 2);
+    r = twom_db_fetch(db, "cherry", 6, NULL, NULL, NULL, NULL, 0);
+    ASSERT_EQ(r, TWOM_NOTFOUND);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.unlocked_fetches, 11);
+    ASSERT_EQ(st.datalocks, 0);
+
+    /* a read transaction skips the header lock, and a long foreach doesn't yield */
+    twom_db_reset_stats(db);
+    r = twom_db_foreach(db, "key", 3, NULL, noop_cb, NULL, 0);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.datalocks, 1);
+    ASSERT_EQ(st.headlocks, 0);
+    ASSERT_EQ(st.yields, 0);
+
+    /* another process writes: the next fetch sees it */
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) shm_child(0);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    twom_db_reset_stats(db);
+    CANFETCH_NOTXN("apple", 5, "a2", 2);
+    CANFETCH_NOTXN("apple", 5, "a2", 2);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.datalocks, 1);
+    ASSERT_EQ(st.unlocked_fetches, 1);
+
+    /* and repacks, then writes to the new file */
+    gen = twom_db_generation(db);
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) shm_child(1);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    CANFETCH_NOTXN("banana", 6, "b1", 2);
+    ASSERT_EQ(twom_db_generation(db), gen + 1);
+    CANFETCH_NOTXN("apple", 5, "a2", 2);
+    ISCONSISTENT();
+
+    /* still hinted after the repack: another write is seen too */
+    CANNOTFETCH_NOTXN("cherry", 6, TWOM_NOTFOUND);
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) shm_child(2);
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+    twom_db_reset_stats(db);
+    CANFETCH_NOTXN("cherry", 6, "c1", 2);
+    CANFETCH_NOTXN("cherry", 6, "c1", 2);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.datalocks, 1);
+    ASSERT_EQ(st.unlocked_fetches, 1);
+
+    /* a writer which dies waiting for the lock has its slot freed by
+     * the next one to get it */
+    ASSERT_EQ(pipe(ready), 0);
+    ASSERT_EQ(pipe(go), 0);
+    pid = fork();
+    ASSERT(pid >= 0);
+    if (pid == 0) shm_waiter_child(ready[1], go[0]);
+    ASSERT_EQ(read(ready[0], &c, 1), 1);
+    CANSTORE("elder", 5, "e1", 2);
+    ASSERT_EQ(write(go[1], &c, 1), 1);
+    for (n = 0; n < 5000 && shm_waiters(name) < 1; n++)
+        usleep(1000);
+    ASSERT_EQ(shm_waiters(name), 1);
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    close(ready[0]);
+    close(ready[1]);
+    close(go[0]);
+    close(go[1]);
+    CANCOMMIT();
+    ASSERT_EQ(shm_waiters(name), 1);
+    twom_db_reset_stats(db);
+    r = twom_db_foreach(db, "key", 3, NULL, noop_cb, NULL, 0);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    ASSERT(st.headlocks > 0);
+    r = twom_db_store(db, "fig", 3, "f1", 2, 0);
+    ASSERT_OK(r);
+    ASSERT_EQ(shm_waiters(name), 0);
+    twom_db_reset_stats(db);
+    r = twom_db_foreach(db, "key", 3, NULL, noop_cb, NULL, 0);
+    ASSERT_OK(r);
+    twom_db_stats(db, &st);
+    ASSERT_EQ(st.headlocks, 0);
+    CANNOTFETCH_NOTXN("damson", 6, TWOM_NOTFOUND);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+static void test_shm(void)
+{
+    char name[32] = "";
+    test_shm_in(name);
+    /* whether that passed or not, the segment would outlive the test */
+    if (*name) shm_unlink(name);
+}
+
+/*
+ * ============================================================
+ * test_store_batch
+ *
+ * A sorted batch on a database with keys already in it: adds
+ * between them, replaces and deletes of them, conditions which
+ * aren't met, and an unsorted batch which changes nothing.  The
+ * put-off checksums all come out right.
+ * ============================================================
+ */
+static void test_store_batch(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    char keys[2000][16];
+    char vals[2000][16];
+    const char *keyp[2000];
+    const char *valp[2000];
+    size_t keylens[2000];
+    size_t vallens[2000];
+    int flags[2000];
+    int rets[2000];
+    int r, n;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    /* the even keys to start with */
+    for (n = 0; n < 2000; n += 2) {
+        snprintf(keys[n], sizeof(keys[n]), "key%05d", n);
+        CANSTORE(keys[n], strlen(keys[n]), "old", 3);
+    }
+    CANCOMMIT();
+
+    /* then all of them: odd ones are new, every tenth is deleted, every
+     * fourth is only stored if it doesn't exist, and the odd multiples of
+     * five are only deleted if they do */
+    for (n = 0; n < 2000; n++) {
+        snprintf(keys[n], sizeof(keys[n]), "key%05d", n);
+        snprintf(vals[n], sizeof(vals[n]), "val%05d", n);
+        keyp[n] = keys[n];
+        keylens[n] = strlen(keys[n]);
+        valp[n] = (n % 5 == 0) ? NULL : vals[n];
+        vallens[n] = valp[n] ? strlen(vals[n]) : 0;
+        flags[n] = (n % 5 == 0 && n % 2) ? TWOM_IFEXIST : (n % 4 == 2) ? TWOM_IFNOTEXIST : 0;
+        rets[n] = 1;
+    }
+
+    r = twom_db_begin_txn(db, 0, &txn);
+    ASSERT_OK(r);
+
+    /* out of order or empty keys are refused before anything is written */
+    {
+        const char *twokeys[2] = { keys[2], keys[1] };
+        r = twom_txn_store_batch(txn, 2, twokeys, keylens + 1, valp + 1, vallens + 1, NULL, NULL);
+        ASSERT_EQ(r, TWOM_BADUSAGE);
+    }
+    keylens[1999] = 0;
+    r = twom_txn_store_batch(txn, 2000, keyp, keylens, valp, vallens, flags, rets);
+    ASSERT_EQ(r, TWOM_BADUSAGE);
+    ASSERT_EQ(rets[0], 1);
+    keylens[1999] = strlen(keys[1999]);
+
+    r = twom_txn_store_batch(txn, 2000, keyp, keylens, valp, vallens, flags, rets);
+    ASSERT_OK(r);
+    CANCOMMIT();
+    ISCONSISTENT();
+
+    for (n = 0; n < 2000; n++) {
+        if (n % 5 == 0 && n % 2) {
+            ASSERT_EQ(rets[n], TWOM_NOTFOUND);
+            CANNOTFETCH(keys[n], keylens[n], TWOM_NOTFOUND);
+        }
+        else if (n % 4 == 2) {
+            ASSERT_EQ(rets[n], TWOM_EXISTS);
+            CANFETCH(keys[n], keylens[n], "old", 3);
+        }
+        else if (n % 5 == 0) {
+            ASSERT_OK(rets[n]);
+            CANNOTFETCH(keys[n], keylens[n], TWOM_NOTFOUND);
+        }
+        else {
+            ASSERT_OK(rets[n]);
+            CANFETCH(keys[n], keylens[n], vals[n], vallens[n]);
+        }
+    }
+    if (txn) CANCOMMIT();
+    ASSERT_EQ(twom_db_num_records(db), 1000 + 800 - 100);
+
+    CANREOPEN();
+    ISCONSISTENT();
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
+/*
+ * ============================================================
+ * test_spare_objects
+ *
+ * Finished transactions and cursors are reused by the next ones:
+ * a reused cursor mustn't keep the last one's prefix, end key or
+ * direction, and more at once than there are spares still works.
+ * ============================================================
+ */
+
+static int count_cursor(struct twom_db *db, const char *prefix, int flags)
+{
+    struct twom_cursor *cur = NULL;
+    const char *key, *val;
+    size_t keylen, vallen;
+    int n = 0;
+
+    int r = twom_db_begin_cursor(db, prefix, prefix ? strlen(prefix) : 0, &cur, flags);
+    if (r) return r;
+    while (!twom_cursor_next(cur, &key, &keylen, &val, &vallen)) n++;
+    twom_cursor_abort(&cur);
+    return n;
+}
+
+static void test_spare_objects(void)
+{
+    struct twom_db *db = NULL;
+    struct twom_txn *txn = NULL;
+    struct twom_cursor *curs[8];
+    const char *key, *val;
+    size_t keylen, vallen;
+    int r, i, round;
+
+    struct twom_open_data init = TWOM_OPEN_DATA_INITIALIZER;
+    init.flags = TWOM_CREATE;
+    r = twom_db_open(filename, &init, &db, NULL);
+    ASSERT_OK(r);
+
+    CANSTORE("a1", 2, "v", 1);
+    CANSTORE("a2", 2, "v", 1);
+    CANSTORE("ab1", 3, "v", 1);
+    CANSTORE("abc1", 4, "v", 1);
+    CANSTORE("b1", 2, "v", 1);
+    CANCOMMIT();
+
+    for (round = 0; round < 3; round++) {
+        ASSERT_EQ(count_cursor(db, "abc", TWOM_CURSOR_PREFIX), 1);
+        ASSERT_EQ(count_cursor(db, NULL, 0), 5);
+        ASSERT_EQ(count_cursor(db, "a", TWOM_CURSOR_PREFIX|TWOM_REVERSE), 4);
+        ASSERT_EQ(count_cursor(db, "ab", 0), 3);
+        ASSERT_EQ(count_cursor(db, "abcdefghijklmnopqrstuvwxyz", TWOM_CURSOR_PREFIX), 0);
+        ASSERT_EQ(count_cursor(db, "ab", TWOM_CURSOR_PREFIX), 2);
+
+        struct twom_cursor *cur = NULL;
+        r = twom_db_begin_cursor(db, NULL, 0, &cur, 0);
+        ASSERT_OK(r);
+        r = twom_cursor_set_end(cur, "ab1", 3, 0, 0);
+        ASSERT_OK(r);
+        for (i = 0; !twom_cursor_next(cur, &key, &keylen, &val, &vallen); i++);
+        ASSERT_EQ(i, 2);
+        twom_cursor_abort(&cur);
+        ASSERT_EQ(count_cursor(db, NULL, 0), 5);
+
+        CANFETCH_NOTXN("a2", 2, "v", 1);
+        r = twom_db_fetch(db, "a3", 2, NULL, NULL, NULL, NULL, 0);
+        ASSERT_EQ(r, TWOM_NOTFOUND);
+    }
+
+    /* more cursors at once than get kept */
+    for (i = 0; i < 8; i++) {
+        curs[i] = NULL;
+        r = twom_db_begin_cursor(db, "a", 1, &curs[i], TWOM_CURSOR_PREFIX|TWOM_SHARED);
+        ASSERT_OK(r);
+        r = twom_cursor_next(curs[i], &key, &keylen, &val, &vallen);
+        ASSERT_OK(r);
+        ASSERT_EQ(keylen, 2);
+        ASSERT_MEM_EQ(key, "a1", 2);
+    }
+    for (i = 0; i < 8; i++)
+        twom_cursor_abort(&curs[i]);
+
+    /* and a write which reuses a read transaction */
+    CANSTORE("c1", 2, "v", 1);
+    CANCOMMIT();
+    ASSERT_EQ(count_cursor(db, NULL, 0), 6);
+
+    r = twom_db_close(&db);
+    ASSERT_OK(r);
+}
+
 /*
  * ============================================================
  * Test runner
@@ -5299,6 +9475,10 @@ static struct test_entry tests[] = {
     { "test_dump_detail",        test_dump_detail },
     { "test_recovery_with_records", test_recovery_with_records },
     { "test_consistent_future_links", test_consistent_future_links },
+    { "test_recovery_tail",      test_recovery_tail },
+    { "test_scrub",              test_scrub },
+    { "test_backup",             test_backup },
+    { "test_changes_since",      test_changes_since },
     { "test_mmap_val_reuse",     test_mmap_val_reuse },
     { "test_csum_null",          test_csum_null },
     { "test_csum_external",      test_csum_external },
@@ -5310,6 +9490,34 @@ static struct test_entry tests[] = {
     { "test_huge_key",           test_huge_key },
     { "test_repair",             test_repair },
     { "test_dump_corrupt",       test_dump_corrupt },
+    { "test_fetch_many",         test_fetch_many },
+    { "test_bulkload",           test_bulkload },
+    { "test_group_commit",       test_group_commit },
+    { "test_sync_ranges",        test_sync_ranges },
+    { "test_reserve_growth",     test_reserve_growth },
+    { "test_stats",              test_stats },
+    { "test_keyprefix",          test_keyprefix },
+    { "test_csum_xxh3",          test_csum_xxh3 },
+    { "test_csumcache",          test_csumcache },
+    { "test_finger_search",      test_finger_search },
+    { "test_locs_kept",          test_locs_kept },
+    { "test_cursor_reverse",     test_cursor_reverse },
+    { "test_mvcc_reverse_cursor", test_mvcc_reverse_cursor },
+    { "test_foreach_range",      test_foreach_range },
+    { "test_estimate_range",     test_estimate_range },
+    { "test_advise_prefetch",    test_advise_prefetch },
+    { "test_repack_step",        test_repack_step },
+    { "test_blobs",              test_blobs },
+    { "test_bloom",              test_bloom },
+    { "test_compress",           test_compress },
+    { "test_compress_threads",   test_compress_threads },
+    { "test_shards",             test_shards },
+    { "test_shards_ranges",      test_shards_ranges },
+    { "test_shards_atomic",      test_shards_atomic },
+    { "test_threadsafe",         test_threadsafe },
+    { "test_shm",                test_shm },
+    { "test_store_batch",        test_store_batch },
+    { "test_spare_objects",      test_spare_objects },
     { NULL, NULL }
 };
 
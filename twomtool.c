@@ -67,7 +67,90 @@ static int printer_cb(void *rock,
     return 0;
 }
 
+static void print_stats(struct twom_db *db)
+{
+    struct twom_stats st;
+    twom_db_stats(db, &st);
+    printf("records\t%zu\n", twom_db_num_records(db));
+    printf("size\t%zu\n", twom_db_size(db));
+    printf("generation\t%zu\n", twom_db_generation(db));
+    printf("locates\t%llu\n", (unsigned long long)st.locates);
+    printf("locate_levels\t%llu\n", (unsigned long long)st.locate_levels);
+    printf("compars\t%llu\n", (unsigned long long)st.compars);
+    printf("findloc_fast\t%llu\n", (unsigned long long)st.findloc_fast);
+    printf("findloc_finger\t%llu\n", (unsigned long long)st.findloc_finger);
+    printf("findloc_full\t%llu\n", (unsigned long long)st.findloc_full);
+    printf("relocates\t%llu\n", (unsigned long long)st.relocates);
+    printf("locs_kept\t%llu\n", (unsigned long long)st.locs_kept);
+    printf("headcsums\t%llu\n", (unsigned long long)st.headcsums);
+    printf("tailcsums\t%llu\n", (unsigned long long)st.tailcsums);
+    printf("tailcsums_cached\t%llu\n", (unsigned long long)st.tailcsums_cached);
+    printf("extends\t%llu\n", (unsigned long long)st.extends);
+    printf("remaps\t%llu\n", (unsigned long long)st.remaps);
+    printf("syncs\t%llu\n", (unsigned long long)st.syncs);
+    printf("sync_bytes\t%llu\n", (unsigned long long)st.sync_bytes);
+    printf("sync_usec\t%llu\n", (unsigned long long)st.sync_usec);
+    printf("headlocks\t%llu\n", (unsigned long long)st.headlocks);
+    printf("headlock_usec\t%llu\n", (unsigned long long)st.headlock_usec);
+    printf("datalocks\t%llu\n", (unsigned long long)st.datalocks);
+    printf("datalock_usec\t%llu\n", (unsigned long long)st.datalock_usec);
+    printf("yields\t%llu\n", (unsigned long long)st.yields);
+    printf("gate_relocks\t%llu\n", (unsigned long long)st.gate_relocks);
+    printf("unlocked_fetches\t%llu\n", (unsigned long long)st.unlocked_fetches);
+    printf("recoveries\t%llu\n", (unsigned long long)st.recoveries);
+    printf("tail_recoveries\t%llu\n", (unsigned long long)st.tail_recoveries);
+    printf("bloom_negatives\t%llu\n", (unsigned long long)st.bloom_negatives);
+    printf("compressions\t%llu\n", (unsigned long long)st.compressions);
+    printf("decompressions\t%llu\n", (unsigned long long)st.decompressions);
+}
+
+/* iterate every record and fetch each one back by key, so the counters
+ * show what both access paths cost on this file */
+static int stats_pass(struct twom_db *db)
+{
+    struct twom_txn *txn = NULL;
+    struct twom_cursor *cur = NULL;
+    const char *key, *val;
+    size_t keylen, vallen;
+
+    int r = twom_db_begin_txn(db, TWOM_SHARED, &txn);
+    if (r) return r;
+    r = twom_txn_begin_cursor(txn, NULL, 0, &cur, 0);
+    while (!r) {
+        r = twom_cursor_next(cur, &key, &keylen, &val, &vallen);
+        if (r) break;
+        r = twom_txn_fetch(txn, key, keylen, NULL, NULL, &val, &vallen, 0);
+    }
+    twom_cursor_fini(&cur);
+    twom_txn_abort(&txn);
+    return r == TWOM_DONE ? 0 : r;
+}
+
 /* recursive mkdir -p for the parent directory of a path */
+// a number of bytes, with an optional K, M or G after it
+static size_t parse_size(const char *arg)
+{
+    char *end = NULL;
+    unsigned long long v = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'g': case 'G': v *= 1024;  /* fall through */
+    case 'm': case 'M': v *= 1024;  /* fall through */
+    case 'k': case 'K': v *= 1024;
+    }
+    return (size_t)v;
+}
+
+static int scrub_cb(void *rock __attribute__((unused)),
+                    const struct twom_scrub_progress *progress)
+{
+    if (progress->finished)
+        printf("scrubbed %llu records, %llu bytes in %zu ranges (%zu bad)\n",
+               (unsigned long long)progress->records,
+               (unsigned long long)progress->bytes,
+               progress->ranges, progress->ranges_bad);
+    return 0;
+}
+
 static int mkdir_p(const char *path)
 {
     char buf[PATH_MAX];
@@ -233,6 +316,10 @@ static void batch_commands(struct twom_db *db)
             }
             fflush(stdout);
         }
+        else if (!strcmp(cmd, "STATS")) {
+            print_stats(db);
+            fflush(stdout);
+        }
         else {
             fprintf(stderr, "ERROR: line %d: unknown command '%s'\n", lineno, cmd);
             goto fail;
@@ -251,6 +338,230 @@ fail:
     if (txn) twom_txn_abort(&txn);
 }
 
+/* export and import: a binary stream of records, each a 4 byte key length
+ * and an 8 byte value length (little-endian) followed by the key and the
+ * value, after a magic header and ending with a zero key length, so that
+ * any key and value survive and a truncated stream is noticed */
+#define EXPORT_MAGIC "TWOMEXP1"
+#define IOBUFSIZE (1024 * 1024)
+#define IMPORT_BYTES (64 * 1024 * 1024)
+
+static void put_le(unsigned char *buf, uint64_t v, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) buf[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *buf, int n)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--) v = (v << 8) | buf[i];
+    return v;
+}
+
+static int export_cb(void *rock,
+                     const char *key, size_t keylen,
+                     const char *data, size_t datalen)
+{
+    FILE *out = (FILE *)rock;
+    unsigned char head[12];
+    if (keylen > 0xFFFFFFFFULL) return TWOM_BADUSAGE;
+    put_le(head, keylen, 4);
+    put_le(head + 4, datalen, 8);
+    if (fwrite(head, 1, 12, out) != 12
+        || fwrite(key, 1, keylen, out) != keylen
+        || fwrite(data, 1, datalen, out) != datalen)
+        return TWOM_IOERROR;
+    return 0;
+}
+
+/* everything (under prefix), from an MVCC snapshot which still yields
+ * to writers between records */
+static int export_records(struct twom_db *db, struct twom_txn *txn,
+                          const char *prefix, size_t prefixlen)
+{
+    struct twom_txn *owntxn = NULL;
+    unsigned char end[12];
+    int r;
+
+    setvbuf(stdout, NULL, _IOFBF, IOBUFSIZE);
+    if (!txn) {
+        r = twom_db_begin_txn(db, TWOM_SHARED | TWOM_MVCC, &owntxn);
+        if (r) return r;
+        txn = owntxn;
+    }
+
+    if (fwrite(EXPORT_MAGIC, 1, 8, stdout) != 8) r = TWOM_IOERROR;
+    else r = twom_txn_foreach(txn, prefix, prefixlen, NULL, export_cb, stdout, 0);
+    if (owntxn) twom_txn_abort(&owntxn);
+    if (r) return r;
+
+    memset(end, 0, sizeof(end));
+    if (fwrite(end, 1, 12, stdout) != 12 || fflush(stdout))
+        return TWOM_IOERROR;
+    return 0;
+}
+
+struct import_batch {
+    char *buf;              /* keys and values, back to back */
+    size_t used, alloc;
+    size_t n, nalloc;
+    size_t *keyoffs, *keylens, *valoffs, *vallens;
+    const char **keys, **vals;
+    int sorted;             /* ascending within the batch */
+};
+
+// does a sort strictly before b, by the default comparison?
+static int key_before(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c < 0 || (!c && alen < blen);
+}
+
+static int import_read(struct import_batch *b, size_t keylen, size_t vallen)
+{
+    if (b->used + keylen + vallen > b->alloc) {
+        size_t want = b->alloc ? b->alloc * 2 : IOBUFSIZE;
+        while (want < b->used + keylen + vallen) want *= 2;
+        char *buf = realloc(b->buf, want);
+        if (!buf) return TWOM_IOERROR;
+        b->buf = buf;
+        b->alloc = want;
+    }
+    if (b->n == b->nalloc) {
+        b->nalloc = b->nalloc ? b->nalloc * 2 : 1024;
+        b->keyoffs = realloc(b->keyoffs, b->nalloc * sizeof(size_t));
+        b->keylens = realloc(b->keylens, b->nalloc * sizeof(size_t));
+        b->valoffs = realloc(b->valoffs, b->nalloc * sizeof(size_t));
+        b->vallens = realloc(b->vallens, b->nalloc * sizeof(size_t));
+        b->keys = realloc(b->keys, b->nalloc * sizeof(char *));
+        b->vals = realloc(b->vals, b->nalloc * sizeof(char *));
+        if (!b->keyoffs || !b->keylens || !b->valoffs || !b->vallens
+            || !b->keys || !b->vals)
+            return TWOM_IOERROR;
+    }
+    if (fread(b->buf + b->used, 1, keylen + vallen, stdin) != keylen + vallen)
+        return TWOM_BADFORMAT;
+    b->keyoffs[b->n] = b->used;
+    b->keylens[b->n] = keylen;
+    b->valoffs[b->n] = b->used + keylen;
+    b->vallens[b->n] = vallen;
+    b->used += keylen + vallen;
+    b->n++;
+    return 0;
+}
+
+/* a batch in key order goes in with twom_db_bulkload while nothing can sort
+ * before it (the database was empty and the input sorted so far), or with
+ * twom_txn_store_batch; anything else a record at a time */
+static int import_flush(struct twom_db *db, struct twom_txn *txn,
+                        struct import_batch *b, int append)
+{
+    struct twom_txn *owntxn = NULL;
+    size_t i;
+    int r = 0;
+
+    if (!b->n) return 0;
+    for (i = 0; i < b->n; i++) {
+        b->keys[i] = b->buf + b->keyoffs[i];
+        b->vals[i] = b->buf + b->valoffs[i];
+    }
+    if (!txn) {
+        r = twom_db_begin_txn(db, 0, &owntxn);
+        if (r) return r;
+        txn = owntxn;
+    }
+
+    if (append)
+        r = twom_db_bulkload(db, b->n, b->keys, b->keylens, b->vals, b->vallens, 0);
+    else if (b->sorted)
+        r = twom_txn_store_batch(txn, b->n, b->keys, b->keylens,
+                                 b->vals, b->vallens, NULL, NULL);
+    else
+        for (i = 0; !r && i < b->n; i++)
+            r = twom_txn_store(txn, b->keys[i], b->keylens[i],
+                               b->vals[i], b->vallens[i], 0);
+
+    if (owntxn) {
+        if (r) twom_txn_abort(&owntxn);
+        else r = twom_txn_commit(&owntxn);
+    }
+    b->used = 0;
+    b->n = 0;
+    b->sorted = 1;
+    return r;
+}
+
+/* read an export from stdin, committing every 'every' records (or 64MB)
+ * unless there's already a transaction */
+static int import_records(struct twom_db *db, struct twom_txn *txn, size_t every)
+{
+    struct import_batch b;
+    unsigned char head[12];
+    char *last = NULL;      /* the previous batch's last key, while appending */
+    size_t lastlen = 0;
+    int append = !twom_db_num_records(db);
+    int r = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.sorted = 1;
+    setvbuf(stdin, NULL, _IOFBF, IOBUFSIZE);
+    if (fread(head, 1, 8, stdin) != 8 || memcmp(head, EXPORT_MAGIC, 8)) {
+        fprintf(stderr, "import: not a twomtool export\n");
+        return TWOM_BADFORMAT;
+    }
+
+    for (;;) {
+        if (fread(head, 1, 12, stdin) != 12) {
+            r = TWOM_BADFORMAT;
+            break;
+        }
+        size_t keylen = get_le(head, 4);
+        size_t vallen = get_le(head + 4, 8);
+        if (!keylen) break;
+        r = import_read(&b, keylen, vallen);
+        if (r) break;
+
+        const char *key = b.buf + b.keyoffs[b.n - 1];
+        if (b.n > 1) {
+            if (!key_before(b.buf + b.keyoffs[b.n - 2], b.keylens[b.n - 2], key, keylen))
+                b.sorted = append = 0;
+        }
+        else if (last && !key_before(last, lastlen, key, keylen)) {
+            append = 0;
+        }
+
+        if (b.n >= every || b.used >= IMPORT_BYTES) {
+            if (append) {
+                char *k = realloc(last, b.keylens[b.n - 1]);
+                if (!k) {
+                    r = TWOM_IOERROR;
+                    break;
+                }
+                lastlen = b.keylens[b.n - 1];
+                memcpy(k, b.buf + b.keyoffs[b.n - 1], lastlen);
+                last = k;
+            }
+            r = import_flush(db, txn, &b, append);
+            if (r) break;
+        }
+    }
+    if (r == TWOM_BADFORMAT)
+        fprintf(stderr, "import: truncated input\n");
+    if (!r) r = import_flush(db, txn, &b, append);
+
+    free(last);
+    free(b.buf);
+    free(b.keyoffs);
+    free(b.keylens);
+    free(b.valoffs);
+    free(b.vallens);
+    free(b.keys);
+    free(b.vals);
+    return r;
+}
+
 static void usage(const char *progname)
 {
     fprintf(stderr, "Usage: %s [options] <db file> <action> [<key>] [<value>]\n", progname);
@@ -262,6 +573,9 @@ static void usage(const char *progname)
     fprintf(stderr, "  -S, --no-sync         don't fsync writes (dangerous)\n");
     fprintf(stderr, "  -T, --use-transaction use a single transaction for the action\n");
     fprintf(stderr, "  -t, --no-transaction  don't use a transaction (default)\n");
+    fprintf(stderr, "  -j, --jobs <n>        consistent: scrub on n threads, checksums too\n");
+    fprintf(stderr, "  -r, --rate <bytes>    consistent: scrub reading at most this a second (K, M, G)\n");
+    fprintf(stderr, "  -c, --commit-every <n> import: commit every n records (default 10000)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Actions:\n");
     fprintf(stderr, "  show [<prefix>]   list all entries (or those matching prefix)\n");
@@ -272,6 +586,10 @@ static void usage(const char *progname)
     fprintf(stderr, "  consistent        check database consistency\n");
     fprintf(stderr, "  repair            repair records with truncated keylen/vallen\n");
     fprintf(stderr, "  repack            repack/compact the database\n");
+    fprintf(stderr, "  backup <file>     copy the database to file while writers carry on\n");
+    fprintf(stderr, "  export [<prefix>] write all entries (or those matching prefix) to stdout, in binary\n");
+    fprintf(stderr, "  import            store the entries from an export on stdin\n");
+    fprintf(stderr, "  stats             read every record back and print the counters\n");
     fprintf(stderr, "  damage            write then crash (recovery testing)\n");
     fprintf(stderr, "  batch             batch mode from stdin\n");
     fprintf(stderr, "\n");
@@ -288,11 +606,14 @@ int main(int argc, char *argv[])
     size_t keylen = 0, vallen = 0;
     int loop;
     int use_txn = 0;
+    int jobs = 0;
+    size_t rate = 0;
+    size_t every = 10000;
     uint32_t open_flags = 0;
     struct twom_db *db = NULL;
     struct twom_txn *txn = NULL;
 
-    static const char short_options[] = "NRSTnt";
+    static const char short_options[] = "NRSTc:j:nr:t";
 
     static const struct option long_options[] = {
         { "no-checksum",     no_argument, NULL, 'N' },
@@ -301,6 +622,9 @@ int main(int argc, char *argv[])
         { "no-sync",         no_argument, NULL, 'S' },
         { "use-transaction", no_argument, NULL, 'T' },
         { "no-transaction",  no_argument, NULL, 't' },
+        { "jobs",            required_argument, NULL, 'j' },
+        { "rate",            required_argument, NULL, 'r' },
+        { "commit-every",    required_argument, NULL, 'c' },
         { 0, 0, 0, 0 },
     };
 
@@ -327,6 +651,16 @@ int main(int argc, char *argv[])
         case 't':
             use_txn = 0;
             break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'r':
+            rate = parse_size(optarg);
+            break;
+        case 'c':
+            every = strtoul(optarg, NULL, 10);
+            if (!every) every = 1;
+            break;
         default:
             usage(argv[0]);
             return 1;
@@ -444,7 +778,10 @@ int main(int argc, char *argv[])
             level = atoi(argv[optind + 2]);
         r = twom_db_dump(db, level);
     } else if (!strcmp(action, "consistent")) {
-        r = twom_db_check_consistency(db);
+        if (jobs || rate)
+            r = twom_db_scrub(db, jobs, rate, scrub_cb, NULL);
+        else
+            r = twom_db_check_consistency(db);
         if (r) {
             printf("No, not consistent\n");
         } else {
@@ -457,6 +794,32 @@ int main(int argc, char *argv[])
             printf("repair: %zu record(s) fixed\n", nfixed);
     } else if (!strcmp(action, "repack")) {
         r = twom_db_repack(db);
+    } else if (!strcmp(action, "backup")) {
+        if ((argc - optind) < 3) {
+            fprintf(stderr, "backup requires a destination file\n");
+            twom_db_close(&db);
+            return 1;
+        }
+        r = twom_db_backup(db, argv[optind + 2]);
+        if (r)
+            fprintf(stderr, "backup failed: %s\n", twom_strerror(r));
+    } else if (!strcmp(action, "export")) {
+        const char *prefix = "";
+        size_t prefixlen = 0;
+        if ((argc - optind) >= 3) {
+            prefix = argv[optind + 2];
+            prefixlen = strlen(prefix);
+        }
+        r = export_records(db, txn, prefix, prefixlen);
+        if (r)
+            fprintf(stderr, "export failed: %s\n", twom_strerror(r));
+    } else if (!strcmp(action, "import")) {
+        r = import_records(db, txn, every);
+        if (r)
+            fprintf(stderr, "import failed: %s\n", twom_strerror(r));
+    } else if (!strcmp(action, "stats")) {
+        r = stats_pass(db);
+        if (!r) print_stats(db);
     } else if (!strcmp(action, "damage")) {
         if (!txn) {
             r = twom_db_begin_txn(db, 0, &txn);